@@ -0,0 +1,67 @@
+/*
+This header file defines the glyph atlas, holding the alphabet used to write
+the object names next to the detection boxes, and the label renderer drawing
+the boxes and their labels.
+
+Atlas file layout (all fields little-endian):
+  - `atlas_header`
+  - glyph table, one `atlas_entry` per glyph
+  - glyph pixels, one byte per pixel, row by row. Glyphs are rendered in
+    black on white, so a single channel is kept
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+Based on darknet, YOLO LICENSE https://github.com/pjreddie/darknet/blob/master/LICENSE
+*/
+
+#ifndef ATLAS_H
+#define ATLAS_H
+
+#include <stdint.h>
+
+#define ATLAS_MAGIC "VODATLS1"
+// Number of font sizes, as generated by `labels/make_labels.py`
+#define ATLAS_SIZES 8
+
+typedef struct {
+    char magic[8];
+    uint32_t nglyphs;
+    uint32_t reserved;
+} atlas_header;
+
+typedef struct {
+    // Font size index and ASCII code, as in `labels/<symbol>_<size>.png`
+    uint8_t size;
+    uint8_t symbol;
+    uint16_t w, h;
+    uint16_t reserved;
+    // Offset of the pixels from the start of the file
+    uint32_t offset;
+} atlas_entry;
+
+typedef struct {
+    int w, h;
+    // NULL if the symbol isn't in the atlas
+    unsigned char *data;
+} atlas_glyph;
+
+typedef struct glyph_atlas {
+    atlas_glyph glyphs[ATLAS_SIZES][128];
+    // Buffer holding the pixels of every glyph
+    unsigned char *pixels;
+} glyph_atlas;
+
+glyph_atlas *make_glyph_atlas(image **alphabet);
+glyph_atlas *load_glyph_atlas(const char *path);
+int write_glyph_atlas(glyph_atlas *atlas, const char *path);
+void draw_labeled_detections(image im, detection *dets, int num, int *ids,
+                             float thresh, char **names, glyph_atlas *atlas,
+                             int classes);
+
+#endif
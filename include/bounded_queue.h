@@ -0,0 +1,87 @@
+/*
+This header file defines a bounded, blocking FIFO queue used to hand work
+over between threads. Producers block while the queue is full, which applies
+backpressure to the upstream stages.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+template <typename T>
+class bounded_queue {
+public:
+    bounded_queue(size_t capacity) : ring(capacity > 0 ? capacity : 1),
+                                     head(0), count(0) {}
+
+    // Append an item, blocking while the queue is full
+    void push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this] { return count < ring.size(); });
+        ring[(head + count) % ring.size()] = item;
+        count++;
+        not_empty.notify_one();
+    }
+
+    // Append an item if the queue isn't full
+    // Output: whether the item was appended
+    bool try_push(T item)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (count == ring.size())
+            return false;
+        ring[(head + count) % ring.size()] = item;
+        count++;
+        not_empty.notify_one();
+        return true;
+    }
+
+    // Remove the oldest item, blocking while the queue is empty
+    T pop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this] { return count > 0; });
+        T item = ring[head];
+        head = (head + 1) % ring.size();
+        count--;
+        not_full.notify_one();
+        return item;
+    }
+
+    // Remove the oldest item if the queue isn't empty
+    // Output: whether an item was removed
+    bool try_pop(T &item)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (count == 0)
+            return false;
+        item = ring[head];
+        head = (head + 1) % ring.size();
+        count--;
+        not_full.notify_one();
+        return true;
+    }
+
+private:
+    std::vector<T> ring;
+    size_t head;
+    size_t count;
+    std::mutex mutex;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+};
+
+#endif
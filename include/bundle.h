@@ -0,0 +1,98 @@
+/*
+This header file defines the model bundle format: a single binary file
+holding everything the detector needs to start, i.e. the layer
+descriptors, the weights, the label list and the alphabet.
+Sections are aligned on `BUNDLE_ALIGNMENT` bytes so that the weights can be
+used in place once the file is mapped (or read) into memory. All values are
+little-endian, which both native (x86-64, AArch64) and WebAssembly targets
+are.
+
+Layout:
+  - header
+  - label list (NUL-separated strings)
+  - layer table, one descriptor per layer: its type and geometry, as darknet
+    computes them from the configuration, and where its parameters are
+  - glyph table, one entry per alphabet symbol
+  - parameters of each layer: weights and biases, with batch normalization
+    folded in, YOLO anchors and masks, route inputs. Convolutional weights
+    are stored as `n` rows of `c*size*size` values, which is the layout
+    darknet's GEMM, and the packed GEMM, read them in
+  - glyph images (planar RGB floats)
+Every offset and size is checked against the file when it is loaded.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <stdint.h>
+
+#define BUNDLE_MAGIC "VODBNDL1"
+#define BUNDLE_VERSION 2
+#define BUNDLE_ALIGNMENT 64
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t nlayers;
+    uint32_t nnames;
+    uint32_t nglyphs;
+    uint64_t names_offset;
+    uint64_t names_size;
+    uint64_t layers_offset;
+    uint64_t glyphs_offset;
+} bundle_header;
+
+typedef struct {
+    // Darknet's LAYER_TYPE and ACTIVATION
+    int32_t type;
+    int32_t activation;
+    // Geometry, with the meaning of darknet's `layer` fields
+    int32_t inputs, outputs;
+    int32_t h, w, c;
+    int32_t out_h, out_w, out_c;
+    int32_t n;
+    int32_t groups, size, stride, pad;
+    int32_t index;
+    int32_t reverse;
+    int32_t classes, coords, total, softmax, background;
+    float alpha, beta, scale;
+    // Parameters of the layer: weights and biases (anchors of the YOLO and
+    // region layers), and indexes (YOLO mask, or route input layers
+    // followed by their sizes). Offsets are 0 when there are none
+    uint32_t nweights;
+    uint32_t nbiases;
+    uint32_t nindexes;
+    uint64_t weights_offset;
+    uint64_t biases_offset;
+    uint64_t indexes_offset;
+} bundle_layer;
+
+typedef struct {
+    // Font size index and ASCII code, as in `labels/<symbol>_<size>.png`
+    int32_t size;
+    int32_t symbol;
+    int32_t w, h, c;
+    int32_t reserved;
+    uint64_t data_offset;
+} bundle_glyph;
+
+static inline uint64_t bundle_align(uint64_t offset)
+{
+    return (offset + BUNDLE_ALIGNMENT - 1) / BUNDLE_ALIGNMENT
+           * BUNDLE_ALIGNMENT;
+}
+
+int bundle_layer_parameters(layer *l, int *nbiases, int *nindexes);
+network *load_bundle(const char *path, int batch, char ***names,
+                     image ***alphabet);
+
+#endif
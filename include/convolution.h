@@ -0,0 +1,33 @@
+/*
+This header file defines the selection of the algorithm each convolutional
+layer of the object detection model runs: Winograd F(2,3), direct 1x1 GEMM or
+im2col and GEMM.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+Based on darknet, YOLO LICENSE https://github.com/pjreddie/darknet/blob/master/LICENSE
+*/
+
+#ifndef CONVOLUTION_H
+#define CONVOLUTION_H
+
+typedef enum {
+    CONV_IM2COL,
+    CONV_DIRECT,
+    CONV_WINOGRAD
+} conv_algorithm;
+
+/* Whether 3x3 convolutions may run the Winograd algorithm. To be set before
+ * the model is loaded */
+extern bool winograd_convolutions;
+
+void select_convolution_algorithms(network *net);
+int check_convolution_algorithms(network *net);
+
+#endif
@@ -0,0 +1,72 @@
+/*
+This header file defines the indexing of H.264 Annex B streams and the
+GOP-parallel decoder, splitting a video at its IDR frames and decoding the
+segments on several threads, as well as the keyframe decoder.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+#ifndef DECODE_H
+#define DECODE_H
+
+#include <stddef.h>
+
+#define NAL_SLICE 1
+#define NAL_SLICE_IDR 5
+#define NAL_SEI 6
+#define NAL_SPS 7
+#define NAL_PPS 8
+#define NAL_AUD 9
+
+/* NAL unit of an Annex B stream */
+typedef struct {
+    // Offset of the start code, and size up to the next start code
+    size_t offset;
+    size_t size;
+    unsigned char type;
+    // First byte following the NAL header, 0 if none
+    unsigned char payload;
+} h264_nal;
+
+/* Group of pictures, starting at an IDR access unit (or at the start of the
+ * stream for the first one). It doesn't reference any other GOP */
+typedef struct {
+    size_t offset;
+    size_t size;
+    // First NAL unit of the GOP, indexed like `h264_index.nals`
+    int nal;
+    // Last sequence and picture parameter sets preceding the GOP, -1 if none.
+    // Indexed like `h264_index.nals`
+    int sps;
+    int pps;
+    // Number of pictures preceding the GOP, in decoding order
+    int frame;
+    // Whether the GOP starts with an IDR picture. Only the first GOP may not
+    bool keyframe;
+} h264_gop;
+
+typedef struct {
+    // File holding the stream, read on demand
+    int fd;
+    size_t size;
+    h264_nal *nals;
+    int nnals;
+    h264_gop *gops;
+    int ngops;
+} h264_index;
+
+bool index_h264_stream(const char *path, h264_index *index);
+void free_h264_index(h264_index *index);
+int h264_decode_parallel(const char *input_file, int threads,
+                         void (*on_frame_ready)(SBufferInfo *));
+int h264_decode_keyframes(const char *input_file,
+                          void (*on_frame_ready)(SBufferInfo *, int));
+
+#endif
@@ -0,0 +1,115 @@
+/*
+This header file defines the object detector state and the functions used to
+run the Darknet model on decoded frames.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+Based on darknet, YOLO LICENSE https://github.com/pjreddie/darknet/blob/master/LICENSE
+*/
+
+#ifndef DETECTOR_H
+#define DETECTOR_H
+
+/* Network state, to be initialized by `init_darknet_detector()` */
+extern char **names;
+extern network *net;
+extern struct glyph_atlas *label_atlas;
+
+/* Detection parameters */
+typedef struct {
+    // Objectness threshold above which an object is considered detected
+    float objectness_thresh;
+    // Class threshold above which a class is considered detected assuming
+    // objectness within the detection box
+    float class_thresh;
+    // Hierarchical threshold (only used by YOLO9000)
+    float hier_thresh;
+    // Whether detection boxes should be drawn and saved to a file
+    bool draw_detection_boxes;
+    // Output (prediction) file path prefix, suffixed with the frame number
+    const char *outfile_prefix;
+    // Writer saving the prediction images in the background. NULL to save
+    // them synchronously
+    struct image_writer *image_writer;
+    // Whether prediction images are only saved for the frames with
+    // detections
+    bool save_detections_only;
+    // Tracker propagating detections to the frames the model is skipped on.
+    // NULL when tracking is disabled
+    struct tracker *object_tracker;
+    // Sink streaming the detections of each frame, replacing the per-frame
+    // printing. NULL to print them
+    struct detection_sink *detection_sink;
+    // Tiler running the model on tiles of the full-resolution frame. NULL to
+    // run it on the letterboxed frame
+    struct frame_tiler *tiler;
+    // Region of interest the model is restricted to. NULL for the whole
+    // frame
+    struct roi_mask *roi;
+    // Non-maximum suppression parameters. NULL to skip the suppression
+    struct nms_options *nms;
+} detector_options;
+
+/* Detections of the last frame the model ran on, reused on the frames skipped
+ * by the motion gate */
+typedef struct {
+    detection *dets;
+    int nboxes;
+} detection_history;
+
+/* A frame travelling through the detection stages */
+typedef struct {
+    int index;
+    // Stream the frame comes from, and position of the frame among the
+    // frames of the stream the model is given (multi-stream mode only)
+    int stream;
+    int sequence;
+    // Presentation timestamp of the decoded frame
+    long long pts;
+    // Decoded frame, owned by the job (only used by the pipeline)
+    SBufferInfo *yuv;
+    // Whether the model is skipped on this frame, in which case the
+    // detections of the closest preceding processed frame are reused
+    bool reuse_detections;
+    // Full-resolution image. Its data is only allocated when detection boxes
+    // are drawn
+    image im;
+    // Image resized to fit the darknet model. Not allocated when detections
+    // are reused
+    image im_sized;
+    // Rectangle of the frame resized into `im_sized`, in pixels. The whole
+    // frame unless a region of interest is set
+    int crop_x, crop_y, crop_w, crop_h;
+    detection *dets;
+    int nboxes;
+    // Track identifier of each detection, when tracking is enabled
+    int *track_ids;
+    // Prediction time, amortized over the batch
+    double prediction_duration;
+} frame_job;
+
+void init_darknet_detector(char *name_list_file, char *cfgfile,
+                           char *weightfile, bool annotate_boxes, int batch);
+void init_darknet_detector_from_bundle(char *bundle_file, bool annotate_boxes,
+                                       int batch);
+void prepare_frame(frame_job *job, SBufferInfo *bufInfo,
+                   detector_options *options);
+bool load_class_allow_list(const char *path);
+network *clone_detector_network();
+detection *get_network_boxes_batch(network *net, int b, int w, int h,
+                                   float thresh, float hier, int *num);
+void infer_frames(network *model, float *input, frame_job **jobs, int n,
+                  detector_options *options);
+void propagate_detections(frame_job *job, detection_history *history);
+void predict_frames(frame_job **jobs, int n, detector_options *options);
+void predict_frame(frame_job *job, detector_options *options);
+void output_frame(frame_job *job, detector_options *options);
+void run_darknet_detector(frame_job **jobs, int n, detector_options *options);
+
+#endif
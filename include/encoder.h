@@ -0,0 +1,36 @@
+/*
+This header file defines the H.264 encoder, re-encoding the prediction
+images into a single video with OpenH264, and the conversion of Darknet
+images back to I420.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+Based on darknet, YOLO LICENSE https://github.com/pjreddie/darknet/blob/master/LICENSE
+*/
+
+#ifndef ENCODER_H
+#define ENCODER_H
+
+// Convert a planar RGB Darknet image into I420 planes of `w*h` and
+// `(w/2)*(h/2)` bytes, `w` and `h` being the image dimensions rounded down to
+// even numbers. `image_to_i420_scalar()` is the portable reference
+// implementation, `image_to_i420()` uses the SIMD kernels available on the
+// target
+void image_to_i420_scalar(image im, unsigned char *y, unsigned char *cb,
+                          unsigned char *cr);
+void image_to_i420(image im, unsigned char *y, unsigned char *cb,
+                   unsigned char *cr);
+
+typedef struct h264_encoder h264_encoder;
+
+h264_encoder *open_h264_encoder(const char *path, int bitrate, int gop);
+bool encode_image(h264_encoder *encoder, image im, long long pts);
+void close_h264_encoder(h264_encoder *encoder);
+
+#endif
@@ -0,0 +1,52 @@
+/*
+This header file defines the 8-bit integer GEMM kernels used by the quantized
+convolutions.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+#ifndef GEMM_INT8_H
+#define GEMM_INT8_H
+
+// Granularity of the reduction dimension: the kernels multiply groups of 4
+// consecutive values. Rows of the activations are padded to a multiple of it
+#define GEMM_INT8_K_ALIGN 4
+
+// Zero point of the unsigned activations: a real value of 0 is stored as 128
+#define GEMM_INT8_ZERO_POINT 128
+
+// Largest weight magnitude. Without VNNI, AVX2 sums pairs of u8 x s8
+// products into saturating 16-bit lanes (`vpmaddubsw`), which 7-bit weights
+// can't overflow
+#if defined(__AVX2__) && !(defined(__AVX512VNNI__) && defined(__AVX512VL__)) \
+    && !defined(__AVXVNNI__)
+#define GEMM_INT8_WEIGHT_MAX 64
+#else
+#define GEMM_INT8_WEIGHT_MAX 127
+#endif
+
+typedef struct {
+    int M, K;
+    // Padded reduction dimension, a multiple of `GEMM_INT8_K_ALIGN`
+    int kp;
+    // Weights packed in panels of rows, in the order the micro-kernel reads
+    // them
+    signed char *panels;
+    // Zero point times the sum of each row, subtracted from the products
+    int *corrections;
+} gemm_int8_weights;
+
+gemm_int8_weights *pack_int8_weights(int M, int K, const signed char *A,
+                                     int lda);
+void free_int8_weights(gemm_int8_weights *weights);
+void gemm_int8(const gemm_int8_weights *A, int N, const unsigned char *Bt,
+               int *C, int ldc);
+
+#endif
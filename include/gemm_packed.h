@@ -0,0 +1,22 @@
+/*
+This header file defines the packed GEMM backend, replacing darknet's
+`gemm()` when the program is built with `GEMM=packed` (the default).
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+#ifndef GEMM_PACKED_H
+#define GEMM_PACKED_H
+
+void set_gemm_threads(int threads);
+const char *gemm_backend();
+double gemm_flops_per_cycle();
+
+#endif
@@ -0,0 +1,22 @@
+/*
+This header file defines the construction of inference-only networks from
+layer descriptors, without darknet's configuration parser.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+Based on darknet, YOLO LICENSE https://github.com/pjreddie/darknet/blob/master/LICENSE
+*/
+
+#ifndef LAYERS_H
+#define LAYERS_H
+
+bool inference_layer_supported(const layer *l);
+network *make_inference_network(const layer *descriptors, int n, int batch);
+
+#endif
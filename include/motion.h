@@ -0,0 +1,47 @@
+/*
+This header file defines the motion gate, a cheap change detector deciding
+whether a frame has to go through the object detection model or whether the
+detections of the previous frame can be reused.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+#ifndef MOTION_H
+#define MOTION_H
+
+// Side of the square luma blocks averaged into the gate's thumbnails
+#define MOTION_BLOCK_SIZE 16
+
+typedef struct {
+    // Mean luma difference of a block, in luma levels, above which the scene
+    // is considered changed
+    float threshold;
+    // Run the model at least once every `refresh_interval` frames
+    int refresh_interval;
+    // Frame and thumbnail dimensions
+    int w, h;
+    int tw, th;
+    // Block averages of the last frame the model ran on and of the current
+    // frame
+    float *reference;
+    float *current;
+    // Frames since the model last ran
+    int since_refresh;
+    // Statistics
+    int frames;
+    int skipped;
+} motion_gate;
+
+void init_motion_gate(motion_gate *gate, float threshold,
+                      int refresh_interval);
+bool motion_gate_skip(motion_gate *gate, SBufferInfo *bufInfo);
+void print_motion_gate_stats(motion_gate *gate);
+
+#endif
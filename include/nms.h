@@ -0,0 +1,37 @@
+/*
+This header file defines the non-maximum suppression engine, replacing
+darknet's `do_nms_sort()`.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+#ifndef NMS_H
+#define NMS_H
+
+typedef struct nms_options {
+    // Overlap (intersection over union) above which the less probable of two
+    // boxes is suppressed
+    float thresh;
+    // Whether boxes suppress each other whatever their class, each box
+    // competing with its most probable class
+    bool class_agnostic;
+    // Gaussian soft-NMS: instead of being suppressed, overlapping boxes see
+    // their probability decay by `exp(-iou^2/sigma)`, and are suppressed once
+    // it falls below `score_thresh`
+    bool soft;
+    float sigma;
+    float score_thresh;
+} nms_options;
+
+void nms_detections(detection *dets, int num, int classes,
+                    const int *active_classes, int nactive,
+                    nms_options *options);
+
+#endif
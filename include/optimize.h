@@ -0,0 +1,23 @@
+/*
+This header file defines the inference-only optimizations applied to the
+object detection model once it is loaded.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+Based on darknet, YOLO LICENSE https://github.com/pjreddie/darknet/blob/master/LICENSE
+*/
+
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+int fold_batchnorm(network *net);
+void finish_convolutional_layer(layer l, network net);
+void optimize_network(network *net, bool print_summary);
+
+#endif
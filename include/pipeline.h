@@ -0,0 +1,25 @@
+/*
+This header file defines the pipelined detection mode, where decoding,
+preparation, prediction and output run concurrently as separate stages.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#ifdef HAVE_THREADS
+void start_pipeline(detector_options *options, int queue_depth);
+void push_pipeline_frame(SBufferInfo *bufInfo, int index,
+                         bool reuse_detections);
+void finish_pipeline();
+#endif
+
+#endif
@@ -0,0 +1,40 @@
+/*
+This header file defines the frame buffer pool, recycling the images,
+detection arrays and other buffers allocated for every frame instead of
+returning them to the system allocator.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+void init_frame_pool(int frames_in_flight);
+void pool_next_frame();
+void *pool_alloc(size_t size);
+void *pool_calloc(size_t num, size_t size);
+void pool_free(void *ptr);
+
+// Darknet images whose data comes from the pool. They must be freed with
+// `free_pooled_image()`, not `free_image()`
+image make_pooled_image(int w, int h, int c);
+void free_pooled_image(image im);
+
+// Detection arrays held in a single pooled buffer, along with their
+// probabilities and masks. They must be freed with
+// `free_pooled_detections()`, not `free_detections()`
+detection *make_pooled_detections(int num, int classes, int nmask);
+void free_pooled_detections(detection *dets);
+
+void print_pool_stats();
+
+#endif
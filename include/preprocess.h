@@ -0,0 +1,31 @@
+/*
+This header file defines the fused frame preprocessing kernel, which turns an
+OpenH264 I420 frame into the letterboxed, normalized tensor expected by the
+object detection model in a single pass.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+Based on darknet, YOLO LICENSE https://github.com/pjreddie/darknet/blob/master/LICENSE
+*/
+
+#ifndef PREPROCESS_H
+#define PREPROCESS_H
+
+// Letterbox an OpenH264 I420 frame into a planar RGB float tensor of
+// `w*h*CHANNELS` values, reading the strided planes directly.
+// `letterbox_yuv420_scalar()` is the portable reference implementation,
+// `letterbox_yuv420()` uses the SIMD kernels available on the target
+void letterbox_yuv420_scalar(SBufferInfo *bufInfo, int w, int h, float *out);
+void letterbox_yuv420(SBufferInfo *bufInfo, int w, int h, float *out);
+
+// Same as `letterbox_yuv420()`, but allocate the output as a Darknet image
+// from the frame pool
+image letterbox_image_from_raw_yuv(SBufferInfo *bufInfo, int w, int h);
+
+#endif
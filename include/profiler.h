@@ -0,0 +1,39 @@
+/*
+This header file defines the profiler, recording the time spent in each
+layer of the object detection model and in each processing stage.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+Based on darknet, YOLO LICENSE https://github.com/pjreddie/darknet/blob/master/LICENSE
+*/
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+typedef enum {
+    STAGE_DECODE,
+    STAGE_YUV_CONVERSION,
+    STAGE_LETTERBOX,
+    STAGE_PREDICTION,
+    STAGE_BOXES,
+    STAGE_NMS,
+    STAGE_DRAW,
+    STAGE_SAVE,
+    STAGE_COUNT
+} profile_stage;
+
+/* Whether the profiler is enabled */
+extern bool profiling;
+
+void start_profiling(network *net);
+double profile_start();
+void profile_end(profile_stage stage, double start);
+void write_profile(const char *prefix);
+
+#endif
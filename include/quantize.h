@@ -0,0 +1,22 @@
+/*
+This header file defines the 8-bit post-training quantization of the
+object detection model.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+Based on darknet, YOLO LICENSE https://github.com/pjreddie/darknet/blob/master/LICENSE
+*/
+
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+int quantize_network(network *net, char *calibration_file,
+                     int calibration_frames, float thresh);
+
+#endif
@@ -0,0 +1,38 @@
+/*
+This header file defines the region of interest masks, restricting the
+object detection model to the parts of the frame that matter.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+#ifndef ROI_H
+#define ROI_H
+
+/* Polygon, in coordinates relative to the frame dimensions. Rectangles are
+ * stored as 4-vertex polygons */
+typedef struct {
+    float *x;
+    float *y;
+    int n;
+} roi_polygon;
+
+typedef struct roi_mask {
+    roi_polygon *polygons;
+    int n;
+    // Bounding box of the polygons, clipped to the frame
+    float left, top, right, bottom;
+} roi_mask;
+
+roi_mask *load_roi_mask(const char *path);
+void roi_crop(roi_mask *mask, int w, int h, int *x, int *y, int *cw, int *ch);
+bool roi_contains(roi_mask *mask, float x, float y);
+void filter_roi_detections(roi_mask *mask, detection *dets, int *num);
+
+#endif
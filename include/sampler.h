@@ -0,0 +1,46 @@
+/*
+This header file defines the frame sampler, selecting the decoded frames the
+object detection model runs on.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+typedef enum {
+    // Every frame
+    SAMPLE_ALL,
+    // One frame every `stride` frames
+    SAMPLE_STRIDE,
+    // Frames at a target rate
+    SAMPLE_RATE,
+    // IDR frames only, the other frames not being decoded at all
+    SAMPLE_KEYFRAMES,
+} sampling_mode;
+
+typedef struct {
+    sampling_mode mode;
+    int stride;
+    // Sampled frames per decoded frame, in (0, 1]
+    double ratio;
+    // Fraction of a sampled frame accumulated since the last sampled frame
+    double credit;
+    // Statistics
+    int frames;
+    int sampled;
+} frame_sampler;
+
+void init_frame_sampler(frame_sampler *sampler, int stride, float target_fps,
+                        float video_fps, bool keyframes_only);
+bool sample_frame(frame_sampler *sampler, int frame);
+void print_frame_sampler_stats(frame_sampler *sampler);
+
+#endif
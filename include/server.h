@@ -0,0 +1,52 @@
+/*
+This header file defines the multi-stream detection server, running the
+object detection model on several H.264 videos concurrently.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+#ifndef SERVER_H
+#define SERVER_H
+
+/* Settings applied to every stream. Output files are suffixed with the
+ * stream number */
+typedef struct {
+    // Detection parameters, copied for each stream
+    detector_options options;
+    // Motion gate and tracking parameters (see `main()`)
+    float motion_threshold;
+    int motion_refresh;
+    int track_interval;
+    // File the detections are streamed to, NULL to print them
+    const char *detections_file;
+    sink_format detections_format;
+    // Prediction images, encoded into a video if `save_video` is set
+    IMTYPE save_format;
+    int save_quality;
+    int save_queue;
+    writer_policy save_policy;
+    bool save_video;
+    const char *h264_output;
+    int h264_bitrate;
+    int h264_gop;
+    // Frame sampling, applied to each stream independently
+    frame_sampler sampling;
+    // Region of interest of each stream, NULL to apply the one of the
+    // detection parameters to every stream
+    struct roi_mask **rois;
+} stream_settings;
+
+#ifdef HAVE_THREADS
+int run_detection_server(char **input_files, int nstreams,
+                         stream_settings *settings, int workers,
+                         int queue_depth);
+#endif
+
+#endif
@@ -0,0 +1,60 @@
+/*
+This header file defines the detection sink, streaming one structured record
+per frame with the detected objects, their probability and their box.
+
+Two formats are supported:
+  - JSON Lines: one JSON object per line,
+    `{"frame": 12, "pts": 400, "detections": [{"class": 0, "name": "person",
+    "prob": 0.912, "track": 3, "bbox": [0.41, 0.52, 0.10, 0.33]}]}`, where
+    `track` is only present when tracking is enabled
+  - Binary: `DETECTION_SINK_MAGIC` followed by length-prefixed records, all
+    fields little-endian:
+      uint32 record length in bytes, excluding this field
+      int32  frame number
+      int64  presentation timestamp
+      uint32 number of detections
+      then, for each detection, `sink_detection`
+Boxes are given by their center, width and height, relative to the frame
+dimensions.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+#ifndef SINK_H
+#define SINK_H
+
+#include <stdint.h>
+
+#define DETECTION_SINK_MAGIC "VODDET1\n"
+
+typedef enum {
+    SINK_JSONL,
+    SINK_BINARY,
+} sink_format;
+
+/* Detection of a binary record */
+typedef struct {
+    int32_t class_id;
+    // Track identifier, -1 if untracked
+    int32_t track_id;
+    float prob;
+    float x, y, w, h;
+} sink_detection;
+
+typedef struct detection_sink detection_sink;
+
+bool reserve_standard_output();
+detection_sink *open_detection_sink(const char *path, sink_format format);
+void write_detection_record(detection_sink *sink, int frame, int64_t pts,
+                            detection *dets, int num, int *track_ids,
+                            float thresh, char **names, int classes);
+void close_detection_sink(detection_sink *sink);
+
+#endif
@@ -0,0 +1,42 @@
+/*
+This header file defines the intra-op thread pool, on which the layer
+forward functions and the GEMM backend split their work.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+typedef void (*parallel_task)(void *arg, int first, int last);
+
+void init_thread_pool(int threads, bool pin);
+int thread_pool_size();
+void parallel_run(int n, int grain, parallel_task task, void *arg);
+
+/* Run `body(first, last)` over ranges covering `[0, n)`, of at least `grain`
+ * items each, on the thread pool, and return once they are all done
+ * Input:
+ *   - number of items
+ *   - smallest number of items worth a task
+ *   - callable taking the first and past-the-end items of a range
+ * Output: None
+ */
+template <typename F>
+void parallel_for(int n, int grain, F body)
+{
+    parallel_run(n, grain,
+                 [](void *arg, int first, int last) {
+                     (*(F *) arg)(first, last);
+                 },
+                 &body);
+}
+
+#endif
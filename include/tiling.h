@@ -0,0 +1,60 @@
+/*
+This header file defines the frame tiler, running the object detection model
+on overlapping network-sized tiles of the full-resolution frame instead of a
+single letterboxed view.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+#ifndef TILING_H
+#define TILING_H
+
+/* Region of the frame fed to the network, in frame pixels. Tiles cover
+ * `net->w*scale`x`net->h*scale` pixels, the global view the whole frame */
+typedef struct {
+    int x, y;
+    bool global;
+} frame_tile;
+
+typedef struct tile_workers tile_workers;
+
+typedef struct frame_tiler {
+    // Fraction of a tile shared with each of its neighbors
+    float overlap;
+    // Frame pixels per network input pixel
+    float scale;
+    // Whether the letterboxed frame is fed to the network along with the
+    // tiles, to detect the objects larger than a tile
+    bool global_view;
+    // Networks, each run by its own thread. The first one is the model
+    network **models;
+    float **inputs;
+    int nworkers;
+    // Threads running the other networks, NULL on targets without threads
+    tile_workers *workers;
+    // Tiles of the last frame dimensions
+    frame_tile *tiles;
+    int ntiles;
+    int w, h;
+    // Statistics
+    long frames;
+    long forward_passes;
+    double time;
+    long tile_detections;
+    long tile_only_detections;
+} frame_tiler;
+
+frame_tiler *make_frame_tiler(float overlap, float scale, bool global_view,
+                              int workers);
+void infer_tiled_frame(frame_tiler *tiler, frame_job *job,
+                       detector_options *options);
+void print_frame_tiler_stats(frame_tiler *tiler);
+
+#endif
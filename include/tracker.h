@@ -0,0 +1,49 @@
+/*
+This header file defines a lightweight multi-object tracker, propagating the
+boxes found by the object detection model to the frames it is skipped on and
+assigning persistent identifiers to the detected objects.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+#ifndef TRACKER_H
+#define TRACKER_H
+
+typedef struct {
+    int id;
+    int class_id;
+    float prob;
+    // Box (relative coordinates) and velocity (per frame) at the last update
+    box bbox;
+    box velocity;
+    // Frame number of the last update
+    int frame;
+    // Number of consecutive updates the track wasn't matched in
+    int misses;
+} track;
+
+typedef struct tracker {
+    track *tracks;
+    int n;
+    int capacity;
+    int next_id;
+    // Minimum overlap between a track and a detection to associate them
+    float iou_thresh;
+    // Number of consecutive unmatched updates after which a track is dropped
+    int max_misses;
+} tracker;
+
+void init_tracker(tracker *t, float iou_thresh, int max_misses);
+int *update_tracker(tracker *t, int frame, detection *dets, int num,
+                    int classes, float thresh);
+detection *predict_tracks(tracker *t, int frame, int classes, int *num,
+                          int **ids);
+
+#endif
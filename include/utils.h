@@ -17,7 +17,18 @@ Based on darknet, YOLO LICENSE https://github.com/pjreddie/darknet/blob/master/L
 
 #define CHANNELS 3
 
+// WASI targets have no threads. Features relying on them fall back to
+// running inline on the caller's thread
+#if !defined(__wasi__)
+#define HAVE_THREADS 1
+#endif
+
+void print_tracked_detections(detection *dets, int num, int *ids, float thresh,
+                              char **names, int classes);
 image load_image_from_raw_yuv(SBufferInfo *bufInfo);
 image **load_alphabet_from_path(const char *label_path);
+SBufferInfo *copy_yuv_frame(SBufferInfo *bufInfo);
+void free_yuv_frame(SBufferInfo *bufInfo);
+detection *copy_detections(detection *dets, int num);
 
 #endif
@@ -0,0 +1,39 @@
+/*
+This header file defines the asynchronous image writer, saving the
+prediction images in the background so that encoding and writing them
+doesn't hold up the detection, either as individual files or as a single
+H.264 video.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+#ifndef WRITER_H
+#define WRITER_H
+
+/* What to do with an image when the writer's queue is full */
+typedef enum {
+    // Wait for room in the queue
+    WRITER_BLOCK,
+    // Drop the image
+    WRITER_DROP,
+} writer_policy;
+
+typedef struct image_writer image_writer;
+
+image_writer *start_image_writer(IMTYPE format, int quality, int queue_depth,
+                                 writer_policy policy);
+image_writer *start_video_writer(const char *path, int bitrate, int gop,
+                                 int queue_depth, writer_policy policy);
+const char *image_writer_extension(image_writer *writer);
+void save_image_async(image_writer *writer, image im, const char *path,
+                      long long pts);
+void finish_image_writer(image_writer *writer);
+
+#endif
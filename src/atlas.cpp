@@ -0,0 +1,345 @@
+/*
+This file implements the glyph atlas and the label renderer.
+The atlas packs the alphabet generated by `labels/make_labels.py` into a
+single file of 8-bit coverage values, so that it is provisioned and loaded in
+one read instead of one PNG per glyph.
+The renderer draws the detection boxes like darknet's `draw_detections()`,
+but labels are rendered once per label string and font size, already
+colored, and cached. Drawing a label then boils down to copying its rows into
+the frame.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+Based on darknet, YOLO LICENSE https://github.com/pjreddie/darknet/blob/master/LICENSE
+*/
+
+extern "C"
+{
+    #include "darknet.h"
+    #include "image.h"
+}
+#include "codec_def.h"
+#include "utils.h"
+#include "atlas.h"
+
+#include <string.h>
+#include <string>
+#include <unordered_map>
+#ifdef HAVE_THREADS
+#include <mutex>
+#endif
+
+// Beyond this many labels, the cache is flushed. Labels combine the names of
+// the classes detected in a box, so their number isn't bounded by the class
+// count
+#define LABEL_CACHE_SIZE 1024
+
+
+// Allocate an empty atlas
+static glyph_atlas *new_glyph_atlas(unsigned char *pixels)
+{
+    glyph_atlas *atlas = (glyph_atlas *) calloc(1, sizeof(glyph_atlas));
+    atlas->pixels = pixels;
+    return atlas;
+}
+
+/* Build a glyph atlas from an alphabet laid out as
+ * `load_alphabet_from_path()` does
+ * Input: alphabet, indexed by font size and symbol
+ * Output: glyph atlas, holding a copy of the glyphs
+ */
+glyph_atlas *make_glyph_atlas(image **alphabet)
+{
+    int i, j, k;
+    size_t size = 0;
+
+    for (j = 0; j < ATLAS_SIZES; j++)
+        for (i = 0; i < 128; i++)
+            if (alphabet[j][i].data)
+                size += alphabet[j][i].w*alphabet[j][i].h;
+
+    glyph_atlas *atlas = new_glyph_atlas((unsigned char *) malloc(size));
+    unsigned char *pixels = atlas->pixels;
+    for (j = 0; j < ATLAS_SIZES; j++) {
+        for (i = 0; i < 128; i++) {
+            image im = alphabet[j][i];
+            if (!im.data)
+                continue;
+            // Glyphs are gray: the first channel holds the coverage
+            for (k = 0; k < im.w*im.h; k++)
+                pixels[k] = (unsigned char) (im.data[k]*255 + .5);
+            atlas->glyphs[j][i].w = im.w;
+            atlas->glyphs[j][i].h = im.h;
+            atlas->glyphs[j][i].data = pixels;
+            pixels += im.w*im.h;
+        }
+    }
+    return atlas;
+}
+
+/* Load a glyph atlas generated by `make_atlas`
+ * Input: atlas file
+ * Output: glyph atlas, NULL if the file couldn't be loaded
+ */
+glyph_atlas *load_glyph_atlas(const char *path)
+{
+    uint32_t i;
+    FILE *f = fopen(path, "rb");
+
+    if (!f) {
+        printf("Couldn't open %s. Boxes won't be annotated\n", path);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    size_t size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    unsigned char *data = (unsigned char *) malloc(size);
+    if (fread(data, 1, size, f) != size) {
+        printf("Couldn't read %s\n", path);
+        fclose(f);
+        free(data);
+        return NULL;
+    }
+    fclose(f);
+
+    atlas_header *header = (atlas_header *) data;
+    if (size < sizeof(atlas_header)
+        || memcmp(header->magic, ATLAS_MAGIC, sizeof(header->magic))
+        || size < sizeof(atlas_header)
+                  + (size_t) header->nglyphs*sizeof(atlas_entry)) {
+        printf("%s isn't a glyph atlas\n", path);
+        free(data);
+        return NULL;
+    }
+
+    glyph_atlas *atlas = new_glyph_atlas(data);
+    atlas_entry *entries = (atlas_entry *) (data + sizeof(atlas_header));
+    for (i = 0; i < header->nglyphs; i++) {
+        atlas_entry *e = &entries[i];
+        if (e->size >= ATLAS_SIZES || e->symbol >= 128
+            || e->offset + (size_t) e->w*e->h > size)
+            continue;
+        atlas->glyphs[e->size][e->symbol].w = e->w;
+        atlas->glyphs[e->size][e->symbol].h = e->h;
+        atlas->glyphs[e->size][e->symbol].data = data + e->offset;
+    }
+    return atlas;
+}
+
+/* Write a glyph atlas to a file
+ * Input:
+ *   - glyph atlas
+ *   - output file
+ * Output: 0 on success, -1 otherwise
+ */
+int write_glyph_atlas(glyph_atlas *atlas, const char *path)
+{
+    int i, j;
+    atlas_header header;
+    atlas_entry entries[ATLAS_SIZES*128];
+    uint32_t offset;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ATLAS_MAGIC, sizeof(header.magic));
+    memset(entries, 0, sizeof(entries));
+    for (j = 0; j < ATLAS_SIZES; j++) {
+        for (i = 0; i < 128; i++) {
+            if (!atlas->glyphs[j][i].data)
+                continue;
+            entries[header.nglyphs].size = j;
+            entries[header.nglyphs].symbol = i;
+            entries[header.nglyphs].w = atlas->glyphs[j][i].w;
+            entries[header.nglyphs].h = atlas->glyphs[j][i].h;
+            header.nglyphs++;
+        }
+    }
+    offset = sizeof(header) + header.nglyphs*sizeof(atlas_entry);
+    for (i = 0; i < (int) header.nglyphs; i++) {
+        entries[i].offset = offset;
+        offset += entries[i].w*entries[i].h;
+    }
+
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        printf("Couldn't create %s\n", path);
+        return -1;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1
+              && fwrite(entries, sizeof(atlas_entry), header.nglyphs, f)
+                 == header.nglyphs;
+    for (i = 0; ok && i < (int) header.nglyphs; i++) {
+        atlas_glyph *g = &atlas->glyphs[entries[i].size][entries[i].symbol];
+        ok = fwrite(g->data, 1, g->w*g->h, f) == (size_t) (g->w*g->h);
+    }
+    fclose(f);
+    if (!ok) {
+        printf("Couldn't write %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Render a label in the given color, the way darknet's `get_label()` and
+// `draw_label()` do: glyphs are tiled with a small overlap and multiplied
+// together, then the label gets a white border of a quarter of its height.
+// Symbols missing from the atlas are skipped
+static image render_label(glyph_atlas *atlas, int size, const char *str,
+                          const float *rgb)
+{
+    int i, x, y, k;
+    int w = 0, h = 0;
+    int dx = -size - 1 + (size + 1)/2;
+    const char *s;
+
+    // Label dimensions
+    for (s = str; *s; s++) {
+        atlas_glyph *g = &atlas->glyphs[size][*s & 127];
+        if (!g->data)
+            continue;
+        w += w ? g->w + dx : g->w;
+        if (g->h > h)
+            h = g->h;
+    }
+    int border = h*.25;
+    int bw = w + 2*border;
+    int bh = h + 2*border;
+
+    // Coverage of the tiled glyphs, white where no glyph is drawn
+    float *coverage = (float *) malloc(bw*bh*sizeof(float));
+    for (i = 0; i < bw*bh; i++)
+        coverage[i] = 1;
+    int left = border;
+    for (s = str; *s; s++) {
+        atlas_glyph *g = &atlas->glyphs[size][*s & 127];
+        if (!g->data)
+            continue;
+        for (y = 0; y < g->h; y++) {
+            float *row = coverage + (border + y)*bw + left;
+            const unsigned char *glyph_row = g->data + y*g->w;
+            for (x = 0; x < g->w; x++)
+                row[x] *= glyph_row[x]/255.f;
+        }
+        left += g->w + dx;
+    }
+
+    image label = make_image(bw, bh, 3);
+    for (k = 0; k < 3; k++)
+        for (i = 0; i < bw*bh; i++)
+            label.data[k*bw*bh + i] = rgb[k]*coverage[i];
+    free(coverage);
+    return label;
+}
+
+// Copy a label into an image, above the given position if there is room,
+// below it otherwise, clipped to the image
+static void blit_label(image im, int r, int c, image label)
+{
+    int j, k;
+
+    if (r - label.h >= 0)
+        r -= label.h;
+    int w = label.w < im.w - c ? label.w : im.w - c;
+    if (w <= 0)
+        return;
+    for (k = 0; k < 3; k++)
+        for (j = 0; j < label.h && j + r < im.h; j++)
+            memcpy(im.data + (k*im.h + j + r)*im.w + c,
+                   label.data + (k*label.h + j)*label.w, w*sizeof(float));
+}
+
+/* Draw the detection boxes and, if an atlas is given, label them with the
+ * names of the detected classes, followed by their track identifiers when
+ * tracking
+ * Labels are cached and shared by the callers
+ * Input:
+ *   - image to draw on
+ *   - detections
+ *   - number of detections
+ *   - track identifier of each detection, -1 for untracked ones. NULL when
+ *     not tracking
+ *   - class threshold
+ *   - class names
+ *   - glyph atlas, NULL to draw the boxes only
+ *   - number of classes
+ * Output: None
+ */
+void draw_labeled_detections(image im, detection *dets, int num, int *ids,
+                             float thresh, char **names, glyph_atlas *atlas,
+                             int classes)
+{
+    static std::unordered_map<std::string, image> labels;
+#ifdef HAVE_THREADS
+    static std::mutex labels_mutex;
+#endif
+    int i, j;
+
+    for (i = 0; i < num; i++) {
+        std::string str;
+        int cls = -1;
+        for (j = 0; j < classes; j++) {
+            if (dets[i].prob[j] > thresh) {
+                if (cls < 0)
+                    cls = j;
+                else
+                    str += ", ";
+                str += names[j];
+            }
+        }
+        if (cls < 0)
+            continue;
+        // As printed by `print_tracked_detections()`
+        if (ids && ids[i] >= 0)
+            str += " #" + std::to_string(ids[i]);
+
+        int width = im.h*.006;
+        int offset = cls*123457 % classes;
+        float rgb[3] = {get_color(2, offset, classes),
+                        get_color(1, offset, classes),
+                        get_color(0, offset, classes)};
+        box b = dets[i].bbox;
+        int left  = (b.x - b.w/2.)*im.w;
+        int right = (b.x + b.w/2.)*im.w;
+        int top   = (b.y - b.h/2.)*im.h;
+        int bot   = (b.y + b.h/2.)*im.h;
+        if (left < 0)
+            left = 0;
+        if (right > im.w - 1)
+            right = im.w - 1;
+        if (top < 0)
+            top = 0;
+        if (bot > im.h - 1)
+            bot = im.h - 1;
+        draw_box_width(im, left, top, right, bot, width, rgb[0], rgb[1],
+                       rgb[2]);
+        if (!atlas)
+            continue;
+
+        // Font size, as picked by `get_label()`
+        int size = (int) (im.h*.03)/10;
+        if (size > ATLAS_SIZES - 1)
+            size = ATLAS_SIZES - 1;
+        // The color follows from the first class of the label
+        std::string key = std::to_string(size) + ":" + str;
+#ifdef HAVE_THREADS
+        // Labels may be flushed by another thread once the lock is released
+        std::lock_guard<std::mutex> lock(labels_mutex);
+#endif
+        auto it = labels.find(key);
+        if (it == labels.end()) {
+            if (labels.size() >= LABEL_CACHE_SIZE) {
+                for (auto &l : labels)
+                    free_image(l.second);
+                labels.clear();
+            }
+            it = labels.emplace(key, render_label(atlas, size, str.c_str(),
+                                                  rgb)).first;
+        }
+        blit_label(im, top + width, left, it->second);
+    }
+}
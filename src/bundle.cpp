@@ -0,0 +1,475 @@
+/*
+This file implements the loading of model bundles, produced offline by
+`tools/make_bundle.cpp`.
+The bundle is mapped into memory (native targets) or read in one go (WASI),
+then every section is checked against the file: offsets and sizes, layer
+geometry, label and glyph tables. The network is built from the layer
+descriptors (see `layers.cpp`), its layers pointing at the parameters in
+place: darknet's parser doesn't run, and nothing is copied, converted or
+allocated besides the buffers the forward pass writes.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+Based on darknet, YOLO LICENSE https://github.com/pjreddie/darknet/blob/master/LICENSE
+*/
+
+extern "C"
+{
+    #include "darknet.h"
+}
+#include "bundle.h"
+#include "layers.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#if !defined(__wasi__)
+#include <sys/mman.h>
+#endif
+
+// Number of font sizes of the alphabet, as in `load_alphabet_from_path()`
+#define BUNDLE_FONT_SIZES 8
+
+// Map the bundle into memory. The mapping is private, so that nothing
+// writing to the parameters could modify the file
+static unsigned char *map_bundle(const char *path, size_t *size)
+{
+    struct stat st;
+    unsigned char *data;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        printf("Couldn't open bundle %s\n", path);
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    *size = st.st_size;
+#if defined(__wasi__)
+    size_t done = 0;
+    if (posix_memalign((void **) &data, BUNDLE_ALIGNMENT, *size) != 0)
+        data = NULL;
+    // Reads may return fewer bytes than requested
+    while (data && done < *size) {
+        ssize_t n = read(fd, data + done, *size - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            free(data);
+            data = NULL;
+        } else {
+            done += n;
+        }
+    }
+    if (!data)
+        printf("Couldn't read bundle %s\n", path);
+#else
+    data = (unsigned char *) mmap(NULL, *size, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        printf("Couldn't map bundle %s\n", path);
+        data = NULL;
+    }
+#endif
+    close(fd);
+    return data;
+}
+
+
+// Release the bundle mapped by `map_bundle()`
+static void unmap_bundle(unsigned char *data, size_t size)
+{
+#if defined(__wasi__)
+    free(data);
+#else
+    munmap(data, size);
+#endif
+}
+
+// Whether `count` values of `size` bytes starting at `offset` lie within the
+// bundle, with the offset aligned on `alignment` bytes. Written so that none
+// of the computations can overflow
+static bool check_section(size_t bundle_size, uint64_t offset, uint64_t count,
+                          uint64_t size, uint64_t alignment)
+{
+    return offset % alignment == 0 && offset <= bundle_size
+           && count <= (bundle_size - offset)/size;
+}
+
+// Product of layer dimensions, -1 if one is negative or if it doesn't fit in
+// an int like darknet's
+static int64_t product(int64_t a, int64_t b, int64_t c = 1, int64_t d = 1)
+{
+    int i;
+    int64_t factors[] = {a, b, c, d};
+    int64_t p = 1;
+
+    for (i = 0; i < 4; i++) {
+        if (factors[i] < 0 || factors[i] > INT_MAX)
+            return -1;
+        p *= factors[i];
+        if (p > INT_MAX)
+            return -1;
+    }
+    return p;
+}
+
+// Whether the output of a shortcut layer and the one it adds are scaled
+// versions of each other, as `shortcut_cpu()` requires
+static bool check_shortcut_scale(int w1, int h1, int w2, int h2)
+{
+    if (w1 >= w2)
+        return w2 > 0 && w1 % w2 == 0 && (int64_t) h2*(w1/w2) == h1;
+    return w1 > 0 && w2 % w1 == 0 && (int64_t) h1*(w2/w1) == h2;
+}
+
+/* Count the parameters of a layer stored in bundles
+ * Input:
+ *   - layer, with batch normalization folded
+ *   - number of biases (output)
+ *   - number of indexes (output): YOLO mask, or route input layers and sizes
+ * Output: number of weights, 0 for layers without weights, -1 for layers
+ *         which can't be stored in bundles
+ */
+int bundle_layer_parameters(layer *l, int *nbiases, int *nindexes)
+{
+    *nbiases = 0;
+    *nindexes = 0;
+    if (!inference_layer_supported(l))
+        return -1;
+    switch (l->type) {
+    case CONVOLUTIONAL:
+        *nbiases = l->n;
+        return l->nweights;
+    case YOLO:
+        *nbiases = 2*l->total;
+        *nindexes = l->n;
+        return 0;
+    case REGION:
+        *nbiases = 2*l->n;
+        return 0;
+    case ROUTE:
+        *nindexes = 2*l->n;
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+// Check the geometry of a layer against darknet's construction of the same
+// layer, and against the layers it reads, so that its forward pass stays
+// within its buffers
+static bool check_layer_geometry(const layer *l, const layer *layers, int i)
+{
+    int j;
+    int64_t size;
+
+    if (product(l->out_h, l->out_w, l->out_c) != l->outputs || l->outputs <= 0)
+        return false;
+    if (l->type != ROUTE
+        && (i > 0 ? l->inputs != layers[i - 1].outputs : l->inputs <= 0))
+        return false;
+
+    switch (l->type) {
+    case CONVOLUTIONAL:
+        if (l->groups <= 0 || l->n <= 0 || l->size <= 0 || l->stride <= 0
+            || l->pad < 0 || l->c % l->groups || l->n % l->groups
+            || product(l->h, l->w, l->c) != l->inputs
+            || l->out_c != l->n
+            || l->w + 2*(int64_t) l->pad < l->size
+            || l->h + 2*(int64_t) l->pad < l->size
+            || l->out_w != (l->w + 2*(int64_t) l->pad - l->size)/l->stride + 1
+            || l->out_h != (l->h + 2*(int64_t) l->pad - l->size)/l->stride + 1)
+            return false;
+        // Unrolled input, in floats
+        size = product(product(l->out_h, l->out_w, l->size, l->size), l->c);
+        if (size < 0 || size > INT_MAX/(int64_t) sizeof(float))
+            return false;
+        size = product(l->c/l->groups, l->n, l->size, l->size);
+        return size >= 0 && l->nweights == size && l->nbiases == l->n;
+    case MAXPOOL:
+        return l->size > 0 && l->stride > 0 && l->pad >= 0
+               && product(l->h, l->w, l->c) == l->inputs && l->out_c == l->c
+               && (int64_t) l->w + l->pad >= l->size
+               && (int64_t) l->h + l->pad >= l->size
+               && l->out_w == ((int64_t) l->w + l->pad - l->size)/l->stride + 1
+               && l->out_h == ((int64_t) l->h + l->pad - l->size)/l->stride + 1;
+    case UPSAMPLE:
+        return l->stride > 0 && product(l->h, l->w, l->c) == l->inputs
+               && l->out_c == l->c
+               && (l->reverse ? l->out_w == l->w/l->stride
+                                && l->out_h == l->h/l->stride
+                              : l->out_w == (int64_t) l->w*l->stride
+                                && l->out_h == (int64_t) l->h*l->stride);
+    case SHORTCUT: {
+        if (l->index < 0 || l->index >= i || l->inputs != l->outputs)
+            return false;
+        const layer *from = &layers[l->index];
+        return from->out_w == l->w && from->out_h == l->h
+               && from->out_c == l->c
+               && check_shortcut_scale(l->w, l->h, l->out_w, l->out_h);
+    }
+    case ROUTE:
+        size = 0;
+        for (j = 0; j < l->n; j++) {
+            int index = l->input_layers[j];
+            if (index < 0 || index >= i
+                || l->input_sizes[j] != layers[index].outputs)
+                return false;
+            size += l->input_sizes[j];
+        }
+        return l->n > 0 && size == l->outputs && l->inputs == l->outputs;
+    case YOLO:
+        for (j = 0; j < l->n; j++)
+            if (l->mask[j] < 0 || l->mask[j] >= l->total)
+                return false;
+        return l->n > 0 && l->classes > 0 && l->total > 0
+               && l->h == l->out_h && l->w == l->out_w && l->c == l->out_c
+               && l->inputs == l->outputs
+               && product(l->n, (int64_t) l->classes + 4 + 1) == l->c;
+    case REGION:
+        return l->n > 0 && l->classes > 0 && l->coords >= 0
+               && l->h == l->out_h && l->w == l->out_w && l->c == l->out_c
+               && l->inputs == l->outputs
+               && product(l->n, (int64_t) l->classes + l->coords + 1) == l->c;
+    default:
+        return false;
+    }
+}
+
+// Turn an entry of the layer table into a layer descriptor pointing at its
+// parameters, checking them against the bundle
+static bool read_layer(const unsigned char *data, size_t size,
+                       const bundle_layer *bl, layer *layers, int i)
+{
+    layer *l = &layers[i];
+    int nbiases, nindexes;
+
+    if (bl->type < 0 || bl->type > BLANK || bl->activation < 0
+        || bl->activation > SELU || bl->n < 0 || bl->total < 0)
+        return false;
+    memset(l, 0, sizeof(*l));
+    l->type = (LAYER_TYPE) bl->type;
+    l->activation = (ACTIVATION) bl->activation;
+    l->inputs = bl->inputs;
+    l->outputs = bl->outputs;
+    l->h = bl->h;
+    l->w = bl->w;
+    l->c = bl->c;
+    l->out_h = bl->out_h;
+    l->out_w = bl->out_w;
+    l->out_c = bl->out_c;
+    l->n = bl->n;
+    l->groups = bl->groups;
+    l->size = bl->size;
+    l->stride = bl->stride;
+    l->pad = bl->pad;
+    l->index = bl->index;
+    l->reverse = bl->reverse;
+    l->classes = bl->classes;
+    l->coords = bl->coords;
+    l->total = bl->total;
+    l->softmax = bl->softmax;
+    l->background = bl->background;
+    l->alpha = bl->alpha;
+    l->beta = bl->beta;
+    l->scale = bl->scale;
+    l->nweights = bl->nweights;
+    l->nbiases = bl->nbiases;
+
+    // The counts must be the ones of the layer's geometry, and the
+    // parameters within the bundle
+    int nweights = bundle_layer_parameters(l, &nbiases, &nindexes);
+    if (nweights < 0 || (int64_t) bl->nweights != nweights
+        || (int64_t) bl->nbiases != nbiases
+        || (int64_t) bl->nindexes != nindexes
+        || !check_section(size, bl->weights_offset, bl->nweights,
+                          sizeof(float), sizeof(float))
+        || !check_section(size, bl->biases_offset, bl->nbiases,
+                          sizeof(float), sizeof(float))
+        || !check_section(size, bl->indexes_offset, bl->nindexes,
+                          sizeof(int32_t), sizeof(int32_t)))
+        return false;
+    if (bl->nweights)
+        l->weights = (float *) (data + bl->weights_offset);
+    if (bl->nbiases)
+        l->biases = (float *) (data + bl->biases_offset);
+    if (bl->nindexes) {
+        int *indexes = (int *) (data + bl->indexes_offset);
+        if (l->type == YOLO) {
+            l->mask = indexes;
+        } else {
+            l->input_layers = indexes;
+            l->input_sizes = indexes + l->n;
+        }
+    }
+    return check_layer_geometry(l, layers, i);
+}
+
+// Point the label list at the NUL-separated strings of the bundle
+static char **read_names(const unsigned char *data, size_t size,
+                         const bundle_header *header)
+{
+    uint32_t i;
+
+    // Each name takes at least its terminator
+    if (!check_section(size, header->names_offset, header->names_size, 1, 1)
+        || header->nnames > header->names_size)
+        return NULL;
+    const char *name = (const char *) data + header->names_offset;
+    const char *end = name + header->names_size;
+    char **names = (char **) calloc(header->nnames + 1, sizeof(char *));
+    for (i = 0; i < header->nnames; i++) {
+        const char *nul = (const char *) memchr(name, '\0', end - name);
+        if (!nul) {
+            free(names);
+            return NULL;
+        }
+        names[i] = (char *) name;
+        name = nul + 1;
+    }
+    return names;
+}
+
+// Release an alphabet built by `read_alphabet()`. Its images live in the
+// bundle
+static void free_bundle_alphabet(image **alphabet)
+{
+    int i;
+
+    if (!alphabet)
+        return;
+    for (i = 0; i < BUNDLE_FONT_SIZES; i++)
+        free(alphabet[i]);
+    free(alphabet);
+}
+
+// Point the alphabet, laid out as `load_alphabet_from_path()` does, at the
+// glyphs of the bundle. The alphabet is NULL when the bundle has no glyphs
+static bool read_alphabet(const unsigned char *data, size_t size,
+                          const bundle_header *header, image ***alphabet)
+{
+    uint32_t i;
+
+    *alphabet = NULL;
+    if (header->nglyphs == 0)
+        return true;
+    if (!check_section(size, header->glyphs_offset, header->nglyphs,
+                       sizeof(bundle_glyph), sizeof(uint64_t)))
+        return false;
+
+    const bundle_glyph *glyphs = (const bundle_glyph *)
+                                 (data + header->glyphs_offset);
+    *alphabet = (image **) calloc(BUNDLE_FONT_SIZES, sizeof(image *));
+    for (i = 0; i < BUNDLE_FONT_SIZES; i++)
+        (*alphabet)[i] = (image *) calloc(128, sizeof(image));
+    for (i = 0; i < header->nglyphs; i++) {
+        const bundle_glyph *g = &glyphs[i];
+        if (g->size < 0 || g->size >= BUNDLE_FONT_SIZES || g->symbol < 0
+            || g->symbol >= 128)
+            continue;
+        if (g->w <= 0 || g->h <= 0 || g->c <= 0
+            || !check_section(size, g->data_offset, (uint64_t) g->w*g->h,
+                              (uint64_t) g->c*sizeof(float), sizeof(float))) {
+            free_bundle_alphabet(*alphabet);
+            *alphabet = NULL;
+            return false;
+        }
+        image *im = &(*alphabet)[g->size][g->symbol];
+        im->w = g->w;
+        im->h = g->h;
+        im->c = g->c;
+        im->data = (float *) (data + g->data_offset);
+    }
+    return true;
+}
+
+// Build the network of a mapped bundle, once its sections are checked
+static network *read_network(const unsigned char *data, size_t size,
+                             const bundle_header *header, int batch,
+                             const char *path)
+{
+    uint32_t i;
+
+    if (header->nlayers == 0 || header->nlayers > INT_MAX
+        || !check_section(size, header->layers_offset, header->nlayers,
+                          sizeof(bundle_layer), sizeof(uint64_t))) {
+        printf("Bundle %s: invalid layer table\n", path);
+        return NULL;
+    }
+    const bundle_layer *table = (const bundle_layer *)
+                                (data + header->layers_offset);
+    layer *layers = (layer *) calloc(header->nlayers, sizeof(layer));
+    for (i = 0; i < header->nlayers; i++) {
+        if (!read_layer(data, size, &table[i], layers, i)) {
+            printf("Bundle %s: invalid layer %u\n", path, i);
+            free(layers);
+            return NULL;
+        }
+        // Labels are looked up by class
+        if ((layers[i].type == YOLO || layers[i].type == REGION)
+            && (uint32_t) layers[i].classes > header->nnames) {
+            printf("Bundle %s: layer %u has %d classes for %u labels\n", path,
+                   i, layers[i].classes, header->nnames);
+            free(layers);
+            return NULL;
+        }
+    }
+
+    network *net = make_inference_network(layers, header->nlayers, batch);
+    free(layers);
+    return net;
+}
+
+/* Load a model bundle. The bundle stays in memory for the lifetime of the
+ * network, which points at it
+ * Input:
+ *   - bundle file
+ *   - number of frames fed to the network in a single forward pass
+ *   - label list (output)
+ *   - alphabet (output), NULL if the bundle has no glyphs
+ * Output: network, or NULL if the bundle is invalid
+ */
+network *load_bundle(const char *path, int batch, char ***names,
+                     image ***alphabet)
+{
+    size_t size;
+    network *net = NULL;
+    unsigned char *data = map_bundle(path, &size);
+
+    *names = NULL;
+    *alphabet = NULL;
+    if (!data)
+        return NULL;
+
+    const bundle_header *header = (const bundle_header *) data;
+    if (size < sizeof(bundle_header)
+        || memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic))
+        || header->version != BUNDLE_VERSION)
+        printf("%s isn't a model bundle or was built for another version\n",
+               path);
+    else if (!(*names = read_names(data, size, header)))
+        printf("Bundle %s: invalid label list\n", path);
+    else if (!read_alphabet(data, size, header, alphabet))
+        printf("Bundle %s: invalid glyph table\n", path);
+    else
+        net = read_network(data, size, header, batch, path);
+
+    if (!net) {
+        free(*names);
+        free_bundle_alphabet(*alphabet);
+        *names = NULL;
+        *alphabet = NULL;
+        unmap_bundle(data, size);
+    }
+    return net;
+}
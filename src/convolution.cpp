@@ -0,0 +1,363 @@
+/*
+This file implements the selection of the convolution algorithm of each
+convolutional layer, once the model is loaded and optimized:
+  - 1x1 stride-1 convolutions are a plain GEMM of the weights with the input,
+    without unrolling it with `im2col_cpu()`. The fused forward function of
+    `optimize.cpp` already does so, and is kept
+  - 3x3 stride-1 convolutions run the Winograd F(2,3) algorithm: the output
+    is computed in 2x2 tiles, each from a 4x4 tile of the input, with 16
+    multiplications per tile and channel pair instead of 36. Input tiles are
+    transformed, then each of the 16 positions of the transformed tiles is a
+    GEMM of the transformed weights with the transformed input, and the
+    products are transformed back into output tiles. Weights are transformed
+    once, when the layer is selected. Tiles are processed in blocks whose
+    transformed input and products fit in the layer's im2col workspace
+  - Other convolutions, and 3x3 convolutions with too few input channels for
+    the transforms to pay off, keep im2col and GEMM
+F(2,3) is used rather than F(4,3): its transforms only involve halves and
+additions, so the results stay within float rounding of the reference.
+`check_convolution_algorithms()` compares each Winograd layer against
+im2col and GEMM on random inputs.
+The plan of each Winograd layer is keyed by the layer's weights, so that the
+networks sharing a model's weights share its plans, and that several models
+may be loaded in the same process.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+Based on darknet, YOLO LICENSE https://github.com/pjreddie/darknet/blob/master/LICENSE
+*/
+
+extern "C"
+{
+    #include "darknet.h"
+    #include "gemm.h"
+    #include "im2col.h"
+}
+#include "optimize.h"
+#include "convolution.h"
+#include "thread_pool.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <unordered_map>
+
+// Below this many input channels, the input and output transforms cost more
+// than the multiplications they save
+#define WINOGRAD_MIN_CHANNELS 16
+// Largest number of tiles transformed and multiplied at once
+#define WINOGRAD_MAX_BLOCK 256
+// Largest error of a Winograd layer relative to the largest output magnitude
+#define WINOGRAD_TOLERANCE 1e-4
+
+typedef struct {
+    // Weights transformed for the Winograd algorithm: 16 matrices of `n` rows
+    // of `c` values, one per position in the transformed tile
+    float *weights;
+    // Number of tiles processed at once
+    int block;
+} conv_plan;
+
+bool winograd_convolutions = true;
+
+/* Plans of the Winograd layers, keyed by the weights they were made for.
+ * Plans are made when a model is loaded, before any network sharing its
+ * weights runs, and are looked up by the layers as they run. Never
+ * destroyed, as models aren't */
+static std::unordered_map<const float *, conv_plan> &plans =
+    *new std::unordered_map<const float *, conv_plan>;
+
+
+// Transform a 3x3 filter into a 4x4 one: `G g G^T`
+static void transform_filter(const float *g, float *u)
+{
+    int i;
+    float t[4][3];
+
+    for (i = 0; i < 3; i++) {
+        t[0][i] = g[i];
+        t[1][i] = .5f*(g[i] + g[3 + i] + g[6 + i]);
+        t[2][i] = .5f*(g[i] - g[3 + i] + g[6 + i]);
+        t[3][i] = g[6 + i];
+    }
+    for (i = 0; i < 4; i++) {
+        u[4*i] = t[i][0];
+        u[4*i + 1] = .5f*(t[i][0] + t[i][1] + t[i][2]);
+        u[4*i + 2] = .5f*(t[i][0] - t[i][1] + t[i][2]);
+        u[4*i + 3] = t[i][2];
+    }
+}
+
+// Transform the weights of a layer, laid out as 16 matrices of `n` rows of
+// `c` values
+static float *transform_weights(layer *l)
+{
+    int i, j, p;
+    float u[16];
+    float *weights = (float *) malloc((size_t) 16*l->n*l->c*sizeof(float));
+
+    for (i = 0; i < l->n; i++) {
+        for (j = 0; j < l->c; j++) {
+            transform_filter(l->weights + (i*l->c + j)*9, u);
+            for (p = 0; p < 16; p++)
+                weights[((size_t) p*l->n + i)*l->c + j] = u[p];
+        }
+    }
+    return weights;
+}
+
+// Transform the 4x4 input tiles of a block of tiles, `B^T d B`, into 16
+// matrices of `c` rows of `block` values, for the channels in
+// `[first_channel, last_channel)`. Tiles are numbered row by row over the
+// output, starting at `first`
+static void transform_input(layer *l, const float *in, int first, int block,
+                            int tiles_w, int first_channel, int last_channel,
+                            float *v)
+{
+    int c, t, i, j;
+    float d[4][4], s[4][4];
+
+    for (c = first_channel; c < last_channel; c++) {
+        const float *channel = in + (size_t) c*l->h*l->w;
+        for (t = 0; t < block; t++) {
+            int y = (first + t)/tiles_w*2 - l->pad;
+            int x = (first + t)%tiles_w*2 - l->pad;
+            for (i = 0; i < 4; i++)
+                for (j = 0; j < 4; j++)
+                    d[i][j] = y + i < 0 || y + i >= l->h || x + j < 0
+                              || x + j >= l->w
+                              ? 0 : channel[(y + i)*l->w + x + j];
+            for (j = 0; j < 4; j++) {
+                s[0][j] = d[0][j] - d[2][j];
+                s[1][j] = d[1][j] + d[2][j];
+                s[2][j] = d[2][j] - d[1][j];
+                s[3][j] = d[1][j] - d[3][j];
+            }
+            for (i = 0; i < 4; i++) {
+                float *row = v + ((size_t) (4*i)*l->c + c)*block + t;
+                size_t stride = (size_t) l->c*block;
+                row[0] = s[i][0] - s[i][2];
+                row[stride] = s[i][1] + s[i][2];
+                row[2*stride] = s[i][2] - s[i][1];
+                row[3*stride] = s[i][1] - s[i][3];
+            }
+        }
+    }
+}
+
+// Transform the products of a block of tiles back into 2x2 output tiles,
+// `A^T m A`, clipped to the output, for the output channels in
+// `[first_channel, last_channel)`
+static void transform_output(layer *l, const float *m, int first, int block,
+                             int tiles_w, int first_channel, int last_channel,
+                             float *out)
+{
+    int k, t, i;
+    float s[2][4];
+    size_t stride = (size_t) l->n*block;
+
+    for (k = first_channel; k < last_channel; k++) {
+        float *channel = out + (size_t) k*l->out_h*l->out_w;
+        for (t = 0; t < block; t++) {
+            const float *p = m + (size_t) k*block + t;
+            int y = (first + t)/tiles_w*2;
+            int x = (first + t)%tiles_w*2;
+            for (i = 0; i < 4; i++) {
+                float m0 = p[(size_t) i*stride];
+                float m1 = p[(size_t) (4 + i)*stride];
+                float m2 = p[(size_t) (8 + i)*stride];
+                float m3 = p[(size_t) (12 + i)*stride];
+                s[0][i] = m0 + m1 + m2;
+                s[1][i] = m1 - m2 - m3;
+            }
+            for (i = 0; i < 2 && y + i < l->out_h; i++) {
+                float *row = channel + (y + i)*l->out_w + x;
+                row[0] = s[i][0] + s[i][1] + s[i][2];
+                if (x + 1 < l->out_w)
+                    row[1] = s[i][1] - s[i][2] - s[i][3];
+            }
+        }
+    }
+}
+
+// Raw 3x3 convolution of one input with the Winograd algorithm. The
+// workspace holds the transformed input and products of a block of tiles.
+// The transforms are split over the thread pool by channels, the products by
+// the GEMM backend
+static void winograd_convolution(layer *l, conv_plan *plan, const float *in,
+                                 float *out, float *workspace)
+{
+    int first, p;
+    int tiles_w = (l->out_w + 1)/2;
+    int tiles = (l->out_h + 1)/2*tiles_w;
+
+    for (first = 0; first < tiles; first += plan->block) {
+        int block = tiles - first < plan->block ? tiles - first : plan->block;
+        float *v = workspace;
+        float *m = workspace + (size_t) 16*l->c*block;
+
+        parallel_for(l->c, 1, [&](int first_channel, int last_channel) {
+            transform_input(l, in, first, block, tiles_w, first_channel,
+                            last_channel, v);
+        });
+        memset(m, 0, (size_t) 16*l->n*block*sizeof(float));
+        for (p = 0; p < 16; p++)
+            gemm(0, 0, l->n, block, l->c, 1,
+                 plan->weights + (size_t) p*l->n*l->c, l->c,
+                 v + (size_t) p*l->c*block, block, 1,
+                 m + (size_t) p*l->n*block, block);
+        parallel_for(l->n, 1, [&](int first_channel, int last_channel) {
+            transform_output(l, m, first, block, tiles_w, first_channel,
+                             last_channel, out);
+        });
+    }
+}
+
+// Forward function of the convolutional layers running the Winograd
+// algorithm. The bias, activation and fused shortcut are applied as by the
+// other implementations
+static void forward_convolutional_layer_winograd(layer l, network net)
+{
+    int b;
+
+    for (b = 0; b < l.batch; b++)
+        winograd_convolution(&l, &plans.at(l.weights),
+                             net.input + b*l.inputs, l.output + b*l.outputs,
+                             net.workspace);
+    finish_convolutional_layer(l, net);
+}
+
+// Raw convolution of one input with im2col and GEMM, as darknet computes it
+static void reference_convolution(layer *l, const float *in, float *out,
+                                  float *workspace)
+{
+    int n = l->out_h*l->out_w;
+    int k = l->size*l->size*l->c;
+
+    im2col_cpu((float *) in, l->c, l->h, l->w, l->size, l->stride, l->pad,
+               workspace);
+    memset(out, 0, (size_t) l->n*n*sizeof(float));
+    gemm(0, 0, l->n, n, k, 1, l->weights, k, workspace, n, 1, out, n);
+}
+
+// Pick the algorithm of a convolutional layer, and the block size of the
+// Winograd algorithm, bounded by the layer's workspace
+static conv_algorithm pick_algorithm(layer *l, int *block)
+{
+    int tiles = (l->out_h + 1)/2*((l->out_w + 1)/2);
+
+    if (l->type != CONVOLUTIONAL || l->batch_normalize || l->binary
+        || l->xnor || l->groups > 1)
+        return CONV_IM2COL;
+    if (l->size == 1 && l->stride == 1 && l->pad == 0)
+        return CONV_DIRECT;
+    if (!winograd_convolutions || l->size != 3 || l->stride != 1
+        || l->pad != 1 || l->c < WINOGRAD_MIN_CHANNELS)
+        return CONV_IM2COL;
+
+    size_t workspace = l->workspace_size/sizeof(float);
+    size_t fit = workspace/(16*(size_t) (l->c + l->n));
+    *block = tiles;
+    if ((size_t) *block > fit)
+        *block = fit;
+    if (*block > WINOGRAD_MAX_BLOCK)
+        *block = WINOGRAD_MAX_BLOCK;
+    return *block > 0 ? CONV_WINOGRAD : CONV_IM2COL;
+}
+
+/* Select the convolution algorithm of each convolutional layer, and
+ * transform the weights of the Winograd layers. Must be called once the
+ * network is optimized, before it runs. Networks sharing the model's weights
+ * and forward functions, e.g. built by `clone_detector_network()`, share its
+ * transformed weights
+ * Input: network
+ * Output: None
+ */
+void select_convolution_algorithms(network *net)
+{
+    int i, block;
+    int count[3] = {0, 0, 0};
+
+    for (i = 0; i < net->n; i++) {
+        layer *l = &net->layers[i];
+
+        if (l->type != CONVOLUTIONAL)
+            continue;
+        conv_algorithm algorithm = pick_algorithm(l, &block);
+        count[algorithm]++;
+        if (algorithm != CONV_WINOGRAD)
+            continue;
+
+        // Weights of a model freed since may have had the same address
+        conv_plan *plan = &plans[l->weights];
+        free(plan->weights);
+        plan->weights = transform_weights(l);
+        plan->block = block;
+        l->forward = forward_convolutional_layer_winograd;
+    }
+
+    printf("Convolution algorithms: %d Winograd F(2,3), %d direct 1x1, %d im2col\n",
+           count[CONV_WINOGRAD], count[CONV_DIRECT], count[CONV_IM2COL]);
+}
+
+/* Compare the raw output of each Winograd layer against im2col and GEMM, on
+ * a random input of the layer's batch size, and time both
+ * Input: network whose algorithms are selected
+ * Output: number of layers whose error exceeds the tolerance
+ */
+int check_convolution_algorithms(network *net)
+{
+    int i, j, b;
+    int failures = 0;
+
+    for (i = 0; i < net->n; i++) {
+        layer *l = &net->layers[i];
+        auto plan = plans.find(l->weights);
+        if (l->type != CONVOLUTIONAL || plan == plans.end())
+            continue;
+
+        size_t inputs = (size_t) l->inputs*l->batch;
+        size_t outputs = (size_t) l->outputs*l->batch;
+        float *in = (float *) malloc(inputs*sizeof(float));
+        float *ref = (float *) malloc(outputs*sizeof(float));
+        float *out = (float *) malloc(outputs*sizeof(float));
+        float *workspace = (float *) malloc(l->workspace_size);
+        for (j = 0; j < (int) inputs; j++)
+            in[j] = rand_uniform(-1, 1);
+
+        // Batch entries share the workspace, as in the forward pass
+        double start = what_time_is_it_now();
+        for (b = 0; b < l->batch; b++)
+            reference_convolution(l, in + b*l->inputs, ref + b*l->outputs,
+                                  workspace);
+        double reference_time = what_time_is_it_now() - start;
+        start = what_time_is_it_now();
+        for (b = 0; b < l->batch; b++)
+            winograd_convolution(l, &plan->second, in + b*l->inputs,
+                                 out + b*l->outputs, workspace);
+        double winograd_time = what_time_is_it_now() - start;
+
+        float max = 0, error = 0;
+        for (j = 0; j < (int) outputs; j++) {
+            max = fmaxf(max, fabsf(ref[j]));
+            error = fmaxf(error, fabsf(out[j] - ref[j]));
+        }
+        bool ok = error <= WINOGRAD_TOLERANCE*max;
+        failures += !ok;
+        printf("Layer %3d: 3x3 conv %4d -> %4d, %4d x %4d x %d: Winograd error %.2e (max output %.2e) %s, %.3f ms vs %.3f ms im2col\n",
+               i, l->c, l->n, l->w, l->h, l->batch, error, max,
+               ok ? "ok" : "FAILED", winograd_time*1e3, reference_time*1e3);
+
+        free(in);
+        free(ref);
+        free(out);
+        free(workspace);
+    }
+    return failures;
+}
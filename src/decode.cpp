@@ -0,0 +1,607 @@
+/*
+This file implements the GOP-parallel decoder and the keyframe decoder.
+The H.264 stream is first indexed: its NAL units are located by their start
+codes, reading the file in chunks rather than loading it, and the stream is
+split into groups of pictures (GOPs) at each IDR access unit. An IDR frame
+resets the decoder's references, so GOPs decode independently of each
+other. Consecutive GOPs are grouped into segments of a few GOPs, which are
+decoded concurrently by several threads, each running its own decoder over
+a temporary file holding the segment, prefixed with the parameter sets it
+relies on. Decoded frames are handed to the frame callback in stream order:
+those of the segment being output as soon as they are decoded, those of the
+segments ahead of it buffered, up to a number of frames per thread past
+which their decoders wait. Memory thus depends on the number of threads and
+the GOP length, not on the length of the video.
+The keyframe decoder feeds the decoder the IDR access units of the stream
+only. Other frames are never decoded, since IDR frames don't reference them.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+extern "C"
+{
+    #include "darknet.h"
+}
+#include "codec_def.h"
+#include "h264dec.h"
+#include "utils.h"
+#include "decode.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_THREADS
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#endif
+
+// Segments are made of whole GOPs. GOPs are added to a segment until it is
+// this large, so that short GOPs don't each pay for a decoder...
+#define MIN_SEGMENT_SIZE (256 << 10)
+// ...or until it holds this many GOPs, so that a segment's frames stay
+// within a couple of GOPs whatever the bitrate
+#define MAX_SEGMENT_GOPS 2
+// Decoded frames buffered per decoding thread, ahead of the segment being
+// output
+#define BUFFERED_FRAMES_PER_THREAD 32
+// Size of the chunks the stream is read in
+#define STREAM_CHUNK_SIZE (1 << 20)
+#ifdef __wasi__
+// The sandbox may only grant access to the output directory
+#define SEGMENT_PATH "output/vod_segment_XXXXXX"
+#else
+#define SEGMENT_PATH "/tmp/vod_segment_XXXXXX"
+#endif
+
+
+// Whether a NAL unit starts a new picture, i.e. is a slice whose first
+// macroblock is 0 (`first_mb_in_slice`, encoded as the Exp-Golomb code `1`)
+static bool starts_picture(h264_index *index, h264_nal *nal)
+{
+    return (nal->type == NAL_SLICE || nal->type == NAL_SLICE_IDR)
+           && (nal->payload & 0x80);
+}
+
+// NAL units that may precede the first slice of an access unit
+static bool is_prefix_nal(int type)
+{
+    return type == NAL_SEI || type == NAL_SPS || type == NAL_PPS
+           || type == NAL_AUD;
+}
+
+// Locate the NAL units of the stream, reading it in chunks. Start codes are
+// `00 00 01`, or `00 00 00 01`, and may straddle chunks
+static bool index_nals(h264_index *index)
+{
+    ssize_t i, n;
+    size_t position = 0;
+    int capacity = 1024;
+    int zeros = 0;
+    // Bytes of the current NAL unit read past its start code: its header,
+    // then the first byte of its payload
+    int read = 2;
+    unsigned char *chunk = (unsigned char *) malloc(STREAM_CHUNK_SIZE);
+
+    index->nals = (h264_nal *) malloc(capacity*sizeof(h264_nal));
+    index->nnals = 0;
+    while ((n = pread(index->fd, chunk, STREAM_CHUNK_SIZE, position)) > 0) {
+        for (i = 0; i < n; i++) {
+            unsigned char byte = chunk[i];
+            if (read == 0) {
+                h264_nal *nal = &index->nals[index->nnals - 1];
+                nal->type = byte & 0x1f;
+                nal->payload = 0;
+            } else if (read == 1) {
+                index->nals[index->nnals - 1].payload = byte;
+            }
+            read++;
+
+            if (byte == 1 && zeros >= 2) {
+                // 4-byte start codes have a leading zero byte
+                size_t start = position + i - (zeros >= 3 ? 3 : 2);
+                if (index->nnals == capacity) {
+                    capacity *= 2;
+                    index->nals = (h264_nal *) realloc(index->nals,
+                                                       capacity*sizeof(h264_nal));
+                }
+                if (index->nnals > 0) {
+                    h264_nal *last = &index->nals[index->nnals - 1];
+                    last->size = start - last->offset;
+                }
+                index->nals[index->nnals].offset = start;
+                index->nals[index->nnals].type = 0;
+                index->nals[index->nnals].payload = 0;
+                index->nnals++;
+                read = 0;
+            }
+            zeros = byte ? 0 : zeros + 1;
+        }
+        position += n;
+    }
+    free(chunk);
+    if (n < 0)
+        return false;
+
+    index->size = position;
+    // A start code ending the stream doesn't start a NAL unit
+    if (index->nnals > 0 && read == 0)
+        index->nnals--;
+    if (index->nnals > 0) {
+        h264_nal *last = &index->nals[index->nnals - 1];
+        last->size = index->size - last->offset;
+    }
+    return true;
+}
+
+// Split the stream into GOPs at each IDR access unit, including the SEI,
+// parameter sets and delimiter preceding its first slice
+static void index_gops(h264_index *index)
+{
+    int i;
+    int sps = -1, pps = -1;
+    int pictures = 0;
+    // First NAL unit of the run of prefix NAL units preceding the current
+    // one, and parameter sets preceding the run
+    int run = -1, run_sps = -1, run_pps = -1;
+
+    index->gops = (h264_gop *) malloc((index->nnals + 1)*sizeof(h264_gop));
+    index->ngops = 1;
+    index->gops[0].offset = 0;
+    index->gops[0].nal = 0;
+    index->gops[0].sps = -1;
+    index->gops[0].pps = -1;
+    index->gops[0].frame = 0;
+    index->gops[0].keyframe = false;
+
+    for (i = 0; i < index->nnals; i++) {
+        h264_nal *nal = &index->nals[i];
+        if (is_prefix_nal(nal->type)) {
+            if (run < 0) {
+                run = i;
+                run_sps = sps;
+                run_pps = pps;
+            }
+        } else {
+            if (nal->type == NAL_SLICE_IDR && starts_picture(index, nal)) {
+                int first = run >= 0 ? run : i;
+                h264_gop *gop = &index->gops[index->ngops - 1];
+                if (index->nals[first].offset > gop->offset) {
+                    gop = &index->gops[index->ngops++];
+                    gop->offset = index->nals[first].offset;
+                    gop->nal = first;
+                    gop->sps = run >= 0 ? run_sps : sps;
+                    gop->pps = run >= 0 ? run_pps : pps;
+                    gop->frame = pictures;
+                }
+                gop->keyframe = true;
+            }
+            if (starts_picture(index, nal))
+                pictures++;
+            run = -1;
+        }
+        if (nal->type == NAL_SPS)
+            sps = i;
+        else if (nal->type == NAL_PPS)
+            pps = i;
+    }
+
+    for (i = 0; i < index->ngops; i++)
+        index->gops[i].size = (i + 1 < index->ngops ? index->gops[i + 1].offset
+                                                    : index->size)
+                              - index->gops[i].offset;
+}
+
+/* Index the NAL units and the GOPs of an H.264 Annex B stream. The stream
+ * stays in its file, which the index keeps open
+ * Input:
+ *   - H.264 file
+ *   - index (output), to be freed with `free_h264_index()`
+ * Output: whether the file could be read
+ */
+bool index_h264_stream(const char *path, h264_index *index)
+{
+    memset(index, 0, sizeof(*index));
+    index->fd = open(path, O_RDONLY);
+    if (index->fd < 0) {
+        printf("Couldn't open %s\n", path);
+        return false;
+    }
+    if (!index_nals(index)) {
+        printf("Couldn't read %s\n", path);
+        free_h264_index(index);
+        return false;
+    }
+    index_gops(index);
+    return true;
+}
+
+void free_h264_index(h264_index *index)
+{
+    if (index->fd >= 0)
+        close(index->fd);
+    free(index->nals);
+    free(index->gops);
+    memset(index, 0, sizeof(*index));
+    index->fd = -1;
+}
+
+// Copy a range of the stream to a file. Ranges are read at their offset,
+// so that several threads may copy from the same index
+static bool write_range(FILE *f, h264_index *index, size_t offset,
+                        size_t size)
+{
+    unsigned char chunk[64 << 10];
+
+    while (size > 0) {
+        size_t n = size < sizeof(chunk) ? size : sizeof(chunk);
+        ssize_t got = pread(index->fd, chunk, n, offset);
+        if (got <= 0 || fwrite(chunk, 1, got, f) != (size_t) got)
+            return false;
+        offset += got;
+        size -= got;
+    }
+    return true;
+}
+
+// Write a NAL unit of the stream to a file, if any
+static bool write_nal(FILE *f, h264_index *index, int nal)
+{
+    if (nal < 0)
+        return true;
+    h264_nal *n = &index->nals[nal];
+    return write_range(f, index, n->offset, n->size);
+}
+
+// Create a temporary file for a stream extracted from the video. `path` is
+// updated with its name
+static FILE *create_temp_stream(char *path)
+{
+    int fd = mkstemp(path);
+
+    return fd < 0 ? NULL : fdopen(fd, "wb");
+}
+
+#ifdef HAVE_THREADS
+
+/* Consecutive GOPs decoded by the same decoder */
+typedef struct {
+    int index;
+    int first_gop;
+    int ngops;
+    // Decoded frames not handed to the frame callback yet, copied into the
+    // frame pool
+    std::deque<SBufferInfo *> frames;
+    bool decoded;
+    int result;
+} segment;
+
+static h264_index stream_index;
+static std::vector<segment> segments;
+
+/* Decoding progress, guarded by the mutex: next segment to be decoded,
+ * number of segments handed to the frame callback, and decoded frames
+ * waiting for it */
+static std::mutex decode_mutex;
+static std::condition_variable frame_decoded;
+static std::condition_variable frame_output;
+static int next_segment;
+static int output_segments;
+static int buffered_frames;
+static int max_buffered_frames;
+
+/* Segment decoded by the current thread. The decoder callback doesn't take
+ * any user data */
+static thread_local segment *current_segment;
+
+// Queue a decoded frame. Decoders of the segments ahead of the one being
+// output wait while too many frames are buffered. The decoder of the segment
+// being output never does, as its frames are consumed as they come
+static void on_segment_frame(SBufferInfo *bufInfo)
+{
+    segment *s = current_segment;
+    SBufferInfo *frame = copy_yuv_frame(bufInfo);
+
+    {
+        std::unique_lock<std::mutex> lock(decode_mutex);
+        frame_output.wait(lock, [s] {
+            return s->index == output_segments
+                   || buffered_frames < max_buffered_frames;
+        });
+        s->frames.push_back(frame);
+        buffered_frames++;
+    }
+    frame_decoded.notify_all();
+}
+
+// Decode a segment through a temporary file, prefixed with the parameter
+// sets in use at its start
+static int decode_segment(segment *s)
+{
+    char path[] = SEGMENT_PATH;
+    h264_gop *first = &stream_index.gops[s->first_gop];
+    h264_gop *last = &stream_index.gops[s->first_gop + s->ngops - 1];
+    size_t size = last->offset + last->size - first->offset;
+    FILE *f = create_temp_stream(path);
+    bool ok = f && write_nal(f, &stream_index, first->sps)
+              && write_nal(f, &stream_index, first->pps)
+              && write_range(f, &stream_index, first->offset, size);
+
+    if (f)
+        fclose(f);
+    if (!ok) {
+        printf("Couldn't write segment to %s\n", path);
+        remove(path);
+        return -1;
+    }
+    current_segment = s;
+    int result = h264_decode(path, "", false, &on_segment_frame);
+    remove(path);
+    return result;
+}
+
+// Decode segments in turn, at most `window` segments ahead of the output
+static void decode_worker(int window)
+{
+    int i;
+    int nsegments = segments.size();
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(decode_mutex);
+            frame_output.wait(lock, [&] {
+                return next_segment >= nsegments
+                       || next_segment < output_segments + window;
+            });
+            if (next_segment >= nsegments)
+                return;
+            i = next_segment++;
+        }
+        int result = decode_segment(&segments[i]);
+        {
+            std::lock_guard<std::mutex> lock(decode_mutex);
+            segments[i].result = result;
+            segments[i].decoded = true;
+        }
+        frame_decoded.notify_all();
+    }
+}
+
+// Group GOPs into segments of `MIN_SEGMENT_SIZE` bytes, or
+// `MAX_SEGMENT_GOPS` GOPs if fewer
+static void split_segments()
+{
+    int i;
+    size_t size = 0;
+
+    segments.clear();
+    for (i = 0; i < stream_index.ngops; i++) {
+        if (segments.empty() || size >= MIN_SEGMENT_SIZE
+            || segments.back().ngops >= MAX_SEGMENT_GOPS) {
+            segments.emplace_back();
+            segments.back().index = segments.size() - 1;
+            segments.back().first_gop = i;
+            size = 0;
+        }
+        segments.back().ngops++;
+        size += stream_index.gops[i].size;
+    }
+}
+
+#endif
+
+/* Decode an H.264 video with several decoders running in parallel on
+ * independent segments of the stream, split at IDR frames. Frames are handed
+ * to the callback in stream order, from the calling thread. Falls back to
+ * sequential decoding on targets without threads or when the stream has a
+ * single GOP
+ * Input:
+ *   - H.264 file
+ *   - number of decoding threads
+ *   - frame callback, as with `h264_decode()`
+ * Output: 0 on success, the first decoder error otherwise
+ */
+int h264_decode_parallel(const char *input_file, int threads,
+                         void (*on_frame_ready)(SBufferInfo *))
+{
+#ifdef HAVE_THREADS
+    int i;
+    int result = 0;
+    // Timestamps, made monotonic across segments
+    unsigned long long offset = 0, last = 0, step = 0;
+    bool started = false;
+
+    if (threads <= 1 || !index_h264_stream(input_file, &stream_index))
+        return h264_decode(input_file, "", false, on_frame_ready);
+    if (stream_index.ngops <= 1) {
+        printf("%s has a single GOP. Decoding it sequentially\n", input_file);
+        free_h264_index(&stream_index);
+        return h264_decode(input_file, "", false, on_frame_ready);
+    }
+
+    split_segments();
+    printf("Parallel decoding: %d NAL units, %d GOPs, %d segments on %d threads\n",
+           stream_index.nnals, stream_index.ngops, (int) segments.size(),
+           threads);
+
+    next_segment = 0;
+    output_segments = 0;
+    buffered_frames = 0;
+    max_buffered_frames = threads*BUFFERED_FRAMES_PER_THREAD;
+    std::vector<std::thread> workers;
+    for (i = 0; i < threads; i++)
+        workers.emplace_back(decode_worker, 2*threads);
+
+    for (i = 0; i < (int) segments.size(); i++) {
+        segment *s = &segments[i];
+        bool first = true;
+
+        while (true) {
+            SBufferInfo *frame;
+            {
+                std::unique_lock<std::mutex> lock(decode_mutex);
+                frame_decoded.wait(lock, [s] {
+                    return !s->frames.empty() || s->decoded;
+                });
+                if (s->frames.empty())
+                    break;
+                frame = s->frames.front();
+                s->frames.pop_front();
+                buffered_frames--;
+            }
+            frame_output.notify_all();
+
+            // Each decoder starts its timestamps over. Carry on from the
+            // previous segment, with the last frame interval
+            unsigned long long pts = frame->uiOutYuvTimeStamp + offset;
+            if (started && first && pts <= last) {
+                offset = last + step - frame->uiOutYuvTimeStamp;
+                pts = last + step;
+            } else if (started && pts > last) {
+                step = pts - last;
+            }
+            frame->uiOutYuvTimeStamp = pts;
+            last = pts;
+            started = true;
+            first = false;
+
+            on_frame_ready(frame);
+            free_yuv_frame(frame);
+        }
+        if (s->result && !result)
+            result = s->result;
+        {
+            std::lock_guard<std::mutex> lock(decode_mutex);
+            output_segments++;
+        }
+        frame_output.notify_all();
+    }
+
+    for (std::thread &worker : workers)
+        worker.join();
+    segments.clear();
+    free_h264_index(&stream_index);
+    return result;
+#else
+    return h264_decode(input_file, "", false, on_frame_ready);
+#endif
+}
+
+/* Keyframe decoding: frame numbers of the keyframes, in decoding order, and
+ * number of frames output by the decoder */
+typedef struct {
+    int *numbers;
+    int n;
+    int output;
+    void (*on_frame_ready)(SBufferInfo *, int);
+} keyframe_decoding;
+
+/* Decoding run by the current thread, as streams may be decoded
+ * concurrently. The decoder callback doesn't take any user data */
+#ifdef HAVE_THREADS
+static thread_local keyframe_decoding *current_keyframes;
+#else
+static keyframe_decoding *current_keyframes;
+#endif
+
+static void on_keyframe_decoded(SBufferInfo *bufInfo)
+{
+    keyframe_decoding *k = current_keyframes;
+    int frame = k->output < k->n ? k->numbers[k->output] : -1;
+
+    k->output++;
+    k->on_frame_ready(bufInfo, frame);
+}
+
+// Size of the first access unit of a GOP, up to the slice starting the next
+// picture or the prefix NAL units preceding it
+static size_t first_access_unit_size(h264_index *index, h264_gop *gop)
+{
+    int i;
+    size_t end = gop->offset + gop->size;
+    // First NAL unit of the run of prefix NAL units preceding the current
+    // one
+    int run = -1;
+    bool slices = false;
+
+    for (i = gop->nal; i < index->nnals; i++) {
+        h264_nal *nal = &index->nals[i];
+        if (nal->offset >= end)
+            break;
+        if (is_prefix_nal(nal->type)) {
+            if (run < 0)
+                run = i;
+            continue;
+        }
+        if (slices && starts_picture(index, nal))
+            return index->nals[run >= 0 ? run : i].offset - gop->offset;
+        if (nal->type == NAL_SLICE || nal->type == NAL_SLICE_IDR)
+            slices = true;
+        run = -1;
+    }
+    return gop->size;
+}
+
+/* Decode the IDR frames of an H.264 video only, skipping every other frame
+ * without decoding it. IDR frames are the first frames of their GOP and
+ * don't reference any other frame
+ * Input:
+ *   - H.264 file
+ *   - frame callback, given the decoded frame and its number in the video
+ *     (-1 if the decoder output more frames than the video has keyframes)
+ * Output: 0 on success, the decoder error otherwise
+ */
+int h264_decode_keyframes(const char *input_file,
+                          void (*on_frame_ready)(SBufferInfo *, int))
+{
+    int i;
+    h264_index index;
+    char path[] = SEGMENT_PATH;
+
+    if (!index_h264_stream(input_file, &index))
+        return -1;
+
+    // Stream made of the keyframes, each with the parameter sets in use
+    FILE *f = create_temp_stream(path);
+    bool ok = f != NULL;
+    keyframe_decoding k = {(int *) malloc(index.ngops*sizeof(int)), 0, 0,
+                           on_frame_ready};
+    for (i = 0; ok && i < index.ngops; i++) {
+        h264_gop *gop = &index.gops[i];
+        if (!gop->keyframe)
+            continue;
+        size_t size = first_access_unit_size(&index, gop);
+        ok = write_nal(f, &index, gop->sps) && write_nal(f, &index, gop->pps)
+             && write_range(f, &index, gop->offset, size);
+        k.numbers[k.n++] = gop->frame;
+    }
+    if (f)
+        fclose(f);
+    printf("Keyframe decoding: %d keyframes out of %d GOPs\n", k.n,
+           index.ngops);
+    free_h264_index(&index);
+    if (!ok) {
+        printf("Couldn't write keyframes to %s\n", path);
+        remove(path);
+        free(k.numbers);
+        return -1;
+    }
+
+    current_keyframes = &k;
+    int result = h264_decode(path, "", false, &on_keyframe_decoded);
+    remove(path);
+    free(k.numbers);
+    return result;
+}
@@ -0,0 +1,753 @@
+/*
+This file contains the object detection functions.
+Processing a frame is split into three steps so that they can either run back
+to back from the decoder callback or as separate pipeline stages:
+  1 - Preparation: conversion of the decoded frame into the model's input
+  2 - Prediction: network inference and extraction of the detection boxes
+  3 - Output: non-maximum suppression, printing, drawing and saving
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+Based on darknet, YOLO LICENSE https://github.com/pjreddie/darknet/blob/master/LICENSE
+*/
+
+extern "C"
+{
+    #include "darknet.h"
+    #include "yolo_layer.h"
+    #include "region_layer.h"
+    #include "detection_layer.h"
+}
+#include "codec_def.h"
+#include "utils.h"
+#include "preprocess.h"
+#include "tracker.h"
+#include "detector.h"
+#include "bundle.h"
+#include "layers.h"
+#include "optimize.h"
+#include "convolution.h"
+#include "profiler.h"
+#include "pool.h"
+#include "sink.h"
+#include "writer.h"
+#include "atlas.h"
+#include "tiling.h"
+#include "roi.h"
+#include "nms.h"
+#include "thread_pool.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+// Smallest numbers of cells filtered and of boxes decoded by a task of the
+// thread pool
+#define YOLO_CELL_GRAIN 64
+#define YOLO_BOX_GRAIN 16
+
+
+/* Network state, to be initialized by `init_darknet_detector()` */
+char **names;
+network *net;
+glyph_atlas *label_atlas;
+
+/* Classes the detections are restricted to, sorted. All of them when
+ * empty */
+static int *active_classes;
+static int nactive_classes;
+
+/* Contiguous input tensor holding a batch of resized frames */
+static float *batch_input;
+
+/* Detections of the last frame the model ran on, reused on frames skipped by
+ * the motion gate */
+static detection_history history;
+
+/* Set the number of frames fed to the network in a single forward pass and
+ * optimize it for inference
+ * Input: batch size
+ * Output: None
+ */
+static void set_detector_batch(int batch)
+{
+    bool resize = batch > 1 && net->batch != batch;
+
+    set_batch_network(net, batch);
+    if (resize)
+        // Layer buffers are sized after the batch in the configuration file.
+        // Resizing the network to its own dimensions reallocates them for the
+        // new batch size
+        resize_network(net, net->w, net->h);
+    if (batch > 1)
+        batch_input = (float *) calloc(net->inputs*batch, sizeof(float));
+
+    // Fold batch normalization and fuse layers. The network can't be resized
+    // anymore
+    optimize_network(net, true);
+    select_convolution_algorithms(net);
+}
+
+/* Initialize the Darknet model (neural network)
+ * Input:
+ *   - name list file: contains the labels of all objects
+ *   - network configuration file
+ *   - weight file
+ *   - whether detection boxes should be annotated with the name of the detected
+ *     object (requires a glyph atlas)
+ *   - number of frames fed to the network in a single forward pass
+ * Output: None
+ */
+void init_darknet_detector(char *name_list_file, char *cfgfile,
+                           char *weightfile, bool annotate_boxes, int batch)
+{
+    // Get name list
+    names = get_labels(name_list_file);
+
+    // Load network
+    net = load_network(cfgfile, weightfile, 0);
+    set_detector_batch(batch);
+
+    // Load the glyph atlas (alphabet packed by `make_atlas`). It is used to
+    // write the labels next to the detection boxes
+    if (annotate_boxes)
+        label_atlas = load_glyph_atlas("program_data/labels.atlas");
+}
+
+/* Initialize the Darknet model from a model bundle (see `bundle.h`). The
+ * label list and, if the bundle embeds it, the alphabet are loaded from the
+ * bundle as well
+ * Input:
+ *   - bundle file
+ *   - whether detection boxes should be annotated with the name of the detected
+ *     object (requires the bundle to embed the alphabet)
+ *   - number of frames fed to the network in a single forward pass
+ * Output: None
+ */
+void init_darknet_detector_from_bundle(char *bundle_file, bool annotate_boxes,
+                                       int batch)
+{
+    int i;
+    image **alphabet;
+
+    // The network is built with its final batch size
+    net = load_bundle(bundle_file, batch, &names, &alphabet);
+    if (!net)
+        exit(1);
+    if (alphabet) {
+        if (annotate_boxes)
+            label_atlas = make_glyph_atlas(alphabet);
+        // Glyph data lives in the bundle
+        for (i = 0; i < ATLAS_SIZES; i++)
+            free(alphabet[i]);
+        free(alphabet);
+    }
+    set_detector_batch(batch);
+}
+
+/* Restrict the detections to a subset of the classes. Must be called once
+ * the model is loaded
+ * Input: file listing the names of the classes, one per line, as in the
+ *        name list file
+ * Output: whether every listed class is known to the model
+ */
+bool load_class_allow_list(const char *path)
+{
+    int i;
+    char line[256];
+    int classes = net->layers[net->n - 1].classes;
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        printf("Couldn't open %s\n", path);
+        return false;
+    }
+    active_classes = (int *) calloc(classes, sizeof(int));
+    nactive_classes = 0;
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (!line[0])
+            continue;
+        for (i = 0; i < classes; i++)
+            if (!strcmp(line, names[i]))
+                break;
+        if (i == classes) {
+            printf("%s: unknown class %s\n", path, line);
+            fclose(f);
+            return false;
+        }
+        if (std::find(active_classes, active_classes + nactive_classes, i)
+            == active_classes + nactive_classes)
+            active_classes[nactive_classes++] = i;
+    }
+    fclose(f);
+    std::sort(active_classes, active_classes + nactive_classes);
+
+    printf("Detections restricted to %d classes:", nactive_classes);
+    for (i = 0; i < nactive_classes; i++)
+        printf(" %s", names[active_classes[i]]);
+    printf("\n");
+    return nactive_classes > 0;
+}
+
+/* Build a network running forward passes alongside the model, e.g. on
+ * another thread. Its layers are built from the model's descriptors (see
+ * `layers.cpp`): it shares the model's parameters and convolution plans,
+ * read-only, and only has its own layer buffers and workspace. Must be called
+ * once the model's layers are final (batch size, optimizations, profiling)
+ * Input: None
+ * Output: network, NULL if it couldn't be built
+ */
+network *clone_detector_network()
+{
+    int i;
+    network *clone = make_inference_network(net->layers, net->n, net->batch);
+
+    if (!clone)
+        return NULL;
+    // Same fusions as the model's, whose summary was already printed
+    optimize_network(clone, false);
+    // Use the model's final forward functions, e.g. profiled ones
+    for (i = 0; i < clone->n; i++)
+        clone->layers[i].forward = net->layers[i].forward;
+    return clone;
+}
+
+/* Convert a decoded frame into the model's input
+ * Input:
+ *   - frame job to be filled in
+ *   - OpenH264's I420 frame buffer
+ *   - detection parameters
+ * Output: None
+ */
+void prepare_frame(frame_job *job, SBufferInfo *bufInfo,
+                   detector_options *options)
+{
+    // Convert and resize the frame to fit the darknet model in a single pass.
+    // The full-resolution RGB image is only needed to draw detection boxes,
+    // or to cut tiles from. Tiling only letterboxes the frame for the global
+    // view
+    bool tiled = options->tiler && !job->reuse_detections;
+    double start = profile_start();
+    int w = bufInfo->UsrData.sSystemBuffer.iWidth;
+    int h = bufInfo->UsrData.sSystemBuffer.iHeight;
+    job->pts = bufInfo->uiOutYuvTimeStamp;
+
+    // Only letterbox the bounding box of the region of interest, so that it
+    // gets more of the model's resolution. Planes are cropped in place
+    SBufferInfo cropped = *bufInfo;
+    job->crop_x = job->crop_y = 0;
+    job->crop_w = w;
+    job->crop_h = h;
+    if (options->roi && !tiled) {
+        roi_crop(options->roi, w, h, &job->crop_x, &job->crop_y,
+                 &job->crop_w, &job->crop_h);
+        int stride0 = bufInfo->UsrData.sSystemBuffer.iStride[0];
+        int stride1 = bufInfo->UsrData.sSystemBuffer.iStride[1];
+        cropped.pDst[0] += job->crop_y*stride0 + job->crop_x;
+        cropped.pDst[1] += job->crop_y/2*stride1 + job->crop_x/2;
+        cropped.pDst[2] += job->crop_y/2*stride1 + job->crop_x/2;
+        cropped.UsrData.sSystemBuffer.iWidth = job->crop_w;
+        cropped.UsrData.sSystemBuffer.iHeight = job->crop_h;
+    }
+
+    if (job->reuse_detections || (tiled && !options->tiler->global_view))
+        job->im_sized = float_to_image(net->w, net->h, CHANNELS, NULL);
+    else
+        job->im_sized = letterbox_image_from_raw_yuv(&cropped, net->w, net->h);
+    profile_end(STAGE_LETTERBOX, start);
+    if (options->draw_detection_boxes || tiled) {
+        start = profile_start();
+        job->im = load_image_from_raw_yuv(bufInfo);
+        profile_end(STAGE_YUV_CONVERSION, start);
+    } else {
+        job->im.w = w;
+        job->im.h = h;
+        job->im.c = CHANNELS;
+        job->im.data = NULL;
+    }
+}
+
+// Whether a layer outputs detection boxes
+static bool is_output_layer(layer *l)
+{
+    return l->type == YOLO || l->type == REGION || l->type == DETECTION;
+}
+
+// Position of an entry of the YOLO output of an anchor box, like darknet's
+// `entry_index()`. Locations number the anchors of all the cells
+static int yolo_entry(layer *l, int location, int entry)
+{
+    int stride = l->w*l->h;
+
+    return (location / stride)*stride*(4 + l->classes + 1) + entry*stride
+           + location % stride;
+}
+
+// Whether an anchor box of a YOLO layer yields a detection: its objectness
+// and its probability for one of the allowed classes must be above the
+// threshold. Only the scores of the allowed classes are read
+static bool keep_yolo_box(layer *l, int location, float thresh)
+{
+    int j;
+    int stride = l->w*l->h;
+    float objectness = l->output[yolo_entry(l, location, 4)];
+    const float *scores = l->output + yolo_entry(l, location, 5);
+
+    if (objectness <= thresh)
+        return false;
+    if (nactive_classes > 0) {
+        for (j = 0; j < nactive_classes; j++)
+            if (objectness*scores[active_classes[j]*stride] > thresh)
+                return true;
+    } else {
+        for (j = 0; j < l->classes; j++)
+            if (objectness*scores[j*stride] > thresh)
+                return true;
+    }
+    return false;
+}
+
+// Decode the selected anchor boxes of a YOLO layer, like darknet's
+// `get_yolo_detections()` and `correct_yolo_boxes()`, computing the
+// probabilities of the allowed classes only. The others stay at 0
+static void decode_yolo_boxes(layer *l, const int *locations, int n, int w,
+                              int h, int netw, int neth, float thresh,
+                              detection *dets)
+{
+    int i, j;
+    int stride = l->w*l->h;
+    int new_w, new_h;
+
+    // Placement of the letterboxed image in the network input
+    if ((float) netw/w < (float) neth/h) {
+        new_w = netw;
+        new_h = (h*netw)/w;
+    } else {
+        new_h = neth;
+        new_w = (w*neth)/h;
+    }
+
+    for (i = 0; i < n; i++) {
+        int anchor = l->mask[locations[i] / stride];
+        int cell = locations[i] % stride;
+        const float *p = l->output + yolo_entry(l, locations[i], 0);
+        const float *scores = p + 5*stride;
+        float objectness = p[4*stride];
+        box b;
+
+        b.x = (cell % l->w + p[0]) / l->w;
+        b.y = (cell / l->w + p[stride]) / l->h;
+        // In double precision, as in darknet's C code
+        b.w = exp((double) p[2*stride]) * l->biases[2*anchor] / netw;
+        b.h = exp((double) p[3*stride]) * l->biases[2*anchor + 1] / neth;
+        b.x = (b.x - (netw - new_w)/2./netw) / ((float) new_w/netw);
+        b.y = (b.y - (neth - new_h)/2./neth) / ((float) new_h/neth);
+        b.w *= (float) netw/new_w;
+        b.h *= (float) neth/new_h;
+        dets[i].bbox = b;
+        dets[i].objectness = objectness;
+
+        if (nactive_classes > 0) {
+            for (j = 0; j < nactive_classes; j++) {
+                int c = active_classes[j];
+                float prob = objectness*scores[c*stride];
+                dets[i].prob[c] = prob > thresh ? prob : 0;
+            }
+        } else {
+            for (j = 0; j < l->classes; j++) {
+                float prob = objectness*scores[j*stride];
+                dets[i].prob[j] = prob > thresh ? prob : 0;
+            }
+        }
+    }
+}
+
+/* Extract the detection boxes of one frame of the last batch. Mirrors
+ * darknet's `get_network_boxes()`, allocating the detections from the frame
+ * pool.
+ * YOLO outputs are decoded here rather than by darknet: anchors are filtered
+ * on their objectness and on the scores of the allowed classes before
+ * anything is allocated, so only the boxes that can be detections are
+ * materialized.
+ * Darknet's box extraction of the other layers only reads the first batch
+ * entry of the output layers and treats batches of 2 as pairs of flipped
+ * images, so the output layers are temporarily narrowed to the requested
+ * batch entry
+ * Input:
+ *   - network the batch ran through
+ *   - batch entry
+ *   - image width and height, used to scale the boxes
+ *   - objectness and hierarchical thresholds
+ *   - number of boxes (output)
+ * Output: detections, to be freed with `free_pooled_detections()`
+ */
+detection *get_network_boxes_batch(network *net, int b, int w, int h,
+                                   float thresh, float hier, int *num)
+{
+    int i, j, k;
+    int nboxes = 0;
+    layer last = net->layers[net->n - 1];
+    detection *dets, *d;
+    // Anchor boxes kept in each YOLO layer
+    int *locations[net->n];
+    int counts[net->n];
+
+    for (i = 0; i < net->n; i++) {
+        layer *l = &net->layers[i];
+        if (!is_output_layer(l))
+            continue;
+        l->output += b*l->outputs;
+        l->batch = 1;
+        if (l->type != YOLO) {
+            nboxes += l->w*l->h*l->n;
+            continue;
+        }
+        // Anchors are filtered on the thread pool by ranges of cells, then
+        // gathered in darknet's order: anchors of the first cell first
+        bool *keep = (bool *) pool_alloc(l->w*l->h*l->n*sizeof(bool));
+        parallel_for(l->w*l->h, YOLO_CELL_GRAIN, [=](int first, int last) {
+            int cell, anchor;
+            for (cell = first; cell < last; cell++)
+                for (anchor = 0; anchor < l->n; anchor++)
+                    keep[cell*l->n + anchor] =
+                        keep_yolo_box(l, anchor*l->w*l->h + cell, thresh);
+        });
+        locations[i] = (int *) pool_alloc(l->w*l->h*l->n*sizeof(int));
+        counts[i] = 0;
+        for (j = 0; j < l->w*l->h; j++)
+            for (k = 0; k < l->n; k++)
+                if (keep[j*l->n + k])
+                    locations[i][counts[i]++] = k*l->w*l->h + j;
+        pool_free(keep);
+        nboxes += counts[i];
+    }
+
+    dets = make_pooled_detections(nboxes, last.classes,
+                                  last.coords > 4 ? last.coords - 4 : 0);
+    for (i = 0, d = dets; i < net->n; i++) {
+        layer *l = &net->layers[i];
+        if (l->type == YOLO) {
+            const int *kept = locations[i];
+            parallel_for(counts[i], YOLO_BOX_GRAIN, [=](int first, int last) {
+                decode_yolo_boxes(l, kept + first, last - first, w, h,
+                                  net->w, net->h, thresh, d + first);
+            });
+            d += counts[i];
+            pool_free(locations[i]);
+        } else if (l->type == REGION) {
+            get_region_detections(*l, w, h, net->w, net->h, thresh, 0, hier,
+                                  1, d);
+            d += l->w*l->h*l->n;
+        } else if (l->type == DETECTION) {
+            get_detection_detections(*l, w, h, thresh, d);
+            d += l->w*l->h*l->n;
+        }
+    }
+
+    for (i = 0; i < net->n; i++) {
+        layer *l = &net->layers[i];
+        if (is_output_layer(l)) {
+            l->output -= b*l->outputs;
+            l->batch = net->batch;
+        }
+    }
+    *num = nboxes;
+    return dets;
+}
+
+// Map boxes relative to the letterboxed rectangle of a frame to the frame
+static void map_crop_boxes(frame_job *job)
+{
+    int i;
+    float sx = (float) job->crop_w / job->im.w;
+    float sy = (float) job->crop_h / job->im.h;
+
+    for (i = 0; i < job->nboxes; i++) {
+        box *b = &job->dets[i].bbox;
+        b->x = (float) job->crop_x / job->im.w + b->x*sx;
+        b->y = (float) job->crop_y / job->im.h + b->y*sy;
+        b->w *= sx;
+        b->h *= sy;
+    }
+}
+
+/* Feed a batch of frames to a network in a single forward pass and extract
+ * the detection boxes of each frame
+ * Input:
+ *   - network, the model or one built by `clone_detector_network()`
+ *   - contiguous input tensor of the network's batch size, only used when it
+ *     is larger than 1
+ *   - frame jobs, whose resized images are fed to the network
+ *   - number of frame jobs, at most the network's batch size
+ *   - detection parameters
+ * Output: None
+ */
+void infer_frames(network *model, float *input, frame_job **jobs, int n,
+                  detector_options *options)
+{
+    int i;
+    double time;
+    int batch = model->batch;
+    float *X;
+
+    if (n == 0)
+        return;
+
+    // Gather the frames into the batch tensor
+    if (batch > 1) {
+        for (i = 0; i < n; i++)
+            memcpy(input + i*model->inputs, jobs[i]->im_sized.data,
+                   model->inputs*sizeof(float));
+        X = input;
+    } else {
+        X = jobs[0]->im_sized.data;
+    }
+
+    // Don't waste a full forward pass on a partial batch (end of the video):
+    // layer buffers are large enough for any smaller batch
+    if (n < batch)
+        set_batch_network(model, n);
+
+    // Run network prediction
+    time  = what_time_is_it_now();
+    network_predict(model, X);
+    profile_end(STAGE_PREDICTION, time);
+    time = what_time_is_it_now() - time;
+
+    // Get detections, relative to the letterboxed rectangle, then to the
+    // frame
+    double start = profile_start();
+    for (i = 0; i < n; i++) {
+        frame_job *job = jobs[i];
+        job->prediction_duration = time / n;
+        job->nboxes = 0;
+        job->dets = get_network_boxes_batch(model, i, job->crop_w, job->crop_h,
+                                            options->objectness_thresh,
+                                            options->hier_thresh,
+                                            &job->nboxes);
+        if (job->crop_w != job->im.w || job->crop_h != job->im.h)
+            map_crop_boxes(job);
+    }
+    profile_end(STAGE_BOXES, start);
+
+    if (n < batch)
+        set_batch_network(model, batch);
+}
+
+/* Give a frame skipped by the motion gate the detections of the closest
+ * preceding frame the model ran on, or remember the detections of a frame
+ * the model ran on. Frames must be passed in order
+ * Input:
+ *   - frame job
+ *   - detections of the last frame the model ran on
+ * Output: None
+ */
+void propagate_detections(frame_job *job, detection_history *history)
+{
+    if (job->reuse_detections) {
+        job->prediction_duration = 0;
+        job->nboxes = history->nboxes;
+        job->dets = copy_detections(history->dets, history->nboxes);
+    } else {
+        free_pooled_detections(history->dets);
+        history->nboxes = job->nboxes;
+        history->dets = copy_detections(job->dets, job->nboxes);
+    }
+}
+
+/* Feed a batch of frames to the object detection model in a single forward
+ * pass and extract the detection boxes of each frame.
+ * Frames flagged by the motion gate are not fed to the model and reuse the
+ * detections of the closest preceding frame the model ran on
+ * Input:
+ *   - frame jobs, whose resized images are fed to the model
+ *   - number of frame jobs, at most the network's batch size
+ *   - detection parameters
+ * Output: None
+ */
+void predict_frames(frame_job **jobs, int n, detector_options *options)
+{
+    int i, m;
+    frame_job *inferred[n];
+
+    for (i = 0, m = 0; i < n; i++)
+        if (!jobs[i]->reuse_detections)
+            inferred[m++] = jobs[i];
+    // Tiles of a frame fill batches on their own
+    if (options->tiler)
+        for (i = 0; i < m; i++)
+            infer_tiled_frame(options->tiler, inferred[i], options);
+    else
+        infer_frames(net, batch_input, inferred, m, options);
+
+    // Propagate detections to the frames skipped by the motion gate, in frame
+    // order. When tracking, the tracker takes care of it at output time
+    for (i = 0; i < n && !options->object_tracker; i++)
+        propagate_detections(jobs[i], &history);
+}
+
+/* Feed a frame to the object detection model and extract the detection boxes
+ * Input:
+ *   - frame job, whose resized image is fed to the model
+ *   - detection parameters
+ * Output: None
+ */
+void predict_frame(frame_job *job, detector_options *options)
+{
+    predict_frames(&job, 1, options);
+}
+
+// Whether any detection is above the threshold for some class
+static bool has_detections(detection *dets, int num, int classes, float thresh)
+{
+    int i, j;
+
+    for (i = 0; i < num; i++)
+        for (j = 0; j < classes; j++)
+            if (dets[i].prob[j] > thresh)
+                return true;
+    return false;
+}
+
+/* Output a prediction, i.e. the same image with boxes highlighting the
+ * detected objects, or the list of detected objects. Give the frame job's
+ * buffers back to the frame pool
+ * Input:
+ *   - frame job, whose detections are output
+ *   - detection parameters
+ * Output: None
+ */
+void output_frame(frame_job *job, detector_options *options)
+{
+    double time;
+    // Not a copy of the layer: other threads may be running the network,
+    // and changing its batch size
+    int classes = net->layers[net->n - 1].classes;
+    char outfile[strlen(options->outfile_prefix) + 12];
+
+    double start = profile_start();
+    // Drop the detections outside of the region of interest first, so that
+    // they don't suppress the ones inside
+    if (options->roi)
+        filter_roi_detections(options->roi, job->dets, &job->nboxes);
+    if (options->nms)
+        nms_detections(job->dets, job->nboxes, classes, active_classes,
+                       nactive_classes, options->nms);
+    profile_end(STAGE_NMS, start);
+
+    // Frames are output in order, which the tracker relies on. Detections of
+    // the frames the model was skipped on are extrapolated from the tracks
+    if (options->object_tracker) {
+        if (job->reuse_detections) {
+            free_pooled_detections(job->dets);
+            job->dets = predict_tracks(options->object_tracker, job->index,
+                                       classes, &job->nboxes,
+                                       &job->track_ids);
+        } else {
+            job->track_ids = update_tracker(options->object_tracker,
+                                            job->index, job->dets,
+                                            job->nboxes, classes,
+                                            options->class_thresh);
+        }
+    }
+    if (options->detection_sink)
+        write_detection_record(options->detection_sink, job->index, job->pts,
+                               job->dets, job->nboxes, job->track_ids,
+                               options->class_thresh, names, classes);
+    else
+        printf("Detection probabilities:\n");
+
+    // Print classes above a certain detection threshold, and their track
+    // identifiers, whether or not the boxes are drawn
+    if (!options->detection_sink) {
+        if (job->track_ids)
+            print_tracked_detections(job->dets, job->nboxes, job->track_ids,
+                                     options->class_thresh, names, classes);
+        else
+            print_detection_probabilities(job->im, job->dets, job->nboxes,
+                                          options->class_thresh, names,
+                                          classes);
+    }
+
+    // Draw boxes around detected objects
+    if (options->draw_detection_boxes) {
+        bool save = !options->save_detections_only
+                    || has_detections(job->dets, job->nboxes, classes,
+                                      options->objectness_thresh);
+        if (save) {
+            start = profile_start();
+            draw_labeled_detections(job->im, job->dets, job->nboxes,
+                                    job->track_ids,
+                                    options->objectness_thresh, names,
+                                    label_atlas, classes);
+            profile_end(STAGE_DRAW, start);
+        }
+
+        // Output the prediction
+        sprintf(outfile, "%s.%d", options->outfile_prefix, job->index);
+        if (save && options->image_writer) {
+            const char *extension =
+                image_writer_extension(options->image_writer);
+            if (!options->detection_sink && extension)
+                printf("Saving prediction to %s.%s...\n", outfile, extension);
+            else if (!options->detection_sink)
+                printf("Encoding prediction...\n");
+            save_image_async(options->image_writer, job->im, outfile,
+                             job->pts);
+            // The image now belongs to the writer
+            job->im.data = NULL;
+        } else if (save) {
+            if (!options->detection_sink)
+                printf("Saving prediction to %s.jpg...\n", outfile);
+            time  = what_time_is_it_now();
+            save_image(job->im, outfile);
+            profile_end(STAGE_SAVE, time);
+            if (!options->detection_sink)
+                printf("Write duration: %lf seconds\n",
+                        what_time_is_it_now() - time);
+        }
+    }
+    free_pooled_detections(job->dets);
+    pool_free(job->track_ids);
+
+    free_pooled_image(job->im);
+    free_pooled_image(job->im_sized);
+}
+
+/* Run the object detection model on a batch of prepared frames and output
+ * the predictions
+ * Input:
+ *   - frame jobs
+ *   - number of frame jobs, at most the network's batch size
+ *   - detection parameters
+ * Output: None
+ */
+void run_darknet_detector(frame_job **jobs, int n, detector_options *options)
+{
+    int i;
+    bool verbose = !options->detection_sink;
+
+    if (n == 0)
+        return;
+
+    if (verbose)
+        printf("Starting prediction...\n");
+    predict_frames(jobs, n, options);
+    if (verbose)
+        printf("Prediction duration: %lf seconds\n",
+               jobs[0]->prediction_duration * n);
+
+    for (i = 0; i < n; i++) {
+        if (n > 1 && verbose)
+            printf("Image %d detections:\n", jobs[i]->index);
+        output_frame(jobs[i], options);
+    }
+}
@@ -0,0 +1,462 @@
+/*
+This file implements the H.264 encoder.
+Prediction images are converted back to I420, two rows at a time: luma is
+computed for each pixel and chroma for each 2x2 block, from the average of
+its RGB values. The conversion is the inverse of `stbi__YCbCr_to_RGB_row()`
+(JFIF, cf. ITU-T T.871), so that frames decoded by this program come out with
+the colors they went in with. The I420 frames are then encoded by OpenH264
+into a single Annex B stream.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+Based on darknet, YOLO LICENSE https://github.com/pjreddie/darknet/blob/master/LICENSE
+*/
+
+#include <string.h>
+
+extern "C" {
+    #include "image.h"
+}
+#include "codec_api.h"
+#include "codec_def.h"
+#include "utils.h"
+#include "encoder.h"
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#elif defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#endif
+
+// Frame rate the rate control assumes, the decoder not exposing it
+#define ENCODER_FRAME_RATE 30.f
+
+// Conversion coefficients, scaled for inputs in [0, 1]. Chroma coefficients
+// apply to the sum of the 4 pixels of a 2x2 block
+#define Y_R (.299f*255)
+#define Y_G (.587f*255)
+#define Y_B (.114f*255)
+#define CB_R (-.168736f*255/4)
+#define CB_G (-.331264f*255/4)
+#define CB_B (.5f*255/4)
+#define CR_R (.5f*255/4)
+#define CR_G (-.418688f*255/4)
+#define CR_B (-.081312f*255/4)
+
+// Convert two rows of `w` planar RGB pixels (`w` even) to two rows of luma and
+// one row of each chroma plane. The G and B rows are `plane` values after the
+// R rows
+typedef void (*i420_rows_fn)(const float *row0, const float *row1, int plane,
+                             int w, unsigned char *y0, unsigned char *y1,
+                             unsigned char *cb, unsigned char *cr);
+
+static inline unsigned char to_u8(float v)
+{
+    v = v < 0 ? 0 : (v > 255 ? 255 : v);
+    return (unsigned char) (v + .5f);
+}
+
+static void i420_rows_scalar(const float *row0, const float *row1, int plane,
+                             int w, unsigned char *y0, unsigned char *y1,
+                             unsigned char *cb, unsigned char *cr)
+{
+    int i, k;
+    const float *r[2] = {row0, row1};
+    unsigned char *y[2] = {y0, y1};
+
+    for (k = 0; k < 2; k++)
+        for (i = 0; i < w; i++)
+            y[k][i] = to_u8(Y_R*r[k][i] + Y_G*r[k][i + plane]
+                            + Y_B*r[k][i + 2*plane]);
+
+    for (i = 0; i < w/2; i++) {
+        float rs = r[0][2*i] + r[0][2*i + 1] + r[1][2*i] + r[1][2*i + 1];
+        const float *g0 = r[0] + plane, *g1 = r[1] + plane;
+        float gs = g0[2*i] + g0[2*i + 1] + g1[2*i] + g1[2*i + 1];
+        const float *b0 = g0 + plane, *b1 = g1 + plane;
+        float bs = b0[2*i] + b0[2*i + 1] + b1[2*i] + b1[2*i + 1];
+        cb[i] = to_u8(128 + CB_R*rs + CB_G*gs + CB_B*bs);
+        cr[i] = to_u8(128 + CR_R*rs + CR_G*gs + CR_B*bs);
+    }
+}
+
+#if defined(__AVX2__)
+static inline void store_u8x8(unsigned char *p, __m256 v)
+{
+    v = _mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()),
+                      _mm256_set1_ps(255));
+    __m256i i = _mm256_cvttps_epi32(_mm256_add_ps(v, _mm256_set1_ps(.5f)));
+    __m128i w = _mm_packs_epi32(_mm256_castsi256_si128(i),
+                                _mm256_extracti128_si256(i, 1));
+    _mm_storel_epi64((__m128i *) p, _mm_packus_epi16(w, w));
+}
+
+static inline __m256 luma(const float *p, int plane)
+{
+    return _mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(Y_R), _mm256_loadu_ps(p)),
+                      _mm256_mul_ps(_mm256_set1_ps(Y_G),
+                                    _mm256_loadu_ps(p + plane))),
+        _mm256_mul_ps(_mm256_set1_ps(Y_B), _mm256_loadu_ps(p + 2*plane)));
+}
+
+// Sums of the 8 2x2 blocks of 16 pixels over two rows
+static inline __m256 block_sums(const float *p0, const float *p1)
+{
+    __m256 a = _mm256_add_ps(_mm256_loadu_ps(p0), _mm256_loadu_ps(p1));
+    __m256 b = _mm256_add_ps(_mm256_loadu_ps(p0 + 8), _mm256_loadu_ps(p1 + 8));
+    // Pairs are added within 128-bit lanes, leaving the blocks in the order
+    // 0 1 4 5 2 3 6 7
+    __m256 s = _mm256_add_ps(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)),
+                             _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    return _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(s), 0xd8));
+}
+
+static inline __m256 chroma(__m256 rs, __m256 gs, __m256 bs, float kr,
+                            float kg, float kb)
+{
+    return _mm256_add_ps(
+        _mm256_add_ps(_mm256_set1_ps(128),
+                      _mm256_mul_ps(_mm256_set1_ps(kr), rs)),
+        _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(kg), gs),
+                      _mm256_mul_ps(_mm256_set1_ps(kb), bs)));
+}
+
+static void i420_rows_simd(const float *row0, const float *row1, int plane,
+                           int w, unsigned char *y0, unsigned char *y1,
+                           unsigned char *cb, unsigned char *cr)
+{
+    int i, j;
+
+    for (i = 0; i + 16 <= w; i += 16) {
+        for (j = 0; j < 16; j += 8) {
+            store_u8x8(y0 + i + j, luma(row0 + i + j, plane));
+            store_u8x8(y1 + i + j, luma(row1 + i + j, plane));
+        }
+        __m256 rs = block_sums(row0 + i, row1 + i);
+        __m256 gs = block_sums(row0 + plane + i, row1 + plane + i);
+        __m256 bs = block_sums(row0 + 2*plane + i, row1 + 2*plane + i);
+        store_u8x8(cb + i/2, chroma(rs, gs, bs, CB_R, CB_G, CB_B));
+        store_u8x8(cr + i/2, chroma(rs, gs, bs, CR_R, CR_G, CR_B));
+    }
+    i420_rows_scalar(row0 + i, row1 + i, plane, w - i, y0 + i, y1 + i,
+                     cb + i/2, cr + i/2);
+}
+#elif defined(__SSE4_1__)
+static inline __m128i to_epi32(__m128 v)
+{
+    v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(255));
+    return _mm_cvttps_epi32(_mm_add_ps(v, _mm_set1_ps(.5f)));
+}
+
+static inline void store_u8x8(unsigned char *p, __m128 lo, __m128 hi)
+{
+    __m128i v = _mm_packs_epi32(to_epi32(lo), to_epi32(hi));
+    _mm_storel_epi64((__m128i *) p, _mm_packus_epi16(v, v));
+}
+
+static inline void store_u8x4(unsigned char *p, __m128 v)
+{
+    __m128i w = _mm_packs_epi32(to_epi32(v), to_epi32(v));
+    int bytes = _mm_cvtsi128_si32(_mm_packus_epi16(w, w));
+    memcpy(p, &bytes, 4);
+}
+
+static inline __m128 luma(const float *p, int plane)
+{
+    return _mm_add_ps(
+        _mm_add_ps(_mm_mul_ps(_mm_set1_ps(Y_R), _mm_loadu_ps(p)),
+                   _mm_mul_ps(_mm_set1_ps(Y_G), _mm_loadu_ps(p + plane))),
+        _mm_mul_ps(_mm_set1_ps(Y_B), _mm_loadu_ps(p + 2*plane)));
+}
+
+// Sums of the 4 2x2 blocks of 8 pixels over two rows
+static inline __m128 block_sums(const float *p0, const float *p1)
+{
+    __m128 a = _mm_add_ps(_mm_loadu_ps(p0), _mm_loadu_ps(p1));
+    __m128 b = _mm_add_ps(_mm_loadu_ps(p0 + 4), _mm_loadu_ps(p1 + 4));
+    return _mm_add_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)),
+                      _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+}
+
+static inline __m128 chroma(__m128 rs, __m128 gs, __m128 bs, float kr,
+                            float kg, float kb)
+{
+    return _mm_add_ps(
+        _mm_add_ps(_mm_set1_ps(128), _mm_mul_ps(_mm_set1_ps(kr), rs)),
+        _mm_add_ps(_mm_mul_ps(_mm_set1_ps(kg), gs),
+                   _mm_mul_ps(_mm_set1_ps(kb), bs)));
+}
+
+static void i420_rows_simd(const float *row0, const float *row1, int plane,
+                           int w, unsigned char *y0, unsigned char *y1,
+                           unsigned char *cb, unsigned char *cr)
+{
+    int i;
+
+    for (i = 0; i + 8 <= w; i += 8) {
+        store_u8x8(y0 + i, luma(row0 + i, plane), luma(row0 + i + 4, plane));
+        store_u8x8(y1 + i, luma(row1 + i, plane), luma(row1 + i + 4, plane));
+        __m128 rs = block_sums(row0 + i, row1 + i);
+        __m128 gs = block_sums(row0 + plane + i, row1 + plane + i);
+        __m128 bs = block_sums(row0 + 2*plane + i, row1 + 2*plane + i);
+        store_u8x4(cb + i/2, chroma(rs, gs, bs, CB_R, CB_G, CB_B));
+        store_u8x4(cr + i/2, chroma(rs, gs, bs, CR_R, CR_G, CR_B));
+    }
+    i420_rows_scalar(row0 + i, row1 + i, plane, w - i, y0 + i, y1 + i,
+                     cb + i/2, cr + i/2);
+}
+#elif defined(__wasm_simd128__)
+static inline v128_t to_i32x4(v128_t v)
+{
+    v = wasm_f32x4_min(wasm_f32x4_max(v, wasm_f32x4_splat(0)),
+                       wasm_f32x4_splat(255));
+    return wasm_i32x4_trunc_sat_f32x4(wasm_f32x4_add(v, wasm_f32x4_splat(.5f)));
+}
+
+static inline void store_u8x8(unsigned char *p, v128_t lo, v128_t hi)
+{
+    v128_t v = wasm_i16x8_narrow_i32x4(to_i32x4(lo), to_i32x4(hi));
+    long long bytes = wasm_i64x2_extract_lane(wasm_u8x16_narrow_i16x8(v, v), 0);
+    memcpy(p, &bytes, 8);
+}
+
+static inline void store_u8x4(unsigned char *p, v128_t v)
+{
+    v128_t w = wasm_i16x8_narrow_i32x4(to_i32x4(v), to_i32x4(v));
+    int bytes = wasm_i32x4_extract_lane(wasm_u8x16_narrow_i16x8(w, w), 0);
+    memcpy(p, &bytes, 4);
+}
+
+static inline v128_t luma(const float *p, int plane)
+{
+    return wasm_f32x4_add(
+        wasm_f32x4_add(wasm_f32x4_mul(wasm_f32x4_splat(Y_R), wasm_v128_load(p)),
+                       wasm_f32x4_mul(wasm_f32x4_splat(Y_G),
+                                      wasm_v128_load(p + plane))),
+        wasm_f32x4_mul(wasm_f32x4_splat(Y_B), wasm_v128_load(p + 2*plane)));
+}
+
+// Sums of the 4 2x2 blocks of 8 pixels over two rows
+static inline v128_t block_sums(const float *p0, const float *p1)
+{
+    v128_t a = wasm_f32x4_add(wasm_v128_load(p0), wasm_v128_load(p1));
+    v128_t b = wasm_f32x4_add(wasm_v128_load(p0 + 4), wasm_v128_load(p1 + 4));
+    return wasm_f32x4_add(wasm_i32x4_shuffle(a, b, 0, 2, 4, 6),
+                          wasm_i32x4_shuffle(a, b, 1, 3, 5, 7));
+}
+
+static inline v128_t chroma(v128_t rs, v128_t gs, v128_t bs, float kr,
+                            float kg, float kb)
+{
+    return wasm_f32x4_add(
+        wasm_f32x4_add(wasm_f32x4_splat(128),
+                       wasm_f32x4_mul(wasm_f32x4_splat(kr), rs)),
+        wasm_f32x4_add(wasm_f32x4_mul(wasm_f32x4_splat(kg), gs),
+                       wasm_f32x4_mul(wasm_f32x4_splat(kb), bs)));
+}
+
+static void i420_rows_simd(const float *row0, const float *row1, int plane,
+                           int w, unsigned char *y0, unsigned char *y1,
+                           unsigned char *cb, unsigned char *cr)
+{
+    int i;
+
+    for (i = 0; i + 8 <= w; i += 8) {
+        store_u8x8(y0 + i, luma(row0 + i, plane), luma(row0 + i + 4, plane));
+        store_u8x8(y1 + i, luma(row1 + i, plane), luma(row1 + i + 4, plane));
+        v128_t rs = block_sums(row0 + i, row1 + i);
+        v128_t gs = block_sums(row0 + plane + i, row1 + plane + i);
+        v128_t bs = block_sums(row0 + 2*plane + i, row1 + 2*plane + i);
+        store_u8x4(cb + i/2, chroma(rs, gs, bs, CB_R, CB_G, CB_B));
+        store_u8x4(cr + i/2, chroma(rs, gs, bs, CR_R, CR_G, CR_B));
+    }
+    i420_rows_scalar(row0 + i, row1 + i, plane, w - i, y0 + i, y1 + i,
+                     cb + i/2, cr + i/2);
+}
+#else
+#define i420_rows_simd i420_rows_scalar
+#endif
+
+static void image_to_i420_impl(image im, unsigned char *y, unsigned char *cb,
+                               unsigned char *cr, i420_rows_fn i420_rows)
+{
+    int r;
+    int w = im.w & ~1;
+    int h = im.h & ~1;
+    int plane = im.w*im.h;
+
+    for (r = 0; r < h; r += 2)
+        i420_rows(im.data + r*im.w, im.data + (r + 1)*im.w, plane, w,
+                  y + r*w, y + (r + 1)*w, cb + (r/2)*(w/2), cr + (r/2)*(w/2));
+}
+
+void image_to_i420_scalar(image im, unsigned char *y, unsigned char *cb,
+                          unsigned char *cr)
+{
+    image_to_i420_impl(im, y, cb, cr, i420_rows_scalar);
+}
+
+void image_to_i420(image im, unsigned char *y, unsigned char *cb,
+                   unsigned char *cr)
+{
+    image_to_i420_impl(im, y, cb, cr, i420_rows_simd);
+}
+
+struct h264_encoder {
+    FILE *file;
+    const char *path;
+    ISVCEncoder *encoder;
+    // Target bitrate (bits per second) and intra period (frames)
+    int bitrate;
+    int gop;
+    // Frame dimensions, set by the first frame
+    int w, h;
+    unsigned char *i420;
+    int frames;
+    long long bytes;
+};
+
+// Initialize the encoder for the dimensions of the first frame
+static bool init_encoder(h264_encoder *e, int w, int h)
+{
+    SEncParamExt param;
+    int format = videoFormatI420;
+
+    e->encoder->GetDefaultParams(&param);
+    param.iUsageType = CAMERA_VIDEO_REAL_TIME;
+    param.iPicWidth = w;
+    param.iPicHeight = h;
+    param.iTargetBitrate = e->bitrate;
+    param.iRCMode = RC_BITRATE_MODE;
+    param.fMaxFrameRate = ENCODER_FRAME_RATE;
+    param.uiIntraPeriod = e->gop;
+    param.iSpatialLayerNum = 1;
+    param.iMultipleThreadIdc = 1;
+    // Every annotated frame is kept, whatever the rate control thinks
+    param.bEnableFrameSkip = false;
+    param.sSpatialLayers[0].iVideoWidth = w;
+    param.sSpatialLayers[0].iVideoHeight = h;
+    param.sSpatialLayers[0].fFrameRate = ENCODER_FRAME_RATE;
+    param.sSpatialLayers[0].iSpatialBitrate = e->bitrate;
+    param.sSpatialLayers[0].sSliceArgument.uiSliceMode = SM_SINGLE_SLICE;
+
+    if (e->encoder->InitializeExt(&param) != cmResultSuccess) {
+        printf("Couldn't initialize the H.264 encoder for %dx%d frames\n", w,
+               h);
+        return false;
+    }
+    e->encoder->SetOption(ENCODER_OPTION_DATAFORMAT, &format);
+
+    e->w = w;
+    e->h = h;
+    e->i420 = (unsigned char *) malloc(w*h + 2*(w/2)*(h/2));
+    return true;
+}
+
+/* Open an H.264 encoder. It is configured when the first frame comes in
+ * Input:
+ *   - output file path
+ *   - target bitrate, in kilobits per second
+ *   - intra period (group of pictures), in frames
+ * Output: encoder, NULL if the file couldn't be opened
+ */
+h264_encoder *open_h264_encoder(const char *path, int bitrate, int gop)
+{
+    h264_encoder *e;
+    FILE *file = fopen(path, "wb");
+
+    if (!file) {
+        printf("Couldn't open %s\n", path);
+        return NULL;
+    }
+
+    e = (h264_encoder *) calloc(1, sizeof(h264_encoder));
+    e->file = file;
+    e->path = path;
+    e->bitrate = bitrate*1000;
+    e->gop = gop;
+    if (WelsCreateSVCEncoder(&e->encoder) != 0) {
+        printf("Couldn't create the H.264 encoder\n");
+        fclose(file);
+        free(e);
+        return NULL;
+    }
+    return e;
+}
+
+/* Encode an image and append it to the stream. Odd dimensions are cropped to
+ * even ones, as required by I420
+ * Input:
+ *   - encoder
+ *   - image, with the dimensions of the first encoded image
+ *   - presentation timestamp, in milliseconds
+ * Output: whether the image was encoded
+ */
+bool encode_image(h264_encoder *e, image im, long long pts)
+{
+    int i, j;
+    int w = im.w & ~1;
+    int h = im.h & ~1;
+    SSourcePicture pic;
+    SFrameBSInfo info;
+
+    if (!e->w && !init_encoder(e, w, h))
+        return false;
+    if (w != e->w || h != e->h) {
+        printf("Frame size changed to %dx%d, not encoded\n", w, h);
+        return false;
+    }
+
+    memset(&pic, 0, sizeof(pic));
+    pic.iColorFormat = videoFormatI420;
+    pic.iPicWidth = w;
+    pic.iPicHeight = h;
+    pic.iStride[0] = w;
+    pic.iStride[1] = pic.iStride[2] = w/2;
+    pic.pData[0] = e->i420;
+    pic.pData[1] = e->i420 + w*h;
+    pic.pData[2] = e->i420 + w*h + (w/2)*(h/2);
+    pic.uiTimeStamp = pts;
+    image_to_i420(im, pic.pData[0], pic.pData[1], pic.pData[2]);
+
+    memset(&info, 0, sizeof(info));
+    if (e->encoder->EncodeFrame(&pic, &info) != cmResultSuccess)
+        return false;
+    if (info.eFrameType == videoFrameTypeSkip)
+        return true;
+
+    // Each layer's NAL units are stored back to back
+    for (i = 0; i < info.iLayerNum; i++) {
+        SLayerBSInfo *layer = &info.sLayerInfo[i];
+        int size = 0;
+        for (j = 0; j < layer->iNalCount; j++)
+            size += layer->pNalLengthInByte[j];
+        fwrite(layer->pBsBuf, 1, size, e->file);
+        e->bytes += size;
+    }
+    e->frames++;
+    return true;
+}
+
+/* Close the stream, print its size and free the encoder
+ * Input: encoder
+ * Output: None
+ */
+void close_h264_encoder(h264_encoder *e)
+{
+    if (e->w)
+        e->encoder->Uninitialize();
+    WelsDestroySVCEncoder(e->encoder);
+    fclose(e->file);
+    printf("H.264 encoder: %d frames encoded to %s (%.2f MiB)\n", e->frames,
+           e->path, e->bytes / (double) (1 << 20));
+    free(e->i420);
+    free(e);
+}
@@ -0,0 +1,293 @@
+/*
+This file implements the 8-bit integer GEMM kernels.
+`C = A*(B - GEMM_INT8_ZERO_POINT)` is computed with unsigned activations B
+and signed weights A, the operand types of the x86 multiply-add
+instructions, the way `gemm_packed.cpp` computes float products:
+  - The weights are packed once, when a layer is quantized, into panels of
+    `GEMM_INT8_MR` rows, along with the products of the zero point by the sum
+    of each row
+  - The activations, stored with the reduction dimension contiguous, are
+    packed per block of `GEMM_INT8_KC` x `GEMM_INT8_NC` into panels of
+    `GEMM_INT8_NR` columns
+  - Panels store groups of 4 consecutive values of the reduction dimension,
+    which the micro-kernel multiplies and sums into 32-bit lanes:
+    `vpdpbusd` with VNNI, `vpmaddubsw` then `vpmaddwd` with AVX2,
+    `i32x4.dot_i16x8` on values widened to 16 bits on WebAssembly. A tile
+    of `GEMM_INT8_MR` x `GEMM_INT8_NR` outputs is accumulated in registers
+  - C starts from minus the zero point corrections, to which the products of
+    every block are added
+`vpmaddubsw` saturates the sum of two products to 16 bits, which weights
+bounded by `GEMM_INT8_WEIGHT_MAX` can't reach. Results are exact otherwise.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+#include "gemm_int8.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#endif
+
+#if defined(__AVX2__)
+#define GEMM_INT8_MR 4
+#define GEMM_INT8_NR 16
+#elif defined(__wasm_simd128__)
+#define GEMM_INT8_MR 4
+#define GEMM_INT8_NR 4
+#else
+#define GEMM_INT8_MR 4
+#define GEMM_INT8_NR 8
+#endif
+
+// Values of the reduction dimension multiplied together by the kernels
+#define GEMM_INT8_KG GEMM_INT8_K_ALIGN
+
+#define GEMM_INT8_KC 512
+#define GEMM_INT8_NC 256
+
+/* Packed block of activations of the calling thread */
+static thread_local std::vector<unsigned char> packed_b;
+
+// Micro-kernel: add the product of a panel of A (`kc` columns of
+// `GEMM_INT8_MR` weights) and a panel of B (`kc` rows of `GEMM_INT8_NR`
+// activations) to a tile of C. `kc` is a multiple of `GEMM_INT8_KG`
+#if defined(__AVX2__)
+static inline __m256i dot_accumulate(__m256i acc, __m256i b, __m256i a)
+{
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+    return _mm256_dpbusd_epi32(acc, b, a);
+#elif defined(__AVXVNNI__)
+    return _mm256_dpbusd_avx_epi32(acc, b, a);
+#else
+    return _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(b, a),
+                                                   _mm256_set1_epi16(1)));
+#endif
+}
+
+static void micro_kernel(int kc, const signed char *a, const unsigned char *b,
+                         int *c, int ldc)
+{
+    int k, r;
+    __m256i acc[GEMM_INT8_MR][2];
+
+    for (r = 0; r < GEMM_INT8_MR; r++)
+        acc[r][0] = acc[r][1] = _mm256_setzero_si256();
+    for (k = 0; k < kc; k += GEMM_INT8_KG, a += GEMM_INT8_MR*GEMM_INT8_KG,
+         b += GEMM_INT8_NR*GEMM_INT8_KG) {
+        __m256i b0 = _mm256_loadu_si256((const __m256i *) b);
+        __m256i b1 = _mm256_loadu_si256((const __m256i *) (b + 32));
+        for (r = 0; r < GEMM_INT8_MR; r++) {
+            int group;
+            memcpy(&group, a + r*GEMM_INT8_KG, sizeof(group));
+            __m256i ar = _mm256_set1_epi32(group);
+            acc[r][0] = dot_accumulate(acc[r][0], b0, ar);
+            acc[r][1] = dot_accumulate(acc[r][1], b1, ar);
+        }
+    }
+    for (r = 0; r < GEMM_INT8_MR; r++) {
+        __m256i *row = (__m256i *) (c + r*ldc);
+        _mm256_storeu_si256(row, _mm256_add_epi32(_mm256_loadu_si256(row),
+                                                  acc[r][0]));
+        _mm256_storeu_si256(row + 1, _mm256_add_epi32(
+                                         _mm256_loadu_si256(row + 1),
+                                         acc[r][1]));
+    }
+}
+#elif defined(__wasm_simd128__)
+static void micro_kernel(int kc, const signed char *a, const unsigned char *b,
+                         int *c, int ldc)
+{
+    int k, r;
+    // Sums of the first and last pairs of each group, for columns 0 and 1,
+    // then 2 and 3
+    v128_t acc[GEMM_INT8_MR][2];
+
+    for (r = 0; r < GEMM_INT8_MR; r++)
+        acc[r][0] = acc[r][1] = wasm_i32x4_splat(0);
+    for (k = 0; k < kc; k += GEMM_INT8_KG, a += GEMM_INT8_MR*GEMM_INT8_KG,
+         b += GEMM_INT8_NR*GEMM_INT8_KG) {
+        v128_t vb = wasm_v128_load(b);
+        v128_t b0 = wasm_u16x8_extend_low_u8x16(vb);
+        v128_t b1 = wasm_u16x8_extend_high_u8x16(vb);
+        for (r = 0; r < GEMM_INT8_MR; r++) {
+            v128_t ar = wasm_i16x8_extend_low_i8x16(
+                wasm_v128_load32_splat(a + r*GEMM_INT8_KG));
+            acc[r][0] = wasm_i32x4_add(acc[r][0], wasm_i32x4_dot_i16x8(b0, ar));
+            acc[r][1] = wasm_i32x4_add(acc[r][1], wasm_i32x4_dot_i16x8(b1, ar));
+        }
+    }
+    for (r = 0; r < GEMM_INT8_MR; r++) {
+        v128_t sum = wasm_i32x4_add(
+            wasm_i32x4_shuffle(acc[r][0], acc[r][1], 0, 2, 4, 6),
+            wasm_i32x4_shuffle(acc[r][0], acc[r][1], 1, 3, 5, 7));
+        int *row = c + r*ldc;
+        wasm_v128_store(row, wasm_i32x4_add(wasm_v128_load(row), sum));
+    }
+}
+#else
+static void micro_kernel(int kc, const signed char *a, const unsigned char *b,
+                         int *c, int ldc)
+{
+    int k, r, j, g;
+    int acc[GEMM_INT8_MR][GEMM_INT8_NR];
+
+    memset(acc, 0, sizeof(acc));
+    for (k = 0; k < kc; k += GEMM_INT8_KG, a += GEMM_INT8_MR*GEMM_INT8_KG,
+         b += GEMM_INT8_NR*GEMM_INT8_KG)
+        for (r = 0; r < GEMM_INT8_MR; r++)
+            for (j = 0; j < GEMM_INT8_NR; j++)
+                for (g = 0; g < GEMM_INT8_KG; g++)
+                    acc[r][j] += a[r*GEMM_INT8_KG + g]*b[j*GEMM_INT8_KG + g];
+    for (r = 0; r < GEMM_INT8_MR; r++)
+        for (j = 0; j < GEMM_INT8_NR; j++)
+            c[r*ldc + j] += acc[r][j];
+}
+#endif
+
+/* Pack the weights of a product into panels of `GEMM_INT8_MR` rows, by
+ * groups of `GEMM_INT8_K_ALIGN` columns
+ * Input:
+ *   - number of rows
+ *   - number of columns, the reduction dimension
+ *   - weights, which must be at most `GEMM_INT8_WEIGHT_MAX` in absolute value
+ *   - leading dimension of the weights
+ * Output: packed weights, released with `free_int8_weights()`
+ */
+gemm_int8_weights *pack_int8_weights(int M, int K, const signed char *A,
+                                     int lda)
+{
+    int i, k, r, g;
+    int kp = (K + GEMM_INT8_K_ALIGN - 1)/GEMM_INT8_K_ALIGN*GEMM_INT8_K_ALIGN;
+    int panels = (M + GEMM_INT8_MR - 1)/GEMM_INT8_MR;
+    gemm_int8_weights *weights = (gemm_int8_weights *)
+        calloc(1, sizeof(gemm_int8_weights));
+
+    if (weights) {
+        weights->panels = (signed char *)
+            calloc((size_t) panels*GEMM_INT8_MR*kp, 1);
+        weights->corrections = (int *) calloc(M > 0 ? M : 1, sizeof(int));
+    }
+    if (!weights || !weights->panels || !weights->corrections) {
+        printf("Couldn't allocate the int8 weights\n");
+        exit(1);
+    }
+    weights->M = M;
+    weights->K = K;
+    weights->kp = kp;
+
+    signed char *packed = weights->panels;
+    for (i = 0; i < M; i += GEMM_INT8_MR) {
+        int rows = M - i < GEMM_INT8_MR ? M - i : GEMM_INT8_MR;
+        for (k = 0; k < kp; k += GEMM_INT8_KG, packed += GEMM_INT8_MR*GEMM_INT8_KG)
+            for (r = 0; r < rows; r++)
+                for (g = 0; g < GEMM_INT8_KG && k + g < K; g++)
+                    packed[r*GEMM_INT8_KG + g] = A[(i + r)*lda + k + g];
+    }
+    for (i = 0; i < M; i++) {
+        int sum = 0;
+        for (k = 0; k < K; k++)
+            sum += A[i*lda + k];
+        weights->corrections[i] = GEMM_INT8_ZERO_POINT*sum;
+    }
+    return weights;
+}
+
+/* Release packed weights
+ * Input: weights packed by `pack_int8_weights()`, may be NULL
+ * Output: None
+ */
+void free_int8_weights(gemm_int8_weights *weights)
+{
+    if (!weights)
+        return;
+    free(weights->panels);
+    free(weights->corrections);
+    free(weights);
+}
+
+// Pack `kc` values from `nc` rows of Bt into panels of `GEMM_INT8_NR`
+// columns, by groups of `GEMM_INT8_KG` values
+static void pack_b(const unsigned char *Bt, int ldb, int kc, int nc,
+                   unsigned char *packed)
+{
+    int j, k, c;
+
+    for (j = 0; j < nc; j += GEMM_INT8_NR, packed += kc*GEMM_INT8_NR) {
+        int cols = nc - j < GEMM_INT8_NR ? nc - j : GEMM_INT8_NR;
+        for (c = 0; c < cols; c++) {
+            const unsigned char *src = Bt + (j + c)*ldb;
+            unsigned char *dst = packed + c*GEMM_INT8_KG;
+            for (k = 0; k < kc; k += GEMM_INT8_KG, dst += GEMM_INT8_NR*GEMM_INT8_KG)
+                memcpy(dst, src + k, GEMM_INT8_KG);
+        }
+        for (; c < GEMM_INT8_NR; c++) {
+            unsigned char *dst = packed + c*GEMM_INT8_KG;
+            for (k = 0; k < kc; k += GEMM_INT8_KG, dst += GEMM_INT8_NR*GEMM_INT8_KG)
+                memset(dst, 0, GEMM_INT8_KG);
+        }
+    }
+}
+
+/* Compute `C[m*ldc + n] = sum_k A[m][k]*(Bt[n*kp + k] - GEMM_INT8_ZERO_POINT)`
+ * on the calling thread, i.e. the product of the weights by activations
+ * stored transposed
+ * Input:
+ *   - packed weights of M rows, and kp columns once padded
+ *   - number of columns of C
+ *   - activations, N rows of kp values. The padding of the rows is ignored
+ *   - output matrix and its leading dimension
+ * Output: None
+ */
+void gemm_int8(const gemm_int8_weights *A, int N, const unsigned char *Bt,
+               int *C, int ldc)
+{
+    int M = A->M, kp = A->kp;
+    int jc, pc, ic, jr, r, j;
+    int edge[GEMM_INT8_MR*GEMM_INT8_NR];
+
+    packed_b.resize((size_t) GEMM_INT8_KC*GEMM_INT8_NC);
+    for (jc = 0; jc < N; jc += GEMM_INT8_NC) {
+        int nc = N - jc < GEMM_INT8_NC ? N - jc : GEMM_INT8_NC;
+        for (r = 0; r < M; r++)
+            for (j = 0; j < nc; j++)
+                C[r*ldc + jc + j] = -A->corrections[r];
+        for (pc = 0; pc < kp; pc += GEMM_INT8_KC) {
+            int kc = kp - pc < GEMM_INT8_KC ? kp - pc : GEMM_INT8_KC;
+            pack_b(Bt + jc*kp + pc, kp, kc, nc, packed_b.data());
+            for (ic = 0; ic < M; ic += GEMM_INT8_MR) {
+                int mr = M - ic < GEMM_INT8_MR ? M - ic : GEMM_INT8_MR;
+                const signed char *a = A->panels + ic*kp + pc*GEMM_INT8_MR;
+                for (jr = 0; jr < nc; jr += GEMM_INT8_NR) {
+                    int nr = nc - jr < GEMM_INT8_NR ? nc - jr : GEMM_INT8_NR;
+                    const unsigned char *b = packed_b.data() + jr*kc;
+                    int *c = C + ic*ldc + jc + jr;
+                    if (mr == GEMM_INT8_MR && nr == GEMM_INT8_NR) {
+                        micro_kernel(kc, a, b, c, ldc);
+                        continue;
+                    }
+                    // Partial tile at the edges of C
+                    memset(edge, 0, sizeof(edge));
+                    micro_kernel(kc, a, b, edge, GEMM_INT8_NR);
+                    for (r = 0; r < mr; r++)
+                        for (j = 0; j < nr; j++)
+                            c[r*ldc + j] += edge[r*GEMM_INT8_NR + j];
+                }
+            }
+        }
+    }
+}
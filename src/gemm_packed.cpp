@@ -0,0 +1,455 @@
+/*
+This file implements the packed GEMM backend, replacing darknet's `gemm()`,
+a plain triple loop, when the program is built with `GEMM=packed`.
+`C = ALPHA*op(A)*op(B) + BETA*C` is computed the way optimized BLAS
+libraries do:
+  - The reduction dimension is split into blocks of `GEMM_KC`, the columns
+    of B into blocks of `GEMM_NC` and the rows of A into blocks of `GEMM_MC`,
+    sized so that a packed block of B stays in the last level cache and a
+    packed block of A in L2
+  - Blocks are packed into panels of `GEMM_MR` rows of A and `GEMM_NR`
+    columns of B, contiguous in the order the micro-kernel reads them,
+    whatever the transposition and leading dimension of the operands.
+    ALPHA is applied when packing A, and panels are zero-padded at the edges
+  - The micro-kernel computes a `GEMM_MR` x `GEMM_NR` tile of C held in
+    registers: AVX-512 (6x32) or AVX2 (6x16) natively, SIMD128 (4x8) on
+    WebAssembly, plain loops the compiler vectorizes otherwise
+  - Large products are split into ranges of columns of C (or of rows, when
+    C is narrow), each computed on the thread pool of `thread_pool.cpp` with
+    its own packing buffers
+The results differ from darknet's by float rounding only, since the products
+are summed in a different order.
+With `GEMM=darknet`, darknet's `gemm.c` is linked instead and only the
+thread count and backend queries remain.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+Based on darknet, YOLO LICENSE https://github.com/pjreddie/darknet/blob/master/LICENSE
+*/
+
+#include "gemm_packed.h"
+#include "thread_pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Like `utils.h`, which the offline tools can't include since it depends on
+// the codec headers
+#if !defined(__wasi__)
+#define HAVE_THREADS 1
+#include <mutex>
+#endif
+
+#include <vector>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#elif defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#endif
+
+#if defined(__AVX512F__)
+#define GEMM_MR 6
+#define GEMM_NR 32
+#elif defined(__AVX2__)
+#define GEMM_MR 6
+#define GEMM_NR 16
+#elif defined(__wasm_simd128__)
+#define GEMM_MR 4
+#define GEMM_NR 8
+#else
+#define GEMM_MR 4
+#define GEMM_NR 8
+#endif
+
+#define GEMM_KC 256
+#define GEMM_MC (GEMM_MR*24)
+#define GEMM_NC 2048
+
+// Below this many floating-point operations per thread, a product isn't
+// worth splitting
+#define GEMM_PARALLEL_FLOPS (1 << 22)
+
+/* Threads a product may be split over, 0 for the size of the thread pool */
+static int gemm_thread_count;
+
+
+/* Set the number of threads a product may be split over. Ignored on WASI
+ * targets, which have no threads
+ * Input: number of threads, 0 for the size of the thread pool
+ * Output: None
+ */
+void set_gemm_threads(int threads)
+{
+    gemm_thread_count = threads;
+}
+
+/* GEMM implementation linked into the program
+ * Input: None
+ * Output: name of the backend
+ */
+const char *gemm_backend()
+{
+#if defined(PACKED_GEMM)
+    return "packed";
+#else
+    return "darknet";
+#endif
+}
+
+/* Single-precision floating-point operations per cycle and core the packed
+ * micro-kernel can reach: two vector fused multiply-adds per cycle, or a
+ * multiplication and an addition without FMA
+ * Input: None
+ * Output: floating-point operations per cycle
+ */
+double gemm_flops_per_cycle()
+{
+#if defined(__AVX512F__)
+    return 2*16*2;
+#elif defined(__AVX2__) && defined(__FMA__)
+    return 2*8*2;
+#elif defined(__AVX2__)
+    return 8*2;
+#else
+    return 4*2;
+#endif
+}
+
+#if defined(PACKED_GEMM)
+
+extern "C"
+{
+    void gemm(int TA, int TB, int M, int N, int K, float ALPHA, float *A,
+              int lda, float *B, int ldb, float BETA, float *C, int ldc);
+    void gemm_cpu(int TA, int TB, int M, int N, int K, float ALPHA, float *A,
+                  int lda, float *B, int ldb, float BETA, float *C, int ldc);
+    void gemm_bin(int M, int N, int K, float ALPHA, char *A, int lda,
+                  float *B, int ldb, float *C, int ldc);
+}
+
+typedef struct {
+    float *a, *b;
+} packing_buffers;
+
+/* Packing buffers not in use */
+static std::vector<packing_buffers> free_buffers;
+#if defined(HAVE_THREADS)
+static std::mutex buffers_mutex;
+#endif
+
+// Micro-kernel: add the product of a panel of A (`kc` columns of `GEMM_MR`
+// values) and a panel of B (`kc` rows of `GEMM_NR` values) to a tile of C
+#if defined(__AVX512F__)
+static void micro_kernel(int kc, const float *a, const float *b, float *c,
+                         int ldc)
+{
+    int k, r;
+    __m512 acc[GEMM_MR][2];
+
+    for (r = 0; r < GEMM_MR; r++)
+        acc[r][0] = acc[r][1] = _mm512_setzero_ps();
+    for (k = 0; k < kc; k++, a += GEMM_MR, b += GEMM_NR) {
+        __m512 b0 = _mm512_loadu_ps(b);
+        __m512 b1 = _mm512_loadu_ps(b + 16);
+        for (r = 0; r < GEMM_MR; r++) {
+            __m512 ar = _mm512_set1_ps(a[r]);
+            acc[r][0] = _mm512_fmadd_ps(ar, b0, acc[r][0]);
+            acc[r][1] = _mm512_fmadd_ps(ar, b1, acc[r][1]);
+        }
+    }
+    for (r = 0; r < GEMM_MR; r++) {
+        float *row = c + r*ldc;
+        _mm512_storeu_ps(row, _mm512_add_ps(_mm512_loadu_ps(row), acc[r][0]));
+        _mm512_storeu_ps(row + 16, _mm512_add_ps(_mm512_loadu_ps(row + 16),
+                                                 acc[r][1]));
+    }
+}
+#elif defined(__AVX2__)
+static inline __m256 multiply_add(__m256 a, __m256 b, __m256 c)
+{
+#if defined(__FMA__)
+    return _mm256_fmadd_ps(a, b, c);
+#else
+    return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+}
+
+static void micro_kernel(int kc, const float *a, const float *b, float *c,
+                         int ldc)
+{
+    int k, r;
+    __m256 acc[GEMM_MR][2];
+
+    for (r = 0; r < GEMM_MR; r++)
+        acc[r][0] = acc[r][1] = _mm256_setzero_ps();
+    for (k = 0; k < kc; k++, a += GEMM_MR, b += GEMM_NR) {
+        __m256 b0 = _mm256_loadu_ps(b);
+        __m256 b1 = _mm256_loadu_ps(b + 8);
+        for (r = 0; r < GEMM_MR; r++) {
+            __m256 ar = _mm256_broadcast_ss(a + r);
+            acc[r][0] = multiply_add(ar, b0, acc[r][0]);
+            acc[r][1] = multiply_add(ar, b1, acc[r][1]);
+        }
+    }
+    for (r = 0; r < GEMM_MR; r++) {
+        float *row = c + r*ldc;
+        _mm256_storeu_ps(row, _mm256_add_ps(_mm256_loadu_ps(row), acc[r][0]));
+        _mm256_storeu_ps(row + 8, _mm256_add_ps(_mm256_loadu_ps(row + 8),
+                                                acc[r][1]));
+    }
+}
+#elif defined(__wasm_simd128__)
+static void micro_kernel(int kc, const float *a, const float *b, float *c,
+                         int ldc)
+{
+    int k, r;
+    v128_t acc[GEMM_MR][2];
+
+    for (r = 0; r < GEMM_MR; r++)
+        acc[r][0] = acc[r][1] = wasm_f32x4_splat(0);
+    for (k = 0; k < kc; k++, a += GEMM_MR, b += GEMM_NR) {
+        v128_t b0 = wasm_v128_load(b);
+        v128_t b1 = wasm_v128_load(b + 4);
+        for (r = 0; r < GEMM_MR; r++) {
+            v128_t ar = wasm_f32x4_splat(a[r]);
+            acc[r][0] = wasm_f32x4_add(acc[r][0], wasm_f32x4_mul(ar, b0));
+            acc[r][1] = wasm_f32x4_add(acc[r][1], wasm_f32x4_mul(ar, b1));
+        }
+    }
+    for (r = 0; r < GEMM_MR; r++) {
+        float *row = c + r*ldc;
+        wasm_v128_store(row, wasm_f32x4_add(wasm_v128_load(row), acc[r][0]));
+        wasm_v128_store(row + 4, wasm_f32x4_add(wasm_v128_load(row + 4),
+                                                acc[r][1]));
+    }
+}
+#else
+static void micro_kernel(int kc, const float *a, const float *b, float *c,
+                         int ldc)
+{
+    int k, r, j;
+    float acc[GEMM_MR][GEMM_NR];
+
+    memset(acc, 0, sizeof(acc));
+    for (k = 0; k < kc; k++, a += GEMM_MR, b += GEMM_NR)
+        for (r = 0; r < GEMM_MR; r++)
+            for (j = 0; j < GEMM_NR; j++)
+                acc[r][j] += a[r]*b[j];
+    for (r = 0; r < GEMM_MR; r++)
+        for (j = 0; j < GEMM_NR; j++)
+            c[r*ldc + j] += acc[r][j];
+}
+#endif
+
+// Pack `mc` rows and `kc` columns of op(A), scaled by ALPHA, into panels of
+// `GEMM_MR` rows stored column by column
+static void pack_a(int TA, const float *A, int lda, int mc, int kc,
+                   float alpha, float *packed)
+{
+    int i, k, r;
+
+    for (i = 0; i < mc; i += GEMM_MR) {
+        int rows = mc - i < GEMM_MR ? mc - i : GEMM_MR;
+        for (k = 0; k < kc; k++, packed += GEMM_MR) {
+            for (r = 0; r < rows; r++)
+                packed[r] = alpha*(TA ? A[k*lda + i + r]
+                                      : A[(i + r)*lda + k]);
+            for (; r < GEMM_MR; r++)
+                packed[r] = 0;
+        }
+    }
+}
+
+// Pack `kc` rows and `nc` columns of op(B) into panels of `GEMM_NR` columns
+// stored row by row
+static void pack_b(int TB, const float *B, int ldb, int kc, int nc,
+                   float *packed)
+{
+    int j, k, c;
+
+    for (j = 0; j < nc; j += GEMM_NR) {
+        int cols = nc - j < GEMM_NR ? nc - j : GEMM_NR;
+        for (k = 0; k < kc; k++, packed += GEMM_NR) {
+            if (!TB && cols == GEMM_NR) {
+                memcpy(packed, B + k*ldb + j, GEMM_NR*sizeof(float));
+                continue;
+            }
+            for (c = 0; c < cols; c++)
+                packed[c] = TB ? B[(j + c)*ldb + k] : B[k*ldb + j + c];
+            for (; c < GEMM_NR; c++)
+                packed[c] = 0;
+        }
+    }
+}
+
+// Take a set of packing buffers. The parts of a product run on whichever
+// pool thread is free, so buffers are recycled across products rather than
+// owned by threads
+static packing_buffers take_buffers()
+{
+    packing_buffers buffers;
+
+    {
+#if defined(HAVE_THREADS)
+        std::lock_guard<std::mutex> lock(buffers_mutex);
+#endif
+        if (!free_buffers.empty()) {
+            buffers = free_buffers.back();
+            free_buffers.pop_back();
+            return buffers;
+        }
+    }
+    buffers.a = (float *) aligned_alloc(64, GEMM_MC*GEMM_KC*sizeof(float));
+    buffers.b = (float *) aligned_alloc(64, GEMM_KC*GEMM_NC*sizeof(float));
+    if (!buffers.a || !buffers.b) {
+        printf("Couldn't allocate the GEMM packing buffers\n");
+        exit(1);
+    }
+    return buffers;
+}
+
+static void give_buffers(packing_buffers buffers)
+{
+#if defined(HAVE_THREADS)
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+#endif
+    free_buffers.push_back(buffers);
+}
+
+// Blocked product `C += ALPHA*op(A)*op(B)` on the calling thread
+static void gemm_blocked(int TA, int TB, int M, int N, int K, float ALPHA,
+                         const float *A, int lda, const float *B, int ldb,
+                         float *C, int ldc)
+{
+    int jc, pc, ic, jr, ir, r, j;
+    packing_buffers buffers = take_buffers();
+    float *packed_a = buffers.a, *packed_b = buffers.b;
+    float edge[GEMM_MR*GEMM_NR];
+
+    for (jc = 0; jc < N; jc += GEMM_NC) {
+        int nc = N - jc < GEMM_NC ? N - jc : GEMM_NC;
+        for (pc = 0; pc < K; pc += GEMM_KC) {
+            int kc = K - pc < GEMM_KC ? K - pc : GEMM_KC;
+            pack_b(TB, TB ? B + jc*ldb + pc : B + pc*ldb + jc, ldb, kc, nc,
+                   packed_b);
+            for (ic = 0; ic < M; ic += GEMM_MC) {
+                int mc = M - ic < GEMM_MC ? M - ic : GEMM_MC;
+                pack_a(TA, TA ? A + pc*lda + ic : A + ic*lda + pc, lda, mc,
+                       kc, ALPHA, packed_a);
+                for (jr = 0; jr < nc; jr += GEMM_NR) {
+                    int nr = nc - jr < GEMM_NR ? nc - jr : GEMM_NR;
+                    const float *b = packed_b + jr*kc;
+                    for (ir = 0; ir < mc; ir += GEMM_MR) {
+                        int mr = mc - ir < GEMM_MR ? mc - ir : GEMM_MR;
+                        const float *a = packed_a + ir*kc;
+                        float *c = C + (ic + ir)*ldc + jc + jr;
+                        if (mr == GEMM_MR && nr == GEMM_NR) {
+                            micro_kernel(kc, a, b, c, ldc);
+                            continue;
+                        }
+                        // Partial tile at the edges of C
+                        memset(edge, 0, sizeof(edge));
+                        micro_kernel(kc, a, b, edge, GEMM_NR);
+                        for (r = 0; r < mr; r++)
+                            for (j = 0; j < nr; j++)
+                                c[r*ldc + j] += edge[r*GEMM_NR + j];
+                    }
+                }
+            }
+        }
+    }
+    give_buffers(buffers);
+}
+
+// Split a product over the thread pool, by ranges of columns of C when it is
+// wide enough, by ranges of rows otherwise
+static void gemm_parallel(int TA, int TB, int M, int N, int K, float ALPHA,
+                          const float *A, int lda, const float *B, int ldb,
+                          float *C, int ldc)
+{
+    int threads = gemm_thread_count > 0 ? gemm_thread_count
+                                        : thread_pool_size();
+    double flops = 2.*M*N*K;
+
+    if (threads > flops/GEMM_PARALLEL_FLOPS)
+        threads = flops/GEMM_PARALLEL_FLOPS;
+    bool by_columns = N >= M || N/GEMM_NR >= 2*threads;
+    int units = by_columns ? (N + GEMM_NR - 1)/GEMM_NR
+                           : (M + GEMM_MR - 1)/GEMM_MR;
+    if (threads > units)
+        threads = units;
+    if (threads <= 1) {
+        gemm_blocked(TA, TB, M, N, K, ALPHA, A, lda, B, ldb, C, ldc);
+        return;
+    }
+    parallel_for(threads, 1, [=](int first_part, int last_part) {
+        int first = units*first_part/threads, last = units*last_part/threads;
+        if (by_columns) {
+            int j = first*GEMM_NR;
+            int n = (last*GEMM_NR < N ? last*GEMM_NR : N) - j;
+            gemm_blocked(TA, TB, M, n, K, ALPHA, A, lda,
+                         TB ? B + j*ldb : B + j, ldb, C + j, ldc);
+        } else {
+            int i = first*GEMM_MR;
+            int m = (last*GEMM_MR < M ? last*GEMM_MR : M) - i;
+            gemm_blocked(TA, TB, m, N, K, ALPHA, TA ? A + i : A + i*lda, lda,
+                         B, ldb, C + i*ldc, ldc);
+        }
+    });
+}
+
+/* Drop-in replacement of darknet's `gemm_cpu()`:
+ * `C = ALPHA*op(A)*op(B) + BETA*C`, op transposing its operand if TA or TB
+ * Input:
+ *   - whether A and B are transposed
+ *   - dimensions: op(A) is M x K, op(B) is K x N
+ *   - ALPHA, A and its leading dimension
+ *   - B and its leading dimension
+ *   - BETA, C and its leading dimension
+ * Output: None
+ */
+void gemm_cpu(int TA, int TB, int M, int N, int K, float ALPHA, float *A,
+              int lda, float *B, int ldb, float BETA, float *C, int ldc)
+{
+    int i, j;
+
+    // Scaled like darknet does, which also propagates NaNs the same way
+    if (BETA != 1)
+        for (i = 0; i < M; i++)
+            for (j = 0; j < N; j++)
+                C[i*ldc + j] *= BETA;
+    if (M <= 0 || N <= 0 || K <= 0)
+        return;
+    gemm_parallel(TA, TB, M, N, K, ALPHA, A, lda, B, ldb, C, ldc);
+}
+
+void gemm(int TA, int TB, int M, int N, int K, float ALPHA, float *A, int lda,
+          float *B, int ldb, float BETA, float *C, int ldc)
+{
+    gemm_cpu(TA, TB, M, N, K, ALPHA, A, lda, B, ldb, BETA, C, ldc);
+}
+
+// Binary GEMM of darknet's `gemm.c`, for XNOR layers: A holds signs
+void gemm_bin(int M, int N, int K, float ALPHA, char *A, int lda, float *B,
+              int ldb, float *C, int ldc)
+{
+    int i, j, k;
+
+    for (i = 0; i < M; i++) {
+        for (k = 0; k < K; k++) {
+            char a = A[i*lda + k];
+            for (j = 0; j < N; j++)
+                C[i*ldc + j] += a ? B[k*ldb + j] : -B[k*ldb + j];
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,212 @@
+/*
+This file builds the networks the detector runs from layer descriptors:
+darknet layers of which only the geometry (dimensions, filters, strides...)
+and the parameters (weights, biases, anchors, route inputs) are read.
+Darknet's parser allocates, and randomly initializes, the parameters of
+every layer along with its training buffers, only for them to be replaced by
+the model's. Here the parameters are shared with the descriptors, read-only,
+and only the buffers the forward pass writes are allocated: layer outputs,
+the indexes of max pooling layers, the deltas YOLO and region layers clear,
+and the network's input and workspace.
+Descriptors come from model bundles (see `bundle.cpp`) or from the loaded
+model, to build the networks running alongside it. Only the layer types of
+the YOLO models are supported, without batch normalization, which must be
+folded into the weights beforehand.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+Based on darknet, YOLO LICENSE https://github.com/pjreddie/darknet/blob/master/LICENSE
+*/
+
+extern "C"
+{
+    #include "darknet.h"
+    #include "network.h"
+    #include "convolutional_layer.h"
+    #include "maxpool_layer.h"
+    #include "route_layer.h"
+    #include "shortcut_layer.h"
+    #include "upsample_layer.h"
+    #include "yolo_layer.h"
+    #include "region_layer.h"
+}
+#include "layers.h"
+
+#include <string.h>
+
+
+/* Whether a network can be built from a layer descriptor
+ * Input: layer descriptor
+ * Output: whether the layer is supported
+ */
+bool inference_layer_supported(const layer *l)
+{
+    switch (l->type) {
+    case CONVOLUTIONAL:
+        return !l->batch_normalize && !l->binary && !l->xnor;
+    case REGION:
+        return !l->softmax_tree;
+    case MAXPOOL:
+    case ROUTE:
+    case SHORTCUT:
+    case UPSAMPLE:
+    case YOLO:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Build a layer from its descriptor, with its own forward buffers. The
+// forward function is darknet's
+static void make_inference_layer(const layer *d, int batch, layer *l)
+{
+    size_t outputs = (size_t) d->outputs*batch;
+
+    l->type = d->type;
+    l->activation = d->activation;
+    l->batch = batch;
+    l->inputs = d->inputs;
+    l->outputs = d->outputs;
+    l->h = d->h;
+    l->w = d->w;
+    l->c = d->c;
+    l->out_h = d->out_h;
+    l->out_w = d->out_w;
+    l->out_c = d->out_c;
+    l->n = d->n;
+    l->groups = d->groups;
+    l->size = d->size;
+    l->stride = d->stride;
+    l->pad = d->pad;
+    l->index = d->index;
+    l->reverse = d->reverse;
+    l->classes = d->classes;
+    l->coords = d->coords;
+    l->total = d->total;
+    l->softmax = d->softmax;
+    l->background = d->background;
+    l->alpha = d->alpha;
+    l->beta = d->beta;
+    l->scale = d->scale;
+    l->nweights = d->nweights;
+    l->nbiases = d->nbiases;
+
+    // Shared parameters
+    l->weights = d->weights;
+    l->biases = d->biases;
+    l->mask = d->mask;
+    l->input_layers = d->input_layers;
+    l->input_sizes = d->input_sizes;
+
+    l->output = (float *) calloc(outputs, sizeof(float));
+    switch (l->type) {
+    case CONVOLUTIONAL:
+        l->forward = forward_convolutional_layer;
+        // As `get_workspace_size()` computes it
+        l->workspace_size = (size_t) l->out_h*l->out_w*l->size*l->size
+                            *l->c/l->groups*sizeof(float);
+        break;
+    case MAXPOOL:
+        l->forward = forward_maxpool_layer;
+        l->indexes = (int *) calloc(outputs, sizeof(int));
+        break;
+    case ROUTE:
+        l->forward = forward_route_layer;
+        break;
+    case SHORTCUT:
+        l->forward = forward_shortcut_layer;
+        break;
+    case UPSAMPLE:
+        l->forward = forward_upsample_layer;
+        break;
+    case YOLO:
+        l->forward = forward_yolo_layer;
+        l->delta = (float *) calloc(outputs, sizeof(float));
+        break;
+    case REGION:
+        l->forward = forward_region_layer;
+        l->delta = (float *) calloc(outputs, sizeof(float));
+        break;
+    default:
+        break;
+    }
+}
+
+// Release a network built by `make_inference_network()`, whose buffers may
+// be missing
+static void free_inference_network(network *net)
+{
+    int i;
+
+    for (i = 0; i < net->n; i++) {
+        free(net->layers[i].output);
+        free(net->layers[i].indexes);
+        free(net->layers[i].delta);
+    }
+    free(net->layers);
+    free(net->input);
+    free(net->workspace);
+    free(net->seen);
+    free(net->t);
+    free(net->cost);
+    free(net);
+}
+
+/* Build a network running forward passes from layer descriptors. The
+ * parameters are shared with the descriptors, which must outlive the network
+ * Input:
+ *   - layer descriptors
+ *   - number of layers
+ *   - batch size
+ * Output: network, NULL if a layer isn't supported or its buffers couldn't
+ *         be allocated
+ */
+network *make_inference_network(const layer *descriptors, int n, int batch)
+{
+    int i;
+    size_t workspace_size = 0;
+
+    for (i = 0; i < n; i++) {
+        if (!inference_layer_supported(&descriptors[i])) {
+            printf("Layer %d: this layer type isn't supported for inference-only networks\n",
+                   i);
+            return NULL;
+        }
+    }
+
+    network *net = make_network(n);
+    bool allocated = true;
+    for (i = 0; i < n; i++) {
+        layer *l = &net->layers[i];
+        make_inference_layer(&descriptors[i], batch, l);
+        allocated = allocated && l->output
+                    && (l->type != MAXPOOL || l->indexes)
+                    && ((l->type != YOLO && l->type != REGION) || l->delta);
+        if (l->workspace_size > workspace_size)
+            workspace_size = l->workspace_size;
+    }
+    layer *out = &net->layers[n - 1];
+    net->batch = batch;
+    net->h = net->layers[0].h;
+    net->w = net->layers[0].w;
+    net->c = net->layers[0].c;
+    net->inputs = net->layers[0].inputs;
+    net->outputs = out->outputs;
+    net->truths = out->outputs;
+    net->output = out->output;
+    net->input = (float *) calloc((size_t) net->inputs*batch, sizeof(float));
+    net->workspace = (float *) calloc(1, workspace_size);
+    if (!allocated || !net->input || (workspace_size && !net->workspace)) {
+        printf("Couldn't allocate the buffers of the network\n");
+        free_inference_network(net);
+        return NULL;
+    }
+    return net;
+}
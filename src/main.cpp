@@ -23,143 +23,272 @@ extern "C"
 #include "codec_def.h"
 #include "h264dec.h"
 #include "utils.h"
-
+#include "detector.h"
+#include "pipeline.h"
+#include "motion.h"
+#include "tracker.h"
+#include "quantize.h"
+#include "profiler.h"
+#include "pool.h"
+#include "sink.h"
+#include "writer.h"
+#include "sampler.h"
+#include "tiling.h"
+#include "roi.h"
+#include "nms.h"
+#include "convolution.h"
+#include "gemm_packed.h"
+#include "thread_pool.h"
+#include "server.h"
+#include "decode.h"
+
+#include <float.h>
 #include <string.h>
 
 
-/* Keep track of the number of frames processed */
+/* Keep track of the number of frames decoded and processed */
+int frames_decoded = 0;
 int frames_processed = 0;
 
-/* Network state, to be initialized by `init_darknet_detector()` */
-char **names;
-network *net;
-image **alphabet;
-
-/* Initialize the Darknet model (neural network)
- * Input:
- *   - name list file: contains the labels of all objects
- *   - network configuration file
- *   - weight file
- *   - whether detection boxes should be annotated with the name of the detected
- *     object (requires an alphabet)
- * Output: None
- */
-void init_darknet_detector(char *name_list_file, char *cfgfile,
-                           char *weightfile, bool annotate_boxes)
+/* Sampler, selecting the frames the model runs on */
+frame_sampler sampler;
+
+/* Non-maximum suppression parameters */
+nms_options nms = {
+    .45,                    // overlap threshold
+    false,                  // class agnostic
+    false,                  // soft suppression
+    .5,                     // soft suppression sigma
+    .1,                     // soft suppression score threshold
+};
+
+/* Detection parameters */
+detector_options options = {
+    .1,                     // objectness threshold
+    .1,                     // class threshold
+    .5,                     // hierarchical threshold
+    true,                   // draw detection boxes
+    "output/prediction",    // output file prefix
+    NULL,                   // image writer
+    false,                  // save images with detections only
+    NULL,                   // object tracker
+    NULL,                   // detection sink
+    NULL,                   // frame tiler
+    NULL,                   // region of interest
+    &nms,                   // non-maximum suppression
+};
+
+/* Whether frames are handed over to the pipeline instead of being processed
+ * synchronously by the decoder callback */
+bool pipelined = false;
+
+/* Motion gate, skipping the model on static frames when enabled */
+bool motion_gating = false;
+motion_gate gate;
+
+/* Tracker, propagating detections between the frames the model runs on when
+ * enabled */
+tracker object_tracker;
+
+/* Time at which the decoder got control back, used to time decoding */
+double decode_start;
+
+/* Prepared frames waiting for a full batch to be run through the network */
+frame_job **pending_jobs;
+int pending_count = 0;
+
+/* Run the network on the pending frames and output their predictions */
+void flush_pending_jobs()
 {
-    // Get name list
-    names = get_labels(name_list_file);
-
-    // Load network
-    net = load_network(cfgfile, weightfile, 0);
-    set_batch_network(net, 1);
-
-    // Load alphabet (set of images corresponding to symbols). It is used to
-    // write the labels next to the detection boxes. Try to load symbols from
-    // `program_data/labels/<symbol_index>_<symbol_size>.png`
-    if (annotate_boxes)
-        alphabet = load_alphabet_from_path("program_data/labels/%d_%d.png");
+    double time;
+    int i;
+
+    time = what_time_is_it_now();
+    run_darknet_detector(pending_jobs, pending_count, &options);
+    if (!options.detection_sink)
+        printf("Detector run: %lf seconds\n", what_time_is_it_now() - time);
+
+    for (i = 0; i < pending_count; i++)
+        pool_free(pending_jobs[i]);
+    pending_count = 0;
 }
 
-/* Feed an image to the object detection model.
- * Output a prediction, i.e. the same image with boxes highlighting the detected
- * objects
+/* Run the detection stages on a sampled frame
  * Input:
- *   - initial image to be annotated with detection boxes
- *   - image to be processed by the model
- *   - objectness threshold above which an object is considered detected
- *   - class threshold above which a class is considered detected assuming
- *     objectness within the detection box
- *   - hierarchical threshold (only used by YOLO9000)
- *   - output (prediction) file path: doesn't include the file extension
- *   - whether detection boxes should be drawn and saved to a file
+ *   - OpenH264's I420 frame buffer
+ *   - frame number in the video
  * Output: None
  */
-void run_darknet_detector(image im, image im_sized, float objectness_thresh,
-                          float class_thresh, float hier_thresh, char *outfile,
-                          bool draw_detection_boxes)
+void process_frame(SBufferInfo *bufInfo, int frame)
 {
+    frame_job *job;
     double time;
-    float nms = .45;
+    bool reuse_detections = false;
 
-    // Run network prediction
-    float *X = im_sized.data;
-    printf("Starting prediction...\n");
-    time  = what_time_is_it_now();
-    network_predict(net, X);
-    printf("Prediction duration: %lf seconds\n",
-                what_time_is_it_now() - time);
+    pool_next_frame();
 
-    // Get detections
-    int nboxes = 0;
-    layer l = net->layers[net->n - 1];
-    detection *dets = get_network_boxes(net, im.w, im.h, objectness_thresh,
-                                        hier_thresh, 0, 1, &nboxes);
-    if (nms)
-        do_nms_sort(dets, nboxes, l.classes, nms);
-    printf("Detection probabilities:\n");
-
-    // Draw boxes around detected objects
-    if (draw_detection_boxes) {
-        draw_detections(im, dets, nboxes, objectness_thresh, names, alphabet,
-                        l.classes);
-
-        // Output the prediction
-        if (outfile) {
-            printf("Saving prediction to %s.jpg...\n", outfile);
-            time  = what_time_is_it_now();
-            save_image(im, outfile);
-            printf("Write duration: %lf seconds\n",
-                    what_time_is_it_now() - time);
-        }
-    } else {
-        // Print classes above a certain detection threshold
-        print_detection_probabilities(im, dets, nboxes, class_thresh, names,
-                                      l.classes);
+    // Look for changes on the luma plane, before any conversion
+    if (motion_gating)
+        reuse_detections = motion_gate_skip(&gate, bufInfo);
+
+#ifdef HAVE_THREADS
+    if (pipelined) {
+        push_pipeline_frame(bufInfo, frame, reuse_detections);
+        frames_processed++;
+        decode_start = profile_start();
+        return;
     }
-    free_detections(dets, nboxes);
+#endif
+
+    if (!options.detection_sink)
+        printf("Image %d ===========================\n", frame);
+
+    time = what_time_is_it_now();
+
+    job = (frame_job *) pool_calloc(1, sizeof(frame_job));
+    job->index = frame;
+    job->reuse_detections = reuse_detections;
+    prepare_frame(job, bufInfo, &options);
 
-    free_image(im);
-    free_image(im_sized);
+    if (!options.detection_sink)
+        printf("Image normalized and resized: %lf seconds\n",
+                    what_time_is_it_now() - time);
+
+    pending_jobs[pending_count++] = job;
+    if (pending_count == net->batch)
+        flush_pending_jobs();
+    frames_processed++;
+    decode_start = profile_start();
 }
 
-/* Callback called by the H.264 decoder whenever a frame is decoded and ready
+/* Callback called by the H.264 decoder whenever a frame is decoded and ready.
+ * Frames that aren't sampled are dropped before any conversion
  * Input: OpenH264's I420 frame buffer
  * Output: None
  */
 void on_frame_ready(SBufferInfo *bufInfo)
 {
-    image im, im_sized;
-    double time;
-    const char *outfile_prefix = "output/prediction";
-    char outfile[strlen(outfile_prefix) + 12];
-    outfile[0] = '\0';
-    char frame_number_suffix[12];
-
-    printf("Image %d ===========================\n", frames_processed);
-
-    time = what_time_is_it_now();
+    int frame = frames_decoded++;
 
-    im = load_image_from_raw_yuv(bufInfo);
-
-    // Resize image to fit the darknet model
-    im_sized = letterbox_image(im, net->w, net->h);
-
-    printf("Image normalized and resized: %lf seconds\n",
-                what_time_is_it_now() - time);
-
-    time = what_time_is_it_now();
-
-    strcat(outfile, outfile_prefix);
-    sprintf(frame_number_suffix, ".%d", frames_processed);
-    strcat(outfile, frame_number_suffix);
+    profile_end(STAGE_DECODE, decode_start);
+    if (sample_frame(&sampler, frame))
+        process_frame(bufInfo, frame);
+    else
+        decode_start = profile_start();
+}
 
-    run_darknet_detector(im, im_sized, .1, .1, .5, outfile, true);
-    printf("Detector run: %lf seconds\n", what_time_is_it_now() - time);
-    frames_processed++;
+/* Callback called by the keyframe decoder whenever an IDR frame is decoded
+ * Input:
+ *   - OpenH264's I420 frame buffer
+ *   - frame number in the video
+ * Output: None
+ */
+void on_keyframe_ready(SBufferInfo *bufInfo, int frame)
+{
+    frames_decoded++;
+    profile_end(STAGE_DECODE, decode_start);
+    sample_frame(&sampler, frame);
+    process_frame(bufInfo, frame);
 }
 
-/* Run the object detection model on each decoded frame */
+/* Run the object detection model on the decoded frames
+ * Options:
+ *   - `-pipeline`: run decoding, preparation, prediction and output as
+ *     concurrent stages. Ignored on targets without threads
+ *   - `-queue_depth <n>`: number of frames buffered between two pipeline
+ *     stages (default: 4)
+ *   - `-batch <n>`: number of frames fed to the network in a single forward
+ *     pass (default: 1)
+ *   - `-motion_threshold <levels>`: skip the model on frames whose luma didn't
+ *     change by more than this many levels on any block since the last
+ *     processed frame, and reuse its detections (default: 0, disabled)
+ *   - `-motion_refresh <n>`: run the model at least once every `n` frames
+ *     when the motion gate is enabled (default: 30, 0 for no limit)
+ *   - `-track_interval <n>`: run the model every `n` frames, or earlier on
+ *     scene changes if the motion gate is enabled, and track the detected
+ *     objects in between (default: 0, disabled)
+ *   - `-bundle <file>`: load the model, label list and alphabet from a model
+ *     bundle generated by `make_bundle` instead of the individual files
+ *   - `-int8 <sample.h264>`: quantize the convolutional layers to 8-bit
+ *     integers, calibrating the activations on the first frames of the sample
+ *     video, and report the drift against the float model
+ *   - `-calibration_frames <n>`: number of frames used for the calibration
+ *     (default: 8)
+ *   - `-profile <prefix>`: time each layer and processing stage over the
+ *     whole video and write the profile to `<prefix>.json`, `<prefix>.csv`
+ *     and `<prefix>.folded`
+ *   - `-detections <file>`: stream the detections of each frame to a file
+ *     (`-` for the standard output, the other messages then going to the
+ *     standard error) instead of printing them
+ *   - `-detections_format <jsonl|binary>`: format of the streamed detections
+ *     (default: jsonl)
+ *   - `-save_format <jpg|png|bmp|tga|h264>`: format of the prediction images
+ *     (default: jpg). With h264, they are encoded into a single video
+ *   - `-h264_output <file>`: path of the H.264 video (default:
+ *     output/annotated.h264)
+ *   - `-h264_bitrate <kbps>`: target bitrate of the H.264 video (default:
+ *     2000)
+ *   - `-h264_gop <n>`: number of frames between two key frames of the H.264
+ *     video (default: 60)
+ *   - `-save_quality <1-100>`: JPEG quality of the prediction images
+ *     (default: 80)
+ *   - `-save_queue <n>`: number of prediction images queued to the image
+ *     writer (default: 8)
+ *   - `-save_policy <block|drop>`: whether the output waits for the image
+ *     writer or drops the image when its queue is full (default: block)
+ *   - `-save_detections_only`: only save the prediction images of the frames
+ *     with detections
+ *   - `-no_labels`: draw the detection boxes without the names of the
+ *     detected objects
+ *   - `-streams <file,file,...>`: process several H.264 videos concurrently
+ *     instead of `video_input/in.h264`. Output files are suffixed with the
+ *     stream number. Requires threads
+ *   - `-workers <n>`: number of inference workers shared by the streams
+ *     (default: one per stream, up to the number of hardware threads)
+ *   - `-decode_threads <n>`: decode the video on `n` threads, splitting it
+ *     into independent segments at IDR frames (default: 1)
+ *   - `-sample_stride <n>`: run the model on one frame every `n` frames only
+ *     (default: 1)
+ *   - `-sample_fps <fps>`: run the model on this many frames per second of
+ *     video only (default: 0, every frame)
+ *   - `-video_fps <fps>`: frame rate of the video, used by `-sample_fps`
+ *     (default: 30)
+ *   - `-keyframes_only`: only decode the IDR frames and run the model on them
+ *   - `-tiles`: run the model on overlapping tiles of the full-resolution
+ *     frame, plus the letterboxed frame, instead of the letterboxed frame
+ *     only. Not available with `-streams`
+ *   - `-tile_overlap <fraction>`: fraction of a tile shared with each of its
+ *     neighbors (default: 0.2)
+ *   - `-tile_scale <f>`: frame pixels per network input pixel in a tile
+ *     (default: 1, full resolution)
+ *   - `-no_global_view`: don't run the model on the letterboxed frame along
+ *     with the tiles
+ *   - `-tile_workers <n>`: number of threads running the tiles of a frame
+ *     (default: 1, the layers of each tile being split over `-threads`)
+ *   - `-classes <file>`: only detect the classes listed in the file, one name
+ *     per line as in the name list file
+ *   - `-roi <file[,file,...]>`: restrict the model to a region of interest,
+ *     defined by a mask file (see `roi.cpp`). With `-streams`, either one
+ *     mask per stream or one mask for all of them
+ *   - `-nms <thresh>`: overlap above which the less probable of two boxes of
+ *     the same class is suppressed (default: 0.45). 0 disables the
+ *     non-maximum suppression. Of two boxes of equal probability, the first
+ *     one detected wins, where darknet's unstable sort picks either
+ *   - `-nms_agnostic`: suppress overlapping boxes whatever their class
+ *   - `-soft_nms`: decay the probability of overlapping boxes (Gaussian
+ *     soft-NMS) instead of suppressing them
+ *   - `-soft_nms_sigma <sigma>`: width of the soft-NMS decay, positive
+ *     (default: 0.5)
+ *   - `-no_winograd`: run the 3x3 convolutions with im2col and GEMM instead
+ *     of the Winograd algorithm
+ *   - `-threads <n>`: number of threads the work of each layer is split
+ *     over (default: the `DETECTOR_THREADS` environment variable, or one per
+ *     hardware thread; 1 with `-streams` or several `-tile_workers`, which
+ *     run several networks at once). Ignored on targets without threads
+ *   - `-pin_threads`: pin each thread of the pool to a core (Linux only)
+ *   - `-gemm_threads <n>`: number of threads a matrix product of the packed
+ *     GEMM backend may be split over (default: `-threads`)
+ */
 int main(int argc, char **argv)
 {
     double time;
@@ -167,22 +296,272 @@ int main(int argc, char **argv)
     char *name_list_file = "program_data/coco.names";
     char *cfgfile = "program_data/yolov3.cfg";
     char *weightfile = "program_data/yolov3.weights";
-    // XXX: Box annotation is temporarily disabled until we find a way to
-    // efficiently provision a batch of files to the enclave (file archive?)
-    bool annotate_boxes = false;
+    bool annotate_boxes = !find_arg(argc, argv, "-no_labels");
+    char *bundle_file = find_char_arg(argc, argv, "-bundle", NULL);
+    int queue_depth = find_int_arg(argc, argv, "-queue_depth", 4);
+    int batch = find_int_arg(argc, argv, "-batch", 1);
+    float motion_threshold = find_float_arg(argc, argv, "-motion_threshold", 0);
+    int motion_refresh = find_int_arg(argc, argv, "-motion_refresh", 30);
+    int track_interval = find_int_arg(argc, argv, "-track_interval", 0);
+    char *calibration_file = find_char_arg(argc, argv, "-int8", NULL);
+    int calibration_frames = find_int_arg(argc, argv, "-calibration_frames", 8);
+    char *profile_prefix = find_char_arg(argc, argv, "-profile", NULL);
+    char *detections_file = find_char_arg(argc, argv, "-detections", NULL);
+    char *detections_format = find_char_arg(argc, argv, "-detections_format",
+                                            "jsonl");
+    char *save_format = find_char_arg(argc, argv, "-save_format", "jpg");
+    int save_quality = find_int_arg(argc, argv, "-save_quality", 80);
+    int save_queue = find_int_arg(argc, argv, "-save_queue", 8);
+    char *save_policy = find_char_arg(argc, argv, "-save_policy", "block");
+    char *h264_output = find_char_arg(argc, argv, "-h264_output",
+                                      "output/annotated.h264");
+    int h264_bitrate = find_int_arg(argc, argv, "-h264_bitrate", 2000);
+    int h264_gop = find_int_arg(argc, argv, "-h264_gop", 60);
+    char *stream_list = find_char_arg(argc, argv, "-streams", NULL);
+    int workers = find_int_arg(argc, argv, "-workers", 0);
+    int decode_threads = find_int_arg(argc, argv, "-decode_threads", 1);
+    int sample_stride = find_int_arg(argc, argv, "-sample_stride", 1);
+    float sample_fps = find_float_arg(argc, argv, "-sample_fps", 0);
+    float video_fps = find_float_arg(argc, argv, "-video_fps", 30);
+    bool keyframes_only = find_arg(argc, argv, "-keyframes_only");
+    bool tiled = find_arg(argc, argv, "-tiles");
+    float tile_overlap = find_float_arg(argc, argv, "-tile_overlap", .2);
+    float tile_scale = find_float_arg(argc, argv, "-tile_scale", 1);
+    bool global_view = !find_arg(argc, argv, "-no_global_view");
+    int tile_workers = find_int_arg(argc, argv, "-tile_workers", 1);
+    char *roi_list = find_char_arg(argc, argv, "-roi", NULL);
+    char *class_list = find_char_arg(argc, argv, "-classes", NULL);
+    int threads = find_int_arg(argc, argv, "-threads",
+                               (tiled && tile_workers > 1) || stream_list
+                               ? 1 : 0);
+    bool pin_threads = find_arg(argc, argv, "-pin_threads");
+    int gemm_threads = find_int_arg(argc, argv, "-gemm_threads", 0);
+    roi_mask **rois = NULL;
+    int nrois = 0;
+    char **input_files = NULL;
+    int nstreams = 0;
+
+    // The standard output only carries the detections when they are streamed
+    // to it, every message printed from now on goes to the standard error
+    if (detections_file && !strcmp(detections_file, "-")) {
+        if (stream_list) {
+            printf("Detections can't be streamed to the standard output with -streams\n");
+            return 1;
+        }
+        if (!reserve_standard_output())
+            return 1;
+    }
+
+    nms.thresh = find_float_arg(argc, argv, "-nms", .45);
+    nms.class_agnostic = find_arg(argc, argv, "-nms_agnostic");
+    nms.soft = find_arg(argc, argv, "-soft_nms");
+    nms.sigma = find_float_arg(argc, argv, "-soft_nms_sigma", .5);
+    // The decay divides by sigma
+    if (nms.sigma <= 0) {
+        printf("-soft_nms_sigma must be positive\n");
+        return 1;
+    }
+    // Decayed boxes are dropped once below the threshold they were kept at
+    nms.score_thresh = options.objectness_thresh;
+    if (nms.thresh <= 0 && !nms.soft)
+        options.nms = NULL;
+
+    winograd_convolutions = !find_arg(argc, argv, "-no_winograd");
+    init_thread_pool(threads, pin_threads);
+    set_gemm_threads(gemm_threads);
+    pipelined = find_arg(argc, argv, "-pipeline");
+    options.save_detections_only = find_arg(argc, argv,
+                                            "-save_detections_only");
+
+    // Validate the output formats before opening anything
+    if (strcmp(detections_format, "jsonl")
+        && strcmp(detections_format, "binary")) {
+        printf("Unknown detection format %s\n", detections_format);
+        return 1;
+    }
+    sink_format detections_type = strcmp(detections_format, "binary")
+                                  ? SINK_JSONL : SINK_BINARY;
+    const char *formats[] = {"png", "bmp", "tga", "jpg"};
+    writer_policy policy = strcmp(save_policy, "drop") ? WRITER_BLOCK
+                                                       : WRITER_DROP;
+    bool save_video = !strcmp(save_format, "h264");
+    int format;
+    for (format = 0; format < 4; format++)
+        if (!strcmp(save_format, formats[format]))
+            break;
+    if (format == 4 && !save_video) {
+        printf("Unknown image format %s\n", save_format);
+        return 1;
+    }
+
+    // Videos processed concurrently, separated by commas
+    if (stream_list) {
+        char *file, *saveptr;
+        input_files = (char **) calloc(strlen(stream_list) + 1,
+                                       sizeof(char *));
+        for (file = strtok_r(stream_list, ",", &saveptr); file;
+             file = strtok_r(NULL, ",", &saveptr))
+            input_files[nstreams++] = file;
+        if (tiled) {
+            printf("-tiles isn't supported with -streams\n");
+            return 1;
+        }
+    }
+
+    // Masks, separated by commas
+    if (roi_list) {
+        // Mask files are tokenized too, hence the reentrant tokenizer
+        char *file, *saveptr;
+        rois = (roi_mask **) calloc(strlen(roi_list) + 1, sizeof(roi_mask *));
+        for (file = strtok_r(roi_list, ",", &saveptr); file;
+             file = strtok_r(NULL, ",", &saveptr))
+            if (!(rois[nrois++] = load_roi_mask(file)))
+                return 1;
+        if (nrois > 1 && nrois != nstreams) {
+            printf("-roi takes one mask, or one mask per stream\n");
+            return 1;
+        }
+        options.roi = rois[0];
+    }
+
+    init_frame_sampler(&sampler, sample_stride, sample_fps, video_fps,
+                       keyframes_only);
+    motion_gating = motion_threshold > 0;
+    if (track_interval > 0) {
+        // The model runs on the frames the motion gate lets through: every
+        // `track_interval` frames and, if enabled, on scene changes
+        init_tracker(&object_tracker, .3, 2);
+        options.object_tracker = &object_tracker;
+        init_motion_gate(&gate, motion_gating ? motion_threshold : FLT_MAX,
+                         track_interval);
+        motion_gating = true;
+    } else {
+        init_motion_gate(&gate, motion_threshold, motion_refresh);
+    }
+    // Streams have their own outputs, opened by the server
+    if (detections_file && nstreams == 0) {
+        options.detection_sink = open_detection_sink(detections_file,
+                                                     detections_type);
+        if (!options.detection_sink)
+            return 1;
+    }
+    if (options.draw_detection_boxes && nstreams == 0) {
+        if (save_video) {
+            options.image_writer = start_video_writer(h264_output,
+                                                      h264_bitrate, h264_gop,
+                                                      save_queue, policy);
+            if (!options.image_writer)
+                return 1;
+        } else {
+            options.image_writer = start_image_writer((IMTYPE) format,
+                                                      save_quality,
+                                                      save_queue, policy);
+        }
+    }
+#ifndef HAVE_THREADS
+    if (nstreams > 0) {
+        printf("Threads are not supported on this target. Multiple streams can't be processed\n");
+        return 1;
+    }
+    if (pipelined) {
+        printf("Threads are not supported on this target. Running the pipeline stages synchronously\n");
+        pipelined = false;
+    }
+#endif
 
     printf("Initializing detector...\n");
     time  = what_time_is_it_now();
-    init_darknet_detector(name_list_file, cfgfile, weightfile, annotate_boxes);
+    if (batch < 1)
+        batch = 1;
+    if (bundle_file)
+        init_darknet_detector_from_bundle(bundle_file, annotate_boxes, batch);
+    else
+        init_darknet_detector(name_list_file, cfgfile, weightfile,
+                              annotate_boxes, batch);
+    pending_jobs = (frame_job **) calloc(batch, sizeof(frame_job *));
     printf("Arguments loaded and network parsed: %lf seconds\n",
                 what_time_is_it_now() - time);
+    if (class_list && !load_class_allow_list(class_list))
+        return 1;
+
+    if (calibration_file) {
+        printf("Quantizing network...\n");
+        time  = what_time_is_it_now();
+        int quantized = quantize_network(net, calibration_file,
+                                         calibration_frames,
+                                         options.class_thresh);
+        printf("%d convolutional layers quantized to 8 bits: %lf seconds\n",
+               quantized, what_time_is_it_now() - time);
+    }
+
+    // Layers are profiled last, so that the final forward functions are
+    // timed
+    if (profile_prefix)
+        start_profiling(net);
+
+    if (tiled) {
+        options.tiler = make_frame_tiler(tile_overlap, tile_scale,
+                                         global_view, tile_workers);
+    }
+
+#ifdef HAVE_THREADS
+    if (nstreams > 0) {
+        stream_settings settings = {
+            options, motion_threshold, motion_refresh, track_interval,
+            detections_file, detections_type,
+            (IMTYPE) (save_video ? JPG : format), save_quality, save_queue,
+            policy, save_video, h264_output, h264_bitrate, h264_gop,
+            sampler, nrois > 1 ? rois : NULL,
+        };
+        int x = run_detection_server(input_files, nstreams, &settings,
+                                     workers, queue_depth);
+        if (profile_prefix)
+            write_profile(profile_prefix);
+        print_pool_stats();
+        return x;
+    }
+#endif
+
+    // Frames held by the pipeline stages and their queues, or waiting for a
+    // full batch. Once that many frames went through, their buffers are
+    // recycled and the frame pool shouldn't allocate anymore
+    init_frame_pool(pipelined ? batch + 3*queue_depth + 3 : batch);
+
+#ifdef HAVE_THREADS
+    if (pipelined)
+        start_pipeline(&options, queue_depth);
+#endif
 
     printf("Starting decoding...\n");
     time  = what_time_is_it_now();
-    int x = h264_decode(input_file, "", false, &on_frame_ready);
+    decode_start = profile_start();
+    int x = keyframes_only
+            ? h264_decode_keyframes(input_file, &on_keyframe_ready)
+            : h264_decode_parallel(input_file, decode_threads,
+                                   &on_frame_ready);
+#ifdef HAVE_THREADS
+    if (pipelined)
+        finish_pipeline();
+#endif
+    // Flush the last, partial batch
+    if (pending_count > 0)
+        flush_pending_jobs();
+    if (options.detection_sink)
+        close_detection_sink(options.detection_sink);
+    if (options.image_writer)
+        finish_image_writer(options.image_writer);
     printf("Finished decoding: %lf seconds\n",
                 what_time_is_it_now() - time);
-    if (frames_processed == 0)
+    if (sampler.mode != SAMPLE_ALL)
+        print_frame_sampler_stats(&sampler);
+    if (options.tiler)
+        print_frame_tiler_stats(options.tiler);
+    if (motion_gating)
+        print_motion_gate_stats(&gate);
+    if (profile_prefix)
+        write_profile(profile_prefix);
+    print_pool_stats();
+    if (frames_decoded == 0)
         printf("No frames were processed. The input video was whether empty or not an H.264 video\n");
 
 
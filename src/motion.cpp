@@ -0,0 +1,136 @@
+/*
+This file implements the motion gate.
+The luma plane of each decoded frame is averaged over blocks of
+`MOTION_BLOCK_SIZE`x`MOTION_BLOCK_SIZE` pixels, before any conversion to RGB.
+The resulting thumbnail is compared to the thumbnail of the last frame the
+object detection model ran on. If no block changed by more than the
+threshold, the frame is considered static and the model can be skipped.
+Comparing against the last processed frame rather than the previous frame
+prevents slow changes from accumulating unnoticed.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "codec_def.h"
+#include "motion.h"
+
+/* Initialize the motion gate
+ * Input:
+ *   - motion gate
+ *   - mean block difference, in luma levels, above which a frame is
+ *     considered changed
+ *   - maximum number of frames between two runs of the model (0: no limit)
+ * Output: None
+ */
+void init_motion_gate(motion_gate *gate, float threshold,
+                      int refresh_interval)
+{
+    gate->threshold = threshold;
+    gate->refresh_interval = refresh_interval;
+    gate->w = gate->h = 0;
+    gate->tw = gate->th = 0;
+    gate->reference = gate->current = NULL;
+    gate->since_refresh = 0;
+    gate->frames = 0;
+    gate->skipped = 0;
+}
+
+// Average the luma plane over blocks. Partial blocks on the right and bottom
+// edges are averaged over the pixels they contain
+static void compute_thumbnail(motion_gate *gate, SBufferInfo *bufInfo)
+{
+    int i, j;
+    int stride = bufInfo->UsrData.sSystemBuffer.iStride[0];
+    unsigned char *row = bufInfo->pDst[0];
+    unsigned int sums[gate->tw];
+
+    for (i = 0; i < gate->th; i++) {
+        int rows = gate->h - i*MOTION_BLOCK_SIZE;
+        if (rows > MOTION_BLOCK_SIZE)
+            rows = MOTION_BLOCK_SIZE;
+
+        for (j = 0; j < gate->tw; j++)
+            sums[j] = 0;
+        for (int r = 0; r < rows; r++) {
+            for (j = 0; j < gate->w; j++)
+                sums[j / MOTION_BLOCK_SIZE] += row[j];
+            row += stride;
+        }
+
+        for (j = 0; j < gate->tw; j++) {
+            int cols = gate->w - j*MOTION_BLOCK_SIZE;
+            if (cols > MOTION_BLOCK_SIZE)
+                cols = MOTION_BLOCK_SIZE;
+            gate->current[i*gate->tw + j] = (float) sums[j] / (rows * cols);
+        }
+    }
+}
+
+/* Decide whether the object detection model can be skipped on a frame
+ * Input:
+ *   - motion gate
+ *   - OpenH264's I420 frame buffer
+ * Output: whether the detections of the last processed frame can be reused
+ */
+bool motion_gate_skip(motion_gate *gate, SBufferInfo *bufInfo)
+{
+    int i;
+    int w = bufInfo->UsrData.sSystemBuffer.iWidth;
+    int h = bufInfo->UsrData.sSystemBuffer.iHeight;
+    bool changed = false;
+
+    gate->frames++;
+
+    // (Re)allocate the thumbnails on the first frame or when the resolution
+    // changes. There is no reference yet, so the model has to run
+    if (w != gate->w || h != gate->h) {
+        gate->w = w;
+        gate->h = h;
+        gate->tw = (w + MOTION_BLOCK_SIZE - 1) / MOTION_BLOCK_SIZE;
+        gate->th = (h + MOTION_BLOCK_SIZE - 1) / MOTION_BLOCK_SIZE;
+        free(gate->reference);
+        free(gate->current);
+        gate->reference = (float *) malloc(gate->tw*gate->th*sizeof(float));
+        gate->current = (float *) malloc(gate->tw*gate->th*sizeof(float));
+        changed = true;
+    }
+
+    compute_thumbnail(gate, bufInfo);
+
+    for (i = 0; !changed && i < gate->tw*gate->th; i++)
+        changed = fabsf(gate->current[i] - gate->reference[i]) >
+                  gate->threshold;
+
+    // Force a refresh every once in a while, unless disabled
+    if (!changed && (gate->refresh_interval <= 0 ||
+                     gate->since_refresh + 1 < gate->refresh_interval)) {
+        gate->since_refresh++;
+        gate->skipped++;
+        return true;
+    }
+
+    float *tmp = gate->reference;
+    gate->reference = gate->current;
+    gate->current = tmp;
+    gate->since_refresh = 0;
+    return false;
+}
+
+/* Print the proportion of frames on which the model was skipped */
+void print_motion_gate_stats(motion_gate *gate)
+{
+    printf("Motion gate: %d/%d frames skipped (%.1f%%)\n", gate->skipped,
+           gate->frames,
+           gate->frames ? 100. * gate->skipped / gate->frames : 0.);
+}
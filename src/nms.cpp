@@ -0,0 +1,378 @@
+/*
+This file implements the non-maximum suppression engine.
+Darknet's `do_nms_sort()` sorts the whole detection array once per class and
+compares every pair of boxes, which is quadratic in the number of detections
+times the number of classes, even though a box is only ever detected as one
+or two classes. Here, each detection is bucketed under the classes it has a
+non-zero probability for, and each bucket is sorted once and swept on its
+own. The boxes of a bucket are gathered into arrays of edges and areas, and
+the overlap of a box with the less probable boxes of its bucket is computed
+4 boxes at a time with SIMD instructions where available.
+The default mode keeps the semantics of `do_nms_sort()`: detections with a
+zero objectness are left out, and within a class a box overlapping a more
+probable box that wasn't suppressed itself loses that class. Boxes of equal
+probability are ordered by index, so that the first one detected wins:
+`do_nms_sort()` uses `qsort()`, which isn't stable, and may suppress either,
+so the same boxes are only suppressed when probabilities don't tie. The
+class-agnostic mode makes boxes compete whatever their class, with their most
+probable class, and the soft mode (Gaussian soft-NMS) decays the probability
+of overlapping boxes instead of suppressing them.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+Based on darknet, YOLO LICENSE https://github.com/pjreddie/darknet/blob/master/LICENSE
+*/
+
+extern "C"
+{
+    #include "darknet.h"
+}
+#include "pool.h"
+#include "nms.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#elif defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#endif
+
+/* Boxes of a bucket, sorted by decreasing score */
+typedef struct {
+    float *left, *top, *right, *bottom, *area;
+    float *score;
+    // Overlap of the current box with the following ones
+    float *iou;
+    // Detection each box comes from
+    int *index;
+    int *suppressed;
+    int n;
+} nms_bucket;
+
+typedef struct {
+    float score;
+    int index;
+} scored_box;
+
+
+// Allocate the arrays of a bucket of at most `n` boxes, in a single pooled
+// buffer
+static void *alloc_bucket(nms_bucket *b, int n)
+{
+    float *data = (float *) pool_alloc((size_t) n*9*sizeof(float));
+
+    b->left = data;
+    b->top = data + n;
+    b->right = data + 2*n;
+    b->bottom = data + 3*n;
+    b->area = data + 4*n;
+    b->score = data + 5*n;
+    b->iou = data + 6*n;
+    b->index = (int *) (data + 7*n);
+    b->suppressed = (int *) (data + 8*n);
+    b->n = 0;
+    return data;
+}
+
+// Sort boxes by decreasing score and gather them into a bucket. Edges are
+// computed as darknet's `overlap()` does, so that overlaps are bit-identical
+// to `box_iou()`'s
+static void fill_bucket(nms_bucket *b, detection *dets, scored_box *boxes,
+                        int n)
+{
+    int i;
+
+    std::sort(boxes, boxes + n, [](const scored_box &x, const scored_box &y) {
+        return x.score > y.score
+               || (x.score == y.score && x.index < y.index);
+    });
+    for (i = 0; i < n; i++) {
+        box bb = dets[boxes[i].index].bbox;
+        b->left[i] = bb.x - bb.w/2;
+        b->right[i] = bb.x + bb.w/2;
+        b->top[i] = bb.y - bb.h/2;
+        b->bottom[i] = bb.y + bb.h/2;
+        b->area[i] = bb.w*bb.h;
+        b->score[i] = boxes[i].score;
+        b->index[i] = boxes[i].index;
+        b->suppressed[i] = 0;
+    }
+    b->n = n;
+}
+
+// Overlap (intersection over union) of box `i` with boxes `i + 1` to `n - 1`
+// of a bucket, stored in `b->iou` at the same positions
+static void overlap_row(nms_bucket *b, int i)
+{
+    int j = i + 1;
+    float l = b->left[i], t = b->top[i], r = b->right[i], bt = b->bottom[i];
+    float a = b->area[i];
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+    __m128 vl = _mm_set1_ps(l), vt = _mm_set1_ps(t);
+    __m128 vr = _mm_set1_ps(r), vb = _mm_set1_ps(bt);
+    __m128 va = _mm_set1_ps(a), zero = _mm_setzero_ps();
+    for (; j + 4 <= b->n; j += 4) {
+        __m128 w = _mm_sub_ps(_mm_min_ps(vr, _mm_loadu_ps(b->right + j)),
+                              _mm_max_ps(vl, _mm_loadu_ps(b->left + j)));
+        __m128 h = _mm_sub_ps(_mm_min_ps(vb, _mm_loadu_ps(b->bottom + j)),
+                              _mm_max_ps(vt, _mm_loadu_ps(b->top + j)));
+        __m128 disjoint = _mm_or_ps(_mm_cmplt_ps(w, zero),
+                                    _mm_cmplt_ps(h, zero));
+        __m128 inter = _mm_andnot_ps(disjoint, _mm_mul_ps(w, h));
+        __m128 uni = _mm_sub_ps(_mm_add_ps(va, _mm_loadu_ps(b->area + j)),
+                                inter);
+        _mm_storeu_ps(b->iou + j,
+                      _mm_andnot_ps(disjoint, _mm_div_ps(inter, uni)));
+    }
+#elif defined(__wasm_simd128__)
+    v128_t vl = wasm_f32x4_splat(l), vt = wasm_f32x4_splat(t);
+    v128_t vr = wasm_f32x4_splat(r), vb = wasm_f32x4_splat(bt);
+    v128_t va = wasm_f32x4_splat(a), zero = wasm_f32x4_splat(0);
+    for (; j + 4 <= b->n; j += 4) {
+        v128_t w = wasm_f32x4_sub(wasm_f32x4_pmin(vr,
+                                      wasm_v128_load(b->right + j)),
+                                  wasm_f32x4_pmax(vl,
+                                      wasm_v128_load(b->left + j)));
+        v128_t h = wasm_f32x4_sub(wasm_f32x4_pmin(vb,
+                                      wasm_v128_load(b->bottom + j)),
+                                  wasm_f32x4_pmax(vt,
+                                      wasm_v128_load(b->top + j)));
+        v128_t disjoint = wasm_v128_or(wasm_f32x4_lt(w, zero),
+                                       wasm_f32x4_lt(h, zero));
+        v128_t inter = wasm_v128_andnot(wasm_f32x4_mul(w, h), disjoint);
+        v128_t uni = wasm_f32x4_sub(wasm_f32x4_add(va,
+                                        wasm_v128_load(b->area + j)),
+                                    inter);
+        wasm_v128_store(b->iou + j,
+                        wasm_v128_andnot(wasm_f32x4_div(inter, uni),
+                                         disjoint));
+    }
+#endif
+    for (; j < b->n; j++) {
+        float w = std::min(r, b->right[j]) - std::max(l, b->left[j]);
+        float h = std::min(bt, b->bottom[j]) - std::max(t, b->top[j]);
+        if (w < 0 || h < 0) {
+            b->iou[j] = 0;
+            continue;
+        }
+        float inter = w*h;
+        b->iou[j] = inter/(a + b->area[j] - inter);
+    }
+}
+
+// Hard suppression: sweep the boxes in order, each box that wasn't suppressed
+// suppressing the following ones it overlaps too much
+static void suppress_bucket(nms_bucket *b, float thresh)
+{
+    int i, j;
+
+    for (i = 0; i < b->n - 1; i++) {
+        if (b->suppressed[i])
+            continue;
+        overlap_row(b, i);
+        for (j = i + 1; j < b->n; j++)
+            b->suppressed[j] |= b->iou[j] > thresh;
+    }
+}
+
+// Swap two boxes of a bucket
+static void swap_boxes(nms_bucket *b, int i, int j)
+{
+    std::swap(b->left[i], b->left[j]);
+    std::swap(b->top[i], b->top[j]);
+    std::swap(b->right[i], b->right[j]);
+    std::swap(b->bottom[i], b->bottom[j]);
+    std::swap(b->area[i], b->area[j]);
+    std::swap(b->score[i], b->score[j]);
+    std::swap(b->index[i], b->index[j]);
+}
+
+// Gaussian soft suppression: repeatedly select the box with the highest
+// remaining score, and decay the scores of the remaining boxes by
+// `exp(-iou^2/sigma)`. Boxes whose score falls below the threshold are
+// suppressed
+static void soft_suppress_bucket(nms_bucket *b, float sigma, float thresh)
+{
+    int i, j;
+
+    for (i = 0; i < b->n; i++) {
+        int best = i;
+        for (j = i + 1; j < b->n; j++)
+            if (b->score[j] > b->score[best])
+                best = j;
+        if (b->score[best] < thresh) {
+            for (j = i; j < b->n; j++)
+                b->suppressed[j] = 1;
+            return;
+        }
+        swap_boxes(b, i, best);
+        overlap_row(b, i);
+        for (j = i + 1; j < b->n; j++)
+            b->score[j] *= expf(-b->iou[j]*b->iou[j]/sigma);
+    }
+}
+
+// Apply the suppression mode to a bucket
+static void suppress(nms_bucket *b, nms_options *options)
+{
+    if (options->soft)
+        soft_suppress_bucket(b, options->sigma, options->score_thresh);
+    else
+        suppress_bucket(b, options->thresh);
+}
+
+// Probability of the most probable class of a detection
+static float top_probability(detection *d, int classes,
+                             const int *active_classes, int nactive)
+{
+    int k;
+    float best = 0;
+
+    for (k = 0; k < (nactive > 0 ? nactive : classes); k++)
+        best = std::max(best, d->prob[nactive > 0 ? active_classes[k] : k]);
+    return best;
+}
+
+// Class-agnostic suppression: a single bucket, scored by the most probable
+// class of each detection. A suppressed detection loses all its classes, a
+// decayed one sees all its probabilities scaled
+static void nms_agnostic(detection *dets, int num, int classes,
+                         const int *active_classes, int nactive,
+                         nms_options *options)
+{
+    int i, k, n = 0;
+    nms_bucket b;
+    scored_box *boxes = (scored_box *) pool_alloc(num*sizeof(scored_box));
+
+    for (i = 0; i < num; i++) {
+        if (dets[i].objectness == 0)
+            continue;
+        float best = top_probability(&dets[i], classes, active_classes,
+                                     nactive);
+        if (best > 0) {
+            boxes[n].score = best;
+            boxes[n++].index = i;
+        }
+    }
+    if (n < 2) {
+        pool_free(boxes);
+        return;
+    }
+    void *data = alloc_bucket(&b, n);
+    fill_bucket(&b, dets, boxes, n);
+    suppress(&b, options);
+
+    // Boxes may have been reordered by the soft suppression: their original
+    // score is the maximum of their probabilities
+    for (i = 0; i < b.n; i++) {
+        detection *d = &dets[b.index[i]];
+        if (b.suppressed[i]) {
+            memset(d->prob, 0, classes*sizeof(float));
+            continue;
+        }
+        if (!options->soft)
+            continue;
+        float decay = b.score[i]/top_probability(d, classes, active_classes,
+                                                 nactive);
+        for (k = 0; k < classes; k++) {
+            d->prob[k] *= decay;
+            if (d->prob[k] < options->score_thresh)
+                d->prob[k] = 0;
+        }
+    }
+    pool_free(data);
+    pool_free(boxes);
+}
+
+/* Non-maximum suppression, in place. Detections keep their order
+ * Input:
+ *   - detections
+ *   - number of detections
+ *   - number of classes
+ *   - classes the detections are restricted to, NULL for all of them
+ *   - number of such classes
+ *   - suppression parameters
+ * Output: None
+ */
+void nms_detections(detection *dets, int num, int classes,
+                    const int *active_classes, int nactive,
+                    nms_options *options)
+{
+    int i, k;
+    nms_bucket b;
+
+    if (num == 0)
+        return;
+    if (options->class_agnostic) {
+        nms_agnostic(dets, num, classes, active_classes, nactive, options);
+        return;
+    }
+
+    // Bucket the detections by class, counting them first so that the
+    // buckets are laid out contiguously
+    int nbuckets = nactive > 0 ? nactive : classes;
+    int *starts = (int *) pool_calloc(nbuckets + 1, sizeof(int));
+    for (i = 0; i < num; i++) {
+        if (dets[i].objectness == 0)
+            continue;
+        for (k = 0; k < nbuckets; k++)
+            if (dets[i].prob[nactive > 0 ? active_classes[k] : k] > 0)
+                starts[k + 1]++;
+    }
+    int largest = 0;
+    for (k = 0; k < nbuckets; k++) {
+        largest = std::max(largest, starts[k + 1]);
+        starts[k + 1] += starts[k];
+    }
+    if (starts[nbuckets] == 0) {
+        pool_free(starts);
+        return;
+    }
+    int *members = (int *) pool_alloc(starts[nbuckets]*sizeof(int));
+    int *fill = (int *) pool_alloc(nbuckets*sizeof(int));
+    memcpy(fill, starts, nbuckets*sizeof(int));
+    for (i = 0; i < num; i++) {
+        if (dets[i].objectness == 0)
+            continue;
+        for (k = 0; k < nbuckets; k++)
+            if (dets[i].prob[nactive > 0 ? active_classes[k] : k] > 0)
+                members[fill[k]++] = i;
+    }
+
+    scored_box *boxes = (scored_box *) pool_alloc(largest*sizeof(scored_box));
+    void *data = alloc_bucket(&b, largest);
+    for (k = 0; k < nbuckets; k++) {
+        int c = nactive > 0 ? active_classes[k] : k;
+        int n = starts[k + 1] - starts[k];
+        if (n < 2)
+            continue;
+        for (i = 0; i < n; i++) {
+            boxes[i].index = members[starts[k] + i];
+            boxes[i].score = dets[boxes[i].index].prob[c];
+        }
+        fill_bucket(&b, dets, boxes, n);
+        suppress(&b, options);
+        for (i = 0; i < n; i++) {
+            if (b.suppressed[i])
+                dets[b.index[i]].prob[c] = 0;
+            else if (options->soft)
+                dets[b.index[i]].prob[c] = b.score[i];
+        }
+    }
+    pool_free(data);
+    pool_free(boxes);
+    pool_free(fill);
+    pool_free(members);
+    pool_free(starts);
+}
@@ -0,0 +1,464 @@
+/*
+This file implements the inference-only optimizations applied to the object
+detection model once it is loaded:
+  - Batch normalization is only ever run with its rolling statistics at
+    inference time, i.e. it is an affine transformation of each output
+    channel, which can be folded into the weights and biases of the layer it
+    follows
+  - Convolutions are computed in tiles of output columns. Each tile is
+    initialized with the biases, accumulated by the GEMM, then activated
+    while it is still in cache, instead of sweeping over the whole output
+    once for the bias and once for the activation
+  - Shortcut layers directly following a convolution are fused into the
+    tile epilogue: the residual is added in place and the shortcut layer
+    shares the convolution's output. The convolution records the fused
+    layer in its own `shortcut` field, unused by darknet, so that each
+    network carries its own fusions
+  - Route layers share the output of their input layer when they have a
+    single one, or have their input layers write directly into their output
+    when the batch size is 1, instead of copying the inputs
+  - The work of each layer is split over the thread pool of
+    `thread_pool.cpp`: convolutions by tiles of output columns and unrolled
+    input channels, their epilogue, max pooling, upsampling and the logistic
+    activation of YOLO layers by channels or anchors, and the remaining route
+    copies by ranges of values. Every output value is computed as on a
+    single thread, so the results don't depend on the number of threads
+Fused layers share output buffers, so the network mustn't be resized
+afterwards.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+Based on darknet, YOLO LICENSE https://github.com/pjreddie/darknet/blob/master/LICENSE
+*/
+
+extern "C"
+{
+    #include "darknet.h"
+    #include "gemm.h"
+    #include "im2col.h"
+    #include "blas.h"
+    #include "batchnorm_layer.h"
+    #include "convolutional_layer.h"
+    #include "activations.h"
+}
+#include "optimize.h"
+#include "thread_pool.h"
+
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+
+// Number of output values per tile. The tile, and the slice of the unrolled
+// input it reads, should fit in the L2 cache
+#define FUSED_TILE_SIZE 32768
+// Smallest number of values copied by a task of the thread pool
+#define COPY_GRAIN 16384
+
+/* Fold batch normalization into the weights and biases of the convolutional
+ * and connected layers, and disable it.
+ * Darknet normalizes with `(x - mean) / (sqrt(variance) + .000001)` before
+ * scaling and adding the bias, so each output channel `i` becomes
+ * `x * s_i + (bias_i - mean_i * s_i)` with
+ * `s_i = scale_i / (sqrt(variance_i) + .000001)`
+ * Input: network
+ * Output: number of folded layers
+ */
+int fold_batchnorm(network *net)
+{
+    int i, j, k;
+    int folded = 0;
+
+    for (i = 0; i < net->n; i++) {
+        layer *l = &net->layers[i];
+        int n, size;
+
+        if (!l->batch_normalize)
+            continue;
+        if (l->type == CONVOLUTIONAL) {
+            n = l->n;
+            size = l->nweights / l->n;
+        } else if (l->type == CONNECTED) {
+            n = l->outputs;
+            size = l->inputs;
+        } else {
+            continue;
+        }
+
+        for (j = 0; j < n; j++) {
+            float s = l->scales[j] / (sqrtf(l->rolling_variance[j]) + .000001f);
+            for (k = 0; k < size; k++)
+                l->weights[j*size + k] *= s;
+            l->biases[j] -= l->rolling_mean[j] * s;
+        }
+        l->batch_normalize = 0;
+        folded++;
+    }
+    return folded;
+}
+
+// Activate a tile of `m` rows of `n` values and add the residual of a fused
+// shortcut layer, if any
+static void finish_tile(float *c, int m, int n, int ldc, ACTIVATION a,
+                        const float *residual, float alpha, float beta)
+{
+    int i, j;
+
+    for (i = 0; i < m; i++) {
+        float *row = c + i*ldc;
+        if (a == LEAKY) {
+            for (j = 0; j < n; j++)
+                row[j] = row[j] > 0 ? row[j] : .1f*row[j];
+        } else if (a == RELU) {
+            for (j = 0; j < n; j++)
+                row[j] = row[j] > 0 ? row[j] : 0;
+        } else if (a != LINEAR) {
+            activate_array(row, n, a);
+        }
+        if (residual) {
+            const float *r = residual + i*ldc;
+            for (j = 0; j < n; j++)
+                row[j] = alpha*row[j] + beta*r[j];
+        }
+    }
+}
+
+// Residual added to the output of a convolutional layer by its fused
+// shortcut layer, NULL if none
+static float *get_residual(layer *l, network *net, float *alpha, float *beta)
+{
+    // A fused shortcut layer follows the convolution, so it is never layer 0
+    if (!l->shortcut)
+        return NULL;
+    layer *s = &net->layers[l->shortcut];
+    *alpha = s->alpha;
+    *beta = s->beta;
+    return net->layers[s->index].output;
+}
+
+/* Finish the forward pass of a convolutional layer whose output holds the
+ * raw convolution: batch normalization or bias, activation and fused
+ * shortcut
+ * Input:
+ *   - layer
+ *   - network
+ * Output: None
+ */
+void finish_convolutional_layer(layer l, network net)
+{
+    int n = l.out_h*l.out_w;
+    float alpha = 1, beta = 1;
+    float *residual = get_residual(&l, &net, &alpha, &beta);
+
+    if (l.batch_normalize)
+        forward_batchnorm_layer(l, net);
+    // Rows of all the batch entries, one per output channel
+    parallel_for(l.batch*l.n, 1, [&](int first, int last) {
+        int r;
+        for (r = first; r < last; r++) {
+            float *row = l.output + (size_t) r*n;
+            if (!l.batch_normalize)
+                add_bias(row, l.biases + r % l.n, 1, 1, n);
+            finish_tile(row, 1, n, n, l.activation,
+                        residual ? residual + (size_t) r*n : NULL, alpha,
+                        beta);
+        }
+    });
+}
+
+// Forward function of the convolutional layers with fused bias, activation
+// and shortcut. Mirrors `forward_convolutional_layer()`
+static void forward_convolutional_layer_fused(layer l, network net)
+{
+    int i, j;
+    int m = l.n/l.groups;
+    int k = l.size*l.size*l.c/l.groups;
+    int n = l.out_w*l.out_h;
+    int channels = l.c/l.groups;
+    float alpha = 1, beta = 1;
+    float *residual = get_residual(&l, &net, &alpha, &beta);
+
+    // Tile width, a multiple of 16 columns
+    int tile = FUSED_TILE_SIZE / m / 16 * 16;
+    if (tile < 16)
+        tile = 16;
+    int tiles = (n + tile - 1)/tile;
+    // With fewer tiles than threads, e.g. in the deepest layers, the tiles run
+    // one after the other and the GEMM backend splits each product instead
+    int grain = tiles < thread_pool_size() ? tiles : 1;
+
+    for (i = 0; i < l.batch; i++) {
+        for (j = 0; j < l.groups; j++) {
+            float *a = l.weights + j*l.nweights/l.groups;
+            float *b = net.workspace;
+            float *c = l.output + (i*l.groups + j)*n*m;
+            float *im = net.input + (i*l.groups + j)*channels*l.h*l.w;
+            float *res = residual ? residual + (i*l.groups + j)*n*m : NULL;
+
+            // Each input channel unrolls into its own rows
+            if (l.size == 1)
+                b = im;
+            else
+                parallel_for(channels, 1, [&](int first, int last) {
+                    im2col_cpu(im + (size_t) first*l.h*l.w, last - first,
+                               l.h, l.w, l.size, l.stride, l.pad,
+                               b + (size_t) first*l.size*l.size*n);
+                });
+
+            parallel_for(tiles, grain, [&](int first, int last) {
+                int t, r;
+                for (t = first*tile; t < n && t < last*tile; t += tile) {
+                    int width = n - t < tile ? n - t : tile;
+                    for (r = 0; r < m; r++)
+                        fill_cpu(width, l.biases[j*m + r], c + r*n + t, 1);
+                    gemm(0, 0, m, width, k, 1, a, k, b + t, n, 1, c + t, n);
+                    finish_tile(c + t, m, width, n, l.activation,
+                                res ? res + t : NULL, alpha, beta);
+                }
+            });
+        }
+    }
+}
+
+// Forward function of the max pooling layers, by channels. Mirrors
+// `forward_maxpool_layer()`
+static void forward_maxpool_layer_parallel(layer l, network net)
+{
+    parallel_for(l.batch*l.c, 1, [&](int first, int last) {
+        int ch, i, j, m, n;
+        int offset = -l.pad/2;
+
+        for (ch = first; ch < last; ch++) {
+            const float *in = net.input + (size_t) ch*l.h*l.w;
+            for (i = 0; i < l.out_h; i++) {
+                for (j = 0; j < l.out_w; j++) {
+                    int out_index = j + l.out_w*(i + l.out_h*ch);
+                    float max = -FLT_MAX;
+                    int max_i = -1;
+                    for (n = 0; n < l.size; n++) {
+                        for (m = 0; m < l.size; m++) {
+                            int y = offset + i*l.stride + n;
+                            int x = offset + j*l.stride + m;
+                            int index = x + l.w*(y + l.h*ch);
+                            bool valid = y >= 0 && y < l.h && x >= 0
+                                         && x < l.w;
+                            float val = valid ? in[y*l.w + x] : -FLT_MAX;
+                            max_i = val > max ? index : max_i;
+                            max = val > max ? val : max;
+                        }
+                    }
+                    l.output[out_index] = max;
+                    l.indexes[out_index] = max_i;
+                }
+            }
+        }
+    });
+}
+
+// Forward function of the upsampling layers, by channels. Mirrors
+// `forward_upsample_layer()`
+static void forward_upsample_layer_parallel(layer l, network net)
+{
+    parallel_for(l.batch*l.c, 1, [&](int first, int last) {
+        size_t size = (size_t) l.out_w*l.out_h;
+        fill_cpu((last - first)*size, 0, l.output + first*size, 1);
+        upsample_cpu(net.input + (size_t) first*l.w*l.h, l.w, l.h,
+                     last - first, 1, l.stride, 1, l.scale,
+                     l.output + first*size);
+    });
+}
+
+// Forward function of the YOLO layers at inference, by anchors. Mirrors
+// `forward_yolo_layer()`: the coordinates, objectness and class scores go
+// through the logistic function
+static void forward_yolo_layer_parallel(layer l, network net)
+{
+    int size = l.w*l.h;
+
+    parallel_for(l.batch*l.n, 1, [&](int first, int last) {
+        int a;
+        for (a = first; a < last; a++) {
+            size_t offset = (size_t) a*size*(4 + l.classes + 1);
+            memcpy(l.output + offset, net.input + offset,
+                   (size_t) size*(4 + l.classes + 1)*sizeof(float));
+            activate_array(l.output + offset, 2*size, LOGISTIC);
+            activate_array(l.output + offset + 4*size,
+                           (1 + l.classes)*size, LOGISTIC);
+        }
+    });
+}
+
+// Copy `n` values on the thread pool
+static void parallel_copy(int n, const float *src, float *dst)
+{
+    parallel_for(n, COPY_GRAIN, [&](int first, int last) {
+        memcpy(dst + first, src + first, (size_t) (last - first)*sizeof(float));
+    });
+}
+
+// Forward function of the shortcut layers fused into the preceding
+// convolution, whose output they share
+static void forward_fused_layer(layer l, network net)
+{
+}
+
+// Forward function of the route layers. Mirrors `forward_route_layer()`,
+// skipping the inputs already written in place
+static void forward_route_layer_fused(layer l, network net)
+{
+    int i, j;
+    int offset = 0;
+
+    for (i = 0; i < l.n; i++) {
+        float *input = net.layers[l.input_layers[i]].output;
+        int input_size = l.input_sizes[i];
+        for (j = 0; j < l.batch; j++) {
+            float *src = input + j*input_size;
+            float *dst = l.output + offset + j*l.outputs;
+            if (src != dst)
+                parallel_copy(input_size, src, dst);
+        }
+        offset += input_size;
+    }
+}
+
+// Number of layers reading the output of a layer, besides the next one
+static int count_readers(network *net, int index)
+{
+    int i, j;
+    int readers = 0;
+
+    for (i = 0; i < net->n; i++) {
+        layer *l = &net->layers[i];
+        if (l->type == SHORTCUT && l->index == index)
+            readers++;
+        if (l->type == ROUTE)
+            for (j = 0; j < l->n; j++)
+                readers += l->input_layers[j] == index;
+    }
+    return readers;
+}
+
+// Point every layer sharing an output buffer at another one
+static void move_output(network *net, float *from, float *to)
+{
+    int i;
+
+    for (i = 0; i < net->n; i++)
+        if (net->layers[i].output == from)
+            net->layers[i].output = to;
+    free(from);
+}
+
+// Fuse the shortcut layer following a convolution into it, when the
+// convolution's output isn't read by any other layer
+static bool fuse_shortcut(network *net, int i)
+{
+    layer *conv = &net->layers[i];
+    layer *s = &net->layers[i + 1];
+    layer *from = &net->layers[s->index];
+
+    if (s->type != SHORTCUT || s->activation != LINEAR
+        || s->index == i || count_readers(net, i) > 0
+        || from->out_w != conv->out_w || from->out_h != conv->out_h
+        || from->out_c != conv->out_c || s->outputs != conv->outputs)
+        return false;
+
+    conv->shortcut = i + 1;
+    s->forward = forward_fused_layer;
+    move_output(net, s->output, conv->output);
+    return true;
+}
+
+// Make the input layers of a route layer write directly into its output
+static bool fuse_route(network *net, int i, bool *has_aliases)
+{
+    int j, k;
+    layer *route = &net->layers[i];
+    int offset = 0;
+    bool fused = false;
+
+    if (route->n == 1) {
+        layer *in = &net->layers[route->input_layers[0]];
+        move_output(net, route->output, in->output);
+        has_aliases[i] = has_aliases[route->input_layers[0]];
+        route->forward = forward_fused_layer;
+        return true;
+    }
+
+    // Inputs are laid out back to back for each batch entry, which only
+    // matches their own layout when the batch size is 1
+    if (net->batch == 1) {
+        for (j = 0; j < route->n; j++) {
+            int index = route->input_layers[j];
+            float *output = net->layers[index].output;
+            bool movable = !has_aliases[index];
+            for (k = 0; k < j && movable; k++)
+                movable = net->layers[route->input_layers[k]].output != output;
+            // Buffers already moved into a route belong to it
+            for (k = 0; k < net->n && movable; k++)
+                movable = !has_aliases[k] || net->layers[k].output > output
+                          || net->layers[k].output + net->layers[k].outputs
+                             <= output;
+            if (movable) {
+                move_output(net, output, route->output + offset);
+                fused = true;
+            }
+            offset += route->input_sizes[j];
+        }
+    }
+    has_aliases[i] = fused;
+    route->forward = forward_route_layer_fused;
+    return fused;
+}
+
+/* Apply the inference-only optimizations to the model. Must be called once
+ * the network has its final batch size
+ * Input:
+ *   - network
+ *   - whether to print what was optimized
+ * Output: None
+ */
+void optimize_network(network *net, bool print_summary)
+{
+    int i;
+    int folded, fused_convs = 0, fused_shortcut_count = 0;
+    int fused_routes = 0, parallel_layers = 0;
+    bool *has_aliases = (bool *) calloc(net->n, sizeof(bool));
+
+    folded = fold_batchnorm(net);
+
+    for (i = 0; i < net->n; i++) {
+        layer *l = &net->layers[i];
+        if (l->type == CONVOLUTIONAL && !l->batch_normalize && !l->binary
+            && !l->xnor) {
+            l->forward = forward_convolutional_layer_fused;
+            fused_convs++;
+            if (i + 1 < net->n && fuse_shortcut(net, i))
+                fused_shortcut_count++;
+        } else if (l->type == ROUTE) {
+            fused_routes += fuse_route(net, i, has_aliases);
+        } else if (l->type == MAXPOOL) {
+            l->forward = forward_maxpool_layer_parallel;
+            parallel_layers++;
+        } else if (l->type == UPSAMPLE && !l->reverse) {
+            l->forward = forward_upsample_layer_parallel;
+            parallel_layers++;
+        } else if (l->type == YOLO) {
+            l->forward = forward_yolo_layer_parallel;
+            parallel_layers++;
+        }
+    }
+    free(has_aliases);
+
+    if (print_summary)
+        printf("Network optimized: batch normalization folded into %d layers, %d convolutions fused with their bias and activation, %d shortcut layers and %d route layers fused, %d other layers split over %d threads\n",
+               folded, fused_convs, fused_shortcut_count, fused_routes,
+               parallel_layers, thread_pool_size());
+}
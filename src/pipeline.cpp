@@ -0,0 +1,147 @@
+/*
+This file implements the pipelined detection mode.
+The decoder thread copies each decoded frame into a bounded queue and
+returns to decoding immediately. Three stages, each running on its own
+thread, then process the frames:
+  1 - Preparation: conversion of the frame into the model's input
+  2 - Prediction: network inference and extraction of the detection boxes,
+      possibly over a batch of frames
+  3 - Output: non-maximum suppression, printing, drawing and saving
+Stages are connected by bounded queues, so a slow stage blocks the upstream
+ones instead of letting frames pile up in memory. Each stage processes frames
+in FIFO order on a single thread, which preserves the frame order in the
+output. A null job marks the end of the stream.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+extern "C"
+{
+    #include "darknet.h"
+}
+#include "codec_def.h"
+#include "utils.h"
+#include "detector.h"
+#include "pipeline.h"
+#include "pool.h"
+
+#ifdef HAVE_THREADS
+
+#include "bounded_queue.h"
+
+#include <thread>
+
+static detector_options *pipeline_options;
+static bounded_queue<frame_job *> *decoded_frames;
+static bounded_queue<frame_job *> *prepared_frames;
+static bounded_queue<frame_job *> *predicted_frames;
+static std::thread prepare_thread, predict_thread, output_thread;
+
+static void prepare_stage()
+{
+    frame_job *job;
+
+    while ((job = decoded_frames->pop())) {
+        prepare_frame(job, job->yuv, pipeline_options);
+        free_yuv_frame(job->yuv);
+        job->yuv = NULL;
+        prepared_frames->push(job);
+    }
+    prepared_frames->push(NULL);
+}
+
+// Gather up to a full batch of frames before running the network. The end of
+// the stream flushes the last, possibly partial, batch
+static void predict_stage()
+{
+    int i, n;
+    frame_job *jobs[net->batch];
+    bool done = false;
+
+    while (!done) {
+        for (n = 0; n < net->batch; n++) {
+            if (!(jobs[n] = prepared_frames->pop())) {
+                done = true;
+                break;
+            }
+        }
+        if (n > 0)
+            predict_frames(jobs, n, pipeline_options);
+        for (i = 0; i < n; i++)
+            predicted_frames->push(jobs[i]);
+    }
+    predicted_frames->push(NULL);
+}
+
+static void output_stage()
+{
+    frame_job *job;
+
+    while ((job = predicted_frames->pop())) {
+        if (!pipeline_options->detection_sink) {
+            printf("Image %d ===========================\n", job->index);
+            printf("Prediction duration: %lf seconds\n",
+                   job->prediction_duration);
+        }
+        output_frame(job, pipeline_options);
+        pool_free(job);
+    }
+}
+
+/* Start the pipeline stages
+ * Input:
+ *   - detection parameters
+ *   - capacity of each inter-stage queue
+ * Output: None
+ */
+void start_pipeline(detector_options *options, int queue_depth)
+{
+    pipeline_options = options;
+    decoded_frames = new bounded_queue<frame_job *>(queue_depth);
+    prepared_frames = new bounded_queue<frame_job *>(queue_depth);
+    predicted_frames = new bounded_queue<frame_job *>(queue_depth);
+
+    prepare_thread = std::thread(prepare_stage);
+    predict_thread = std::thread(predict_stage);
+    output_thread = std::thread(output_stage);
+}
+
+/* Hand a decoded frame over to the pipeline. Block while the pipeline is full
+ * Input:
+ *   - OpenH264's I420 frame buffer, copied before returning
+ *   - frame number
+ *   - whether the detections of the previous processed frame are reused
+ * Output: None
+ */
+void push_pipeline_frame(SBufferInfo *bufInfo, int index,
+                         bool reuse_detections)
+{
+    frame_job *job = (frame_job *) pool_calloc(1, sizeof(frame_job));
+
+    job->index = index;
+    job->reuse_detections = reuse_detections;
+    job->yuv = copy_yuv_frame(bufInfo);
+    decoded_frames->push(job);
+}
+
+/* Flush the pipeline and wait for every stage to terminate */
+void finish_pipeline()
+{
+    decoded_frames->push(NULL);
+    prepare_thread.join();
+    predict_thread.join();
+    output_thread.join();
+
+    delete decoded_frames;
+    delete prepared_frames;
+    delete predicted_frames;
+}
+
+#endif
@@ -0,0 +1,275 @@
+/*
+This file implements the frame buffer pool.
+Every frame needs the same buffers: the decoded frame copy, the RGB image,
+the model input, the detection array... Allocating and freeing them for each
+frame churns the allocator with large blocks, which on WebAssembly fragments
+and grows the linear memory, which never shrinks.
+Freed buffers are instead kept on free lists, one per size class, and handed
+out again to the next request of the same class. The pool thus sizes itself
+from the first frames (frame dimensions, model input, number of boxes) and
+stops allocating once every buffer in flight has been recycled.
+Size classes split each power of two into 8 steps, so that buffers whose
+size varies from frame to frame (detections) are recycled too, while wasting
+at most 1/8 of each buffer.
+Buffers allocated outside of the pool escape its statistics. Native Linux
+builds thus wrap the system allocator (`-Wl,--wrap=malloc`, with
+`COUNT_MALLOC` defined) to count every call to `malloc()`, `calloc()` and
+`realloc()` made in steady state as well.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+extern "C"
+{
+    #include "darknet.h"
+}
+#include "codec_def.h"
+#include "utils.h"
+#include "pool.h"
+
+#include <string.h>
+#ifdef HAVE_THREADS
+#include <mutex>
+#endif
+#if defined(COUNT_MALLOC)
+#include <atomic>
+#endif
+
+// Smallest size class
+#define POOL_MIN_SIZE 64
+#define POOL_CLASSES (8*8*sizeof(size_t))
+
+/* Header of each pooled buffer, keeping the data 16-byte aligned for the SIMD
+ * kernels */
+typedef struct alignas(16) pool_block {
+    // Size class index
+    size_t size_class;
+    // Next free buffer of the same class, when on a free list
+    struct pool_block *next;
+} pool_block;
+
+static pool_block *free_lists[POOL_CLASSES];
+#ifdef HAVE_THREADS
+// Buffers are allocated and freed by different pipeline stages
+static std::mutex pool_mutex;
+#endif
+
+/* Statistics */
+static long requests;
+static long allocations;
+static long steady_allocations;
+static double allocated_bytes;
+static int frame = -1;
+static int last_allocation_frame = -1;
+static int warmup_frames = 1;
+#if defined(COUNT_MALLOC)
+static std::atomic<long> malloc_calls;
+// Calls made before the end of the warmup, and before the current frame
+static long warmup_malloc_calls = -1;
+static long frame_malloc_calls;
+
+extern "C"
+{
+    void *__real_malloc(size_t size);
+    void *__real_calloc(size_t num, size_t size);
+    void *__real_realloc(void *ptr, size_t size);
+
+    void *__wrap_malloc(size_t size)
+    {
+        malloc_calls.fetch_add(1, std::memory_order_relaxed);
+        return __real_malloc(size);
+    }
+
+    void *__wrap_calloc(size_t num, size_t size)
+    {
+        malloc_calls.fetch_add(1, std::memory_order_relaxed);
+        return __real_calloc(num, size);
+    }
+
+    void *__wrap_realloc(void *ptr, size_t size)
+    {
+        malloc_calls.fetch_add(1, std::memory_order_relaxed);
+        return __real_realloc(ptr, size);
+    }
+}
+#endif
+
+// Size class of a request, and the size of the buffers of that class
+static size_t get_size_class(size_t size, size_t *class_size)
+{
+    if (size <= POOL_MIN_SIZE) {
+        *class_size = POOL_MIN_SIZE;
+        return 0;
+    }
+
+    // Size in (2^b, 2^(b+1)], rounded up to a multiple of 2^(b-3)
+    int b = 8*sizeof(unsigned long) - 1 - __builtin_clzl(size - 1);
+    size_t step = (size_t) 1 << (b - 3);
+    size_t steps = (size + step - 1) / step;
+    *class_size = steps*step;
+    return (b - 6)*8 + steps - 8;
+}
+
+/* Set the number of frames that can be in flight at once. Allocations made
+ * past this many frames are counted as steady-state allocations
+ * Input: number of frames processed concurrently (batch, pipeline queues)
+ * Output: None
+ */
+void init_frame_pool(int frames_in_flight)
+{
+    warmup_frames = frames_in_flight;
+}
+
+/* Mark the start of a new frame, for the statistics */
+void pool_next_frame()
+{
+#ifdef HAVE_THREADS
+    std::lock_guard<std::mutex> lock(pool_mutex);
+#endif
+    frame++;
+#if defined(COUNT_MALLOC)
+    frame_malloc_calls = malloc_calls.load(std::memory_order_relaxed);
+    if (frame == warmup_frames)
+        warmup_malloc_calls = frame_malloc_calls;
+#endif
+}
+
+/* Get a buffer from the pool, allocating it if none of its size class is free
+ * Input: size in bytes
+ * Output: buffer, 16-byte aligned and uninitialized
+ */
+void *pool_alloc(size_t size)
+{
+    size_t class_size;
+    size_t size_class = get_size_class(size, &class_size);
+    pool_block *block;
+
+    {
+#ifdef HAVE_THREADS
+        std::lock_guard<std::mutex> lock(pool_mutex);
+#endif
+        requests++;
+        block = free_lists[size_class];
+        if (block) {
+            free_lists[size_class] = block->next;
+            return block + 1;
+        }
+        allocations++;
+        allocated_bytes += class_size;
+        last_allocation_frame = frame;
+        if (frame >= warmup_frames)
+            steady_allocations++;
+    }
+
+    block = (pool_block *) malloc(sizeof(pool_block) + class_size);
+    if (!block) {
+        printf("Couldn't allocate %zu bytes\n", class_size);
+        exit(1);
+    }
+    block->size_class = size_class;
+    return block + 1;
+}
+
+/* Get a zeroed buffer from the pool
+ * Input:
+ *   - number of elements
+ *   - element size in bytes
+ * Output: buffer
+ */
+void *pool_calloc(size_t num, size_t size)
+{
+    void *ptr = pool_alloc(num*size);
+    memset(ptr, 0, num*size);
+    return ptr;
+}
+
+/* Give a buffer back to the pool
+ * Input: buffer returned by `pool_alloc()`, or NULL
+ * Output: None
+ */
+void pool_free(void *ptr)
+{
+    if (!ptr)
+        return;
+    pool_block *block = (pool_block *) ptr - 1;
+#ifdef HAVE_THREADS
+    std::lock_guard<std::mutex> lock(pool_mutex);
+#endif
+    block->next = free_lists[block->size_class];
+    free_lists[block->size_class] = block;
+}
+
+/* Make a Darknet image from the pool
+ * Input: width, height and number of channels
+ * Output: image, uninitialized
+ */
+image make_pooled_image(int w, int h, int c)
+{
+    image im;
+
+    im.w = w;
+    im.h = h;
+    im.c = c;
+    im.data = (float *) pool_alloc((size_t) w*h*c*sizeof(float));
+    return im;
+}
+
+void free_pooled_image(image im)
+{
+    pool_free(im.data);
+}
+
+/* Make a detection array from the pool, like darknet's
+ * `make_network_boxes()`. Probabilities and masks are zeroed and follow the
+ * array in the same buffer
+ * Input:
+ *   - number of detections
+ *   - number of classes
+ *   - number of mask coefficients, 0 for none
+ * Output: detections
+ */
+detection *make_pooled_detections(int num, int classes, int nmask)
+{
+    int i;
+    size_t size = num*sizeof(detection)
+                  + (size_t) num*(classes + nmask)*sizeof(float);
+    detection *dets = (detection *) pool_calloc(1, size);
+    float *values = (float *) (dets + num);
+
+    for (i = 0; i < num; i++) {
+        dets[i].classes = classes;
+        dets[i].prob = values + (size_t) i*classes;
+        if (nmask)
+            dets[i].mask = values + (size_t) num*classes + (size_t) i*nmask;
+    }
+    return dets;
+}
+
+void free_pooled_detections(detection *dets)
+{
+    pool_free(dets);
+}
+
+/* Print the pool statistics: once warm, neither the pool nor the rest of
+ * the program should allocate anymore */
+void print_pool_stats()
+{
+    printf("Frame pool: %ld buffers served, %ld allocated (%.1f MiB), %ld steady-state allocations after frame %d, last allocation on frame %d of %d\n",
+           requests, allocations, allocated_bytes / (1 << 20),
+           steady_allocations, warmup_frames, last_allocation_frame,
+           frame + 1);
+#if defined(COUNT_MALLOC)
+    // Up to the start of the last frame, leaving out the teardown
+    if (warmup_malloc_calls >= 0)
+        printf("System allocator: %ld calls to malloc, calloc and realloc from frame %d to frame %d, the pool's included\n",
+               frame_malloc_calls - warmup_malloc_calls, warmup_frames,
+               frame);
+#endif
+}
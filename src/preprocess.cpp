@@ -0,0 +1,457 @@
+/*
+This file provides the fused frame preprocessing kernel.
+The legacy path linearizes the OpenH264 frame buffer, upsamples the chroma
+planes, converts the whole frame to RGB, converts it to floats and finally
+letterboxes it with `letterbox_image()`, i.e. four full-resolution passes and
+as many full-resolution allocations.
+The kernel below only touches the source rows needed by the bilinear resize
+and produces the network input directly:
+  1 - Convert a source row from I420 to RGB (SIMD where available)
+  2 - Resample it horizontally to the letterboxed width (cached per row)
+  3 - Blend two resampled rows vertically into the output tensor
+The arithmetic mirrors `stbi__YCbCr_to_RGB_row()` and Darknet's
+`resize_image()` and `letterbox_image()`.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+Based on darknet, YOLO LICENSE https://github.com/pjreddie/darknet/blob/master/LICENSE
+*/
+
+#include <string.h>
+
+extern "C" {
+    #include "image.h"
+}
+#include "codec_def.h"
+#include "utils.h"
+#include "preprocess.h"
+#include "pool.h"
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#elif defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#endif
+
+#define stbi__float2fixed(x)  (((int) ((x) * 4096.0f + 0.5f)) << 8)
+
+// Convert one row of I420 pixels to planar RGB bytes (R, G and B rows of `w`
+// bytes each, stored back to back). Chroma samples are used twice
+typedef void (*yuv_row_fn)(const unsigned char *y, const unsigned char *cb,
+                           const unsigned char *cr, int w, unsigned char *rgb);
+
+// Blend two resampled rows: `out = (1 - dy) * p0 + dy * p1`
+typedef void (*blend_row_fn)(const float *p0, const float *p1, float dy, int n,
+                             float *out);
+
+static void yuv_row_scalar(const unsigned char *y, const unsigned char *cb,
+                           const unsigned char *cr, int w, unsigned char *rgb)
+{
+    int i;
+    for (i = 0; i < w; i++) {
+        int y_fixed = (y[i] << 20) + (1<<19); // rounding
+        int r, g, b;
+        int vcr = cr[i/2] - 128;
+        int vcb = cb[i/2] - 128;
+        r = y_fixed + vcr * stbi__float2fixed(1.40200f);
+        g = y_fixed + (vcr * -stbi__float2fixed(0.71414f))
+            + ((vcb * -stbi__float2fixed(0.34414f)) & 0xffff0000);
+        b = y_fixed + vcb * stbi__float2fixed(1.77200f);
+        r >>= 20;
+        g >>= 20;
+        b >>= 20;
+        if ((unsigned) r > 255) { if (r < 0) r = 0; else r = 255; }
+        if ((unsigned) g > 255) { if (g < 0) g = 0; else g = 255; }
+        if ((unsigned) b > 255) { if (b < 0) b = 0; else b = 255; }
+        rgb[i] = (unsigned char)r;
+        rgb[i + w] = (unsigned char)g;
+        rgb[i + w*2] = (unsigned char)b;
+    }
+}
+
+static void blend_row_scalar(const float *p0, const float *p1, float dy, int n,
+                             float *out)
+{
+    int i;
+    for (i = 0; i < n; i++)
+        out[i] = (1 - dy) * p0[i] + dy * p1[i];
+}
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+static inline __m128i load_u8x4_epi32(const unsigned char *p)
+{
+    int v;
+    memcpy(&v, p, 4);
+    return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(v));
+}
+
+// Saturate two vectors of 4 32-bit integers to 8 unsigned bytes, which
+// matches the clamping of the scalar path
+static inline void store_u8x8(unsigned char *p, __m128i lo, __m128i hi)
+{
+    __m128i v = _mm_packs_epi32(lo, hi);
+    _mm_storel_epi64((__m128i *) p, _mm_packus_epi16(v, v));
+}
+#endif
+
+#if defined(__AVX2__)
+static void yuv_row_simd(const unsigned char *y, const unsigned char *cb,
+                         const unsigned char *cr, int w, unsigned char *rgb)
+{
+    const __m256i round = _mm256_set1_epi32(1 << 19);
+    const __m256i bias = _mm256_set1_epi32(128);
+    const __m256i k_r_cr = _mm256_set1_epi32(stbi__float2fixed(1.40200f));
+    const __m256i k_g_cr = _mm256_set1_epi32(-stbi__float2fixed(0.71414f));
+    const __m256i k_g_cb = _mm256_set1_epi32(-stbi__float2fixed(0.34414f));
+    const __m256i k_b_cb = _mm256_set1_epi32(stbi__float2fixed(1.77200f));
+    const __m256i mask = _mm256_set1_epi32((int) 0xffff0000);
+    const __m256i dup = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+    int i;
+
+    for (i = 0; i + 8 <= w; i += 8) {
+        __m256i vy = _mm256_cvtepu8_epi32(
+            _mm_loadl_epi64((const __m128i *) (y + i)));
+        __m256i vcb = _mm256_permutevar8x32_epi32(
+            _mm256_castsi128_si256(load_u8x4_epi32(cb + i/2)), dup);
+        __m256i vcr = _mm256_permutevar8x32_epi32(
+            _mm256_castsi128_si256(load_u8x4_epi32(cr + i/2)), dup);
+        vcb = _mm256_sub_epi32(vcb, bias);
+        vcr = _mm256_sub_epi32(vcr, bias);
+
+        __m256i y_fixed = _mm256_add_epi32(_mm256_slli_epi32(vy, 20), round);
+        __m256i r = _mm256_add_epi32(y_fixed, _mm256_mullo_epi32(vcr, k_r_cr));
+        __m256i g = _mm256_add_epi32(
+            _mm256_add_epi32(y_fixed, _mm256_mullo_epi32(vcr, k_g_cr)),
+            _mm256_and_si256(_mm256_mullo_epi32(vcb, k_g_cb), mask));
+        __m256i b = _mm256_add_epi32(y_fixed, _mm256_mullo_epi32(vcb, k_b_cb));
+        r = _mm256_srai_epi32(r, 20);
+        g = _mm256_srai_epi32(g, 20);
+        b = _mm256_srai_epi32(b, 20);
+
+        store_u8x8(rgb + i, _mm256_castsi256_si128(r),
+                   _mm256_extracti128_si256(r, 1));
+        store_u8x8(rgb + i + w, _mm256_castsi256_si128(g),
+                   _mm256_extracti128_si256(g, 1));
+        store_u8x8(rgb + i + w*2, _mm256_castsi256_si128(b),
+                   _mm256_extracti128_si256(b, 1));
+    }
+
+    // Tail. Chroma is indexed from the start of the row, hence the offsets
+    if (i < w) {
+        unsigned char tail[3*8];
+        yuv_row_scalar(y + i, cb + i/2, cr + i/2, w - i, tail);
+        memcpy(rgb + i, tail, w - i);
+        memcpy(rgb + i + w, tail + (w - i), w - i);
+        memcpy(rgb + i + w*2, tail + 2*(w - i), w - i);
+    }
+}
+
+static void blend_row_simd(const float *p0, const float *p1, float dy, int n,
+                           float *out)
+{
+    const __m256 a = _mm256_set1_ps(1 - dy);
+    const __m256 b = _mm256_set1_ps(dy);
+    int i;
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_add_ps(_mm256_mul_ps(a, _mm256_loadu_ps(p0 + i)),
+                                 _mm256_mul_ps(b, _mm256_loadu_ps(p1 + i)));
+        _mm256_storeu_ps(out + i, v);
+    }
+    blend_row_scalar(p0 + i, p1 + i, dy, n - i, out + i);
+}
+#elif defined(__SSE4_1__)
+static void yuv_row_simd(const unsigned char *y, const unsigned char *cb,
+                         const unsigned char *cr, int w, unsigned char *rgb)
+{
+    const __m128i round = _mm_set1_epi32(1 << 19);
+    const __m128i bias = _mm_set1_epi32(128);
+    const __m128i k_r_cr = _mm_set1_epi32(stbi__float2fixed(1.40200f));
+    const __m128i k_g_cr = _mm_set1_epi32(-stbi__float2fixed(0.71414f));
+    const __m128i k_g_cb = _mm_set1_epi32(-stbi__float2fixed(0.34414f));
+    const __m128i k_b_cb = _mm_set1_epi32(stbi__float2fixed(1.77200f));
+    const __m128i mask = _mm_set1_epi32((int) 0xffff0000);
+    int i, k;
+
+    for (i = 0; i + 8 <= w; i += 8) {
+        __m128i vy8 = _mm_loadl_epi64((const __m128i *) (y + i));
+        __m128i vcb4 = _mm_sub_epi32(load_u8x4_epi32(cb + i/2), bias);
+        __m128i vcr4 = _mm_sub_epi32(load_u8x4_epi32(cr + i/2), bias);
+        __m128i r[2], g[2], b[2];
+
+        // Two halves of 4 pixels, each using 2 chroma samples twice
+        for (k = 0; k < 2; k++) {
+            __m128i vy = _mm_cvtepu8_epi32(k ? _mm_srli_si128(vy8, 4) : vy8);
+            __m128i vcb = k ? _mm_unpackhi_epi32(vcb4, vcb4)
+                            : _mm_unpacklo_epi32(vcb4, vcb4);
+            __m128i vcr = k ? _mm_unpackhi_epi32(vcr4, vcr4)
+                            : _mm_unpacklo_epi32(vcr4, vcr4);
+            __m128i y_fixed = _mm_add_epi32(_mm_slli_epi32(vy, 20), round);
+            r[k] = _mm_add_epi32(y_fixed, _mm_mullo_epi32(vcr, k_r_cr));
+            g[k] = _mm_add_epi32(
+                _mm_add_epi32(y_fixed, _mm_mullo_epi32(vcr, k_g_cr)),
+                _mm_and_si128(_mm_mullo_epi32(vcb, k_g_cb), mask));
+            b[k] = _mm_add_epi32(y_fixed, _mm_mullo_epi32(vcb, k_b_cb));
+            r[k] = _mm_srai_epi32(r[k], 20);
+            g[k] = _mm_srai_epi32(g[k], 20);
+            b[k] = _mm_srai_epi32(b[k], 20);
+        }
+
+        store_u8x8(rgb + i, r[0], r[1]);
+        store_u8x8(rgb + i + w, g[0], g[1]);
+        store_u8x8(rgb + i + w*2, b[0], b[1]);
+    }
+
+    if (i < w) {
+        unsigned char tail[3*8];
+        yuv_row_scalar(y + i, cb + i/2, cr + i/2, w - i, tail);
+        memcpy(rgb + i, tail, w - i);
+        memcpy(rgb + i + w, tail + (w - i), w - i);
+        memcpy(rgb + i + w*2, tail + 2*(w - i), w - i);
+    }
+}
+
+static void blend_row_simd(const float *p0, const float *p1, float dy, int n,
+                           float *out)
+{
+    const __m128 a = _mm_set1_ps(1 - dy);
+    const __m128 b = _mm_set1_ps(dy);
+    int i;
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m128 v = _mm_add_ps(_mm_mul_ps(a, _mm_loadu_ps(p0 + i)),
+                              _mm_mul_ps(b, _mm_loadu_ps(p1 + i)));
+        _mm_storeu_ps(out + i, v);
+    }
+    blend_row_scalar(p0 + i, p1 + i, dy, n - i, out + i);
+}
+#elif defined(__wasm_simd128__)
+static inline v128_t load_u8x4_i32x4(const unsigned char *p)
+{
+    int v;
+    memcpy(&v, p, 4);
+    return wasm_u32x4_extend_low_u16x8(
+        wasm_u16x8_extend_low_u8x16(wasm_i32x4_make(v, 0, 0, 0)));
+}
+
+static inline void store_u8x8(unsigned char *p, v128_t lo, v128_t hi)
+{
+    v128_t v = wasm_i16x8_narrow_i32x4(lo, hi);
+    long long bytes = wasm_i64x2_extract_lane(wasm_u8x16_narrow_i16x8(v, v), 0);
+    memcpy(p, &bytes, 8);
+}
+
+static void yuv_row_simd(const unsigned char *y, const unsigned char *cb,
+                         const unsigned char *cr, int w, unsigned char *rgb)
+{
+    const v128_t round = wasm_i32x4_splat(1 << 19);
+    const v128_t bias = wasm_i32x4_splat(128);
+    const v128_t k_r_cr = wasm_i32x4_splat(stbi__float2fixed(1.40200f));
+    const v128_t k_g_cr = wasm_i32x4_splat(-stbi__float2fixed(0.71414f));
+    const v128_t k_g_cb = wasm_i32x4_splat(-stbi__float2fixed(0.34414f));
+    const v128_t k_b_cb = wasm_i32x4_splat(stbi__float2fixed(1.77200f));
+    const v128_t mask = wasm_i32x4_splat((int) 0xffff0000);
+    int i, k;
+
+    for (i = 0; i + 8 <= w; i += 8) {
+        long long y8;
+        memcpy(&y8, y + i, 8);
+        v128_t vy16 = wasm_u16x8_extend_low_u8x16(wasm_i64x2_make(y8, 0));
+        v128_t vcb4 = wasm_i32x4_sub(load_u8x4_i32x4(cb + i/2), bias);
+        v128_t vcr4 = wasm_i32x4_sub(load_u8x4_i32x4(cr + i/2), bias);
+        v128_t r[2], g[2], b[2];
+
+        for (k = 0; k < 2; k++) {
+            v128_t vy = k ? wasm_u32x4_extend_high_u16x8(vy16)
+                          : wasm_u32x4_extend_low_u16x8(vy16);
+            v128_t vcb = k ? wasm_i32x4_shuffle(vcb4, vcb4, 2, 2, 3, 3)
+                           : wasm_i32x4_shuffle(vcb4, vcb4, 0, 0, 1, 1);
+            v128_t vcr = k ? wasm_i32x4_shuffle(vcr4, vcr4, 2, 2, 3, 3)
+                           : wasm_i32x4_shuffle(vcr4, vcr4, 0, 0, 1, 1);
+            v128_t y_fixed = wasm_i32x4_add(wasm_i32x4_shl(vy, 20), round);
+            r[k] = wasm_i32x4_add(y_fixed, wasm_i32x4_mul(vcr, k_r_cr));
+            g[k] = wasm_i32x4_add(
+                wasm_i32x4_add(y_fixed, wasm_i32x4_mul(vcr, k_g_cr)),
+                wasm_v128_and(wasm_i32x4_mul(vcb, k_g_cb), mask));
+            b[k] = wasm_i32x4_add(y_fixed, wasm_i32x4_mul(vcb, k_b_cb));
+            r[k] = wasm_i32x4_shr(r[k], 20);
+            g[k] = wasm_i32x4_shr(g[k], 20);
+            b[k] = wasm_i32x4_shr(b[k], 20);
+        }
+
+        store_u8x8(rgb + i, r[0], r[1]);
+        store_u8x8(rgb + i + w, g[0], g[1]);
+        store_u8x8(rgb + i + w*2, b[0], b[1]);
+    }
+
+    if (i < w) {
+        unsigned char tail[3*8];
+        yuv_row_scalar(y + i, cb + i/2, cr + i/2, w - i, tail);
+        memcpy(rgb + i, tail, w - i);
+        memcpy(rgb + i + w, tail + (w - i), w - i);
+        memcpy(rgb + i + w*2, tail + 2*(w - i), w - i);
+    }
+}
+
+static void blend_row_simd(const float *p0, const float *p1, float dy, int n,
+                           float *out)
+{
+    const v128_t a = wasm_f32x4_splat(1 - dy);
+    const v128_t b = wasm_f32x4_splat(dy);
+    int i;
+    for (i = 0; i + 4 <= n; i += 4) {
+        v128_t v = wasm_f32x4_add(wasm_f32x4_mul(a, wasm_v128_load(p0 + i)),
+                                  wasm_f32x4_mul(b, wasm_v128_load(p1 + i)));
+        wasm_v128_store(out + i, v);
+    }
+    blend_row_scalar(p0 + i, p1 + i, dy, n - i, out + i);
+}
+#else
+#define yuv_row_simd yuv_row_scalar
+#define blend_row_simd blend_row_scalar
+#endif
+
+// Convert source row `src_y` to RGB and resample it horizontally to `new_w`
+// pixels, as the first pass of `resize_image()` does
+static void resample_row(SBufferInfo *bufInfo, int src_y, int new_w,
+                         const int *ix, const float *fx, const float *lut,
+                         yuv_row_fn yuv_row, unsigned char *rgb, float *dst)
+{
+    int i, k;
+    int src_w = bufInfo->UsrData.sSystemBuffer.iWidth;
+    int stride0 = bufInfo->UsrData.sSystemBuffer.iStride[0];
+    int stride1 = bufInfo->UsrData.sSystemBuffer.iStride[1];
+
+    yuv_row(bufInfo->pDst[0] + src_y*stride0,
+            bufInfo->pDst[1] + (src_y/2)*stride1,
+            bufInfo->pDst[2] + (src_y/2)*stride1, src_w, rgb);
+
+    for (k = 0; k < CHANNELS; k++) {
+        const unsigned char *src = rgb + k*src_w;
+        for (i = 0; i < new_w; i++) {
+            int x = ix[i];
+            if (fx[i] == 0)
+                dst[i] = lut[src[x]];
+            else
+                dst[i] = (1 - fx[i]) * lut[src[x]] + fx[i] * lut[src[x + 1]];
+        }
+        dst += new_w;
+    }
+}
+
+// Fused I420 to letterboxed tensor conversion, parameterized by the row
+// kernels.
+// Two resampled rows are cached since consecutive output rows mostly share
+// their source rows
+static void letterbox_yuv420_impl(SBufferInfo *bufInfo, int w, int h,
+                                  float *out, yuv_row_fn yuv_row,
+                                  blend_row_fn blend_row)
+{
+    int i, k, r;
+    int src_w = bufInfo->UsrData.sSystemBuffer.iWidth;
+    int src_h = bufInfo->UsrData.sSystemBuffer.iHeight;
+    int new_w = src_w;
+    int new_h = src_h;
+    float lut[256];
+
+    // Same geometry as `letterbox_image()`
+    if (((float)w/src_w) < ((float)h/src_h)) {
+        new_w = w;
+        new_h = (src_h * w)/src_w;
+    } else {
+        new_h = h;
+        new_w = (src_w * h)/src_h;
+    }
+    int off_x = (w - new_w)/2;
+    int off_y = (h - new_h)/2;
+    float w_scale = new_w > 1 ? (float)(src_w - 1) / (new_w - 1) : 0;
+    float h_scale = new_h > 1 ? (float)(src_h - 1) / (new_h - 1) : 0;
+
+    for (i = 0; i < 256; i++)
+        lut[i] = (float)i/255.;
+
+    unsigned char *rgb = (unsigned char *) pool_alloc(src_w*CHANNELS);
+    float *part = (float *) pool_alloc(2*new_w*CHANNELS*sizeof(float));
+    int *ix = (int *) pool_alloc(new_w*sizeof(int));
+    float *fx = (float *) pool_alloc(new_w*sizeof(float));
+    int cached[2] = {-1, -1};
+
+    // Horizontal sampling positions, as in `resize_image()`
+    for (i = 0; i < new_w; i++) {
+        if (i == new_w - 1 || src_w == 1) {
+            ix[i] = src_w - 1;
+            fx[i] = 0;
+        } else {
+            float sx = i*w_scale;
+            ix[i] = (int) sx;
+            fx[i] = sx - ix[i];
+        }
+    }
+
+    // Letterbox padding
+    for (i = 0; i < w*h*CHANNELS; i++)
+        out[i] = .5;
+
+    for (r = 0; r < new_h; r++) {
+        float sy = r*h_scale;
+        int iy = (int) sy;
+        float dy = sy - iy;
+        int taps = (r == new_h - 1 || src_h == 1) ? 1 : 2;
+        int rows[2] = {iy, iy + 1 < src_h ? iy + 1 : iy};
+        float *p[2];
+
+        for (k = 0; k < taps; k++) {
+            int slot;
+            if (cached[0] == rows[k]) {
+                slot = 0;
+            } else if (cached[1] == rows[k]) {
+                slot = 1;
+            } else {
+                // Don't evict the row needed by the other tap
+                int keep = rows[1 - k];
+                slot = (taps == 2 && cached[0] == keep) ? 1 : 0;
+                cached[slot] = rows[k];
+                resample_row(bufInfo, rows[k], new_w, ix, fx, lut, yuv_row,
+                             rgb, part + slot*new_w*CHANNELS);
+            }
+            p[k] = part + slot*new_w*CHANNELS;
+        }
+
+        for (k = 0; k < CHANNELS; k++) {
+            float *dst = out + k*w*h + (r + off_y)*w + off_x;
+            if (taps == 1) {
+                for (i = 0; i < new_w; i++)
+                    dst[i] = (1 - dy) * p[0][k*new_w + i];
+            } else {
+                blend_row(p[0] + k*new_w, p[1] + k*new_w, dy, new_w, dst);
+            }
+        }
+    }
+
+    pool_free(fx);
+    pool_free(ix);
+    pool_free(part);
+    pool_free(rgb);
+}
+
+void letterbox_yuv420_scalar(SBufferInfo *bufInfo, int w, int h, float *out)
+{
+    letterbox_yuv420_impl(bufInfo, w, h, out, yuv_row_scalar,
+                          blend_row_scalar);
+}
+
+void letterbox_yuv420(SBufferInfo *bufInfo, int w, int h, float *out)
+{
+    letterbox_yuv420_impl(bufInfo, w, h, out, yuv_row_simd, blend_row_simd);
+}
+
+image letterbox_image_from_raw_yuv(SBufferInfo *bufInfo, int w, int h)
+{
+    image im = make_pooled_image(w, h, CHANNELS);
+    letterbox_yuv420(bufInfo, w, h, im.data);
+    return im;
+}
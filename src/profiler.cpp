@@ -0,0 +1,288 @@
+/*
+This file implements the profiler.
+Layers are profiled by wrapping their forward functions, so that every
+forward pass over the video is timed, whichever implementation (darknet,
+fused, Winograd, int8) the layer runs. Work is estimated per layer from its
+shape:
+  - FLOPs: 2 per multiply-accumulate for convolutional and connected layers,
+    1 per output value otherwise
+  - Bytes: input, output and weights, read or written once
+Processing stages are timed around their calls.
+At exit, the profile is written as JSON and CSV, and as folded stacks
+(`<stage>;<layer> <microseconds>`) which flame graph tools take as input.
+A summary sorted by time is printed as well.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+Based on darknet, YOLO LICENSE https://github.com/pjreddie/darknet/blob/master/LICENSE
+*/
+
+extern "C"
+{
+    #include "darknet.h"
+    #include "network.h"
+}
+#include "codec_def.h"
+#include "utils.h"
+#include "profiler.h"
+
+#include <string.h>
+#include <algorithm>
+#ifdef HAVE_THREADS
+#include <mutex>
+#endif
+
+#if defined(__wasi__)
+#define PROFILE_TARGET "wasm"
+#else
+#define PROFILE_TARGET "native"
+#endif
+
+typedef struct {
+    double time;
+    long calls;
+    double flops;
+    double bytes;
+    void (*forward)(layer, network);
+} layer_profile;
+
+typedef struct {
+    double time;
+    long calls;
+} stage_profile;
+
+static const char *stage_names[STAGE_COUNT] = {
+    "decode",
+    "yuv_conversion",
+    "letterbox",
+    "prediction",
+    "boxes",
+    "nms",
+    "draw",
+    "save",
+};
+
+bool profiling = false;
+
+static network *profiled_net;
+static layer_profile *layer_profiles;
+static stage_profile stage_profiles[STAGE_COUNT];
+#ifdef HAVE_THREADS
+// Stages run on different threads in pipelined and multi-stream modes
+static std::mutex stage_mutex;
+#endif
+
+// Estimate the work of a forward pass of a layer, for the given batch size
+static void estimate_work(layer *l, int batch, double *flops, double *bytes)
+{
+    double weights = 0;
+
+    switch (l->type) {
+    case CONVOLUTIONAL:
+        weights = l->nweights;
+        *flops = 2. * l->nweights * l->out_h * l->out_w * batch;
+        break;
+    case CONNECTED:
+        weights = (double) l->inputs * l->outputs;
+        *flops = 2. * l->inputs * l->outputs * batch;
+        break;
+    default:
+        *flops = (double) l->outputs * batch;
+        break;
+    }
+    *bytes = ((double) (l->inputs + l->outputs) * batch + weights)
+             * sizeof(float);
+}
+
+// Forward function wrapping the actual one of each layer
+static void forward_profiled(layer l, network net)
+{
+    layer_profile *p = &layer_profiles[net.index];
+    double flops, bytes;
+    double time = what_time_is_it_now();
+
+    p->forward(l, net);
+    time = what_time_is_it_now() - time;
+    estimate_work(&l, l.batch, &flops, &bytes);
+#ifdef HAVE_THREADS
+    // Worker networks share the layers' profiles in multi-stream mode
+    std::lock_guard<std::mutex> lock(stage_mutex);
+#endif
+    p->time += time;
+    p->calls++;
+    p->flops += flops;
+    p->bytes += bytes;
+}
+
+/* Enable the profiler and start profiling the layers of the network. Must be
+ * called once the layers' forward functions are final
+ * Input: network
+ * Output: None
+ */
+void start_profiling(network *net)
+{
+    int i;
+
+    profiling = true;
+    profiled_net = net;
+    layer_profiles = (layer_profile *) calloc(net->n, sizeof(layer_profile));
+    for (i = 0; i < net->n; i++) {
+        layer_profiles[i].forward = net->layers[i].forward;
+        net->layers[i].forward = forward_profiled;
+    }
+}
+
+/* Start timing a stage
+ * Input: None
+ * Output: start time, 0 if the profiler is disabled
+ */
+double profile_start()
+{
+    return profiling ? what_time_is_it_now() : 0;
+}
+
+/* Stop timing a stage
+ * Input:
+ *   - stage
+ *   - start time returned by `profile_start()`
+ * Output: None
+ */
+void profile_end(profile_stage stage, double start)
+{
+    if (!profiling)
+        return;
+    double time = what_time_is_it_now() - start;
+#ifdef HAVE_THREADS
+    std::lock_guard<std::mutex> lock(stage_mutex);
+#endif
+    stage_profiles[stage].time += time;
+    stage_profiles[stage].calls++;
+}
+
+static double gflops(layer_profile *p)
+{
+    return p->time > 0 ? p->flops / p->time * 1e-9 : 0;
+}
+
+static FILE *open_report(const char *prefix, const char *extension)
+{
+    char path[strlen(prefix) + 16];
+
+    sprintf(path, "%s.%s", prefix, extension);
+    FILE *f = fopen(path, "w");
+    if (!f)
+        printf("Couldn't write the profile to %s\n", path);
+    else
+        printf("Writing profile to %s...\n", path);
+    return f;
+}
+
+/* Write the profile to `<prefix>.json`, `<prefix>.csv` and
+ * `<prefix>.folded`, and print a summary sorted by time
+ * Input: output file path prefix
+ * Output: None
+ */
+void write_profile(const char *prefix)
+{
+    int i;
+    int n = profiled_net->n;
+    FILE *f;
+
+    if (!profiling)
+        return;
+
+    if ((f = open_report(prefix, "json"))) {
+        fprintf(f, "{\n  \"target\": \"%s\",\n  \"layers\": [\n",
+                PROFILE_TARGET);
+        for (i = 0; i < n; i++) {
+            layer_profile *p = &layer_profiles[i];
+            fprintf(f, "    {\"index\": %d, \"type\": \"%s\", \"calls\": %ld, \"time\": %.9f, \"flops\": %.0f, \"bytes\": %.0f, \"gflops\": %.3f}%s\n",
+                    i, get_layer_string(profiled_net->layers[i].type),
+                    p->calls, p->time, p->flops, p->bytes, gflops(p),
+                    i < n - 1 ? "," : "");
+        }
+        fprintf(f, "  ],\n  \"stages\": [\n");
+        for (i = 0; i < STAGE_COUNT; i++)
+            fprintf(f, "    {\"name\": \"%s\", \"calls\": %ld, \"time\": %.9f}%s\n",
+                    stage_names[i], stage_profiles[i].calls,
+                    stage_profiles[i].time, i < STAGE_COUNT - 1 ? "," : "");
+        fprintf(f, "  ]\n}\n");
+        fclose(f);
+    }
+
+    if ((f = open_report(prefix, "csv"))) {
+        fprintf(f, "kind,name,index,calls,time,flops,bytes,gflops\n");
+        for (i = 0; i < n; i++) {
+            layer_profile *p = &layer_profiles[i];
+            fprintf(f, "layer,%s,%d,%ld,%.9f,%.0f,%.0f,%.3f\n",
+                    get_layer_string(profiled_net->layers[i].type), i,
+                    p->calls, p->time, p->flops, p->bytes, gflops(p));
+        }
+        for (i = 0; i < STAGE_COUNT; i++)
+            fprintf(f, "stage,%s,,%ld,%.9f,,,\n", stage_names[i],
+                    stage_profiles[i].calls, stage_profiles[i].time);
+        fclose(f);
+    }
+
+    // Layers are nested in the prediction stage, which also includes the
+    // time spent outside of them
+    if ((f = open_report(prefix, "folded"))) {
+        double layers_time = 0;
+        for (i = 0; i < n; i++) {
+            layers_time += layer_profiles[i].time;
+            fprintf(f, "prediction;%s_%d %.0f\n",
+                    get_layer_string(profiled_net->layers[i].type), i,
+                    layer_profiles[i].time * 1e6);
+        }
+        for (i = 0; i < STAGE_COUNT; i++) {
+            double time = stage_profiles[i].time;
+            if (i == STAGE_PREDICTION)
+                time = std::max(time - layers_time, 0.);
+            fprintf(f, "%s %.0f\n", stage_names[i], time * 1e6);
+        }
+        fclose(f);
+    }
+
+    // Summary
+    double total = 0;
+    int order[STAGE_COUNT > n ? STAGE_COUNT : n];
+    for (i = 0; i < STAGE_COUNT; i++) {
+        total += stage_profiles[i].time;
+        order[i] = i;
+    }
+    std::sort(order, order + STAGE_COUNT, [](int a, int b) {
+        return stage_profiles[a].time > stage_profiles[b].time;
+    });
+    printf("Profile (%s) ===========================\n", PROFILE_TARGET);
+    printf("%-16s %8s %12s %7s\n", "stage", "calls", "seconds", "share");
+    for (i = 0; i < STAGE_COUNT; i++) {
+        stage_profile *p = &stage_profiles[order[i]];
+        printf("%-16s %8ld %12.6f %6.2f%%\n", stage_names[order[i]], p->calls,
+               p->time, total > 0 ? 100 * p->time / total : 0);
+    }
+
+    double layers_total = 0;
+    for (i = 0; i < n; i++) {
+        layers_total += layer_profiles[i].time;
+        order[i] = i;
+    }
+    std::sort(order, order + n, [](int a, int b) {
+        return layer_profiles[a].time > layer_profiles[b].time;
+    });
+    printf("%-5s %-16s %8s %12s %7s %10s %10s\n", "layer", "type", "calls",
+           "seconds", "share", "GFLOP", "GFLOP/s");
+    for (i = 0; i < n; i++) {
+        layer_profile *p = &layer_profiles[order[i]];
+        printf("%-5d %-16s %8ld %12.6f %6.2f%% %10.3f %10.3f\n", order[i],
+               get_layer_string(profiled_net->layers[order[i]].type),
+               p->calls, p->time,
+               layers_total > 0 ? 100 * p->time / layers_total : 0,
+               p->flops * 1e-9, gflops(p));
+    }
+}
@@ -0,0 +1,466 @@
+/*
+This file implements the 8-bit post-training quantization of the object
+detection model.
+Process:
+  1 - Quantize the weights of each convolutional layer, with one scale per
+      output channel
+  2 - Calibrate the activations: run the float model on a few frames of a
+      sample video and record the largest input magnitude of each layer,
+      which gives one scale per input tensor
+  3 - Replace the forward function of the quantized layers. Inputs are
+      quantized to unsigned values around `GEMM_INT8_ZERO_POINT`, unrolled
+      into patches and multiplied with the packed weights by the u8 x s8
+      GEMM of `gemm_int8.cpp`, with 32-bit accumulation. The result is
+      rescaled to floats before batch normalization, bias and activation,
+      which are unchanged. The output positions are split over the thread
+      pool, each range unrolled, multiplied and rescaled by one thread
+  4 - Report the drift of the quantized model against the float model on the
+      calibration frames
+The layers feeding the YOLO layers (linear activation) are kept in floating
+point: they are small and their outputs are decoded into box coordinates,
+which are sensitive to quantization noise.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+Based on darknet, YOLO LICENSE https://github.com/pjreddie/darknet/blob/master/LICENSE
+*/
+
+extern "C"
+{
+    #include "darknet.h"
+}
+#include "codec_def.h"
+#include "h264dec.h"
+#include "utils.h"
+#include "preprocess.h"
+#include "gemm_int8.h"
+#include "optimize.h"
+#include "quantize.h"
+#include "thread_pool.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <vector>
+
+// Smallest number of inputs worth quantizing on a thread
+#define QUANTIZE_GRAIN 16384
+// Smallest number of output positions worth computing on a thread
+#define OUTPUT_GRAIN 64
+
+typedef struct {
+    // Quantized weights, packed for the GEMM, and their per-output-channel
+    // scales. NULL for layers kept in floating point
+    gemm_int8_weights *weights;
+    float *weight_scales;
+    // Largest input magnitude seen during calibration
+    float input_max;
+    // Patch size and its padded counterpart
+    int k, kp;
+    // Original forward function
+    void (*float_forward)(layer, network);
+} int8_conv;
+
+/* Quantization state of each layer, indexed like `net->layers` */
+static int8_conv *convs;
+
+/* Scratch buffers of the quantized layers, one set per thread, so that
+ * networks sharing the quantized weights may run concurrently. They grow to
+ * the largest layer run on the thread */
+static thread_local std::vector<unsigned char> qinput;
+static thread_local std::vector<unsigned char> qcols;
+static thread_local std::vector<int> qacc;
+
+/* Calibration frames */
+static network *calibration_net;
+static float **calibration_inputs;
+static int calibration_w, calibration_h;
+static int calibration_count, calibration_target;
+
+static inline signed char quantize_value(float x, float inv_scale)
+{
+    float v = x * inv_scale;
+    if (v > 127)
+        v = 127;
+    if (v < -127)
+        v = -127;
+    return (signed char) (v >= 0 ? v + .5f : v - .5f);
+}
+
+// Quantize an activation to an unsigned value offset by the zero point
+static inline unsigned char quantize_activation(float x, float inv_scale)
+{
+    return (unsigned char) (quantize_value(x, inv_scale)
+                            + GEMM_INT8_ZERO_POINT);
+}
+
+// Quantize the weights of a convolutional layer, one scale per output
+// channel, within the range the GEMM kernels accept, then pack them
+static void quantize_weights(layer *l, int8_conv *q)
+{
+    int i, j;
+    signed char *weights;
+
+    q->k = l->size*l->size*l->c;
+    weights = (signed char *) malloc((size_t) l->n*q->k);
+    q->weight_scales = (float *) malloc(l->n*sizeof(float));
+
+    for (i = 0; i < l->n; i++) {
+        float *w = l->weights + i*q->k;
+        float max = 0;
+        for (j = 0; j < q->k; j++)
+            max = fmaxf(max, fabsf(w[j]));
+        q->weight_scales[i] = max > 0 ? max / GEMM_INT8_WEIGHT_MAX : 1;
+        for (j = 0; j < q->k; j++)
+            weights[i*q->k + j] = quantize_value(w[j],
+                                                 1 / q->weight_scales[i]);
+    }
+    q->weights = pack_int8_weights(l->n, q->k, weights, q->k);
+    q->kp = q->weights->kp;
+    free(weights);
+}
+
+// Unroll the patches of the output positions `[first, last)` of a quantized
+// input into rows of `kp` values, in the same order as the weights, i.e. a
+// transposed `im2col_cpu()`. The padding of the input is the zero point
+static void im2row_int8(const unsigned char *in, layer *l, int k, int kp,
+                        int first, int last, unsigned char *cols)
+{
+    int p, c, ky, kx;
+
+    for (p = first; p < last; p++) {
+        int oy = p / l->out_w, ox = p % l->out_w;
+        unsigned char *dst = cols + (size_t) p*kp;
+        for (c = 0; c < l->c; c++) {
+            for (ky = 0; ky < l->size; ky++) {
+                int iy = oy*l->stride + ky - l->pad;
+                for (kx = 0; kx < l->size; kx++) {
+                    int ix = ox*l->stride + kx - l->pad;
+                    *dst++ = (iy < 0 || iy >= l->h || ix < 0 || ix >= l->w)
+                             ? GEMM_INT8_ZERO_POINT
+                             : in[(c*l->h + iy)*l->w + ix];
+                }
+            }
+        }
+        memset(dst, 0, kp - k);
+    }
+}
+
+// Forward function of the quantized convolutional layers
+static void forward_convolutional_layer_int8(layer l, network net)
+{
+    int b;
+    int8_conv *q = &convs[net.index];
+    int n = l.out_h*l.out_w;
+    float input_scale = q->input_max > 0 ? q->input_max / 127 : 1;
+
+    if (qinput.size() < (size_t) l.inputs)
+        qinput.resize(l.inputs);
+    if (qcols.size() < (size_t) n*q->kp)
+        qcols.resize((size_t) n*q->kp);
+    if (qacc.size() < (size_t) n*l.n)
+        qacc.resize((size_t) n*l.n);
+
+    // The buffers of the calling thread, shared with the pool threads
+    unsigned char *input = qinput.data(), *cols = qcols.data();
+    int *acc = qacc.data();
+
+    for (b = 0; b < l.batch; b++) {
+        float *in = net.input + b*l.inputs;
+        float *out = l.output + b*l.outputs;
+
+        parallel_for(l.inputs, QUANTIZE_GRAIN, [&](int first, int last) {
+            int i;
+            for (i = first; i < last; i++)
+                input[i] = quantize_activation(in[i], 1 / input_scale);
+        });
+        // Ranges of output positions, i.e. of columns of the product
+        parallel_for(n, OUTPUT_GRAIN, [&](int first, int last) {
+            int i, j;
+            im2row_int8(input, &l, q->k, q->kp, first, last, cols);
+            gemm_int8(q->weights, last - first, cols + (size_t) first*q->kp,
+                      acc + first, n);
+            for (i = 0; i < l.n; i++) {
+                float scale = input_scale * q->weight_scales[i];
+                for (j = first; j < last; j++)
+                    out[i*n + j] = acc[i*n + j] * scale;
+            }
+        });
+    }
+
+    // Same epilogue as the float layers, including fused shortcuts
+    finish_convolutional_layer(l, net);
+}
+
+// Forward function recording the largest input magnitude during calibration
+static void forward_calibration(layer l, network net)
+{
+    int i;
+    int8_conv *q = &convs[net.index];
+
+    for (i = 0; i < l.inputs*l.batch; i++)
+        q->input_max = fmaxf(q->input_max, fabsf(net.input[i]));
+    q->float_forward(l, net);
+}
+
+// Install a forward function on every quantized layer
+static void set_forward(network *net, void (*forward)(layer, network))
+{
+    int i;
+
+    for (i = 0; i < net->n; i++)
+        if (convs[i].weights)
+            net->layers[i].forward = forward ? forward
+                                             : convs[i].float_forward;
+}
+
+static void on_calibration_frame(SBufferInfo *bufInfo)
+{
+    network *net = calibration_net;
+
+    if (calibration_count >= calibration_target)
+        return;
+    calibration_w = bufInfo->UsrData.sSystemBuffer.iWidth;
+    calibration_h = bufInfo->UsrData.sSystemBuffer.iHeight;
+    calibration_inputs[calibration_count] =
+        (float *) malloc(net->inputs*sizeof(float));
+    letterbox_yuv420(bufInfo, net->w, net->h,
+                     calibration_inputs[calibration_count]);
+    calibration_count++;
+}
+
+// Run the model on a calibration frame and return the detections after
+// non-maximum suppression
+static detection *detect(network *net, float *X, float thresh, int *num)
+{
+    layer l = net->layers[net->n - 1];
+
+    network_predict(net, X);
+    detection *dets = get_network_boxes(net, calibration_w, calibration_h,
+                                        thresh, .5, 0, 1, num);
+    do_nms_sort(dets, *num, l.classes, .45);
+    return dets;
+}
+
+// Average precision of the quantized model's detections of a class, taking
+// the float model's detections as ground truth (IoU >= .5).
+// Also accumulate the IoU of the matched boxes
+static float class_average_precision(int c, detection **ref, int *nref,
+                                     detection **test, int *ntest, int frames,
+                                     float thresh, double *iou_sum,
+                                     int *matches)
+{
+    int f, i, j;
+    int total = 0, npred = 0;
+
+    for (f = 0; f < frames; f++) {
+        for (i = 0; i < nref[f]; i++)
+            total += ref[f][i].prob[c] > thresh;
+        for (i = 0; i < ntest[f]; i++)
+            npred += test[f][i].prob[c] > thresh;
+    }
+    if (total == 0)
+        return -1;
+
+    // Predictions sorted by decreasing probability
+    int (*preds)[2] = (int (*)[2]) malloc(npred*sizeof(*preds));
+    for (f = 0, npred = 0; f < frames; f++) {
+        for (i = 0; i < ntest[f]; i++) {
+            if (test[f][i].prob[c] <= thresh)
+                continue;
+            for (j = npred++; j > 0; j--) {
+                int *p = preds[j - 1];
+                if (test[p[0]][p[1]].prob[c] >= test[f][i].prob[c])
+                    break;
+                preds[j][0] = p[0];
+                preds[j][1] = p[1];
+            }
+            preds[j][0] = f;
+            preds[j][1] = i;
+        }
+    }
+
+    // Greedy matching, then area under the interpolated precision-recall
+    // curve
+    bool **used = (bool **) malloc(frames*sizeof(bool *));
+    for (f = 0; f < frames; f++)
+        used[f] = (bool *) calloc(nref[f] + 1, sizeof(bool));
+    float *precision = (float *) malloc((npred + 1)*sizeof(float));
+    float *recall = (float *) malloc((npred + 1)*sizeof(float));
+    int tp = 0;
+    for (i = 0; i < npred; i++) {
+        detection *d = &test[preds[i][0]][preds[i][1]];
+        detection *r = ref[preds[i][0]];
+        float best = .5;
+        int best_j = -1;
+        for (j = 0; j < nref[preds[i][0]]; j++) {
+            if (used[preds[i][0]][j] || r[j].prob[c] <= thresh)
+                continue;
+            float iou = box_iou(d->bbox, r[j].bbox);
+            if (iou >= best) {
+                best = iou;
+                best_j = j;
+            }
+        }
+        if (best_j >= 0) {
+            used[preds[i][0]][best_j] = true;
+            tp++;
+            *iou_sum += best;
+            (*matches)++;
+        }
+        precision[i] = (float) tp / (i + 1);
+        recall[i] = (float) tp / total;
+    }
+
+    float ap = 0, prev_recall = 0;
+    for (i = 0; i < npred; i++) {
+        float max_precision = 0;
+        for (j = i; j < npred; j++)
+            max_precision = fmaxf(max_precision, precision[j]);
+        ap += (recall[i] - prev_recall) * max_precision;
+        prev_recall = recall[i];
+    }
+
+    for (f = 0; f < frames; f++)
+        free(used[f]);
+    free(used);
+    free(precision);
+    free(recall);
+    free(preds);
+    return ap;
+}
+
+// Compare the detections and the prediction time of the float and quantized
+// models on the calibration frames
+static void report_drift(network *net, float thresh)
+{
+    int f, c;
+    int frames = calibration_count;
+    int classes = net->layers[net->n - 1].classes;
+    detection **ref = (detection **) malloc(frames*sizeof(detection *));
+    detection **test = (detection **) malloc(frames*sizeof(detection *));
+    int *nref = (int *) malloc(frames*sizeof(int));
+    int *ntest = (int *) malloc(frames*sizeof(int));
+    double time, float_time = 0, int8_time = 0;
+    double iou_sum = 0;
+    int matches = 0, total_ref = 0, total_test = 0;
+
+    for (f = 0; f < frames; f++) {
+        set_forward(net, NULL);
+        time = what_time_is_it_now();
+        ref[f] = detect(net, calibration_inputs[f], thresh, &nref[f]);
+        float_time += what_time_is_it_now() - time;
+
+        set_forward(net, forward_convolutional_layer_int8);
+        time = what_time_is_it_now();
+        test[f] = detect(net, calibration_inputs[f], thresh, &ntest[f]);
+        int8_time += what_time_is_it_now() - time;
+    }
+
+    float map = 0;
+    int nclasses = 0;
+    for (c = 0; c < classes; c++) {
+        float ap = class_average_precision(c, ref, nref, test, ntest, frames,
+                                           thresh, &iou_sum, &matches);
+        if (ap >= 0) {
+            map += ap;
+            nclasses++;
+        }
+    }
+    for (f = 0; f < frames; f++) {
+        for (int i = 0; i < nref[f]; i++)
+            total_ref += ref[f][i].prob[max_index(ref[f][i].prob, classes)]
+                         > thresh;
+        for (int i = 0; i < ntest[f]; i++)
+            total_test += test[f][i].prob[max_index(test[f][i].prob, classes)]
+                          > thresh;
+        free_detections(ref[f], nref[f]);
+        free_detections(test[f], ntest[f]);
+    }
+    free(ref);
+    free(test);
+    free(nref);
+    free(ntest);
+
+    printf("INT8 drift against float on %d calibration frames:\n", frames);
+    if (nclasses > 0)
+        printf("  mAP@0.5: %.3f over %d classes\n", map / nclasses, nclasses);
+    else
+        printf("  mAP@0.5: n/a (no float detections)\n");
+    printf("  Matched boxes: %d (float: %d, int8: %d), mean IoU: %.3f\n",
+           matches, total_ref, total_test, matches ? iou_sum / matches : 0.);
+    printf("  Prediction time: %lf seconds (float) vs %lf seconds (int8) per frame\n",
+           float_time / frames, int8_time / frames);
+}
+
+/* Quantize the convolutional layers of the model to 8-bit integers
+ * Input:
+ *   - network
+ *   - sample H.264 video used to calibrate the activations
+ *   - number of calibration frames
+ *   - class threshold used to compare the quantized model against the float
+ *     model
+ * Output: number of quantized layers
+ */
+int quantize_network(network *net, char *calibration_file,
+                     int calibration_frames, float thresh)
+{
+    int i, f;
+    int quantized = 0;
+    int batch = net->batch;
+
+    convs = (int8_conv *) calloc(net->n, sizeof(int8_conv));
+    for (i = 0; i < net->n; i++) {
+        layer *l = &net->layers[i];
+        if (l->type != CONVOLUTIONAL || l->groups > 1 || l->binary || l->xnor
+            || l->activation == LINEAR)
+            continue;
+
+        quantize_weights(l, &convs[i]);
+        convs[i].float_forward = l->forward;
+        quantized++;
+    }
+    if (quantized == 0)
+        return 0;
+
+    // Collect the calibration frames
+    calibration_net = net;
+    calibration_target = calibration_frames;
+    calibration_count = 0;
+    calibration_inputs = (float **) calloc(calibration_frames,
+                                           sizeof(float *));
+    h264_decode(calibration_file, "", false, &on_calibration_frame);
+    if (calibration_count == 0) {
+        printf("No calibration frames could be decoded from %s. Keeping the float model\n",
+               calibration_file);
+        for (i = 0; i < net->n; i++) {
+            free_int8_weights(convs[i].weights);
+            free(convs[i].weight_scales);
+        }
+        free(calibration_inputs);
+        return 0;
+    }
+
+    // Calibrate the activation scales, one frame at a time
+    set_batch_network(net, 1);
+    set_forward(net, forward_calibration);
+    for (f = 0; f < calibration_count; f++)
+        network_predict(net, calibration_inputs[f]);
+
+    report_drift(net, thresh);
+
+    set_forward(net, forward_convolutional_layer_int8);
+    set_batch_network(net, batch);
+
+    for (f = 0; f < calibration_count; f++)
+        free(calibration_inputs[f]);
+    free(calibration_inputs);
+
+    return quantized;
+}
@@ -0,0 +1,252 @@
+/*
+This file implements the region of interest masks.
+A mask is a union of polygons and rectangles, read from a text file with one
+region per line, in coordinates relative to the frame dimensions:
+  rect <x> <y> <w> <h>
+  poly <x1> <y1> <x2> <y2> <x3> <y3> ...
+Empty lines and lines starting with `#` are ignored.
+Frames are cropped to the bounding box of the mask before being letterboxed,
+so the model gets a higher resolution view of a smaller area, and detections
+whose center falls outside of the mask are dropped.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+extern "C"
+{
+    #include "darknet.h"
+}
+#include "roi.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_LINE 4096
+
+
+// Add a polygon to a mask, growing its bounding box
+static void add_polygon(roi_mask *mask, float *x, float *y, int n)
+{
+    int i;
+    roi_polygon *p;
+
+    mask->polygons = (roi_polygon *) realloc(mask->polygons,
+                                             (mask->n + 1)*sizeof(roi_polygon));
+    p = &mask->polygons[mask->n++];
+    p->x = x;
+    p->y = y;
+    p->n = n;
+    for (i = 0; i < n; i++) {
+        if (x[i] < mask->left)
+            mask->left = x[i];
+        if (x[i] > mask->right)
+            mask->right = x[i];
+        if (y[i] < mask->top)
+            mask->top = y[i];
+        if (y[i] > mask->bottom)
+            mask->bottom = y[i];
+    }
+}
+
+static void free_roi_mask(roi_mask *mask)
+{
+    int i;
+
+    for (i = 0; i < mask->n; i++) {
+        free(mask->polygons[i].x);
+        free(mask->polygons[i].y);
+    }
+    free(mask->polygons);
+    free(mask);
+}
+
+// Parse a region of a mask file. Returns false if the line is malformed
+static bool parse_region(roi_mask *mask, char *line)
+{
+    int n = 0, capacity = 8;
+    // Reentrant, as the list of mask files may be tokenized by the caller
+    char *saveptr;
+    char *token = strtok_r(line, " \t\r\n", &saveptr);
+    float *values;
+
+    if (!token || token[0] == '#')
+        return true;
+    bool rect = !strcmp(token, "rect");
+    if (!rect && strcmp(token, "poly"))
+        return false;
+
+    values = (float *) malloc(capacity*sizeof(float));
+    while ((token = strtok_r(NULL, " \t\r\n", &saveptr))) {
+        char *end;
+        if (n == capacity) {
+            capacity *= 2;
+            values = (float *) realloc(values, capacity*sizeof(float));
+        }
+        values[n++] = strtof(token, &end);
+        if (*end) {
+            free(values);
+            return false;
+        }
+    }
+    if ((rect && n != 4) || (!rect && (n < 6 || n % 2))) {
+        free(values);
+        return false;
+    }
+
+    int vertices = rect ? 4 : n/2;
+    float *x = (float *) malloc(vertices*sizeof(float));
+    float *y = (float *) malloc(vertices*sizeof(float));
+    if (rect) {
+        x[0] = x[3] = values[0];
+        x[1] = x[2] = values[0] + values[2];
+        y[0] = y[1] = values[1];
+        y[2] = y[3] = values[1] + values[3];
+    } else {
+        for (int i = 0; i < vertices; i++) {
+            x[i] = values[2*i];
+            y[i] = values[2*i + 1];
+        }
+    }
+    free(values);
+    add_polygon(mask, x, y, vertices);
+    return true;
+}
+
+/* Load a region of interest mask
+ * Input: mask file
+ * Output: mask, NULL if the file couldn't be read or has no region
+ */
+roi_mask *load_roi_mask(const char *path)
+{
+    char line[MAX_LINE];
+    int number = 0;
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        printf("Couldn't open %s\n", path);
+        return NULL;
+    }
+    roi_mask *mask = (roi_mask *) calloc(1, sizeof(roi_mask));
+    mask->left = mask->top = 1;
+    mask->right = mask->bottom = 0;
+    while (fgets(line, sizeof(line), f)) {
+        number++;
+        if (!parse_region(mask, line)) {
+            printf("%s:%d: expected `rect <x> <y> <w> <h>` or `poly <x1> <y1> <x2> <y2> <x3> <y3> ...`\n",
+                   path, number);
+            fclose(f);
+            free_roi_mask(mask);
+            return NULL;
+        }
+    }
+    fclose(f);
+
+    // Regions may extend beyond the frame
+    if (mask->left < 0)
+        mask->left = 0;
+    if (mask->top < 0)
+        mask->top = 0;
+    if (mask->right > 1)
+        mask->right = 1;
+    if (mask->bottom > 1)
+        mask->bottom = 1;
+    if (mask->n == 0 || mask->left >= mask->right
+        || mask->top >= mask->bottom) {
+        printf("%s doesn't define any region within the frame\n", path);
+        free_roi_mask(mask);
+        return NULL;
+    }
+    printf("%s: %d regions, inference restricted to %.1f%% of the frame\n",
+           path, mask->n,
+           100.*(mask->right - mask->left)*(mask->bottom - mask->top));
+    return mask;
+}
+
+/* Compute the rectangle of a frame the model runs on: the bounding box of the
+ * mask, widened to even coordinates to keep the chroma planes aligned
+ * Input:
+ *   - mask
+ *   - frame width and height
+ *   - left, top, width and height of the rectangle, in pixels (output)
+ * Output: None
+ */
+void roi_crop(roi_mask *mask, int w, int h, int *x, int *y, int *cw, int *ch)
+{
+    int left = (int) floorf(mask->left*w) & ~1;
+    int top = (int) floorf(mask->top*h) & ~1;
+    int right = (int) ceilf(mask->right*w);
+    int bottom = (int) ceilf(mask->bottom*h);
+
+    right += right % 2;
+    bottom += bottom % 2;
+    *x = left;
+    *y = top;
+    *cw = (right < w ? right : w) - left;
+    *ch = (bottom < h ? bottom : h) - top;
+}
+
+// Whether a point lies within a polygon, by the even-odd rule
+static bool polygon_contains(roi_polygon *p, float x, float y)
+{
+    int i, j;
+    bool inside = false;
+
+    for (i = 0, j = p->n - 1; i < p->n; j = i++) {
+        if ((p->y[i] > y) != (p->y[j] > y)
+            && x < (p->x[j] - p->x[i])*(y - p->y[i])/(p->y[j] - p->y[i])
+                   + p->x[i])
+            inside = !inside;
+    }
+    return inside;
+}
+
+/* Tell whether a point, in coordinates relative to the frame, lies within
+ * any region of a mask
+ * Input:
+ *   - mask
+ *   - point coordinates
+ * Output: whether the point is within the mask
+ */
+bool roi_contains(roi_mask *mask, float x, float y)
+{
+    int i;
+
+    for (i = 0; i < mask->n; i++)
+        if (polygon_contains(&mask->polygons[i], x, y))
+            return true;
+    return false;
+}
+
+/* Drop the detections whose center falls outside of a mask, keeping the
+ * others in order
+ * Input:
+ *   - mask
+ *   - detections, compacted in place
+ *   - number of detections, updated
+ * Output: None
+ */
+void filter_roi_detections(roi_mask *mask, detection *dets, int *num)
+{
+    int i, n = 0;
+
+    for (i = 0; i < *num; i++) {
+        if (!roi_contains(mask, dets[i].bbox.x, dets[i].bbox.y))
+            continue;
+        if (n != i) {
+            // Swap, so that every entry keeps its own probability buffer
+            detection d = dets[n];
+            dets[n] = dets[i];
+            dets[i] = d;
+        }
+        n++;
+    }
+    *num = n;
+}
@@ -0,0 +1,94 @@
+/*
+This file implements the frame sampler.
+Frames are selected from their number in the video, before any conversion,
+so that the frames the model doesn't run on are dropped right after being
+decoded. In keyframe mode, frames other than IDR frames aren't even decoded
+(see `h264_decode_keyframes()`), and the sampler keeps every frame it is
+given.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+#include <stdio.h>
+
+#include "sampler.h"
+
+/* Initialize the frame sampler. Keyframes take precedence over the stride,
+ * which takes precedence over the target rate
+ * Input:
+ *   - frame sampler
+ *   - number of frames between two sampled frames (1: every frame)
+ *   - number of frames sampled per second of video (0: disabled)
+ *   - frame rate of the video, used with the target rate
+ *   - whether IDR frames only are decoded
+ * Output: None
+ */
+void init_frame_sampler(frame_sampler *sampler, int stride, float target_fps,
+                        float video_fps, bool keyframes_only)
+{
+    sampler->mode = SAMPLE_ALL;
+    sampler->stride = 1;
+    sampler->ratio = 1;
+    if (keyframes_only) {
+        sampler->mode = SAMPLE_KEYFRAMES;
+    } else if (stride > 1) {
+        sampler->mode = SAMPLE_STRIDE;
+        sampler->stride = stride;
+    } else if (target_fps > 0 && video_fps > 0 && target_fps < video_fps) {
+        sampler->mode = SAMPLE_RATE;
+        sampler->ratio = target_fps / video_fps;
+    }
+    // The first frame is always sampled
+    sampler->credit = 1;
+    sampler->frames = 0;
+    sampler->sampled = 0;
+}
+
+/* Tell whether the model should run on a frame
+ * Input:
+ *   - frame sampler
+ *   - frame number in the video
+ * Output: whether the frame is sampled
+ */
+bool sample_frame(frame_sampler *sampler, int frame)
+{
+    bool sampled = true;
+
+    switch (sampler->mode) {
+    case SAMPLE_STRIDE:
+        sampled = frame % sampler->stride == 0;
+        break;
+    case SAMPLE_RATE:
+        // Spread the sampled frames evenly when the rates aren't multiples
+        // of each other. The margin absorbs rounding errors
+        sampled = sampler->credit >= 1 - 1e-9;
+        if (sampled)
+            sampler->credit -= 1;
+        sampler->credit += sampler->ratio;
+        break;
+    default:
+        break;
+    }
+    sampler->frames++;
+    if (sampled)
+        sampler->sampled++;
+    return sampled;
+}
+
+void print_frame_sampler_stats(frame_sampler *sampler)
+{
+    if (sampler->mode == SAMPLE_KEYFRAMES)
+        printf("Frame sampler: %d keyframes decoded\n", sampler->frames);
+    else
+        printf("Frame sampler: %d/%d frames sampled (%.1f%%)\n",
+               sampler->sampled, sampler->frames,
+               sampler->frames ? 100. * sampler->sampled / sampler->frames
+                               : 0.);
+}
@@ -0,0 +1,395 @@
+/*
+This file implements the multi-stream detection server.
+Each stream is decoded on its own thread, with its own decoder, motion gate,
+tracker and outputs. Decoded frames are prepared on their decoder thread,
+then queued to a shared pool of inference workers. Each worker runs its own
+network, built from the model's configuration and sharing its weights
+read-only, so that loading the model once serves every stream. A worker
+waits for a frame and batches it with the frames of any stream already
+waiting, up to the batch size, so frames of different streams share forward
+passes when they line up.
+Workers complete frames out of order. Each stream keeps the frames completed
+ahead of their predecessors, and whichever worker completes the next frame
+of a stream outputs it and its waiting successors, so the output of each
+stream stays in order.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+extern "C"
+{
+    #include "darknet.h"
+}
+#include "codec_def.h"
+#include "h264dec.h"
+#include "utils.h"
+#include "detector.h"
+#include "motion.h"
+#include "tracker.h"
+#include "profiler.h"
+#include "pool.h"
+#include "sink.h"
+#include "writer.h"
+#include "sampler.h"
+#include "decode.h"
+#include "server.h"
+
+#include <float.h>
+#include <string.h>
+
+#ifdef HAVE_THREADS
+
+#include "bounded_queue.h"
+
+#include <map>
+#include <mutex>
+#include <thread>
+
+/* A video processed by the server */
+typedef struct {
+    int id;
+    const char *input_file;
+    // Detection parameters, with the stream's own tracker and outputs
+    detector_options options;
+    bool motion_gating;
+    motion_gate gate;
+    tracker object_tracker;
+    detection_history history;
+    // Decoder side
+    frame_sampler sampler;
+    std::thread decoder;
+    int frames_decoded;
+    int frames_sampled;
+    double decode_start;
+    int decoder_result;
+    // Output side, guarded by the mutex: frames completed ahead of their
+    // predecessors, indexed by sequence number, and next frame to output
+    std::mutex mutex;
+    std::map<int, frame_job *> completed;
+    int next_output;
+    double last_output;
+} detection_stream;
+
+/* Inference worker, running the forward passes of its own network */
+typedef struct {
+    network *model;
+    std::thread thread;
+    // Statistics
+    long forward_passes;
+    long inferred_frames;
+} inference_worker;
+
+static detection_stream **streams;
+static bounded_queue<frame_job *> *ready_frames;
+
+/* Stream decoded by the current thread. The decoder callback doesn't take
+ * any user data */
+static thread_local detection_stream *current_stream;
+
+/* Per-frame messages of the streams are printed as a whole */
+static std::mutex print_mutex;
+
+// Insert the stream number before the extension of a path, if any:
+// `output/annotated.h264` becomes `output/annotated.<id>.h264`
+static char *stream_path(const char *path, int id)
+{
+    const char *slash = strrchr(path, '/');
+    const char *dot = strrchr(path, '.');
+    int length = dot && (!slash || dot > slash) ? dot - path : strlen(path);
+    char *s = (char *) malloc(strlen(path) + 16);
+
+    sprintf(s, "%.*s.%d%s", length, path, id, path + length);
+    return s;
+}
+
+// Set up the state and the outputs of a stream, like `main()` does for a
+// single video
+static bool open_stream(detection_stream *s, int id, char *input_file,
+                        stream_settings *settings)
+{
+    s->id = id;
+    s->input_file = input_file;
+    s->options = settings->options;
+    s->options.outfile_prefix = stream_path(settings->options.outfile_prefix,
+                                            id);
+    s->sampler = settings->sampling;
+    if (settings->rois)
+        s->options.roi = settings->rois[id];
+
+    if (settings->track_interval > 0) {
+        init_tracker(&s->object_tracker, .3, 2);
+        s->options.object_tracker = &s->object_tracker;
+        init_motion_gate(&s->gate, settings->motion_threshold > 0
+                                   ? settings->motion_threshold : FLT_MAX,
+                         settings->track_interval);
+        s->motion_gating = true;
+    } else {
+        init_motion_gate(&s->gate, settings->motion_threshold,
+                         settings->motion_refresh);
+        s->motion_gating = settings->motion_threshold > 0;
+    }
+
+    if (settings->detections_file) {
+        s->options.detection_sink = open_detection_sink(
+            stream_path(settings->detections_file, id),
+            settings->detections_format);
+        if (!s->options.detection_sink)
+            return false;
+    }
+    if (s->options.draw_detection_boxes && settings->save_video) {
+        s->options.image_writer = start_video_writer(
+            stream_path(settings->h264_output, id), settings->h264_bitrate,
+            settings->h264_gop, settings->save_queue, settings->save_policy);
+        if (!s->options.image_writer)
+            return false;
+    } else if (s->options.draw_detection_boxes) {
+        s->options.image_writer = start_image_writer(settings->save_format,
+                                                     settings->save_quality,
+                                                     settings->save_queue,
+                                                     settings->save_policy);
+    }
+    return true;
+}
+
+// Prepare a sampled frame while the decoder's buffer is valid, then queue it
+// to the inference workers
+static void queue_stream_frame(detection_stream *s, SBufferInfo *bufInfo,
+                               int frame)
+{
+    frame_job *job = (frame_job *) pool_calloc(1, sizeof(frame_job));
+
+    pool_next_frame();
+
+    job->index = frame;
+    job->sequence = s->frames_sampled++;
+    job->stream = s->id;
+    // Look for changes on the luma plane, before any conversion
+    if (s->motion_gating)
+        job->reuse_detections = motion_gate_skip(&s->gate, bufInfo);
+    prepare_frame(job, bufInfo, &s->options);
+
+    ready_frames->push(job);
+    s->decode_start = profile_start();
+}
+
+// Decoder callback. Frames that aren't sampled are dropped before any
+// conversion
+static void on_stream_frame(SBufferInfo *bufInfo)
+{
+    detection_stream *s = current_stream;
+    int frame = s->frames_decoded++;
+
+    profile_end(STAGE_DECODE, s->decode_start);
+    if (sample_frame(&s->sampler, frame))
+        queue_stream_frame(s, bufInfo, frame);
+    else
+        s->decode_start = profile_start();
+}
+
+static void on_stream_keyframe(SBufferInfo *bufInfo, int frame)
+{
+    detection_stream *s = current_stream;
+
+    s->frames_decoded++;
+    profile_end(STAGE_DECODE, s->decode_start);
+    sample_frame(&s->sampler, frame);
+    queue_stream_frame(s, bufInfo, frame);
+}
+
+static void decode_stream(detection_stream *s)
+{
+    current_stream = s;
+    s->decode_start = profile_start();
+    if (s->sampler.mode == SAMPLE_KEYFRAMES)
+        s->decoder_result = h264_decode_keyframes(s->input_file,
+                                                  &on_stream_keyframe);
+    else
+        s->decoder_result = h264_decode(s->input_file, "", false,
+                                        &on_stream_frame);
+}
+
+// Output the frames of a stream that are next in order. Must be called with
+// the stream's lock held
+static void output_stream_frames(detection_stream *s)
+{
+    std::map<int, frame_job *>::iterator next;
+
+    while ((next = s->completed.begin()) != s->completed.end()
+           && next->first == s->next_output) {
+        frame_job *job = next->second;
+        s->completed.erase(next);
+
+        // The tracker propagates detections itself at output time
+        if (!s->options.object_tracker)
+            propagate_detections(job, &s->history);
+        if (s->options.detection_sink) {
+            output_frame(job, &s->options);
+        } else {
+            std::lock_guard<std::mutex> lock(print_mutex);
+            printf("Stream %d, image %d ===========================\n", s->id,
+                   job->index);
+            printf("Prediction duration: %lf seconds\n",
+                   job->prediction_duration);
+            output_frame(job, &s->options);
+        }
+        pool_free(job);
+        s->next_output++;
+        s->last_output = what_time_is_it_now();
+    }
+}
+
+// Run forward passes over the queued frames until the end marker
+static void run_inference_worker(inference_worker *worker)
+{
+    int i, n, m;
+    int batch = worker->model->batch;
+    frame_job *jobs[batch], *inferred[batch];
+    float *input = NULL;
+    bool done = false;
+
+    if (batch > 1)
+        input = (float *) calloc(worker->model->inputs*batch, sizeof(float));
+
+    while (!done && (jobs[0] = ready_frames->pop())) {
+        // Batch the frame with the frames already waiting, whatever their
+        // stream
+        for (n = 1; n < batch && ready_frames->try_pop(jobs[n]); n++) {
+            if (!jobs[n]) {
+                done = true;
+                break;
+            }
+        }
+
+        // Detection thresholds are the same for every stream
+        for (i = 0, m = 0; i < n; i++)
+            if (!jobs[i]->reuse_detections)
+                inferred[m++] = jobs[i];
+        if (m > 0) {
+            infer_frames(worker->model, input, inferred, m,
+                         &streams[jobs[0]->stream]->options);
+            worker->forward_passes++;
+            worker->inferred_frames += m;
+        }
+
+        for (i = 0; i < n; i++) {
+            detection_stream *s = streams[jobs[i]->stream];
+            std::lock_guard<std::mutex> lock(s->mutex);
+            s->completed[jobs[i]->sequence] = jobs[i];
+            output_stream_frames(s);
+        }
+    }
+    free(input);
+}
+
+/* Run the object detection model on several videos concurrently, and print
+ * the throughput of each stream and of the server
+ * Input:
+ *   - H.264 videos
+ *   - number of videos
+ *   - settings applied to every stream
+ *   - number of inference workers, each running its own network
+ *   - number of prepared frames queued per stream
+ * Output: 0 on success, the first decoder error otherwise
+ */
+int run_detection_server(char **input_files, int nstreams,
+                         stream_settings *settings, int workers,
+                         int queue_depth)
+{
+    int i;
+    int result = 0;
+    long frames = 0, forward_passes = 0, inferred_frames = 0;
+    double time, start;
+
+    if (workers < 1) {
+        workers = std::thread::hardware_concurrency();
+        if (workers < 1 || workers > nstreams)
+            workers = nstreams;
+    }
+    printf("Building %d inference workers...\n", workers);
+    time = what_time_is_it_now();
+    inference_worker *pool = new inference_worker[workers]();
+    // The model's network isn't run by the workers: running a partial batch
+    // changes a network's batch size, while the streams read the model
+    for (i = 0; i < workers; i++) {
+        pool[i].model = clone_detector_network();
+        if (!pool[i].model)
+            return 1;
+    }
+    printf("Inference workers built: %lf seconds\n",
+           what_time_is_it_now() - time);
+
+    streams = new detection_stream *[nstreams];
+    for (i = 0; i < nstreams; i++) {
+        streams[i] = new detection_stream();
+        if (!open_stream(streams[i], i, input_files[i], settings))
+            return 1;
+    }
+    ready_frames = new bounded_queue<frame_job *>(queue_depth*nstreams);
+
+    // Frames being prepared, queued to the workers, in their batches and
+    // queued to the image writers
+    init_frame_pool(nstreams*(queue_depth + settings->save_queue + 1)
+                    + workers*net->batch);
+
+    printf("Starting %d streams...\n", nstreams);
+    start = what_time_is_it_now();
+    for (i = 0; i < workers; i++)
+        pool[i].thread = std::thread(run_inference_worker, &pool[i]);
+    for (i = 0; i < nstreams; i++)
+        streams[i]->decoder = std::thread(decode_stream, streams[i]);
+
+    for (i = 0; i < nstreams; i++)
+        streams[i]->decoder.join();
+    // One end marker per worker
+    for (i = 0; i < workers; i++)
+        ready_frames->push(NULL);
+    for (i = 0; i < workers; i++) {
+        pool[i].thread.join();
+        forward_passes += pool[i].forward_passes;
+        inferred_frames += pool[i].inferred_frames;
+    }
+    time = what_time_is_it_now() - start;
+
+    for (i = 0; i < nstreams; i++) {
+        detection_stream *s = streams[i];
+        double duration = s->last_output - start;
+
+        if (s->options.detection_sink)
+            close_detection_sink(s->options.detection_sink);
+        if (s->options.image_writer)
+            finish_image_writer(s->options.image_writer);
+        printf("Stream %d (%s): %d frames in %lf seconds (%.1f frames per second)\n",
+               i, s->input_file, s->frames_decoded, duration,
+               duration > 0 ? s->frames_decoded / duration : 0);
+        if (s->sampler.mode != SAMPLE_ALL)
+            print_frame_sampler_stats(&s->sampler);
+        if (s->motion_gating)
+            print_motion_gate_stats(&s->gate);
+        if (s->frames_decoded == 0)
+            printf("No frames were processed. The input video was whether empty or not an H.264 video\n");
+        if (s->decoder_result && !result)
+            result = s->decoder_result;
+        frames += s->frames_decoded;
+    }
+    printf("Server: %ld frames from %d streams in %lf seconds (%.1f frames per second), %ld forward passes on %d workers (%.2f frames per pass)\n",
+           frames, nstreams, time, time > 0 ? frames / time : 0,
+           forward_passes, workers,
+           forward_passes > 0 ? (double) inferred_frames / forward_passes
+                              : 0);
+
+    delete ready_frames;
+    for (i = 0; i < nstreams; i++)
+        delete streams[i];
+    delete[] streams;
+    delete[] pool;
+    return result;
+}
+
+#endif
@@ -0,0 +1,313 @@
+/*
+This file implements the detection sink.
+Records are formatted into an in-memory buffer. Full buffers are handed over
+to a writer thread, which writes them to the file while the next buffer
+fills up, so that the output never waits on the file system. On targets
+without threads, full buffers are written directly.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+extern "C"
+{
+    #include "darknet.h"
+}
+#include "codec_def.h"
+#include "utils.h"
+#include "sink.h"
+
+#include <stdarg.h>
+#include <string.h>
+#if !defined(__wasi__)
+#include <unistd.h>
+#endif
+#ifdef HAVE_THREADS
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
+// Size of each of the two buffers
+#define SINK_BUFFER_SIZE (1 << 16)
+
+struct detection_sink {
+    FILE *file;
+    sink_format format;
+    // Buffer being filled
+    char *buffer;
+    size_t size;
+    size_t capacity;
+#ifdef HAVE_THREADS
+    // Buffer being written by the writer thread
+    char *spare;
+    size_t spare_size;
+    size_t spare_capacity;
+    bool writing;
+    bool closing;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::thread writer;
+#endif
+};
+
+/* Standard output, once reserved for the detections */
+static FILE *standard_output;
+
+#ifdef HAVE_THREADS
+static void writer_thread(detection_sink *sink)
+{
+    std::unique_lock<std::mutex> lock(sink->mutex);
+
+    for (;;) {
+        sink->cond.wait(lock, [sink] {
+            return sink->writing || sink->closing;
+        });
+        if (!sink->writing)
+            break;
+        lock.unlock();
+        fwrite(sink->spare, 1, sink->spare_size, sink->file);
+        fflush(sink->file);
+        lock.lock();
+        sink->writing = false;
+        sink->cond.notify_all();
+    }
+}
+#endif
+
+// Write out the buffered records
+static void flush_sink(detection_sink *sink)
+{
+    if (sink->size == 0)
+        return;
+#ifdef HAVE_THREADS
+    // Wait for the previous buffer to be written and swap the buffers
+    std::unique_lock<std::mutex> lock(sink->mutex);
+    sink->cond.wait(lock, [sink] { return !sink->writing; });
+    std::swap(sink->buffer, sink->spare);
+    std::swap(sink->capacity, sink->spare_capacity);
+    sink->spare_size = sink->size;
+    sink->writing = true;
+    sink->cond.notify_all();
+#else
+    fwrite(sink->buffer, 1, sink->size, sink->file);
+    fflush(sink->file);
+#endif
+    sink->size = 0;
+}
+
+// Make room for `n` more bytes in the buffer
+static char *reserve(detection_sink *sink, size_t n)
+{
+    if (sink->size + n > sink->capacity)
+        flush_sink(sink);
+    if (n > sink->capacity) {
+        sink->capacity = n;
+        sink->buffer = (char *) realloc(sink->buffer, n);
+    }
+    return sink->buffer + sink->size;
+}
+
+static void append(detection_sink *sink, const void *data, size_t n)
+{
+    memcpy(reserve(sink, n), data, n);
+    sink->size += n;
+}
+
+// Append formatted text, making room for it whatever its length
+static void append_format(detection_sink *sink, const char *format, ...)
+{
+    va_list args, retry;
+    size_t room = sink->capacity - sink->size;
+
+    va_start(args, format);
+    va_copy(retry, args);
+    int n = vsnprintf(sink->buffer + sink->size, room, format, args);
+    if (n >= 0 && (size_t) n >= room)
+        n = vsnprintf(reserve(sink, n + 1), n + 1, format, retry);
+    if (n > 0)
+        sink->size += n;
+    va_end(retry);
+    va_end(args);
+}
+
+// Append a string as a JSON string
+static void append_json_string(detection_sink *sink, const char *s)
+{
+    char *p = reserve(sink, 2*strlen(s) + 2);
+    char *start = p;
+
+    *p++ = '"';
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            *p++ = '\\';
+        *p++ = (unsigned char) *s < ' ' ? ' ' : *s;
+    }
+    *p++ = '"';
+    sink->size += p - start;
+}
+
+/* Reserve the standard output for the detections streamed to `-`: the
+ * sink writes to a duplicate of it, and whatever the program prints to the
+ * standard output from then on goes to the standard error. Not supported on
+ * WASI targets, which can't duplicate file descriptors
+ * Input: None
+ * Output: whether the standard output could be reserved
+ */
+bool reserve_standard_output()
+{
+#if defined(__wasi__)
+    printf("Detections can't be streamed to the standard output on this target\n");
+    return false;
+#else
+    fflush(stdout);
+    int fd = dup(STDOUT_FILENO);
+    FILE *file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+
+    if (!file || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+        printf("Couldn't reserve the standard output for the detections\n");
+        if (file)
+            fclose(file);
+        else if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    standard_output = file;
+    return true;
+#endif
+}
+
+/* Open a detection sink
+ * Input:
+ *   - output file path, `-` for the standard output, which should have been
+ *     reserved with `reserve_standard_output()`
+ *   - record format
+ * Output: detection sink, NULL if the file couldn't be opened
+ */
+detection_sink *open_detection_sink(const char *path, sink_format format)
+{
+    FILE *file = strcmp(path, "-") ? fopen(path, "wb")
+                 : standard_output ? standard_output : stdout;
+
+    if (!file) {
+        printf("Couldn't open %s\n", path);
+        return NULL;
+    }
+
+    detection_sink *sink = new detection_sink();
+    sink->file = file;
+    sink->format = format;
+    sink->capacity = SINK_BUFFER_SIZE;
+    sink->buffer = (char *) malloc(sink->capacity);
+#ifdef HAVE_THREADS
+    sink->spare_capacity = SINK_BUFFER_SIZE;
+    sink->spare = (char *) malloc(sink->spare_capacity);
+    sink->writer = std::thread(writer_thread, sink);
+#endif
+
+    if (format == SINK_BINARY)
+        append(sink, DETECTION_SINK_MAGIC, strlen(DETECTION_SINK_MAGIC));
+    return sink;
+}
+
+/* Stream the record of a frame. Each detection is reported once for each
+ * class above the threshold, like `print_detection_probabilities()`
+ * Input:
+ *   - detection sink
+ *   - frame number
+ *   - presentation timestamp
+ *   - detections, after non-maximum suppression
+ *   - number of detections
+ *   - track identifier of each detection, NULL when tracking is disabled
+ *   - class threshold
+ *   - class names
+ *   - number of classes
+ * Output: None
+ */
+void write_detection_record(detection_sink *sink, int frame, int64_t pts,
+                            detection *dets, int num, int *track_ids,
+                            float thresh, char **names, int classes)
+{
+    int i, j;
+
+    if (sink->format == SINK_BINARY) {
+        uint32_t count = 0;
+        for (i = 0; i < num; i++)
+            for (j = 0; j < classes; j++)
+                count += dets[i].prob[j] > thresh;
+
+        uint32_t length = sizeof(int32_t) + sizeof(int64_t) + sizeof(uint32_t)
+                          + count*sizeof(sink_detection);
+        int32_t frame32 = frame;
+        append(sink, &length, sizeof(length));
+        append(sink, &frame32, sizeof(frame32));
+        append(sink, &pts, sizeof(pts));
+        append(sink, &count, sizeof(count));
+        for (i = 0; i < num; i++) {
+            for (j = 0; j < classes; j++) {
+                if (dets[i].prob[j] <= thresh)
+                    continue;
+                sink_detection d = {
+                    j, track_ids ? track_ids[i] : -1, dets[i].prob[j],
+                    dets[i].bbox.x, dets[i].bbox.y,
+                    dets[i].bbox.w, dets[i].bbox.h,
+                };
+                append(sink, &d, sizeof(d));
+            }
+        }
+        return;
+    }
+
+    bool first = true;
+    append_format(sink, "{\"frame\": %d, \"pts\": %lld, \"detections\": [",
+                  frame, (long long) pts);
+    for (i = 0; i < num; i++) {
+        for (j = 0; j < classes; j++) {
+            if (dets[i].prob[j] <= thresh)
+                continue;
+            append_format(sink, "%s{\"class\": %d, \"name\": ",
+                          first ? "" : ", ", j);
+            append_json_string(sink, names[j]);
+            append_format(sink, ", \"prob\": %.4f", dets[i].prob[j]);
+            if (track_ids)
+                append_format(sink, ", \"track\": %d", track_ids[i]);
+            // Coordinates are unbounded, e.g. of boxes extrapolated by the
+            // tracker
+            append_format(sink, ", \"bbox\": [%.5f, %.5f, %.5f, %.5f]}",
+                          dets[i].bbox.x, dets[i].bbox.y, dets[i].bbox.w,
+                          dets[i].bbox.h);
+            first = false;
+        }
+    }
+    append(sink, "]}\n", 3);
+}
+
+/* Write out the remaining records and close the sink
+ * Input: detection sink
+ * Output: None
+ */
+void close_detection_sink(detection_sink *sink)
+{
+    flush_sink(sink);
+#ifdef HAVE_THREADS
+    {
+        std::lock_guard<std::mutex> lock(sink->mutex);
+        sink->closing = true;
+        sink->cond.notify_all();
+    }
+    sink->writer.join();
+    free(sink->spare);
+#endif
+    if (sink->file != stdout && sink->file != standard_output)
+        fclose(sink->file);
+    else
+        fflush(sink->file);
+    free(sink->buffer);
+    delete sink;
+}
@@ -0,0 +1,308 @@
+/*
+This file implements the intra-op thread pool.
+Even with a batch of one frame, every layer of the model has plenty of
+independent work: output channels, columns of the output, anchor boxes...
+`parallel_for()` splits such a loop into ranges, a few per thread so that the
+load balances itself, and runs them on the pool:
+  - Each worker thread owns a queue of ranges. The ranges of a loop are
+    dealt round-robin into the queues, the calling thread runs the first one
+    itself, then helps with the others
+  - Workers run the ranges of their own queue first, oldest first, and steal
+    from the other end of the other queues once theirs is empty, so that
+    threads finishing early take over the work of the slow ones
+  - Loops started from within a range run inline, so the layers can split
+    their work without oversubscribing the threads of the GEMM backend
+  - Several threads (tiles, streams, pipeline stages) may run loops on the
+    pool at the same time
+The pool is sized from the `-threads` option, the `DETECTOR_THREADS`
+environment variable or the number of hardware threads, the calling thread
+counting as one of them. Workers may be pinned to a core each, on Linux.
+On WASI targets, which have no threads, every loop runs inline.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+#include "thread_pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Like `utils.h`, which the offline tools can't include since it depends on
+// the codec headers
+#if !defined(__wasi__)
+#define HAVE_THREADS 1
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#endif
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Ranges a loop is split into per thread, so that threads finishing early
+// have some left to steal
+#define TASKS_PER_THREAD 4
+
+/* Threads running the loops, including the calling thread */
+static int pool_size = 1;
+
+#if defined(HAVE_THREADS)
+
+typedef struct {
+    parallel_task task;
+    void *arg;
+    // Ranges not completed yet
+    std::atomic<int> remaining;
+} pool_job;
+
+typedef struct {
+    pool_job *job;
+    int first, last;
+} pool_task;
+
+typedef struct {
+    std::mutex mutex;
+    std::deque<pool_task> tasks;
+} task_queue;
+
+/* Never destroyed: idle workers still wait on the pool when the program
+ * exits, and destroying a condition variable they wait on would block */
+static std::vector<std::thread> &workers = *new std::vector<std::thread>;
+/* Queue of each worker */
+static task_queue *queues;
+static int nqueues;
+/* Ranges waiting in the queues, updated along with them */
+static std::atomic<int> queued;
+/* Queue the next loop starts dealing its ranges into */
+static std::atomic<unsigned> next_queue;
+
+/* Idle workers wait for ranges, callers for the end of their loop */
+static std::mutex &wake_mutex = *new std::mutex;
+static std::condition_variable &wake = *new std::condition_variable;
+static std::condition_variable &done = *new std::condition_variable;
+static bool stopping;
+
+/* Whether the current thread is running a range */
+static thread_local bool in_task;
+
+
+// Take a range from a queue: from the front of the worker's own queue, from
+// the back of the others. Callers waiting for their loop only take its
+// ranges
+static bool take_task(int q, bool own, pool_job *job, pool_task *task)
+{
+    task_queue *queue = &queues[q];
+    std::lock_guard<std::mutex> lock(queue->mutex);
+
+    if (queue->tasks.empty())
+        return false;
+    if (!job) {
+        if (own) {
+            *task = queue->tasks.front();
+            queue->tasks.pop_front();
+        } else {
+            *task = queue->tasks.back();
+            queue->tasks.pop_back();
+        }
+        queued--;
+        return true;
+    }
+    for (auto it = queue->tasks.rbegin(); it != queue->tasks.rend(); ++it) {
+        if (it->job == job) {
+            *task = *it;
+            queue->tasks.erase(std::next(it).base());
+            queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Take a range from any queue, starting with `self`'s, -1 for a caller
+static bool find_task(int self, pool_job *job, pool_task *task)
+{
+    int i;
+    int start = self >= 0 ? self : 0;
+
+    for (i = 0; i < nqueues; i++)
+        if (take_task((start + i) % nqueues, self >= 0 && i == 0, job, task))
+            return true;
+    return false;
+}
+
+static void run_task(pool_task task)
+{
+    bool nested = in_task;
+
+    in_task = true;
+    task.job->task(task.job->arg, task.first, task.last);
+    in_task = nested;
+    // The job lives on its caller's stack, and mustn't be touched once its
+    // last range is done
+    if (task.job->remaining.fetch_sub(1) == 1) {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        done.notify_all();
+    }
+}
+
+// Pin the current thread to a core
+static void pin_thread(int cpu)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+        printf("Couldn't pin a pool thread to CPU %d\n", cpu);
+#endif
+}
+
+static void worker_loop(int self, int cpu)
+{
+    pool_task task;
+
+    if (cpu >= 0)
+        pin_thread(cpu);
+    for (;;) {
+        if (find_task(self, NULL, &task)) {
+            run_task(task);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(wake_mutex);
+        wake.wait(lock, [] { return stopping || queued > 0; });
+        if (stopping)
+            return;
+    }
+}
+
+static void stop_workers()
+{
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &worker : workers)
+        worker.join();
+    workers.clear();
+    delete[] queues;
+    queues = NULL;
+    nqueues = 0;
+    stopping = false;
+}
+
+#endif
+
+/* Start, or resize, the thread pool. No loop may be running on it
+ * Input:
+ *   - number of threads, including the calling thread. 0 for the value of
+ *     the `DETECTOR_THREADS` environment variable, or one per hardware thread
+ *   - whether to pin each worker thread to a core (Linux only). The calling
+ *     thread isn't pinned, so workers take the cores from the second one
+ * Output: None
+ */
+void init_thread_pool(int threads, bool pin)
+{
+    if (threads <= 0 && getenv("DETECTOR_THREADS"))
+        threads = atoi(getenv("DETECTOR_THREADS"));
+#if defined(HAVE_THREADS)
+    int i;
+    int cpus = (int) std::thread::hardware_concurrency();
+
+    if (cpus < 1)
+        cpus = 1;
+    if (threads <= 0)
+        threads = cpus;
+#if !defined(__linux__)
+    if (pin)
+        printf("Pinning threads isn't supported on this platform\n");
+    pin = false;
+#endif
+
+    stop_workers();
+    pool_size = threads;
+    nqueues = threads - 1;
+    if (nqueues > 0)
+        queues = new task_queue[nqueues];
+    for (i = 0; i < nqueues; i++)
+        workers.emplace_back(worker_loop, i, pin ? (i + 1) % cpus : -1);
+#else
+    threads = 1;
+#endif
+    printf("Thread pool: %d threads%s\n", threads,
+           pin && threads > 1 ? ", pinned" : "");
+}
+
+/* Number of threads running the loops, including the calling thread
+ * Input: None
+ * Output: number of threads, 1 until the pool is started
+ */
+int thread_pool_size()
+{
+    return pool_size;
+}
+
+/* Run `task(arg, first, last)` over ranges covering `[0, n)` on the thread
+ * pool, and return once they are all done. The loop runs inline when the
+ * pool has a single thread, when it is too small to split, or when it is
+ * started from within another loop. See `parallel_for()` for callables
+ * Input:
+ *   - number of items
+ *   - smallest number of items worth a range
+ *   - task and its argument
+ * Output: None
+ */
+void parallel_run(int n, int grain, parallel_task task, void *arg)
+{
+    if (n <= 0)
+        return;
+    if (grain < 1)
+        grain = 1;
+    int chunks = (n + grain - 1)/grain;
+    if (chunks > pool_size*TASKS_PER_THREAD)
+        chunks = pool_size*TASKS_PER_THREAD;
+
+#if defined(HAVE_THREADS)
+    if (pool_size > 1 && chunks > 1 && !in_task) {
+        int c;
+        pool_job job;
+        pool_task own;
+        unsigned start = next_queue++;
+
+        job.task = task;
+        job.arg = arg;
+        job.remaining = chunks;
+        for (c = 1; c < chunks; c++) {
+            task_queue *queue = &queues[(start + c) % nqueues];
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            queue->tasks.push_back({&job, (int) ((long) n*c/chunks),
+                                    (int) ((long) n*(c + 1)/chunks)});
+            queued++;
+        }
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex);
+        }
+        wake.notify_all();
+
+        run_task({&job, 0, n/chunks});
+        while (find_task(-1, &job, &own))
+            run_task(own);
+        std::unique_lock<std::mutex> lock(wake_mutex);
+        done.wait(lock, [&job] { return job.remaining == 0; });
+        return;
+    }
+#endif
+    task(arg, 0, n);
+}
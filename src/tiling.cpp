@@ -0,0 +1,470 @@
+/*
+This file implements the frame tiler.
+Letterboxing a 4K frame into the network input shrinks small objects down to
+a few pixels. The tiler instead splits the full-resolution frame into
+overlapping tiles covering `scale` frame pixels per network input pixel,
+spread evenly so that the outer tiles are aligned with the frame edges, and
+optionally adds the letterboxed frame as a global view for the objects larger
+than a tile. Tiles are fed to the network in batches of the network's batch
+size. By default a single worker runs the batches one after the other, the
+layers of each being split over the thread pool. Batches may instead be
+distributed over several workers, each running its own network sharing the
+model's weights, with a thread pool sized accordingly not to oversubscribe
+the cores. Workers are threads started with the tiler, which wait for the
+frames between them. Detections are mapped back to frame coordinates and
+merged by the non-maximum suppression of `output_frame()`, which runs over
+the detections of all the tiles at once.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+extern "C"
+{
+    #include "darknet.h"
+}
+#include "codec_def.h"
+#include "utils.h"
+#include "detector.h"
+#include "profiler.h"
+#include "pool.h"
+#include "tiling.h"
+
+#include <math.h>
+#include <string.h>
+
+#ifdef HAVE_THREADS
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#endif
+
+// Minimum overlap between a tile detection and a global view detection of
+// the same class for the object to be considered found by both
+#define MATCH_IOU .45
+
+/* Tiled inference of a frame, shared by the workers */
+typedef struct {
+    frame_job *job;
+    detector_options *options;
+    // Next batch of tiles to be run
+#ifdef HAVE_THREADS
+    std::atomic<int> next_batch;
+#else
+    int next_batch;
+#endif
+    // Detections of each tile, in frame coordinates
+    detection **dets;
+    int *counts;
+} tiled_inference;
+
+#ifdef HAVE_THREADS
+/* Threads running the networks of the tiler but the first one, which the
+ * thread inferring the frame runs */
+struct tile_workers {
+    std::vector<std::thread> threads;
+    // Guards the following, set for each frame
+    std::mutex mutex;
+    std::condition_variable start;
+    std::condition_variable done;
+    tiled_inference *inference;
+    // Frames handed to the workers
+    long frames;
+    // Workers still running the tiles of the last frame
+    int running;
+};
+#endif
+
+static void run_tile_batches(frame_tiler *tiler, int worker,
+                             tiled_inference *inference);
+
+#ifdef HAVE_THREADS
+// Run the tiles of each frame handed to the workers
+static void tile_worker(frame_tiler *tiler, int worker)
+{
+    tile_workers *w = tiler->workers;
+    long frames = 0;
+
+    while (true) {
+        tiled_inference *inference;
+        {
+            std::unique_lock<std::mutex> lock(w->mutex);
+            w->start.wait(lock, [w, frames] { return w->frames != frames; });
+            frames = w->frames;
+            inference = w->inference;
+        }
+        run_tile_batches(tiler, worker, inference);
+
+        bool last;
+        {
+            std::lock_guard<std::mutex> lock(w->mutex);
+            last = --w->running == 0;
+        }
+        if (last)
+            w->done.notify_all();
+    }
+}
+#endif
+
+/* Build a frame tiler
+ * Input:
+ *   - fraction of a tile shared with each of its neighbors
+ *   - frame pixels per network input pixel (1: full resolution)
+ *   - whether the letterboxed frame is fed to the network along with the
+ *     tiles
+ *   - number of workers running the tiles in parallel, at least 1. Must be
+ *     called once the model's layers are final
+ * Output: frame tiler
+ */
+frame_tiler *make_frame_tiler(float overlap, float scale, bool global_view,
+                              int workers)
+{
+    int i;
+    frame_tiler *tiler = (frame_tiler *) calloc(1, sizeof(frame_tiler));
+
+    tiler->overlap = overlap < 0 ? 0 : overlap > .9 ? .9 : overlap;
+    tiler->scale = scale > 0 ? scale : 1;
+    tiler->global_view = global_view;
+#ifdef HAVE_THREADS
+    if (workers < 1)
+        workers = 1;
+#else
+    workers = 1;
+#endif
+
+    tiler->models = (network **) calloc(workers, sizeof(network *));
+    tiler->inputs = (float **) calloc(workers, sizeof(float *));
+    tiler->models[0] = net;
+    for (i = 0; i < workers; i++) {
+        if (i > 0 && !(tiler->models[i] = clone_detector_network())) {
+            printf("Couldn't build tiling worker %d. Using %d workers\n", i,
+                   i);
+            break;
+        }
+        tiler->inputs[i] = (float *) calloc(net->inputs*net->batch,
+                                            sizeof(float));
+    }
+    tiler->nworkers = i;
+#ifdef HAVE_THREADS
+    // Never stopped: the tiler lasts as long as the program
+    tiler->workers = new tile_workers();
+    for (i = 1; i < tiler->nworkers; i++)
+        tiler->workers->threads.emplace_back(tile_worker, tiler, i);
+#endif
+    return tiler;
+}
+
+// Number of tiles along a dimension
+static int tile_count(int size, int tile, float overlap)
+{
+    int stride = tile*(1 - overlap);
+
+    if (size <= tile)
+        return 1;
+    if (stride < 1)
+        stride = 1;
+    return (size - tile + stride - 1)/stride + 1;
+}
+
+// Lay the tiles out over a frame, the global view first
+static void layout_tiles(frame_tiler *tiler, int w, int h)
+{
+    int i, j;
+    int tw = lroundf(net->w*tiler->scale);
+    int th = lroundf(net->h*tiler->scale);
+    int nx = tile_count(w, tw, tiler->overlap);
+    int ny = tile_count(h, th, tiler->overlap);
+    frame_tile *tile;
+
+    tiler->w = w;
+    tiler->h = h;
+    tiler->ntiles = nx*ny + tiler->global_view;
+    tiler->tiles = (frame_tile *) realloc(tiler->tiles,
+                                          tiler->ntiles*sizeof(frame_tile));
+    tile = tiler->tiles;
+    if (tiler->global_view) {
+        tile->x = tile->y = 0;
+        tile->global = true;
+        tile++;
+    }
+    for (j = 0; j < ny; j++) {
+        for (i = 0; i < nx; i++, tile++) {
+            tile->x = nx > 1 ? (long) i*(w - tw)/(nx - 1) : 0;
+            tile->y = ny > 1 ? (long) j*(h - th)/(ny - 1) : 0;
+            tile->global = false;
+        }
+    }
+}
+
+// Copy a tile of the frame into a network input of `w`x`h` pixels,
+// resampling it bilinearly unless the scale is 1. Areas beyond the frame are
+// gray, as with letterboxing
+static void crop_tile(image im, frame_tile *tile, float scale, int w, int h,
+                      float *out)
+{
+    int k, u, v;
+
+    for (k = 0; k < im.c; k++) {
+        float *plane = im.data + k*im.w*im.h;
+        for (v = 0; v < h; v++) {
+            float *row = out + (k*h + v)*w;
+            if (scale == 1) {
+                int y = tile->y + v;
+                int n = y < im.h ? im.w - tile->x : 0;
+                if (n > w)
+                    n = w;
+                if (n > 0)
+                    memcpy(row, plane + y*im.w + tile->x, n*sizeof(float));
+                for (u = n > 0 ? n : 0; u < w; u++)
+                    row[u] = .5;
+                continue;
+            }
+
+            float fy = tile->y + (v + .5f)*scale;
+            if (fy >= im.h) {
+                for (u = 0; u < w; u++)
+                    row[u] = .5;
+                continue;
+            }
+            float sy = fy - .5f < 0 ? 0 : fy - .5f;
+            int y0 = sy;
+            int y1 = y0 + 1 < im.h ? y0 + 1 : y0;
+            float dy = sy - y0;
+            const float *r0 = plane + y0*im.w;
+            const float *r1 = plane + y1*im.w;
+            for (u = 0; u < w; u++) {
+                float fx = tile->x + (u + .5f)*scale;
+                if (fx >= im.w) {
+                    row[u] = .5;
+                    continue;
+                }
+                float sx = fx - .5f < 0 ? 0 : fx - .5f;
+                int x0 = sx;
+                int x1 = x0 + 1 < im.w ? x0 + 1 : x0;
+                float dx = sx - x0;
+                float top = r0[x0]*(1 - dx) + r0[x1]*dx;
+                float bottom = r1[x0]*(1 - dx) + r1[x1]*dx;
+                row[u] = top*(1 - dy) + bottom*dy;
+            }
+        }
+    }
+}
+
+// Map boxes relative to the network input of a tile to frame coordinates
+static void map_tile_boxes(detection *dets, int n, frame_tile *tile,
+                           float scale, int w, int h)
+{
+    int i;
+    float tw = net->w*scale;
+    float th = net->h*scale;
+
+    for (i = 0; i < n; i++) {
+        box *b = &dets[i].bbox;
+        b->x = (tile->x + b->x*tw)/w;
+        b->y = (tile->y + b->y*th)/h;
+        b->w *= tw/w;
+        b->h *= th/h;
+    }
+}
+
+// Run batches of tiles through a worker's network until none are left
+static void run_tile_batches(frame_tiler *tiler, int worker,
+                             tiled_inference *inference)
+{
+    int i, b;
+    network *model = tiler->models[worker];
+    float *input = tiler->inputs[worker];
+    int batch = model->batch;
+    frame_job *job = inference->job;
+    detector_options *options = inference->options;
+
+    while ((b = inference->next_batch++)*batch < tiler->ntiles) {
+        int first = b*batch;
+        int n = tiler->ntiles - first < batch ? tiler->ntiles - first : batch;
+
+        for (i = 0; i < n; i++) {
+            frame_tile *tile = &tiler->tiles[first + i];
+            float *slot = input + i*model->inputs;
+            if (tile->global)
+                memcpy(slot, job->im_sized.data, model->inputs*sizeof(float));
+            else
+                crop_tile(job->im, tile, tiler->scale, model->w, model->h,
+                          slot);
+        }
+
+        // Layer buffers are large enough for any smaller batch
+        if (n < batch)
+            set_batch_network(model, n);
+        network_predict(model, input);
+        for (i = 0; i < n; i++) {
+            frame_tile *tile = &tiler->tiles[first + i];
+            // Boxes of the global view are relative to the letterboxed frame,
+            // those of the tiles to the network input
+            int w = tile->global ? job->im.w : model->w;
+            int h = tile->global ? job->im.h : model->h;
+            inference->dets[first + i] = get_network_boxes_batch(
+                model, i, w, h, options->objectness_thresh,
+                options->hier_thresh, &inference->counts[first + i]);
+            if (!tile->global)
+                map_tile_boxes(inference->dets[first + i],
+                               inference->counts[first + i], tile,
+                               tiler->scale, job->im.w, job->im.h);
+        }
+        if (n < batch)
+            set_batch_network(model, batch);
+    }
+}
+
+// Most likely class of a detection above the threshold, -1 if none
+static int detected_class(detection *d, float thresh)
+{
+    int j;
+    int best = -1;
+
+    for (j = 0; j < d->classes; j++)
+        if (d->prob[j] > thresh && (best < 0 || d->prob[j] > d->prob[best]))
+            best = j;
+    return best;
+}
+
+// Count the tile detections, and those the global view missed, i.e. that
+// don't overlap a global view detection of the same class
+static void count_tile_detections(frame_tiler *tiler,
+                                  tiled_inference *inference, float thresh)
+{
+    int i, j, k;
+    detection *global = tiler->global_view ? inference->dets[0] : NULL;
+    int nglobal = tiler->global_view ? inference->counts[0] : 0;
+
+    for (i = tiler->global_view; i < tiler->ntiles; i++) {
+        for (j = 0; j < inference->counts[i]; j++) {
+            detection *d = &inference->dets[i][j];
+            int cls = detected_class(d, thresh);
+            if (cls < 0)
+                continue;
+            tiler->tile_detections++;
+            for (k = 0; k < nglobal; k++)
+                if (global[k].prob[cls] > thresh
+                    && box_iou(global[k].bbox, d->bbox) > MATCH_IOU)
+                    break;
+            if (tiler->global_view && k == nglobal)
+                tiler->tile_only_detections++;
+        }
+    }
+}
+
+/* Run the object detection model on the tiles of a frame, and on its global
+ * view if enabled, and gather their detections in frame coordinates. They
+ * overlap across tiles until the non-maximum suppression
+ * Input:
+ *   - frame tiler
+ *   - frame job, with its full-resolution image and, with a global view, its
+ *     letterboxed image
+ *   - detection parameters
+ * Output: None
+ */
+void infer_tiled_frame(frame_tiler *tiler, frame_job *job,
+                       detector_options *options)
+{
+    int i, j;
+    int total = 0;
+    double time = what_time_is_it_now();
+    tiled_inference inference;
+
+    if (job->im.w != tiler->w || job->im.h != tiler->h)
+        layout_tiles(tiler, job->im.w, job->im.h);
+
+    inference.job = job;
+    inference.options = options;
+    inference.next_batch = 0;
+    inference.dets = (detection **) pool_calloc(tiler->ntiles,
+                                                sizeof(detection *));
+    inference.counts = (int *) pool_calloc(tiler->ntiles, sizeof(int));
+
+    int batches = (tiler->ntiles + net->batch - 1)/net->batch;
+#ifdef HAVE_THREADS
+    // Workers left without a batch are done as soon as they wake up
+    tile_workers *w = tiler->workers;
+    bool parallel = batches > 1 && tiler->nworkers > 1;
+    if (parallel) {
+        {
+            std::lock_guard<std::mutex> lock(w->mutex);
+            w->inference = &inference;
+            w->running = tiler->nworkers - 1;
+            w->frames++;
+        }
+        w->start.notify_all();
+    }
+#endif
+    run_tile_batches(tiler, 0, &inference);
+#ifdef HAVE_THREADS
+    if (parallel) {
+        std::unique_lock<std::mutex> lock(w->mutex);
+        w->done.wait(lock, [w] { return w->running == 0; });
+    }
+#endif
+
+    count_tile_detections(tiler, &inference, options->class_thresh);
+
+    // Gather the detections of all the tiles
+    for (i = 0; i < tiler->ntiles; i++)
+        total += inference.counts[i];
+    job->nboxes = total;
+    job->dets = make_pooled_detections(total, net->layers[net->n - 1].classes,
+                                       0);
+    detection *d = job->dets;
+    for (i = 0; i < tiler->ntiles; i++) {
+        for (j = 0; j < inference.counts[i]; j++, d++) {
+            float *prob = d->prob;
+            *d = inference.dets[i][j];
+            d->prob = prob;
+            d->mask = NULL;
+            memcpy(prob, inference.dets[i][j].prob, d->classes*sizeof(float));
+        }
+        free_pooled_detections(inference.dets[i]);
+    }
+    pool_free(inference.dets);
+    pool_free(inference.counts);
+
+    profile_end(STAGE_PREDICTION, time);
+    job->prediction_duration = what_time_is_it_now() - time;
+    tiler->frames++;
+    tiler->forward_passes += batches;
+    tiler->time += job->prediction_duration;
+}
+
+/* Print the cost of tiling and what it brings: tiles and forward passes per
+ * frame, inference time, and detections the global view alone missed
+ * Input: frame tiler
+ * Output: None
+ */
+void print_frame_tiler_stats(frame_tiler *tiler)
+{
+    if (tiler->frames == 0)
+        return;
+    printf("Tiling: %d tiles of %dx%d pixels per frame%s, %.1f forward passes per frame on %d workers, %lf seconds per frame\n",
+           tiler->ntiles - tiler->global_view,
+           (int) lroundf(net->w*tiler->scale),
+           (int) lroundf(net->h*tiler->scale),
+           tiler->global_view ? " plus the global view" : "",
+           (double) tiler->forward_passes / tiler->frames, tiler->nworkers,
+           tiler->time / tiler->frames);
+    printf("Tiling: each frame costs %d times the network evaluation of a letterboxed frame\n",
+           tiler->ntiles);
+    if (tiler->global_view)
+        printf("Tiling: %ld detections in tiles, %ld of them (%.1f%%) missed by the global view\n",
+               tiler->tile_detections, tiler->tile_only_detections,
+               tiler->tile_detections
+               ? 100. * tiler->tile_only_detections / tiler->tile_detections
+               : 0.);
+    else
+        printf("Tiling: %ld detections in tiles\n", tiler->tile_detections);
+}
@@ -0,0 +1,207 @@
+/*
+This file implements the multi-object tracker.
+Each track follows a constant-velocity model, updated with an alpha-beta
+filter (the steady-state form of a constant-velocity Kalman filter) whenever
+the object detection model runs. Detections are associated with tracks
+greedily, by decreasing IoU between the detection and the track's predicted
+box, among tracks of the same class. Unmatched detections start new tracks
+and tracks left unmatched for too long are dropped.
+On the frames the model is skipped on, each track's box is extrapolated from
+its last update, which costs a few multiplications per object.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+extern "C"
+{
+    #include "darknet.h"
+}
+#include "tracker.h"
+#include "pool.h"
+
+// Filter gains, weighting the measured position and velocity against the
+// predicted ones
+#define TRACKER_ALPHA .75
+#define TRACKER_BETA .5
+
+/* Initialize the tracker
+ * Input:
+ *   - tracker
+ *   - minimum IoU between a detection and a track to associate them
+ *   - number of consecutive unmatched updates after which a track is dropped
+ * Output: None
+ */
+void init_tracker(tracker *t, float iou_thresh, int max_misses)
+{
+    t->tracks = NULL;
+    t->n = 0;
+    t->capacity = 0;
+    t->next_id = 0;
+    t->iou_thresh = iou_thresh;
+    t->max_misses = max_misses;
+}
+
+// Extrapolate a track's box to a given frame
+static box predict_box(track *tr, int frame)
+{
+    int dt = frame - tr->frame;
+    box b = tr->bbox;
+
+    b.x += tr->velocity.x * dt;
+    b.y += tr->velocity.y * dt;
+    b.w += tr->velocity.w * dt;
+    b.h += tr->velocity.h * dt;
+    if (b.w < 0)
+        b.w = 0;
+    if (b.h < 0)
+        b.h = 0;
+    return b;
+}
+
+// Alpha-beta update of a single coordinate
+static void filter(float *x, float *v, float measured, int dt)
+{
+    float predicted = *x + *v * dt;
+    float residual = measured - predicted;
+
+    *x = predicted + TRACKER_ALPHA * residual;
+    if (dt > 0)
+        *v += TRACKER_BETA * residual / dt;
+}
+
+/* Update the tracks with the detections of a frame the model ran on
+ * Input:
+ *   - tracker
+ *   - frame number
+ *   - detections, after non-maximum suppression
+ *   - number of detections
+ *   - number of classes
+ *   - class threshold above which a detection is tracked
+ * Output: track identifier of each detection, -1 for untracked detections,
+ *         allocated from the frame pool
+ */
+int *update_tracker(tracker *t, int frame, detection *dets, int num,
+                    int classes, float thresh)
+{
+    int i, j;
+    int *ids = (int *) pool_alloc(num*sizeof(int));
+    int *det_class = (int *) pool_alloc(num*sizeof(int));
+    bool *matched = (bool *) pool_calloc(t->n, sizeof(bool));
+
+    for (i = 0; i < num; i++) {
+        ids[i] = -1;
+        det_class[i] = -1;
+        int best = max_index(dets[i].prob, classes);
+        if (dets[i].prob[best] > thresh)
+            det_class[i] = best;
+    }
+
+    // Greedy association by decreasing IoU
+    for (;;) {
+        float best_iou = t->iou_thresh;
+        int best_det = -1, best_track = -1;
+        for (i = 0; i < num; i++) {
+            if (det_class[i] < 0 || ids[i] >= 0)
+                continue;
+            for (j = 0; j < t->n; j++) {
+                if (matched[j] || t->tracks[j].class_id != det_class[i])
+                    continue;
+                float iou = box_iou(dets[i].bbox,
+                                    predict_box(&t->tracks[j], frame));
+                if (iou > best_iou) {
+                    best_iou = iou;
+                    best_det = i;
+                    best_track = j;
+                }
+            }
+        }
+        if (best_det < 0)
+            break;
+
+        track *tr = &t->tracks[best_track];
+        box z = dets[best_det].bbox;
+        int dt = frame - tr->frame;
+        filter(&tr->bbox.x, &tr->velocity.x, z.x, dt);
+        filter(&tr->bbox.y, &tr->velocity.y, z.y, dt);
+        filter(&tr->bbox.w, &tr->velocity.w, z.w, dt);
+        filter(&tr->bbox.h, &tr->velocity.h, z.h, dt);
+        tr->prob = dets[best_det].prob[tr->class_id];
+        tr->frame = frame;
+        tr->misses = 0;
+        matched[best_track] = true;
+        ids[best_det] = tr->id;
+    }
+
+    // Age unmatched tracks and drop the stale ones
+    for (i = 0, j = 0; i < t->n; i++) {
+        if (!matched[i] && ++t->tracks[i].misses > t->max_misses)
+            continue;
+        t->tracks[j++] = t->tracks[i];
+    }
+    t->n = j;
+
+    // Start new tracks
+    for (i = 0; i < num; i++) {
+        if (det_class[i] < 0 || ids[i] >= 0)
+            continue;
+        if (t->n == t->capacity) {
+            t->capacity = t->capacity ? 2*t->capacity : 16;
+            t->tracks = (track *) realloc(t->tracks,
+                                          t->capacity*sizeof(track));
+        }
+        track *tr = &t->tracks[t->n++];
+        tr->id = t->next_id++;
+        tr->class_id = det_class[i];
+        tr->prob = dets[i].prob[det_class[i]];
+        tr->bbox = dets[i].bbox;
+        tr->velocity.x = tr->velocity.y = tr->velocity.w = tr->velocity.h = 0;
+        tr->frame = frame;
+        tr->misses = 0;
+        ids[i] = tr->id;
+    }
+
+    pool_free(matched);
+    pool_free(det_class);
+    return ids;
+}
+
+/* Propagate the tracks to a frame the model was skipped on
+ * Input:
+ *   - tracker
+ *   - frame number
+ *   - number of classes
+ *   - number of detections (output)
+ *   - track identifier of each detection (output)
+ * Output: one detection per live track, allocated from the frame pool
+ */
+detection *predict_tracks(tracker *t, int frame, int classes, int *num,
+                          int **ids)
+{
+    int i, n = 0;
+    detection *dets = make_pooled_detections(t->n, classes, 0);
+
+    *ids = (int *) pool_alloc(t->n*sizeof(int));
+    for (i = 0; i < t->n; i++) {
+        track *tr = &t->tracks[i];
+        // Tracks that missed the last update are kept around to be matched
+        // again, but not reported
+        if (tr->misses > 0)
+            continue;
+        dets[n].bbox = predict_box(tr, frame);
+        dets[n].prob[tr->class_id] = tr->prob;
+        dets[n].objectness = tr->prob;
+        dets[n].sort_class = tr->class_id;
+        (*ids)[n] = tr->id;
+        n++;
+    }
+
+    *num = n;
+    return dets;
+}
@@ -13,6 +13,7 @@ Based on darknet, YOLO LICENSE https://github.com/pjreddie/darknet/blob/master/L
 */
 
 #include <assert.h>
+#include <string.h>
 
 extern "C" {
     #include "image.h"
@@ -20,6 +21,7 @@ extern "C" {
 }
 #include "codec_def.h"
 #include "utils.h"
+#include "pool.h"
 
 // Print detection probability for each object detected
 void print_detection_probabilities(image im, detection *dets, int num,
@@ -41,6 +43,31 @@ void print_detection_probabilities(image im, detection *dets, int num,
         printf("No objects detected\n");
 }
 
+// Print detection probability for each object detected, along with the
+// identifier of the track following the object
+void print_tracked_detections(detection *dets, int num, int *ids, float thresh,
+                              char **names, int classes)
+{
+    int i, j;
+    bool found = false;
+
+    for (i = 0; i < num; i++) {
+        for (j = 0; j < classes; j++) {
+            if (dets[i].prob[j] > thresh) {
+                if (ids[i] >= 0)
+                    printf("%s #%d: %.0f%%\n", names[j], ids[i],
+                           dets[i].prob[j]*100);
+                else
+                    printf("%s: %.0f%%\n", names[j], dets[i].prob[j]*100);
+                found = true;
+            }
+        }
+    }
+
+    if (!found)
+        printf("No objects detected\n");
+}
+
 // Linearize OpenH264 frame buffer and revert chroma subsampling by doubling Cb
 // and Cr pixels.
 // OpenH264 outputs frames whose rows are not contiguous (separated by a
@@ -70,7 +97,7 @@ void linearize_openh264_frame_buffer(SBufferInfo *bufInfo,
         for (j = 0; j < w; j++)
             buffer_linearized[j + i*w] = ptr[j/2];
         // Use each Cb row twice
-        if(i > 0 && i % 2 == 0)
+        if (i % 2 == 1)
             ptr += stride1;
     }
 
@@ -81,7 +108,7 @@ void linearize_openh264_frame_buffer(SBufferInfo *bufInfo,
         for (j = 0; j < w; j++)
             buffer_linearized[j + i*w] = ptr[j/2];
         // Use each Cr row twice
-        if (i > 0 && i % 2 == 0)
+        if (i % 2 == 1)
             ptr += stride1;
     }
 }
@@ -122,7 +149,7 @@ static void stbi__YCbCr_to_RGB_row(stbi_uc *out, const stbi_uc *y,
 //   3 - Transform to RGB color space
 //   4 - Convert integer array to Darknet image (float array)
 // Input: OpenH264 I420 frame buffer
-// Output: Darknet-compatible RGB image
+// Output: Darknet-compatible RGB image, allocated from the frame pool
 image load_image_from_raw_yuv(SBufferInfo *bufInfo)
 {
     int i;
@@ -130,7 +157,7 @@ image load_image_from_raw_yuv(SBufferInfo *bufInfo)
     int h = bufInfo->UsrData.sSystemBuffer.iHeight;
     unsigned char *yuv_frame;
 
-    yuv_frame = (unsigned char *) malloc(w*h*CHANNELS);
+    yuv_frame = (unsigned char *) pool_alloc(w*h*CHANNELS);
 
     // Linearize OpenH264 frame buffer and revert chroma subsampling
     linearize_openh264_frame_buffer(bufInfo, yuv_frame);
@@ -140,17 +167,11 @@ image load_image_from_raw_yuv(SBufferInfo *bufInfo)
                            yuv_frame + w*h*2, w, h);
 
     // Convert RGB frame to Darknet image (float array)
-    image im = make_image(w, h, CHANNELS);
+    image im = make_pooled_image(w, h, CHANNELS);
     for (i = 0; i < w*h*CHANNELS; i++)
         im.data[i] = (float)yuv_frame[i]/255.;
 
-    free(yuv_frame);
-
-    if ((h && w) && (h != im.h || w != im.w)) {
-        image resized = resize_image(im, w, h);
-        free_image(im);
-        im = resized;
-    }
+    pool_free(yuv_frame);
 
     return im;
 }
@@ -171,3 +192,67 @@ image **load_alphabet_from_path(const char *label_path)
     return alphabets;
 }
 
+
+// Copy an OpenH264 I420 frame into a buffer from the frame pool.
+// The decoder reuses its frame buffer once the frame callback returns, so
+// frames processed asynchronously have to be copied first. The copy keeps the
+// I420 layout, with rows packed contiguously
+SBufferInfo *copy_yuv_frame(SBufferInfo *bufInfo)
+{
+    int i;
+    int w = bufInfo->UsrData.sSystemBuffer.iWidth;
+    int h = bufInfo->UsrData.sSystemBuffer.iHeight;
+    int cw = (w + 1) / 2;
+    int ch = (h + 1) / 2;
+    SBufferInfo *copy = (SBufferInfo *) pool_alloc(sizeof(SBufferInfo));
+    unsigned char *data = (unsigned char *) pool_alloc(w*h + 2*cw*ch);
+
+    *copy = *bufInfo;
+    copy->UsrData.sSystemBuffer.iStride[0] = w;
+    copy->UsrData.sSystemBuffer.iStride[1] = cw;
+    copy->pDst[0] = data;
+    copy->pDst[1] = data + w*h;
+    copy->pDst[2] = data + w*h + cw*ch;
+
+    for (i = 0; i < h; i++)
+        memcpy(copy->pDst[0] + i*w,
+               bufInfo->pDst[0] + i*bufInfo->UsrData.sSystemBuffer.iStride[0],
+               w);
+    for (i = 0; i < ch; i++) {
+        memcpy(copy->pDst[1] + i*cw,
+               bufInfo->pDst[1] + i*bufInfo->UsrData.sSystemBuffer.iStride[1],
+               cw);
+        memcpy(copy->pDst[2] + i*cw,
+               bufInfo->pDst[2] + i*bufInfo->UsrData.sSystemBuffer.iStride[1],
+               cw);
+    }
+
+    return copy;
+}
+
+void free_yuv_frame(SBufferInfo *bufInfo)
+{
+    if (!bufInfo)
+        return;
+    pool_free(bufInfo->pDst[0]);
+    pool_free(bufInfo);
+}
+
+// Deep copy a detection array into the frame pool, so that it can be freed
+// independently with `free_pooled_detections()`. Masks are not copied
+detection *copy_detections(detection *dets, int num)
+{
+    int i;
+    int classes = num > 0 ? dets[0].classes : 0;
+    detection *copy = make_pooled_detections(num, classes, 0);
+
+    for (i = 0; i < num; i++) {
+        float *prob = copy[i].prob;
+        copy[i] = dets[i];
+        copy[i].prob = prob;
+        copy[i].mask = NULL;
+        memcpy(prob, dets[i].prob, classes*sizeof(float));
+    }
+
+    return copy;
+}
@@ -0,0 +1,212 @@
+/*
+This file implements the asynchronous image writer.
+Images to be saved are queued to a background thread, which encodes and
+writes them in order with `save_image_options()`, or appends them to an H.264
+video (see `encoder.h`). The queue is bounded: when it is full, the output
+stage either waits for room or drops the image, depending on the policy. On
+targets without threads, images are saved synchronously.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+*/
+
+extern "C"
+{
+    #include "darknet.h"
+}
+#include "codec_def.h"
+#include "utils.h"
+#include "pool.h"
+#include "profiler.h"
+#include "encoder.h"
+#include "writer.h"
+
+#include <string.h>
+#ifdef HAVE_THREADS
+#include "bounded_queue.h"
+
+#include <thread>
+#endif
+
+/* An image waiting to be saved */
+typedef struct {
+    image im;
+    long long pts;
+    // Output file path, without extension
+    char path[];
+} save_request;
+
+struct image_writer {
+    IMTYPE format;
+    int quality;
+    // Encoder of the H.264 video the images are appended to, NULL to save
+    // them as individual files
+    h264_encoder *encoder;
+    writer_policy policy;
+    int saved;
+    // Images the encoder or the image library failed to write
+    int failed;
+    int dropped;
+    double duration;
+#ifdef HAVE_THREADS
+    bounded_queue<save_request *> *queue;
+    std::thread thread;
+#endif
+};
+
+static const char *extensions[] = {"png", "bmp", "tga", "jpg"};
+
+// Save an image as a file, and return whether it was written.
+// `save_image_options()` doesn't return its result, so the file is removed
+// first and looked for afterwards
+static bool save_image_file(image_writer *writer, save_request *request)
+{
+    char file[4096];
+    FILE *f;
+
+    snprintf(file, sizeof(file), "%s.%s", request->path,
+             extensions[writer->format]);
+    remove(file);
+    save_image_options(request->im, request->path, writer->format,
+                       writer->quality);
+    if (!(f = fopen(file, "rb")))
+        return false;
+    fclose(f);
+    return true;
+}
+
+// Save an image and give it back to the frame pool
+static void save_request_image(image_writer *writer, save_request *request)
+{
+    double time = what_time_is_it_now();
+    bool saved;
+
+    if (writer->encoder)
+        saved = encode_image(writer->encoder, request->im, request->pts);
+    else
+        saved = save_image_file(writer, request);
+    profile_end(STAGE_SAVE, time);
+    writer->duration += what_time_is_it_now() - time;
+    if (saved)
+        writer->saved++;
+    else
+        writer->failed++;
+    free_pooled_image(request->im);
+    pool_free(request);
+}
+
+#ifdef HAVE_THREADS
+static void writer_thread(image_writer *writer)
+{
+    save_request *request;
+
+    while ((request = writer->queue->pop()))
+        save_request_image(writer, request);
+}
+#endif
+
+/* Start the image writer
+ * Input:
+ *   - image format
+ *   - encoding quality, from 1 to 100 (JPEG only)
+ *   - number of images queued before the policy applies
+ *   - what to do when the queue is full
+ * Output: image writer
+ */
+image_writer *start_image_writer(IMTYPE format, int quality, int queue_depth,
+                                 writer_policy policy)
+{
+    image_writer *writer = new image_writer();
+
+    writer->format = format;
+    writer->quality = quality;
+    writer->policy = policy;
+#ifdef HAVE_THREADS
+    writer->queue = new bounded_queue<save_request *>(queue_depth);
+    writer->thread = std::thread(writer_thread, writer);
+#endif
+    return writer;
+}
+
+/* Start an image writer appending the images to an H.264 video
+ * Input:
+ *   - video file path
+ *   - target bitrate, in kilobits per second
+ *   - intra period (group of pictures), in frames
+ *   - number of images queued before the policy applies
+ *   - what to do when the queue is full
+ * Output: image writer, NULL if the video couldn't be created
+ */
+image_writer *start_video_writer(const char *path, int bitrate, int gop,
+                                 int queue_depth, writer_policy policy)
+{
+    h264_encoder *encoder = open_h264_encoder(path, bitrate, gop);
+
+    if (!encoder)
+        return NULL;
+    image_writer *writer = start_image_writer(JPG, 0, queue_depth, policy);
+    writer->encoder = encoder;
+    return writer;
+}
+
+/* File extension of the saved images, NULL if they are appended to a video */
+const char *image_writer_extension(image_writer *writer)
+{
+    return writer->encoder ? NULL : extensions[writer->format];
+}
+
+/* Queue an image to be saved
+ * Input:
+ *   - image writer
+ *   - image, allocated from the frame pool. The writer takes ownership of it
+ *   - output file path, without extension
+ *   - presentation timestamp, in milliseconds
+ * Output: None
+ */
+void save_image_async(image_writer *writer, image im, const char *path,
+                      long long pts)
+{
+    save_request *request =
+        (save_request *) pool_alloc(sizeof(save_request) + strlen(path) + 1);
+
+    request->im = im;
+    request->pts = pts;
+    strcpy(request->path, path);
+#ifdef HAVE_THREADS
+    if (writer->policy == WRITER_BLOCK) {
+        writer->queue->push(request);
+    } else if (!writer->queue->try_push(request)) {
+        // Only the output stage queues images: no need to lock the counter
+        writer->dropped++;
+        free_pooled_image(im);
+        pool_free(request);
+    }
+#else
+    save_request_image(writer, request);
+#endif
+}
+
+/* Wait for the queued images to be saved, stop the writer and print its
+ * statistics
+ * Input: image writer
+ * Output: None
+ */
+void finish_image_writer(image_writer *writer)
+{
+#ifdef HAVE_THREADS
+    writer->queue->push(NULL);
+    writer->thread.join();
+    delete writer->queue;
+#endif
+    printf("Image writer: %d images saved (%lf seconds), %d failed, %d dropped\n",
+           writer->saved, writer->duration, writer->failed, writer->dropped);
+    if (writer->encoder)
+        close_h264_encoder(writer->encoder);
+    delete writer;
+}
@@ -0,0 +1,873 @@
+/*
+This file contains the benchmark harness, run by the `bench` target of both
+Makefiles.
+Synthetic I420 frames (moving gradient and boxes, so that consecutive frames
+differ) are generated at several resolutions and fed to the detector without
+going through the decoder. For each model and resolution, the following
+stages are timed frame by frame, separately and end to end:
+  - preprocess: conversion and letterboxing of the frame into the model input
+  - inference: network forward pass
+  - postprocess: box extraction and non-maximum suppression
+  - end_to_end: preparation, prediction and output of the frame
+When an H.264 video is given, decoding is timed as well.
+The SIMD preprocessing kernel is checked against its scalar reference on
+random frames of odd sizes and strides, and so is the RGB to I420 kernel of
+the H.264 encoder on random images of odd sizes. The harness fails if they
+differ.
+The non-maximum suppression is also benchmarked on its own, on synthetic
+detections: darknet's `do_nms_sort()` against the engine of `nms.cpp`, in its
+default, class-agnostic and soft modes. The default mode is checked to
+suppress the same boxes as `do_nms_sort()`, and the harness fails otherwise.
+Likewise, the layers running the Winograd algorithm are checked against
+im2col and GEMM, on synthetic layers with random weights and when each model
+is loaded.
+A GEMM microbenchmark times the GEMM backend against a naive triple loop on
+square and convolution-shaped products, checks that they agree, and reports
+the GFLOP/s reached against the theoretical peak of the micro-kernel. The
+int8 GEMM of the quantized convolutions is timed on the same shapes and
+checked to match an exact integer loop.
+The forward pass of each model is timed with thread pools of increasing
+sizes, for a scaling curve from 1 to N cores, and its outputs are checked to
+be the same whatever the number of threads.
+Results are appended to a CSV file with one line per model, resolution and
+stage: frames per second, median and 99th percentile per-frame latency, and
+peak memory (resident set size natively, linear memory size on WebAssembly).
+
+Usage: vod_bench [-models yolov3,yolov3-tiny] [-resolutions 480p,720p,...]
+                 [-frames <n>] [-video <file.h264>] [-tag <label>]
+                 [-nms_boxes 100,1000,...] [-gemm_sizes MxNxK,...]
+                 [-gemm_threads <n>] [-cpu_ghz <f>] [-threads 1,2,4,...]
+                 [-pin_threads] [-out <results.csv>]
+Models are looked up as `program_data/<model>.cfg` and `.weights`.
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+Based on darknet, YOLO LICENSE https://github.com/pjreddie/darknet/blob/master/LICENSE
+*/
+
+extern "C"
+{
+    #include "darknet.h"
+    #include "gemm.h"
+}
+#include "codec_def.h"
+#include "h264dec.h"
+#include "utils.h"
+#include "detector.h"
+#include "pool.h"
+#include "preprocess.h"
+#include "encoder.h"
+#include "nms.h"
+#include "convolution.h"
+#include "gemm_packed.h"
+#include "gemm_int8.h"
+#include "thread_pool.h"
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#ifdef HAVE_THREADS
+#include <thread>
+#endif
+#if defined(__wasi__)
+#define BENCH_TARGET "wasm"
+#else
+#define BENCH_TARGET "native"
+#include <sys/resource.h>
+#endif
+
+#define WARMUP_FRAMES 2
+#define NMS_CLASSES 80
+// Rounds of the naive GEMM, which is too slow to run as many times as the
+// backend
+#define NAIVE_GEMM_ROUNDS 3
+
+typedef struct {
+    const char *name;
+    int w, h;
+} resolution;
+
+static const resolution resolutions[] = {
+    {"480p", 854, 480},
+    {"720p", 1280, 720},
+    {"1080p", 1920, 1080},
+    {"4K", 3840, 2160},
+};
+
+static FILE *results;
+static const char *tag;
+
+/* Per-frame latencies of the decoding benchmark */
+static std::vector<double> decode_latencies;
+static double decode_last;
+
+// Peak memory usage, in MiB
+static double peak_memory()
+{
+#if defined(__wasi__)
+    // Linear memory never shrinks: its current size is its peak size
+    return __builtin_wasm_memory_size(0) * 65536. / (1 << 20);
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.;
+#endif
+}
+
+// Nearest-rank percentile of sorted latencies
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    size_t rank = (size_t) (p * sorted.size() + .999999);
+    if (rank < 1)
+        rank = 1;
+    return sorted[std::min(rank, sorted.size()) - 1];
+}
+
+// Append a result line
+static void report(const char *model, const char *res, int w, int h,
+                   const char *stage, std::vector<double> latencies)
+{
+    double total = 0;
+
+    if (latencies.empty())
+        return;
+    for (double l : latencies)
+        total += l;
+    std::sort(latencies.begin(), latencies.end());
+    double fps = latencies.size() / total;
+    double p50 = percentile(latencies, .5) * 1e3;
+    double p99 = percentile(latencies, .99) * 1e3;
+    double memory = peak_memory();
+
+    fprintf(results, "%s,%s,%s,%s,%d,%d,%s,%d,%.3f,%.3f,%.3f,%.1f\n",
+            BENCH_TARGET, tag, model, res, w, h, stage,
+            (int) latencies.size(), fps, p50, p99, memory);
+    fflush(results);
+    printf("[bench] %-12s %-6s %-11s %8.3f fps  p50 %9.3f ms  p99 %9.3f ms  peak %8.1f MiB\n",
+           model, res, stage, fps, p50, p99, memory);
+}
+
+// Allocate a synthetic I420 frame
+static SBufferInfo *make_frame(int w, int h)
+{
+    SBufferInfo *frame = (SBufferInfo *) calloc(1, sizeof(SBufferInfo));
+    unsigned char *data = (unsigned char *) malloc(w*h + 2*(w/2)*(h/2));
+
+    frame->UsrData.sSystemBuffer.iWidth = w;
+    frame->UsrData.sSystemBuffer.iHeight = h;
+    frame->UsrData.sSystemBuffer.iStride[0] = w;
+    frame->UsrData.sSystemBuffer.iStride[1] = w/2;
+    frame->pDst[0] = data;
+    frame->pDst[1] = data + w*h;
+    frame->pDst[2] = data + w*h + (w/2)*(h/2);
+    return frame;
+}
+
+// Draw the `t`-th synthetic frame: a diagonal gradient scrolling over time
+// and a few boxes moving across it
+static void draw_frame(SBufferInfo *frame, int t)
+{
+    int x, y, i;
+    int w = frame->UsrData.sSystemBuffer.iWidth;
+    int h = frame->UsrData.sSystemBuffer.iHeight;
+
+    for (y = 0; y < h; y++)
+        for (x = 0; x < w; x++)
+            frame->pDst[0][y*w + x] = (x + y + 4*t) & 255;
+    for (y = 0; y < h/2; y++) {
+        for (x = 0; x < w/2; x++) {
+            frame->pDst[1][y*(w/2) + x] = 128 + ((x - t) & 63) - 32;
+            frame->pDst[2][y*(w/2) + x] = 128 + ((y + t) & 63) - 32;
+        }
+    }
+    for (i = 0; i < 3; i++) {
+        int bw = w/(6 + 2*i), bh = h/(4 + i);
+        int bx = (i*w/3 + t*(8 + 4*i)) % (w - bw);
+        int by = (i*h/4 + t*(2 + i)) % (h - bh);
+        for (y = by; y < by + bh; y++)
+            memset(frame->pDst[0] + y*w + bx, 40 + 80*i, bw);
+    }
+}
+
+static void on_decoded_frame(SBufferInfo *bufInfo)
+{
+    double now = what_time_is_it_now();
+    decode_latencies.push_back(now - decode_last);
+    decode_last = what_time_is_it_now();
+}
+
+// Benchmark one model on one resolution
+static void bench_resolution(const char *model, const resolution *res,
+                             int frames, detector_options *options)
+{
+    int i;
+    int w = res->w, h = res->h;
+    layer l = net->layers[net->n - 1];
+    std::vector<double> pre, infer, post, e2e;
+    SBufferInfo *frame = make_frame(w, h);
+
+    for (i = 0; i < frames + WARMUP_FRAMES; i++) {
+        bool warm = i >= WARMUP_FRAMES;
+        frame_job job;
+        double time;
+        int nboxes = 0;
+
+        draw_frame(frame, i);
+
+        // Stages, separately
+        memset(&job, 0, sizeof(job));
+        time = what_time_is_it_now();
+        prepare_frame(&job, frame, options);
+        if (warm)
+            pre.push_back(what_time_is_it_now() - time);
+
+        time = what_time_is_it_now();
+        network_predict(net, job.im_sized.data);
+        if (warm)
+            infer.push_back(what_time_is_it_now() - time);
+
+        time = what_time_is_it_now();
+        detection *dets = get_network_boxes_batch(net, 0, w, h,
+                                                  options->objectness_thresh,
+                                                  options->hier_thresh,
+                                                  &nboxes);
+        nms_detections(dets, nboxes, l.classes, NULL, 0, options->nms);
+        free_pooled_detections(dets);
+        if (warm)
+            post.push_back(what_time_is_it_now() - time);
+        free_pooled_image(job.im);
+        free_pooled_image(job.im_sized);
+
+        // End to end
+        memset(&job, 0, sizeof(job));
+        job.index = i;
+        time = what_time_is_it_now();
+        prepare_frame(&job, frame, options);
+        predict_frame(&job, options);
+        output_frame(&job, options);
+        if (warm)
+            e2e.push_back(what_time_is_it_now() - time);
+    }
+
+    report(model, res->name, w, h, "preprocess", pre);
+    report(model, res->name, w, h, "inference", infer);
+    report(model, res->name, w, h, "postprocess", post);
+    report(model, res->name, w, h, "end_to_end", e2e);
+
+    free(frame->pDst[0]);
+    free(frame);
+}
+
+// Allocate a random I420 frame of odd size, whose rows are padded to odd
+// strides as the decoder's may be
+static SBufferInfo *make_odd_frame(int w, int h, unsigned *seed)
+{
+    int i;
+    int stride0 = w + 7, stride1 = (w + 1)/2 + 5;
+    int size = stride0*h + 2*stride1*((h + 1)/2);
+    SBufferInfo *frame = (SBufferInfo *) calloc(1, sizeof(SBufferInfo));
+    unsigned char *data = (unsigned char *) malloc(size);
+
+    for (i = 0; i < size; i++) {
+        *seed = *seed*1103515245u + 12345u;
+        data[i] = *seed >> 16;
+    }
+    frame->UsrData.sSystemBuffer.iWidth = w;
+    frame->UsrData.sSystemBuffer.iHeight = h;
+    frame->UsrData.sSystemBuffer.iStride[0] = stride0;
+    frame->UsrData.sSystemBuffer.iStride[1] = stride1;
+    frame->pDst[0] = data;
+    frame->pDst[1] = data + stride0*h;
+    frame->pDst[2] = data + stride0*h + stride1*((h + 1)/2);
+    return frame;
+}
+
+// Check the SIMD preprocessing kernel against the scalar reference, on
+// frames downscaled and upscaled into model inputs, and return the number of
+// frames on which they differ by more than rounding
+static int check_preprocess()
+{
+    static const int sizes[][4] = {
+        // Frame, then model input
+        {853, 479, 416, 416},
+        {1281, 721, 608, 352},
+        {97, 63, 416, 416},
+        {33, 301, 320, 320},
+        {3, 5, 32, 32},
+    };
+    unsigned seed = 1;
+    int failures = 0;
+
+    for (const int *size : sizes) {
+        SBufferInfo *frame = make_odd_frame(size[0], size[1], &seed);
+        int n = size[2]*size[3]*CHANNELS;
+        std::vector<float> scalar(n), simd(n);
+        float error = 0;
+        int i;
+
+        letterbox_yuv420_scalar(frame, size[2], size[3], scalar.data());
+        letterbox_yuv420(frame, size[2], size[3], simd.data());
+        for (i = 0; i < n; i++)
+            error = std::max(error, fabsf(simd[i] - scalar[i]));
+        // Pixels are converted to bytes by both kernels, so anything beyond
+        // float rounding is a wrong pixel
+        bool mismatch = error > 1e-5;
+        failures += mismatch;
+        printf("[bench] preprocess %dx%d -> %dx%d, error %.2e%s\n", size[0],
+               size[1], size[2], size[3], error,
+               mismatch ? ": MISMATCH" : "");
+        free(frame->pDst[0]);
+        free(frame);
+    }
+    return failures;
+}
+
+// Check the SIMD RGB to I420 kernel of the encoder against the scalar
+// reference, on random images of odd sizes, and return the number of images
+// on which they differ by more than rounding
+static int check_i420_conversion()
+{
+    static const int sizes[][2] = {{853, 479}, {417, 33}, {9, 7}, {3, 3}};
+    int failures = 0;
+
+    for (const int *size : sizes) {
+        image im = make_image(size[0], size[1], CHANNELS);
+        int w = size[0] & ~1, h = size[1] & ~1;
+        int n = w*h + 2*(w/2)*(h/2);
+        std::vector<unsigned char> scalar(n), simd(n);
+        int i, error = 0;
+
+        for (i = 0; i < im.w*im.h*im.c; i++)
+            im.data[i] = rand_uniform(0, 1);
+        image_to_i420_scalar(im, scalar.data(), scalar.data() + w*h,
+                             scalar.data() + w*h + (w/2)*(h/2));
+        image_to_i420(im, simd.data(), simd.data() + w*h,
+                      simd.data() + w*h + (w/2)*(h/2));
+        for (i = 0; i < n; i++)
+            error = std::max(error, abs(simd[i] - scalar[i]));
+        // Sums may be ordered differently, which may round a value halfway
+        // between two levels either way
+        bool mismatch = error > 1;
+        failures += mismatch;
+        printf("[bench] i420 %dx%d, error %d%s\n", size[0], size[1], error,
+               mismatch ? ": MISMATCH" : "");
+        free_image(im);
+    }
+    return failures;
+}
+
+// Check the Winograd algorithm against im2col and GEMM on synthetic 3x3
+// layers with random weights, so that it is checked without any model. Odd
+// output sizes clip the last tiles of each row and column, tile counts
+// aren't multiples of the block size, and batches have several inputs.
+// Return the number of layers whose error exceeds the tolerance
+static int check_synthetic_convolutions()
+{
+    static const int shapes[][5] = {
+        // Input channels, output channels, width, height, batch
+        {16, 32, 37, 29, 2},
+        {64, 64, 13, 11, 3},
+        {255, 128, 19, 21, 2},
+        {64, 255, 45, 33, 2},
+    };
+    int i, j;
+    int n = sizeof(shapes)/sizeof(shapes[0]);
+    std::vector<layer> layers(n);
+    network synthetic = {};
+
+    for (i = 0; i < n; i++) {
+        layer *l = &layers[i];
+        memset(l, 0, sizeof(*l));
+        l->type = CONVOLUTIONAL;
+        l->c = shapes[i][0];
+        l->n = shapes[i][1];
+        l->w = l->out_w = shapes[i][2];
+        l->h = l->out_h = shapes[i][3];
+        l->batch = shapes[i][4];
+        l->size = 3;
+        l->stride = 1;
+        l->pad = 1;
+        l->groups = 1;
+        l->inputs = l->w*l->h*l->c;
+        l->outputs = l->out_w*l->out_h*l->n;
+        l->nweights = 9*l->c*l->n;
+        l->weights = (float *) malloc(l->nweights*sizeof(float));
+        for (j = 0; j < l->nweights; j++)
+            l->weights[j] = rand_uniform(-1, 1);
+        l->workspace_size = (size_t) l->out_w*l->out_h*9*l->c*sizeof(float);
+    }
+    synthetic.n = n;
+    synthetic.layers = layers.data();
+    select_convolution_algorithms(&synthetic);
+    int failures = check_convolution_algorithms(&synthetic);
+    for (i = 0; i < n; i++)
+        free(layers[i].weights);
+    return failures;
+}
+
+// Pseudo-random number in [0, 1)
+static float random_unit(unsigned *seed)
+{
+    *seed = *seed*1103515245u + 12345u;
+    return ((*seed >> 8) & 0xffffff)/16777216.f;
+}
+
+// Synthetic detections for the suppression benchmark: clusters of jittered
+// boxes, like the model outputs around each object, one box in 8 being
+// detected as a second class. Objectness tags each detection with its index,
+// since `do_nms_sort()` reorders them. Probabilities are all different:
+// `do_nms_sort()` breaks ties with `qsort()`, which isn't stable, and the
+// engine by index, so that they may suppress different boxes of equal
+// probability
+static detection *make_nms_detections(int n)
+{
+    int i;
+    unsigned seed = n;
+    detection *dets = make_pooled_detections(n, NMS_CLASSES, 0);
+    float x = 0, y = 0, size = 0;
+    int cls = 0, next = 0;
+    // Distinct probabilities, spread over [0.1, 1) in a random order
+    std::vector<int> ranks(2*n);
+
+    for (i = 0; i < 2*n; i++)
+        ranks[i] = i;
+    for (i = 2*n - 1; i > 0; i--)
+        std::swap(ranks[i], ranks[(int) (random_unit(&seed)*(i + 1))]);
+    auto probability = [&]() {
+        return .1f + .9f*(ranks[next++] + .5f)/(2*n);
+    };
+
+    for (i = 0; i < n; i++) {
+        if (i % 12 == 0) {
+            x = random_unit(&seed);
+            y = random_unit(&seed);
+            size = .02 + .2*random_unit(&seed);
+            cls = random_unit(&seed)*NMS_CLASSES;
+        }
+        dets[i].bbox.x = x + size*(random_unit(&seed) - .5f)*.5f;
+        dets[i].bbox.y = y + size*(random_unit(&seed) - .5f)*.5f;
+        dets[i].bbox.w = size*(.7f + .6f*random_unit(&seed));
+        dets[i].bbox.h = size*(.7f + .6f*random_unit(&seed));
+        dets[i].objectness = 1 + i;
+        dets[i].sort_class = 0;
+        memset(dets[i].prob, 0, NMS_CLASSES*sizeof(float));
+        dets[i].prob[cls] = probability();
+        if (i % 8 == 0)
+            dets[i].prob[(cls + 1) % NMS_CLASSES] = probability();
+    }
+    return dets;
+}
+
+static detection *copy_nms_detections(detection *src, int n)
+{
+    int i;
+    detection *dets = make_pooled_detections(n, NMS_CLASSES, 0);
+
+    for (i = 0; i < n; i++) {
+        float *prob = dets[i].prob;
+        dets[i] = src[i];
+        dets[i].prob = prob;
+        memcpy(prob, src[i].prob, NMS_CLASSES*sizeof(float));
+    }
+    return dets;
+}
+
+// Time a suppression function on a fresh copy of the detections
+template <typename F>
+static detection *time_nms(detection *src, int n, std::vector<double> *out,
+                           bool warm, F suppress)
+{
+    detection *dets = copy_nms_detections(src, n);
+    double time = what_time_is_it_now();
+    suppress(dets);
+    if (warm)
+        out->push_back(what_time_is_it_now() - time);
+    return dets;
+}
+
+// Benchmark the non-maximum suppression on `n` synthetic detections, and
+// return the number of detections whose probabilities differ between
+// `do_nms_sort()` and the engine
+static int bench_nms(int n, int rounds)
+{
+    int i, r, mismatches = 0;
+    char label[16];
+    std::vector<double> darknet, engine, agnostic, soft;
+    nms_options hard = {.45, false, false, .5, .1};
+    nms_options agnostic_options = {.45, true, false, .5, .1};
+    nms_options soft_options = {.45, false, true, .5, .1};
+    detection *src = make_nms_detections(n);
+
+    for (r = 0; r < rounds + WARMUP_FRAMES; r++) {
+        bool warm = r >= WARMUP_FRAMES;
+        detection *ref = time_nms(src, n, &darknet, warm, [n](detection *d) {
+            do_nms_sort(d, n, NMS_CLASSES, .45);
+        });
+        detection *dets = time_nms(src, n, &engine, warm,
+                                   [n, &hard](detection *d) {
+            nms_detections(d, n, NMS_CLASSES, NULL, 0, &hard);
+        });
+        if (r == 0) {
+            for (i = 0; i < n; i++) {
+                int index = (int) ref[i].objectness - 1;
+                if (memcmp(ref[i].prob, dets[index].prob,
+                           NMS_CLASSES*sizeof(float)))
+                    mismatches++;
+            }
+        }
+        free_pooled_detections(ref);
+        free_pooled_detections(dets);
+
+        free_pooled_detections(time_nms(src, n, &agnostic, warm,
+                                        [n, &agnostic_options](detection *d) {
+            nms_detections(d, n, NMS_CLASSES, NULL, 0, &agnostic_options);
+        }));
+        free_pooled_detections(time_nms(src, n, &soft, warm,
+                                        [n, &soft_options](detection *d) {
+            nms_detections(d, n, NMS_CLASSES, NULL, 0, &soft_options);
+        }));
+    }
+    free_pooled_detections(src);
+
+    snprintf(label, sizeof(label), "%d", n);
+    report("nms", label, 0, 0, "darknet", darknet);
+    report("nms", label, 0, 0, "engine", engine);
+    report("nms", label, 0, 0, "agnostic", agnostic);
+    report("nms", label, 0, 0, "soft", soft);
+    if (mismatches)
+        printf("[bench] nms    %-6s %d detections differ from do_nms_sort()\n",
+               label, mismatches);
+    return mismatches;
+}
+
+// Clock frequency of the processor, in GHz, 0 if unknown
+static double cpu_ghz()
+{
+    char line[256];
+    double mhz, max = 0;
+    FILE *f = fopen("/proc/cpuinfo", "r");
+
+    if (!f)
+        return 0;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "cpu MHz : %lf", &mhz) == 1 && mhz > max)
+            max = mhz;
+    fclose(f);
+    return max/1000;
+}
+
+// Naive product `C += A*B`, the loop of darknet's `gemm_nn()`
+static void naive_gemm(int M, int N, int K, const float *A, const float *B,
+                       float *C)
+{
+    int i, j, k;
+
+    for (i = 0; i < M; i++)
+        for (k = 0; k < K; k++)
+            for (j = 0; j < N; j++)
+                C[i*N + j] += A[i*K + k]*B[k*N + j];
+}
+
+// Benchmark the GEMM backend on an M x K by K x N product against the naive
+// loop, and return whether they disagree
+static bool bench_gemm(int M, int N, int K, int rounds, double peak)
+{
+    int i, r;
+    char label[48];
+    std::vector<double> backend, naive;
+    std::vector<float> A((size_t) M*K), B((size_t) K*N);
+    std::vector<float> C((size_t) M*N), R((size_t) M*N, 0);
+
+    for (i = 0; i < M*K; i++)
+        A[i] = rand_uniform(-1, 1);
+    for (i = 0; i < K*N; i++)
+        B[i] = rand_uniform(-1, 1);
+    for (r = 0; r < rounds + WARMUP_FRAMES; r++) {
+        double time = what_time_is_it_now();
+        gemm(0, 0, M, N, K, 1, A.data(), K, B.data(), N, 0, C.data(), N);
+        if (r >= WARMUP_FRAMES)
+            backend.push_back(what_time_is_it_now() - time);
+    }
+    for (r = 0; r < NAIVE_GEMM_ROUNDS; r++) {
+        std::fill(R.begin(), R.end(), 0);
+        double time = what_time_is_it_now();
+        naive_gemm(M, N, K, A.data(), B.data(), R.data());
+        naive.push_back(what_time_is_it_now() - time);
+    }
+
+    float max = 0, error = 0;
+    for (i = 0; i < M*N; i++) {
+        max = std::max(max, fabsf(R[i]));
+        error = std::max(error, fabsf(C[i] - R[i]));
+    }
+    bool mismatch = error > 1e-4*max;
+
+    snprintf(label, sizeof(label), "%dx%dx%d", M, N, K);
+    report("gemm", label, N, M, gemm_backend(), backend);
+    report("gemm", label, N, M, "naive", naive);
+    std::sort(backend.begin(), backend.end());
+    std::sort(naive.begin(), naive.end());
+    double flops = 2.*M*N*K;
+    double gflops = flops/percentile(backend, .5)*1e-9;
+    printf("[bench] gemm   %-14s %s %8.2f GFLOP/s", label, gemm_backend(),
+           gflops);
+    if (peak > 0)
+        printf(" (%.1f%% of %.1f GFLOP/s peak)", 100*gflops/peak, peak);
+    printf(", naive %.2f GFLOP/s, error %.2e%s\n",
+           flops/percentile(naive, .5)*1e-9, error,
+           mismatch ? ": MISMATCH" : "");
+    return mismatch;
+}
+
+// Naive int8 product `C = A*(Bt - zero point)^T`, with Bt stored transposed
+static void naive_gemm_int8(int M, int N, int K, const signed char *A,
+                            const unsigned char *Bt, int kp, int *C)
+{
+    int i, j, k;
+
+    for (i = 0; i < M; i++) {
+        for (j = 0; j < N; j++) {
+            int sum = 0;
+            for (k = 0; k < K; k++)
+                sum += A[i*K + k]*(Bt[j*kp + k] - GEMM_INT8_ZERO_POINT);
+            C[i*N + j] = sum;
+        }
+    }
+}
+
+// Benchmark the int8 GEMM on an M x K by K x N product against the naive
+// loop, and return whether they disagree. Results must be exact
+static bool bench_gemm_int8(int M, int N, int K, int rounds)
+{
+    int i, r;
+    char label[48];
+    std::vector<double> times;
+    std::vector<signed char> A((size_t) M*K);
+
+    for (i = 0; i < M*K; i++)
+        A[i] = rand() % (2*GEMM_INT8_WEIGHT_MAX + 1) - GEMM_INT8_WEIGHT_MAX;
+    gemm_int8_weights *weights = pack_int8_weights(M, K, A.data(), K);
+    int kp = weights->kp;
+    std::vector<unsigned char> Bt((size_t) N*kp);
+    std::vector<int> C((size_t) M*N), R((size_t) M*N);
+    for (i = 0; i < N*kp; i++)
+        Bt[i] = rand() % 256;
+
+    for (r = 0; r < rounds + WARMUP_FRAMES; r++) {
+        double time = what_time_is_it_now();
+        gemm_int8(weights, N, Bt.data(), C.data(), N);
+        if (r >= WARMUP_FRAMES)
+            times.push_back(what_time_is_it_now() - time);
+    }
+    naive_gemm_int8(M, N, K, A.data(), Bt.data(), kp, R.data());
+    free_int8_weights(weights);
+    bool mismatch = C != R;
+
+    snprintf(label, sizeof(label), "%dx%dx%d", M, N, K);
+    report("gemm_int8", label, N, M, "int8", times);
+    std::sort(times.begin(), times.end());
+    printf("[bench] gemm   %-14s int8 %8.2f GOP/s%s\n", label,
+           2.*M*N*K/percentile(times, .5)*1e-9, mismatch ? ": MISMATCH" : "");
+    return mismatch;
+}
+
+// Time the forward pass of the model on a random input with each number of
+// threads, and return the number of thread counts whose outputs differ from
+// the first one's
+static int bench_threads(const char *model, const std::vector<int> &counts,
+                         int rounds, bool pin)
+{
+    int i, r;
+    int mismatches = 0;
+    char res[32], stage[32];
+    double single = 0;
+    std::vector<float> input(net->inputs*net->batch), reference;
+
+    for (i = 0; i < net->inputs*net->batch; i++)
+        input[i] = rand_uniform(0, 1);
+    snprintf(res, sizeof(res), "%dx%d", net->w, net->h);
+    for (int threads : counts) {
+        std::vector<double> latencies;
+        std::vector<float> outputs;
+
+        init_thread_pool(threads, pin);
+        for (r = 0; r < rounds + WARMUP_FRAMES; r++) {
+            double time = what_time_is_it_now();
+            network_predict(net, input.data());
+            if (r >= WARMUP_FRAMES)
+                latencies.push_back(what_time_is_it_now() - time);
+        }
+        for (i = 0; i < net->n; i++) {
+            layer *l = &net->layers[i];
+            if (l->type == YOLO || l->type == REGION || l->type == DETECTION)
+                outputs.insert(outputs.end(), l->output,
+                               l->output + l->outputs*l->batch);
+        }
+        if (reference.empty())
+            reference = outputs;
+        bool mismatch = outputs != reference;
+        mismatches += mismatch;
+
+        snprintf(stage, sizeof(stage), "threads_%d", thread_pool_size());
+        report(model, res, net->w, net->h, stage, latencies);
+        std::sort(latencies.begin(), latencies.end());
+        double p50 = percentile(latencies, .5);
+        if (single == 0)
+            single = p50*thread_pool_size();
+        printf("[bench] threads %-12s %3d threads %9.3f ms  speedup %5.2fx  efficiency %5.1f%%%s\n",
+               model, thread_pool_size(), p50*1e3, single/p50,
+               100*single/p50/thread_pool_size(),
+               mismatch ? ": OUTPUTS DIFFER" : "");
+    }
+    return mismatches;
+}
+
+// Split a comma-separated list in place
+static std::vector<char *> split(char *list)
+{
+    std::vector<char *> items;
+    for (char *item = strtok(list, ","); item; item = strtok(NULL, ","))
+        items.push_back(item);
+    return items;
+}
+
+int main(int argc, char **argv)
+{
+    char default_models[] = "yolov3-tiny,yolov3";
+    char default_resolutions[] = "480p,720p,1080p,4K";
+    char *models = find_char_arg(argc, argv, "-models", default_models);
+    char *res_list = find_char_arg(argc, argv, "-resolutions",
+                                   default_resolutions);
+    int frames = find_int_arg(argc, argv, "-frames", 20);
+    char *video = find_char_arg(argc, argv, "-video", NULL);
+    char *out = find_char_arg(argc, argv, "-out", "bench_results.csv");
+    char default_nms_boxes[] = "100,1000,5000";
+    char *nms_boxes = find_char_arg(argc, argv, "-nms_boxes",
+                                    default_nms_boxes);
+    char default_gemm_sizes[] = "256x256x256,1024x1024x1024,64x43264x288,512x676x2304";
+    char *gemm_sizes = find_char_arg(argc, argv, "-gemm_sizes",
+                                     default_gemm_sizes);
+    int gemm_threads = find_int_arg(argc, argv, "-gemm_threads", 0);
+    double ghz = find_float_arg(argc, argv, "-cpu_ghz", 0);
+    char *thread_list = find_char_arg(argc, argv, "-threads", NULL);
+    bool pin_threads = find_arg(argc, argv, "-pin_threads");
+    int nms_mismatches = 0, conv_failures = 0, gemm_mismatches = 0;
+    int thread_mismatches = 0, preprocess_failures;
+    std::vector<int> thread_counts;
+    nms_options nms = {.45, false, false, .5, .1};
+    detector_options options = {
+        .1,                     // objectness threshold
+        .1,                     // class threshold
+        .5,                     // hierarchical threshold
+        false,                  // draw detection boxes
+        "output/prediction",    // output file prefix
+        NULL,                   // image writer
+        false,                  // save images with detections only
+        NULL,                   // object tracker
+        NULL,                   // detection sink
+        NULL,                   // frame tiler
+        NULL,                   // region of interest
+        &nms,                   // non-maximum suppression
+    };
+
+    tag = find_char_arg(argc, argv, "-tag", "-");
+
+    // Results accumulate across runs (commits, targets), with a single header
+    results = fopen(out, "a+");
+    if (!results) {
+        printf("Couldn't open %s\n", out);
+        return 1;
+    }
+    fseek(results, 0, SEEK_END);
+    if (ftell(results) == 0)
+        fprintf(results, "target,tag,model,resolution,width,height,stage,frames,fps,p50_ms,p99_ms,peak_memory_mib\n");
+
+    preprocess_failures = check_preprocess() + check_i420_conversion();
+
+    if (video) {
+        decode_last = what_time_is_it_now();
+        h264_decode(video, "", false, &on_decoded_frame);
+        report("-", "video", 0, 0, "decode", decode_latencies);
+    }
+
+    // Thread counts of the scaling curve: powers of two up to the number of
+    // hardware threads, and that number. The other benchmarks run with the
+    // largest count
+    if (thread_list) {
+        for (char *count : split(thread_list))
+            if (atoi(count) > 0)
+                thread_counts.push_back(atoi(count));
+    } else {
+#ifdef HAVE_THREADS
+        int cpus = std::thread::hardware_concurrency();
+#else
+        int cpus = 1;
+#endif
+        for (int count = 1; count < cpus; count *= 2)
+            thread_counts.push_back(count);
+        thread_counts.push_back(std::max(cpus, 1));
+    }
+    if (thread_counts.empty())
+        thread_counts.push_back(1);
+    int max_threads = *std::max_element(thread_counts.begin(),
+                                        thread_counts.end());
+    init_thread_pool(max_threads, pin_threads);
+
+    // Theoretical peak of the GEMM backend: the micro-kernel's operations per
+    // cycle on each thread
+    set_gemm_threads(gemm_threads);
+    if (gemm_threads == 0)
+        gemm_threads = thread_pool_size();
+    if (ghz == 0)
+        ghz = cpu_ghz();
+    double peak = ghz*gemm_flops_per_cycle()*gemm_threads;
+    for (char *size : split(gemm_sizes)) {
+        int m, n, k;
+        if (sscanf(size, "%dx%dx%d", &m, &n, &k) == 3 && m > 0 && n > 0
+            && k > 0)
+            gemm_mismatches += bench_gemm(m, n, k, frames, peak)
+                               + bench_gemm_int8(m, n, k, frames);
+    }
+
+    for (char *boxes : split(nms_boxes))
+        if (atoi(boxes) > 0)
+            nms_mismatches += bench_nms(atoi(boxes), frames);
+
+    conv_failures += check_synthetic_convolutions();
+
+    std::vector<char *> selected = split(res_list);
+    for (char *model : split(models)) {
+        char cfgfile[256], weightfile[256];
+        snprintf(cfgfile, sizeof(cfgfile), "program_data/%s.cfg", model);
+        snprintf(weightfile, sizeof(weightfile), "program_data/%s.weights",
+                 model);
+        FILE *f = fopen(weightfile, "rb");
+        if (!f) {
+            printf("[bench] %s not found, skipping %s\n", weightfile, model);
+            continue;
+        }
+        fclose(f);
+
+        init_darknet_detector("program_data/coco.names", cfgfile, weightfile,
+                              false, 1);
+        conv_failures += check_convolution_algorithms(net);
+        thread_mismatches += bench_threads(model, thread_counts, frames,
+                                           pin_threads);
+        init_thread_pool(max_threads, pin_threads);
+        for (char *name : selected)
+            for (const resolution &res : resolutions)
+                if (!strcmp(res.name, name))
+                    bench_resolution(model, &res, frames, &options);
+    }
+
+    fclose(results);
+    return nms_mismatches || conv_failures || gemm_mismatches
+           || thread_mismatches || preprocess_failures ? 1 : 0;
+}
@@ -0,0 +1,53 @@
+/*
+This file contains the offline tool packing the alphabet generated by
+`labels/make_labels.py` into a single glyph atlas (see `include/atlas.h`),
+loaded by the detector to annotate the detection boxes.
+
+Usage: make_atlas <labels dir> <output atlas>
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+Based on darknet, YOLO LICENSE https://github.com/pjreddie/darknet/blob/master/LICENSE
+*/
+
+extern "C"
+{
+    #include "darknet.h"
+}
+#include "atlas.h"
+
+#include <string.h>
+
+
+int main(int argc, char **argv)
+{
+    int i, j;
+
+    if (argc < 3) {
+        printf("Usage: %s <labels dir> <output atlas>\n", argv[0]);
+        return 1;
+    }
+
+    // Glyphs, as loaded by `load_alphabet_from_path()`
+    image *alphabet[ATLAS_SIZES];
+    for (j = 0; j < ATLAS_SIZES; j++) {
+        alphabet[j] = (image *) calloc(128, sizeof(image));
+        for (i = 32; i < 127; i++) {
+            char path[256];
+            snprintf(path, sizeof(path), "%s/%d_%d.png", argv[1], i, j);
+            alphabet[j][i] = load_image_color(path, 0, 0);
+        }
+    }
+
+    glyph_atlas *atlas = make_glyph_atlas(alphabet);
+    if (write_glyph_atlas(atlas, argv[2]))
+        return 1;
+    printf("Glyph atlas written to %s\n", argv[2]);
+    return 0;
+}
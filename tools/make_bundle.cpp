@@ -0,0 +1,264 @@
+/*
+This file contains the offline tool turning a darknet model (configuration,
+weights and label list) and, optionally, the alphabet generated by
+`labels/make_labels.py` into a single model bundle (see `include/bundle.h`).
+Batch normalization is folded into the weights beforehand, and each layer is
+stored as a descriptor of its geometry, so that loading the bundle involves
+neither darknet's parser nor any computation.
+
+Usage: make_bundle <cfg> <weights> <names> <output bundle> [<labels dir>]
+
+AUTHORS
+
+The Veracruz Development Team.
+
+COPYRIGHT AND LICENSING
+
+See the `LICENSE_MIT.markdown` file in the example's root directory for
+copyright and licensing information.
+Based on darknet, YOLO LICENSE https://github.com/pjreddie/darknet/blob/master/LICENSE
+*/
+
+extern "C"
+{
+    #include "darknet.h"
+}
+#include "bundle.h"
+#include "optimize.h"
+
+#include <string.h>
+
+#define NSIZE 8
+
+
+// Read a whole file
+static char *read_file(const char *path, size_t *size)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        printf("Couldn't open %s\n", path);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *data = (char *) malloc(*size + 1);
+    if (fread(data, 1, *size, f) != *size) {
+        printf("Couldn't read %s\n", path);
+        exit(1);
+    }
+    data[*size] = '\0';
+    fclose(f);
+    return data;
+}
+
+// Turn the label list into NUL-separated strings
+static char *pack_names(const char *path, size_t *size, uint32_t *count)
+{
+    char *names = read_file(path, size);
+    size_t i, n;
+
+    *count = 0;
+    for (i = 0, n = 0; i < *size; i++) {
+        if (names[i] == '\r')
+            continue;
+        if (names[i] == '\n') {
+            names[n++] = '\0';
+            (*count)++;
+        } else {
+            names[n++] = names[i];
+        }
+    }
+    if (n > 0 && names[n - 1] != '\0') {
+        // Last line without a newline
+        names[n++] = '\0';
+        (*count)++;
+    }
+    *size = n;
+    return names;
+}
+
+// Write `size` bytes at `offset`, padding the file up to it
+static void write_at(FILE *f, uint64_t offset, const void *data, size_t size)
+{
+    static const char zeros[BUNDLE_ALIGNMENT] = {0};
+    long pos = ftell(f);
+
+    while ((uint64_t) pos < offset) {
+        size_t pad = offset - pos < BUNDLE_ALIGNMENT ? offset - pos
+                                                      : BUNDLE_ALIGNMENT;
+        fwrite(zeros, 1, pad, f);
+        pos += pad;
+    }
+    if (fwrite(data, 1, size, f) != size) {
+        printf("Couldn't write the bundle\n");
+        exit(1);
+    }
+}
+
+// Describe a layer by its geometry, as darknet computed it from the
+// configuration
+static void describe_layer(layer *l, bundle_layer *bl)
+{
+    bl->type = l->type;
+    bl->activation = l->activation;
+    bl->inputs = l->inputs;
+    bl->outputs = l->outputs;
+    bl->h = l->h;
+    bl->w = l->w;
+    bl->c = l->c;
+    bl->out_h = l->out_h;
+    bl->out_w = l->out_w;
+    bl->out_c = l->out_c;
+    bl->n = l->n;
+    bl->groups = l->groups;
+    bl->size = l->size;
+    bl->stride = l->stride;
+    bl->pad = l->pad;
+    bl->index = l->index;
+    bl->reverse = l->reverse;
+    bl->classes = l->classes;
+    bl->coords = l->coords;
+    bl->total = l->total;
+    bl->softmax = l->softmax;
+    bl->background = l->background;
+    bl->alpha = l->alpha;
+    bl->beta = l->beta;
+    bl->scale = l->scale;
+}
+
+int main(int argc, char **argv)
+{
+    int i, j, k;
+    size_t names_size;
+    uint32_t nnames;
+
+    if (argc < 5) {
+        printf("Usage: %s <cfg> <weights> <names> <output bundle> [<labels dir>]\n",
+               argv[0]);
+        return 1;
+    }
+    char *names = pack_names(argv[3], &names_size, &nnames);
+
+    network *net = load_network(argv[1], argv[2], 0);
+    int folded = fold_batchnorm(net);
+
+    // Glyphs, as loaded by `load_alphabet_from_path()`
+    image glyph_images[NSIZE][128];
+    int nglyphs = 0;
+    for (j = 0; j < NSIZE; j++) {
+        for (i = 32; i < 127; i++) {
+            glyph_images[j][i].data = NULL;
+            if (argc < 6)
+                continue;
+            char path[256];
+            snprintf(path, sizeof(path), "%s/%d_%d.png", argv[5], i, j);
+            glyph_images[j][i] = load_image_color(path, 0, 0);
+            nglyphs++;
+        }
+    }
+
+    // Lay out the sections
+    bundle_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+    header.version = BUNDLE_VERSION;
+    header.nlayers = net->n;
+    header.nnames = nnames;
+    header.nglyphs = nglyphs;
+    header.names_offset = bundle_align(sizeof(header));
+    header.names_size = names_size;
+    header.layers_offset = bundle_align(header.names_offset + names_size);
+    header.glyphs_offset = bundle_align(header.layers_offset
+                                        + net->n*sizeof(bundle_layer));
+    uint64_t offset = bundle_align(header.glyphs_offset
+                                   + nglyphs*sizeof(bundle_glyph));
+
+    bundle_layer *layers = (bundle_layer *) calloc(net->n,
+                                                   sizeof(bundle_layer));
+    for (i = 0; i < net->n; i++) {
+        int nbiases, nindexes;
+        int nweights = bundle_layer_parameters(&net->layers[i], &nbiases,
+                                               &nindexes);
+        if (nweights < 0) {
+            printf("Layer %d: this layer type isn't supported by bundles\n",
+                   i);
+            return 1;
+        }
+        describe_layer(&net->layers[i], &layers[i]);
+        layers[i].nweights = nweights;
+        layers[i].nbiases = nbiases;
+        layers[i].nindexes = nindexes;
+        if (nweights > 0) {
+            layers[i].weights_offset = offset;
+            offset = bundle_align(offset + nweights*sizeof(float));
+        }
+        if (nbiases > 0) {
+            layers[i].biases_offset = offset;
+            offset = bundle_align(offset + nbiases*sizeof(float));
+        }
+        if (nindexes > 0) {
+            layers[i].indexes_offset = offset;
+            offset = bundle_align(offset + nindexes*sizeof(int32_t));
+        }
+    }
+
+    bundle_glyph *glyphs = (bundle_glyph *) calloc(nglyphs + 1,
+                                                   sizeof(bundle_glyph));
+    for (j = 0, k = 0; j < NSIZE; j++) {
+        for (i = 32; i < 127; i++) {
+            image *im = &glyph_images[j][i];
+            if (!im->data)
+                continue;
+            glyphs[k].size = j;
+            glyphs[k].symbol = i;
+            glyphs[k].w = im->w;
+            glyphs[k].h = im->h;
+            glyphs[k].c = im->c;
+            glyphs[k].data_offset = offset;
+            offset = bundle_align(offset + im->w*im->h*im->c*sizeof(float));
+            k++;
+        }
+    }
+
+    // Write the sections in order
+    FILE *f = fopen(argv[4], "wb");
+    if (!f) {
+        printf("Couldn't open %s\n", argv[4]);
+        return 1;
+    }
+    write_at(f, 0, &header, sizeof(header));
+    write_at(f, header.names_offset, names, names_size);
+    write_at(f, header.layers_offset, layers, net->n*sizeof(bundle_layer));
+    write_at(f, header.glyphs_offset, glyphs, nglyphs*sizeof(bundle_glyph));
+    for (i = 0; i < net->n; i++) {
+        layer *l = &net->layers[i];
+        if (layers[i].nweights > 0)
+            write_at(f, layers[i].weights_offset, l->weights,
+                     layers[i].nweights*sizeof(float));
+        if (layers[i].nbiases > 0)
+            write_at(f, layers[i].biases_offset, l->biases,
+                     layers[i].nbiases*sizeof(float));
+        if (l->type == YOLO) {
+            write_at(f, layers[i].indexes_offset, l->mask,
+                     l->n*sizeof(int32_t));
+        } else if (l->type == ROUTE) {
+            // Input layers, then their sizes
+            write_at(f, layers[i].indexes_offset, l->input_layers,
+                     l->n*sizeof(int32_t));
+            write_at(f, layers[i].indexes_offset + l->n*sizeof(int32_t),
+                     l->input_sizes, l->n*sizeof(int32_t));
+        }
+    }
+    for (k = 0; k < nglyphs; k++) {
+        image *im = &glyph_images[glyphs[k].size][glyphs[k].symbol];
+        write_at(f, glyphs[k].data_offset, im->data,
+                 im->w*im->h*im->c*sizeof(float));
+    }
+    long size = ftell(f);
+    fclose(f);
+
+    printf("Bundle %s written: %d layers (%d with batch normalization folded), %u labels, %d glyphs, %ld bytes\n",
+           argv[4], net->n, folded, nnames, nglyphs, size);
+    return 0;
+}